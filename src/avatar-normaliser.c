@@ -0,0 +1,407 @@
+/*
+ * avatar-normaliser.c - fixing up avatars to suit the protocol
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Rather than rejecting avatars which are too big, or in a format the prpl
+ * doesn't accept, SetAvatar passes them through here: they are decoded,
+ * scaled to fit the prpl's icon spec, and re-encoded into one of its formats
+ * until they fit its size limit.  All of that happens in GIO's worker
+ * threads, so the main loop never waits for image work.
+ */
+
+#include "config.h"
+#include "avatar-normaliser.h"
+
+#include <string.h>
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "debug.h"
+
+/* Each time no format fits under the size limit, the image is shrunk to
+ * this fraction of its size and tried again, at most MAX_SHRINKS times.
+ */
+#define SHRINK_NUMERATOR 3
+#define SHRINK_DENOMINATOR 4
+#define MAX_SHRINKS 8
+
+static const gchar * const jpeg_qualities[] = { "90", "75", "50", NULL };
+
+typedef struct {
+  PurpleBuddyIconSpec icon_spec;
+  GBytes *avatar;
+  gchar *mime_type;
+  GBytes *result;
+} NormaliseData;
+
+static void
+normalise_data_free (gpointer p)
+{
+  NormaliseData *data = p;
+
+  g_bytes_unref (data->avatar);
+  g_free (data->mime_type);
+
+  if (data->result != NULL)
+    g_bytes_unref (data->result);
+
+  g_slice_free (NormaliseData, data);
+}
+
+/* libpurple calls JPEG "jpg"; gdk-pixbuf calls it "jpeg". */
+static const gchar *
+purple_format_to_pixbuf (const gchar *format)
+{
+  if (!tp_strdiff (format, "jpg"))
+    return "jpeg";
+
+  return format;
+}
+
+static gboolean
+format_is_writable (const gchar *name)
+{
+  GSList *formats = gdk_pixbuf_get_formats ();
+  GSList *l;
+  gboolean ret = FALSE;
+
+  for (l = formats; l != NULL && !ret; l = l->next)
+    {
+      gchar *format_name = gdk_pixbuf_format_get_name (l->data);
+
+      ret = !tp_strdiff (format_name, name) &&
+          gdk_pixbuf_format_is_writable (l->data);
+      g_free (format_name);
+    }
+
+  g_slist_free (formats);
+  return ret;
+}
+
+/* What SetAvatar used to accept without looking inside the image. */
+static gboolean
+is_acceptable_as_is (const PurpleBuddyIconSpec *icon_spec,
+    gchar **formats,
+    gsize size,
+    const gchar *mime_type)
+{
+  gchar **f;
+
+  if (icon_spec->max_filesize > 0 && size > icon_spec->max_filesize)
+    return FALSE;
+
+  /* Mission Control passes an empty MIME type when re-setting an avatar
+   * it has cached, which is most likely acceptable. */
+  if (tp_str_empty (mime_type))
+    return TRUE;
+
+  if (!g_str_has_prefix (mime_type, "image/"))
+    return FALSE;
+
+  for (f = formats; *f != NULL; f++)
+    {
+      if (!tp_strdiff (*f, mime_type + strlen ("image/")))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+is_listed_format (gchar **formats,
+    const gchar *pixbuf_format)
+{
+  gchar **f;
+
+  for (f = formats; *f != NULL; f++)
+    {
+      if (!tp_strdiff (purple_format_to_pixbuf (*f), pixbuf_format))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Works out how big an image of width × height should be to fit the
+ * prpl's limits, keeping its aspect ratio. */
+static void
+fit_dimensions (const PurpleBuddyIconSpec *icon_spec,
+    gint width,
+    gint height,
+    gint *new_width,
+    gint *new_height)
+{
+  gdouble scale = 1.0;
+
+  if (icon_spec->max_width > 0 && width > icon_spec->max_width)
+    scale = MIN (scale, (gdouble) icon_spec->max_width / width);
+
+  if (icon_spec->max_height > 0 && height > icon_spec->max_height)
+    scale = MIN (scale, (gdouble) icon_spec->max_height / height);
+
+  if (scale == 1.0)
+    {
+      if (icon_spec->min_width > 0 && width < icon_spec->min_width)
+        scale = MAX (scale, (gdouble) icon_spec->min_width / width);
+
+      if (icon_spec->min_height > 0 && height < icon_spec->min_height)
+        scale = MAX (scale, (gdouble) icon_spec->min_height / height);
+    }
+
+  *new_width = MAX (1, (gint) (width * scale + 0.5));
+  *new_height = MAX (1, (gint) (height * scale + 0.5));
+}
+
+/* Tries each of the prpl's formats which gdk-pixbuf can write, in the
+ * prpl's order of preference, returning the first encoding of pixbuf which
+ * fits within max_size (if non-zero). */
+static GBytes *
+encode (GdkPixbuf *pixbuf,
+    gchar **formats,
+    gsize max_size,
+    gboolean *any_writable)
+{
+  gchar **f;
+
+  for (f = formats; *f != NULL; f++)
+    {
+      const gchar *name = purple_format_to_pixbuf (*f);
+      const gchar * const *quality;
+      gboolean is_jpeg = !tp_strdiff (name, "jpeg");
+
+      if (!format_is_writable (name))
+        continue;
+
+      *any_writable = TRUE;
+
+      for (quality = jpeg_qualities; *quality != NULL; quality++)
+        {
+          GError *error = NULL;
+          gchar *buffer;
+          gsize size;
+          gboolean ok;
+
+          if (is_jpeg)
+            ok = gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &size, name,
+                &error, "quality", *quality, NULL);
+          else
+            ok = gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &size, name,
+                &error, NULL);
+
+          if (!ok)
+            {
+              DEBUG ("couldn't save as %s: %s", name, error->message);
+              g_clear_error (&error);
+              break;
+            }
+
+          if (max_size == 0 || size <= max_size)
+            {
+              DEBUG ("encoded %dx%d as %s, %" G_GSIZE_FORMAT " bytes",
+                  gdk_pixbuf_get_width (pixbuf),
+                  gdk_pixbuf_get_height (pixbuf), name, size);
+              return g_bytes_new_take (buffer, size);
+            }
+
+          g_free (buffer);
+
+          /* Only JPEG has a quality to turn down. */
+          if (!is_jpeg)
+            break;
+        }
+    }
+
+  return NULL;
+}
+
+static GBytes *
+normalise (const PurpleBuddyIconSpec *icon_spec,
+    GBytes *avatar,
+    const gchar *mime_type,
+    GError **error)
+{
+  GdkPixbufLoader *loader = gdk_pixbuf_loader_new ();
+  gchar **formats = g_strsplit (icon_spec->format, ",", 0);
+  gsize size;
+  const guchar *data = g_bytes_get_data (avatar, &size);
+  GBytes *ret = NULL;
+  GdkPixbuf *pixbuf = NULL;
+  gchar *pixbuf_format = NULL;
+  gint width, height, new_width, new_height;
+  gboolean any_writable = FALSE;
+  gboolean written;
+  guint shrinks;
+
+  written = gdk_pixbuf_loader_write (loader, data, size, NULL);
+
+  /* Close the loader exactly once, even if writing failed, so it doesn't
+   * complain. */
+  if (gdk_pixbuf_loader_close (loader, NULL) && written)
+    pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+
+  if (pixbuf == NULL)
+    {
+      /* We can't do anything with it, but the prpl might. */
+      if (is_acceptable_as_is (icon_spec, formats, size, mime_type))
+        ret = g_bytes_ref (avatar);
+      else
+        g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+            "couldn't decode the avatar, and it's not acceptable as it is");
+
+      goto out;
+    }
+
+  pixbuf_format = gdk_pixbuf_format_get_name (
+      gdk_pixbuf_loader_get_format (loader));
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+
+  fit_dimensions (icon_spec, width, height, &new_width, &new_height);
+
+  if (new_width == width && new_height == height &&
+      is_listed_format (formats, pixbuf_format) &&
+      (icon_spec->max_filesize == 0 || size <= icon_spec->max_filesize))
+    {
+      DEBUG ("%dx%d %s avatar is fine as it is", width, height,
+          pixbuf_format);
+      ret = g_bytes_ref (avatar);
+      goto out;
+    }
+
+  DEBUG ("%dx%d %s avatar, %" G_GSIZE_FORMAT " bytes, needs fixing up",
+      width, height, pixbuf_format, size);
+
+  if (new_width != width || new_height != height)
+    pixbuf = gdk_pixbuf_scale_simple (pixbuf, new_width, new_height,
+        GDK_INTERP_BILINEAR);
+  else
+    g_object_ref (pixbuf);
+
+  for (shrinks = 0; ; shrinks++)
+    {
+      GdkPixbuf *smaller;
+
+      ret = encode (pixbuf, formats, icon_spec->max_filesize, &any_writable);
+
+      if (ret != NULL || !any_writable || shrinks == MAX_SHRINKS)
+        break;
+
+      new_width = new_width * SHRINK_NUMERATOR / SHRINK_DENOMINATOR;
+      new_height = new_height * SHRINK_NUMERATOR / SHRINK_DENOMINATOR;
+
+      if (new_width < MAX (1, icon_spec->min_width) ||
+          new_height < MAX (1, icon_spec->min_height))
+        break;
+
+      smaller = gdk_pixbuf_scale_simple (pixbuf, new_width, new_height,
+          GDK_INTERP_BILINEAR);
+      g_object_unref (pixbuf);
+      pixbuf = smaller;
+    }
+
+  g_object_unref (pixbuf);
+
+  if (ret == NULL && !any_writable)
+    g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+        "the avatar needs converting, but none of the protocol's formats "
+        "(%s) can be written", icon_spec->format);
+  else if (ret == NULL)
+    g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+        "couldn't make the avatar smaller than %" G_GSIZE_FORMAT "B",
+        icon_spec->max_filesize);
+
+out:
+  g_free (pixbuf_format);
+  g_strfreev (formats);
+  g_object_unref (loader);
+  return ret;
+}
+
+static void
+normalise_thread (GSimpleAsyncResult *simple,
+    GObject *object,
+    GCancellable *cancellable)
+{
+  NormaliseData *data = g_simple_async_result_get_op_res_gpointer (simple);
+  GError *error = NULL;
+
+  data->result = normalise (&data->icon_spec, data->avatar, data->mime_type,
+      &error);
+
+  if (data->result == NULL)
+    g_simple_async_result_take_error (simple, error);
+}
+
+/*
+ * haze_avatar_normalise_async:
+ * @icon_spec: the prpl's requirements for icons
+ * @avatar: an image
+ * @mime_type: @avatar's MIME type according to the client, possibly ""
+ * @callback: called on the current thread when the avatar is ready
+ * @user_data: data for @callback
+ *
+ * Starts converting @avatar into something which fits @icon_spec.
+ */
+void
+haze_avatar_normalise_async (const PurpleBuddyIconSpec *icon_spec,
+    GBytes *avatar,
+    const gchar *mime_type,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple = g_simple_async_result_new (NULL, callback,
+      user_data, haze_avatar_normalise_async);
+  NormaliseData *data = g_slice_new0 (NormaliseData);
+
+  /* icon_spec->format points into the prpl, which outlives us. */
+  data->icon_spec = *icon_spec;
+  data->avatar = g_bytes_ref (avatar);
+  data->mime_type = g_strdup (mime_type);
+
+  g_simple_async_result_set_op_res_gpointer (simple, data,
+      normalise_data_free);
+  g_simple_async_result_run_in_thread (simple, normalise_thread,
+      G_PRIORITY_DEFAULT, NULL);
+  g_object_unref (simple);
+}
+
+/*
+ * haze_avatar_normalise_finish:
+ * @result: the result passed to haze_avatar_normalise_async()'s callback
+ * @error: used to raise an error in the TP_ERROR domain
+ *
+ * Returns: the avatar, fixed up if need be, or NULL if it was beyond help
+ */
+GBytes *
+haze_avatar_normalise_finish (GAsyncResult *result,
+    GError **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+  NormaliseData *data;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (result, NULL,
+        haze_avatar_normalise_async), NULL);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+  return g_bytes_ref (data->result);
+}
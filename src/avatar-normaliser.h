@@ -0,0 +1,36 @@
+#ifndef __HAZE_AVATAR_NORMALISER_H__
+#define __HAZE_AVATAR_NORMALISER_H__
+/*
+ * avatar-normaliser.h - header for fixing up avatars to suit the protocol
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <gio/gio.h>
+
+#include <libpurple/buddyicon.h>
+
+G_BEGIN_DECLS
+
+void haze_avatar_normalise_async (const PurpleBuddyIconSpec *icon_spec,
+    GBytes *avatar, const gchar *mime_type, GAsyncReadyCallback callback,
+    gpointer user_data);
+GBytes *haze_avatar_normalise_finish (GAsyncResult *result, GError **error);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_AVATAR_NORMALISER_H__ */
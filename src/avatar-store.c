@@ -0,0 +1,733 @@
+/*
+ * avatar-store.c - persistent, content-addressed store for avatars
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* libpurple's own icon cache lives in our throwaway user directory, so
+ * without this every avatar is downloaded again each time Haze starts.
+ *
+ * Avatars are stored once per distinct SHA-1 token, as
+ * $XDG_CACHE_HOME/telepathy-haze/avatars/<first two hex digits>/<token>, so
+ * contacts (on any account) with the same picture share a file.  Files are
+ * read back with mmap(), and the least recently used are deleted once the
+ * store outgrows HAZE_AVATAR_STORE_KB.  Alongside them, index.ini remembers
+ * which token (and which protocol-specific checksum) each contact last had,
+ * so their icon can be handed back to libpurple before the prpl decides
+ * whether to fetch it.
+ */
+
+#include "config.h"
+#include "avatar-store.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "debug.h"
+#include "util.h"
+
+/* in KiB */
+#define DEFAULT_MAX_SIZE (10 * 1024)
+#define TOKEN_LENGTH 40
+#define INDEX_SAVE_DELAY_SECONDS 5
+
+typedef struct {
+    gchar *token;
+    goffset size;
+    GList *link;
+} StoreEntry;
+
+/* NULL if the store is disabled */
+static gchar *store_dir = NULL;
+static guint64 max_size = 0;
+
+/* Protects entries, lru and total_size, which hashing threads update too;
+ * everything else is only touched from the main thread.
+ */
+static GMutex store_lock;
+/* owned gchar *token => owned StoreEntry */
+static GHashTable *entries = NULL;
+/* StoreEntry, least recently used first */
+static GQueue lru = G_QUEUE_INIT;
+static guint64 total_size = 0;
+
+static GKeyFile *index_file = NULL;
+static gchar *index_path = NULL;
+static guint save_index_id = 0;
+
+static gboolean
+token_is_valid (const gchar *token)
+{
+  guint i;
+
+  for (i = 0; i < TOKEN_LENGTH; i++)
+    {
+      if (!g_ascii_isxdigit (token[i]) || g_ascii_isupper (token[i]))
+        return FALSE;
+    }
+
+  return token[TOKEN_LENGTH] == '\0';
+}
+
+static gchar *
+dup_shard_dir (const gchar *token)
+{
+  gchar prefix[3] = { token[0], token[1], '\0' };
+
+  return g_build_filename (store_dir, prefix, NULL);
+}
+
+static gchar *
+dup_entry_path (const gchar *token)
+{
+  gchar prefix[3] = { token[0], token[1], '\0' };
+
+  return g_build_filename (store_dir, prefix, token, NULL);
+}
+
+static void
+store_entry_free (gpointer p)
+{
+  StoreEntry *entry = p;
+
+  g_free (entry->token);
+  g_slice_free (StoreEntry, entry);
+}
+
+/* Adds token to the store's bookkeeping as the most recently used entry,
+ * and steals it. */
+static StoreEntry *
+insert_entry_locked (gchar *token,
+    goffset size)
+{
+  StoreEntry *entry = g_slice_new0 (StoreEntry);
+
+  entry->token = token;
+  entry->size = size;
+  g_queue_push_tail (&lru, entry);
+  entry->link = lru.tail;
+  g_hash_table_insert (entries, entry->token, entry);
+  total_size += size;
+
+  return entry;
+}
+
+static void
+remove_entry_locked (StoreEntry *entry,
+    gboolean unlink_file)
+{
+  if (unlink_file)
+    {
+      gchar *path = dup_entry_path (entry->token);
+
+      DEBUG ("evicting %s (%" G_GOFFSET_FORMAT " bytes)", entry->token,
+          entry->size);
+
+      /* Anyone who has it mapped keeps their copy. */
+      if (g_unlink (path) != 0)
+        DEBUG ("couldn't delete %s", path);
+
+      g_free (path);
+    }
+
+  total_size -= entry->size;
+  g_queue_delete_link (&lru, entry->link);
+  g_hash_table_remove (entries, entry->token);
+}
+
+static void
+touch_entry_locked (StoreEntry *entry)
+{
+  gchar *path;
+
+  if (entry->link != lru.tail)
+    {
+      g_queue_unlink (&lru, entry->link);
+      g_queue_push_tail_link (&lru, entry->link);
+    }
+
+  /* Bump the mtime too, so the LRU order survives a restart. */
+  path = dup_entry_path (entry->token);
+  g_utime (path, NULL);
+  g_free (path);
+}
+
+static void
+evict_locked (void)
+{
+  /* Never evict the only entry, however big it is. */
+  while (total_size > max_size && lru.length > 1)
+    remove_entry_locked (g_queue_peek_head (&lru), TRUE);
+}
+
+typedef struct {
+    gchar *token;
+    goffset size;
+    time_t mtime;
+} ScannedFile;
+
+static gint
+compare_scanned_files (gconstpointer a,
+    gconstpointer b)
+{
+  const ScannedFile *x = *(ScannedFile * const *) a;
+  const ScannedFile *y = *(ScannedFile * const *) b;
+
+  if (x->mtime != y->mtime)
+    return x->mtime < y->mtime ? -1 : 1;
+
+  return 0;
+}
+
+static void
+scanned_file_free (gpointer p)
+{
+  ScannedFile *file = p;
+
+  g_free (file->token);
+  g_slice_free (ScannedFile, file);
+}
+
+static void
+scan_store (void)
+{
+  GPtrArray *files = g_ptr_array_new_with_free_func (scanned_file_free);
+  GDir *dir = g_dir_open (store_dir, 0, NULL);
+  const gchar *shard;
+  guint i;
+
+  if (dir == NULL)
+    return;
+
+  while ((shard = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *shard_path = g_build_filename (store_dir, shard, NULL);
+      GDir *subdir = g_dir_open (shard_path, 0, NULL);
+      const gchar *name;
+
+      while (subdir != NULL && (name = g_dir_read_name (subdir)) != NULL)
+        {
+          gchar *path = g_build_filename (shard_path, name, NULL);
+          GStatBuf st;
+
+          if (!token_is_valid (name) || strncmp (name, shard, 2) != 0)
+            {
+              /* Most likely left behind by a crash mid-write. */
+              DEBUG ("removing stray file %s", path);
+              g_unlink (path);
+            }
+          else if (g_stat (path, &st) == 0)
+            {
+              ScannedFile *file = g_slice_new0 (ScannedFile);
+
+              file->token = g_strdup (name);
+              file->size = st.st_size;
+              file->mtime = st.st_mtime;
+              g_ptr_array_add (files, file);
+            }
+
+          g_free (path);
+        }
+
+      if (subdir != NULL)
+        g_dir_close (subdir);
+
+      g_free (shard_path);
+    }
+
+  g_dir_close (dir);
+
+  g_ptr_array_sort (files, compare_scanned_files);
+
+  g_mutex_lock (&store_lock);
+
+  for (i = 0; i < files->len; i++)
+    {
+      ScannedFile *file = g_ptr_array_index (files, i);
+
+      insert_entry_locked (file->token, file->size);
+      file->token = NULL;
+    }
+
+  evict_locked ();
+
+  DEBUG ("%u avatars, %" G_GUINT64_FORMAT " bytes", lru.length, total_size);
+  g_mutex_unlock (&store_lock);
+
+  g_ptr_array_unref (files);
+}
+
+static void
+load_index (void)
+{
+  GError *error = NULL;
+  gchar **groups;
+  gchar **group;
+
+  index_path = g_build_filename (store_dir, "index.ini", NULL);
+  index_file = g_key_file_new ();
+
+  if (!g_key_file_load_from_file (index_file, index_path, G_KEY_FILE_NONE,
+          &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        DEBUG ("couldn't load %s, starting afresh: %s", index_path,
+            error->message);
+
+      g_clear_error (&error);
+      return;
+    }
+
+  /* Forget contacts whose avatar has since been evicted. */
+  groups = g_key_file_get_groups (index_file, NULL);
+
+  for (group = groups; *group != NULL; group++)
+    {
+      gchar *token = g_key_file_get_string (index_file, *group, "token",
+          NULL);
+
+      if (token == NULL || g_hash_table_lookup (entries, token) == NULL)
+        g_key_file_remove_group (index_file, *group, NULL);
+
+      g_free (token);
+    }
+
+  g_strfreev (groups);
+}
+
+static void
+save_index (void)
+{
+  GError *error = NULL;
+  gsize length;
+  gchar *data = g_key_file_to_data (index_file, &length, NULL);
+
+  if (!g_file_set_contents (index_path, data, length, &error))
+    {
+      DEBUG ("couldn't save %s: %s", index_path, error->message);
+      g_clear_error (&error);
+    }
+
+  g_free (data);
+}
+
+static gboolean
+save_index_cb (gpointer unused)
+{
+  save_index_id = 0;
+  save_index ();
+  return FALSE;
+}
+
+static void
+schedule_save_index (void)
+{
+  if (save_index_id == 0)
+    save_index_id = g_timeout_add_seconds (INDEX_SAVE_DELAY_SECONDS,
+        save_index_cb, NULL);
+}
+
+void
+haze_avatar_store_init (void)
+{
+  guint max_kib = haze_get_tunable ("HAZE_AVATAR_STORE_KB", DEFAULT_MAX_SIZE);
+
+  if (max_kib == 0)
+    {
+      DEBUG ("avatar store disabled");
+      return;
+    }
+
+  max_size = (guint64) max_kib * 1024;
+  store_dir = g_build_filename (g_get_user_cache_dir (), "telepathy-haze",
+      "avatars", NULL);
+
+  if (g_mkdir_with_parents (store_dir, 0700) != 0)
+    {
+      g_warning ("couldn't create %s; avatars won't be kept across "
+          "restarts", store_dir);
+      g_free (store_dir);
+      store_dir = NULL;
+      return;
+    }
+
+  entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      store_entry_free);
+  scan_store ();
+  load_index ();
+}
+
+void
+haze_avatar_store_shutdown (void)
+{
+  if (store_dir == NULL)
+    return;
+
+  if (save_index_id != 0)
+    {
+      g_source_remove (save_index_id);
+      save_index_id = 0;
+      save_index ();
+    }
+
+  /* The file table is deliberately left alone: hashing threads may still
+   * be adding to it as we exit. */
+  g_key_file_free (index_file);
+  index_file = NULL;
+  g_free (index_path);
+  index_path = NULL;
+}
+
+gboolean
+haze_avatar_store_is_enabled (void)
+{
+  return store_dir != NULL;
+}
+
+/*
+ * haze_avatar_store_add:
+ * @token: the lower-case hex SHA-1 of @data
+ * @data: an avatar
+ * @size: the length of @data
+ *
+ * Writes @data to the store if it isn't already there, and marks it as
+ * recently used either way.
+ */
+void
+haze_avatar_store_add (const gchar *token,
+    gconstpointer data,
+    gsize size)
+{
+  GError *error = NULL;
+  StoreEntry *entry;
+  gchar *shard_dir;
+  gchar *path;
+
+  if (store_dir == NULL || !token_is_valid (token))
+    return;
+
+  g_mutex_lock (&store_lock);
+  entry = g_hash_table_lookup (entries, token);
+
+  if (entry != NULL)
+    touch_entry_locked (entry);
+
+  g_mutex_unlock (&store_lock);
+
+  if (entry != NULL)
+    return;
+
+  shard_dir = dup_shard_dir (token);
+  path = dup_entry_path (token);
+
+  /* g_file_set_contents() writes to a temporary file and renames it over
+   * the destination, so readers never see half an avatar. */
+  if (g_mkdir_with_parents (shard_dir, 0700) != 0 ||
+      !g_file_set_contents (path, data, size, &error))
+    {
+      DEBUG ("couldn't store %s: %s", token,
+          error != NULL ? error->message : g_strerror (errno));
+      g_clear_error (&error);
+    }
+  else
+    {
+      g_mutex_lock (&store_lock);
+
+      /* Someone else might have stored the same picture meanwhile. */
+      if (g_hash_table_lookup (entries, token) == NULL)
+        {
+          insert_entry_locked (g_strdup (token), size);
+          evict_locked ();
+        }
+
+      g_mutex_unlock (&store_lock);
+    }
+
+  g_free (shard_dir);
+  g_free (path);
+}
+
+typedef struct {
+    gchar *token;
+    GBytes *avatar;
+    gchar *path;
+} AddData;
+
+static void
+add_data_free (gpointer p)
+{
+  AddData *data = p;
+
+  g_free (data->token);
+  g_bytes_unref (data->avatar);
+  g_free (data->path);
+  g_slice_free (AddData, data);
+}
+
+static void
+add_thread (GSimpleAsyncResult *simple,
+    GObject *object,
+    GCancellable *cancellable)
+{
+  AddData *data = g_simple_async_result_get_op_res_gpointer (simple);
+  gsize size;
+  gconstpointer bytes = g_bytes_get_data (data->avatar, &size);
+
+  haze_avatar_store_add (data->token, bytes, size);
+  data->path = haze_avatar_store_dup_path (data->token);
+
+  if (data->path == NULL)
+    g_simple_async_result_set_error (simple, TP_ERROR,
+        TP_ERROR_NOT_AVAILABLE, "couldn't store avatar %s", data->token);
+}
+
+/*
+ * haze_avatar_store_add_async:
+ * @token: the lower-case hex SHA-1 of @avatar
+ * @avatar: an avatar
+ * @callback: called on the current thread once @avatar is stored
+ * @user_data: data for @callback
+ *
+ * Like haze_avatar_store_add(), but writes @avatar in a worker thread.
+ */
+void
+haze_avatar_store_add_async (const gchar *token,
+    GBytes *avatar,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple = g_simple_async_result_new (NULL, callback,
+      user_data, haze_avatar_store_add_async);
+  AddData *data = g_slice_new0 (AddData);
+
+  data->token = g_strdup (token);
+  data->avatar = g_bytes_ref (avatar);
+
+  g_simple_async_result_set_op_res_gpointer (simple, data, add_data_free);
+  g_simple_async_result_run_in_thread (simple, add_thread,
+      G_PRIORITY_DEFAULT, NULL);
+  g_object_unref (simple);
+}
+
+/*
+ * haze_avatar_store_add_finish:
+ * @result: the result passed to haze_avatar_store_add_async()'s callback
+ * @error: used to raise an error in the TP_ERROR domain
+ *
+ * Returns: the stored avatar's path, or NULL if it couldn't be stored
+ */
+gchar *
+haze_avatar_store_add_finish (GAsyncResult *result,
+    GError **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+  AddData *data;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (result, NULL,
+        haze_avatar_store_add_async), NULL);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+  return g_strdup (data->path);
+}
+
+/*
+ * haze_avatar_store_lookup:
+ * @token: an avatar token
+ *
+ * Returns: a read-only mapping of the avatar whose token is @token, or NULL
+ *  if it's not in the store
+ */
+GBytes *
+haze_avatar_store_lookup (const gchar *token)
+{
+  GError *error = NULL;
+  GMappedFile *mapped;
+  StoreEntry *entry;
+  gchar *path;
+
+  if (store_dir == NULL || !token_is_valid (token))
+    return NULL;
+
+  g_mutex_lock (&store_lock);
+  entry = g_hash_table_lookup (entries, token);
+
+  if (entry != NULL)
+    touch_entry_locked (entry);
+
+  g_mutex_unlock (&store_lock);
+
+  if (entry == NULL)
+    return NULL;
+
+  path = dup_entry_path (token);
+  mapped = g_mapped_file_new (path, FALSE, &error);
+  g_free (path);
+
+  if (mapped == NULL || g_mapped_file_get_length (mapped) == 0)
+    {
+      DEBUG ("%s has gone missing: %s", token,
+          error != NULL ? error->message : "empty file");
+      g_clear_error (&error);
+
+      if (mapped != NULL)
+        g_mapped_file_unref (mapped);
+
+      g_mutex_lock (&store_lock);
+      entry = g_hash_table_lookup (entries, token);
+
+      if (entry != NULL)
+        remove_entry_locked (entry, TRUE);
+
+      g_mutex_unlock (&store_lock);
+      return NULL;
+    }
+
+  return g_bytes_new_with_free_func (g_mapped_file_get_contents (mapped),
+      g_mapped_file_get_length (mapped),
+      (GDestroyNotify) g_mapped_file_unref, mapped);
+}
+
+/*
+ * haze_avatar_store_dup_path:
+ * @token: an avatar token
+ *
+ * Returns: the path of the file holding the avatar whose token is @token,
+ *  or NULL if it's not in the store
+ */
+gchar *
+haze_avatar_store_dup_path (const gchar *token)
+{
+  StoreEntry *entry;
+
+  if (store_dir == NULL || !token_is_valid (token))
+    return NULL;
+
+  g_mutex_lock (&store_lock);
+  entry = g_hash_table_lookup (entries, token);
+
+  if (entry != NULL)
+    touch_entry_locked (entry);
+
+  g_mutex_unlock (&store_lock);
+
+  return entry != NULL ? dup_entry_path (token) : NULL;
+}
+
+static gchar *
+dup_index_group (PurpleAccount *account,
+    const gchar *who)
+{
+  gchar *id = g_strdup_printf ("%s\n%s\n%s",
+      purple_account_get_protocol_id (account),
+      purple_account_get_username (account), who);
+  /* Contact identifiers can contain anything, including ']'. */
+  gchar *group = g_compute_checksum_for_string (G_CHECKSUM_SHA1, id, -1);
+
+  g_free (id);
+  return group;
+}
+
+/*
+ * haze_avatar_store_remember:
+ * @account: an account
+ * @who: a contact on @account
+ * @token: @who's avatar token, or "" if they have no avatar
+ * @checksum: the prpl's checksum for @who's avatar, or NULL
+ *
+ * Remembers what @who's avatar was for next time, so that
+ * haze_avatar_store_recall() can give it back.
+ */
+void
+haze_avatar_store_remember (PurpleAccount *account,
+    const gchar *who,
+    const gchar *token,
+    const gchar *checksum)
+{
+  gchar *group;
+  gchar *old_token;
+  gchar *old_checksum;
+
+  if (index_file == NULL)
+    return;
+
+  group = dup_index_group (account, who);
+  old_token = g_key_file_get_string (index_file, group, "token", NULL);
+  old_checksum = g_key_file_get_string (index_file, group, "checksum", NULL);
+
+  if (tp_str_empty (token))
+    {
+      if (old_token != NULL)
+        {
+          g_key_file_remove_group (index_file, group, NULL);
+          schedule_save_index ();
+        }
+    }
+  else if (tp_strdiff (old_token, token) || tp_strdiff (old_checksum, checksum))
+    {
+      g_key_file_set_string (index_file, group, "token", token);
+
+      if (checksum != NULL)
+        g_key_file_set_string (index_file, group, "checksum", checksum);
+      else
+        g_key_file_remove_key (index_file, group, "checksum", NULL);
+
+      schedule_save_index ();
+    }
+
+  g_free (old_checksum);
+  g_free (old_token);
+  g_free (group);
+}
+
+/*
+ * haze_avatar_store_recall:
+ * @account: an account
+ * @who: a contact on @account
+ * @checksum: (out): used to return the prpl's checksum for the avatar, or
+ *  NULL if it didn't provide one
+ *
+ * Returns: the token of the avatar @who had last time, which is still in
+ *  the store, or NULL
+ */
+gchar *
+haze_avatar_store_recall (PurpleAccount *account,
+    const gchar *who,
+    gchar **checksum)
+{
+  gchar *group;
+  gchar *token;
+
+  *checksum = NULL;
+
+  if (index_file == NULL)
+    return NULL;
+
+  group = dup_index_group (account, who);
+  token = g_key_file_get_string (index_file, group, "token", NULL);
+
+  if (token != NULL)
+    *checksum = g_key_file_get_string (index_file, group, "checksum", NULL);
+
+  g_free (group);
+  return token;
+}
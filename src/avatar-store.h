@@ -0,0 +1,50 @@
+#ifndef __HAZE_AVATAR_STORE_H__
+#define __HAZE_AVATAR_STORE_H__
+/*
+ * avatar-store.h - header for the on-disk avatar store
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <gio/gio.h>
+
+#include <libpurple/account.h>
+
+G_BEGIN_DECLS
+
+void haze_avatar_store_init (void);
+void haze_avatar_store_shutdown (void);
+gboolean haze_avatar_store_is_enabled (void);
+
+/* These may be called from any thread. */
+void haze_avatar_store_add (const gchar *token, gconstpointer data,
+    gsize size);
+GBytes *haze_avatar_store_lookup (const gchar *token);
+gchar *haze_avatar_store_dup_path (const gchar *token);
+
+void haze_avatar_store_add_async (const gchar *token, GBytes *avatar,
+    GAsyncReadyCallback callback, gpointer user_data);
+gchar *haze_avatar_store_add_finish (GAsyncResult *result, GError **error);
+
+void haze_avatar_store_remember (PurpleAccount *account, const gchar *who,
+    const gchar *token, const gchar *checksum);
+gchar *haze_avatar_store_recall (PurpleAccount *account, const gchar *who,
+    gchar **checksum);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_AVATAR_STORE_H__ */
@@ -81,7 +81,7 @@ get_alias (HazeConnection *self,
     }
     else
     {
-        PurpleBuddy *buddy = purple_find_buddy (self->account, bname);
+        PurpleBuddy *buddy = haze_connection_get_buddy (self, handle);
 
         if (buddy != NULL)
         {
@@ -241,7 +241,7 @@ set_aliases_foreach (gpointer key,
     else
     {
         const gchar *bname = tp_handle_inspect (data->contact_handles, handle);
-        PurpleBuddy *buddy = purple_find_buddy (data->conn->account, bname);
+        PurpleBuddy *buddy = haze_connection_get_buddy (data->conn, handle);
 
         if (buddy == NULL)
         {
@@ -22,14 +22,86 @@
 #include <config.h>
 #include "connection-avatars.h"
 
-#include <string.h>
-
+#include <dbus/dbus-glib-lowlevel.h>
 #include <telepathy-glib/telepathy-glib.h>
 
-#include <libpurple/cipher.h>
-
+#include "avatar-store.h"
+#ifdef ENABLE_AVATAR_NORMALISATION
+#include "avatar-normaliser.h"
+#endif
 #include "connection.h"
 #include "debug.h"
+#include "util.h"
+
+#include "extensions/extensions.h"
+
+/* Hashing a few hundred avatars at once is the main-loop stall we're trying
+ * to avoid, so tokens are computed in a small pool of worker threads and
+ * cached per handle until libpurple tells us the icon has changed.
+ */
+#define HASH_THREADS 2
+
+/* RequestAvatars returns straight away; the avatars themselves are sent
+ * from an idle callback, at most this many KiB of them per iteration of
+ * the main loop...
+ */
+#define RETRIEVE_KB_PER_TICK_DEFAULT 256
+/* ... and not at all while libdbus has more than this many KiB of messages
+ * waiting to be written, in which case we check again after
+ * RETRIEVE_BACKOFF_MS.
+ */
+#define RETRIEVE_MAX_OUTGOING_KB_DEFAULT 2048
+#define RETRIEVE_BACKOFF_MS 50
+
+struct _HazeConnectionAvatarsPrivate {
+    /* TpHandle => owned gchar *token, "" if the contact has no avatar */
+    GHashTable *tokens;
+    /* TpHandle => owned gchar *token which was forgotten because the
+     * contact's icon changed, until the new one is known; AvatarUpdated is
+     * only emitted if the two differ */
+    GHashTable *superseded;
+    /* TokensRequest *s for GetAvatarTokens calls waiting on hash jobs */
+    GSList *tokens_requests;
+    guint tokens_requests_id;
+    /* TpHandle => serial of the newest hash job queued for that handle */
+    GHashTable *pending;
+    guint last_serial;
+
+    /* TpHandle, in the order RequestAvatars asked for them */
+    GQueue retrieve_queue;
+    /* TpHandle => TRUE for those in retrieve_queue; asking for one of them
+     * again before it has been sent doesn't send it twice */
+    GHashTable *retrieve_queued;
+    /* TpHandle => TRUE for those taken off retrieve_queue whose token was
+     * still being hashed; they go back on once it's known */
+    GHashTable *retrieve_waiting;
+    guint retrieve_id;
+
+    /* Bumped by every SetAvatar and ClearAvatar call; an avatar which comes
+     * back from being normalised is only used if no call has come in since
+     * it was sent off, so that avatars finishing out of order can't undo a
+     * later call. */
+    guint set_avatar_serial;
+};
+
+typedef struct {
+    HazeConnection *conn;
+    TpHandle handle;
+    guint serial;
+    GBytes *avatar;
+    /* set by the worker thread */
+    gchar *token;
+} HashJob;
+
+typedef struct {
+    DBusGMethodInvocation *context;
+    GArray *contacts;
+} TokensRequest;
+
+static GThreadPool *hash_pool = NULL;
+
+static gboolean answer_tokens_requests_cb (gpointer data);
+static void queue_retrieve (HazeConnection *conn, TpHandle handle);
 
 static gchar **
 dup_mime_types (PurpleBuddyIconSpec *icon_spec)
@@ -215,96 +287,351 @@ haze_connection_get_avatar_requirements (TpSvcConnectionInterfaceAvatars *self,
         min_width, min_height, max_width, max_height, max_bytes);
 }
 
-static GArray *
+static void
+stored_image_unref (gpointer image)
+{
+    purple_imgstore_unref (image);
+}
+
+static void
+buddy_icon_unref (gpointer icon)
+{
+    purple_buddy_icon_unref (icon);
+}
+
+/* Returns a view of handle's icon which keeps the libpurple image or icon
+ * it points into alive, or NULL if there's no icon. libpurple's refcounts
+ * aren't thread-safe, so the last unref must happen on the main thread.
+ */
+static GBytes *
 get_avatar (HazeConnection *conn,
             TpHandle handle)
 {
-    GArray *avatar = NULL;
     TpBaseConnection *base = TP_BASE_CONNECTION (conn);
-    TpHandleRepoIface *contact_handles =
-        tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
-    gconstpointer icon_data = NULL;
-    size_t icon_size = 0;
 
     if (handle == tp_base_connection_get_self_handle (base))
     {
+        /* We own the ref this returns. */
         PurpleStoredImage *image =
             purple_buddy_icons_find_account_icon (conn->account);
-        if (image)
-        {
-            icon_data = purple_imgstore_get_data (image);
-            icon_size = purple_imgstore_get_size (image);
-        }
+
+        if (image != NULL)
+            return g_bytes_new_with_free_func (
+                purple_imgstore_get_data (image),
+                purple_imgstore_get_size (image), stored_image_unref, image);
     }
     else
     {
-        const gchar *bname = tp_handle_inspect (contact_handles, handle);
-        PurpleBuddy *buddy = purple_find_buddy (conn->account, bname);
+        PurpleBuddy *buddy = haze_connection_get_buddy (conn, handle);
         PurpleBuddyIcon *icon = NULL;
+        gconstpointer icon_data = NULL;
+        size_t icon_size = 0;
+        const gchar *token = g_hash_table_lookup (conn->avatars_priv->tokens,
+            GUINT_TO_POINTER (handle));
+
+        /* Once we know what the icon is, serve it from the store's mapping
+         * rather than from libpurple's heap.
+         */
+        if (buddy != NULL && !tp_str_empty (token))
+        {
+            GBytes *stored = haze_avatar_store_lookup (token);
+
+            if (stored != NULL)
+                return stored;
+        }
+
         if (buddy)
             icon = purple_buddy_get_icon (buddy);
         if (icon)
             icon_data = purple_buddy_icon_get_data (icon, &icon_size);
+        if (icon_data)
+            return g_bytes_new_with_free_func (icon_data, icon_size,
+                buddy_icon_unref, purple_buddy_icon_ref (icon));
     }
 
-    if (icon_data)
-    {
-        avatar = g_array_sized_new (FALSE, FALSE, sizeof (gchar), icon_size);
-        g_array_append_vals (avatar, icon_data, icon_size);
-    }
+    return NULL;
+}
 
-    return avatar;
+static gchar *
+get_token (gconstpointer data,
+           gsize size)
+{
+    /* Same lower-case hex SHA-1 as libpurple's cipher, but thread-safe. */
+    return g_compute_checksum_for_data (G_CHECKSUM_SHA1, data, size);
 }
 
 static gchar *
-get_token (const GArray *avatar)
+get_avatar_token (GBytes *avatar)
 {
-    gchar *token;
+    gsize size;
+    gconstpointer data = g_bytes_get_data (avatar, &size);
+
+    return get_token (data, size);
+}
 
-    PurpleCipherContext *context;
-    gchar digest[41];
+/* Caches token, which this function steals, as handle's.  Finding out a
+ * token for the first time isn't news to anyone, so AvatarUpdated is only
+ * emitted if it replaces a different one that was forgotten when the icon
+ * changed.
+ */
+static void
+store_token (HazeConnection *conn,
+             TpHandle handle,
+             gchar *token)
+{
+    HazeConnectionAvatarsPrivate *priv = conn->avatars_priv;
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    gpointer key = GUINT_TO_POINTER (handle);
+    const gchar *old = g_hash_table_lookup (priv->superseded, key);
+    gboolean changed = (old != NULL && tp_strdiff (old, token));
 
-    g_assert (avatar != NULL);
+    g_hash_table_insert (priv->tokens, key, token);
+    g_hash_table_remove (priv->superseded, key);
 
-    context = purple_cipher_context_new_by_name ("sha1", NULL);
-    if (context == NULL)
+    if (changed &&
+        tp_base_connection_get_status (base) != TP_CONNECTION_STATUS_DISCONNECTED)
     {
-        g_error ("Could not find libpurple's sha1 cipher");
+        DEBUG ("%u '%s'", handle, token);
+        tp_svc_connection_interface_avatars_emit_avatar_updated (conn, handle,
+            token);
     }
 
-    /* Hash the image data */
-    purple_cipher_context_append (context, (const guchar *) avatar->data,
-            avatar->len);
-    if (!purple_cipher_context_digest_to_str (context, sizeof (digest),
-                digest, NULL))
+    if (priv->tokens_requests != NULL && priv->tokens_requests_id == 0)
+        priv->tokens_requests_id = g_idle_add (answer_tokens_requests_cb,
+            conn);
+
+    if (g_hash_table_remove (priv->retrieve_waiting, key))
+        queue_retrieve (conn, handle);
+}
+
+/* Records handle's token in the avatar store's index, so that their icon
+ * can be restored without fetching it next time we see them.
+ */
+static void
+remember_token (HazeConnection *conn,
+                TpHandle handle,
+                const gchar *token)
+{
+    PurpleBuddy *buddy;
+
+    if (handle == tp_base_connection_get_self_handle (
+            TP_BASE_CONNECTION (conn)))
+        return;
+
+    buddy = haze_connection_get_buddy (conn, handle);
+    if (buddy == NULL)
+        return;
+
+    haze_avatar_store_remember (conn->account, purple_buddy_get_name (buddy),
+        token, purple_buddy_icons_get_checksum_for_user (buddy));
+}
+
+static void
+hash_job_free (HashJob *job)
+{
+    g_object_unref (job->conn);
+    if (job->avatar != NULL)
+        g_bytes_unref (job->avatar);
+    g_free (job->token);
+    g_slice_free (HashJob, job);
+}
+
+static gboolean
+hash_job_done_cb (gpointer data)
+{
+    HashJob *job = data;
+    HazeConnectionAvatarsPrivate *priv = job->conn->avatars_priv;
+    gpointer key = GUINT_TO_POINTER (job->handle);
+
+    if (GPOINTER_TO_UINT (g_hash_table_lookup (priv->pending, key)) ==
+        job->serial)
     {
-        g_error ("Failed to get SHA-1 digest");
+        g_hash_table_remove (priv->pending, key);
+        remember_token (job->conn, job->handle, job->token);
+        store_token (job->conn, job->handle, job->token);
+        job->token = NULL;
+    }
+    else
+    {
+        DEBUG ("icon for %u changed while hashing; discarding '%s'",
+            job->handle, job->token);
     }
-    purple_cipher_context_destroy (context);
 
-    token = g_strdup (digest);
+    hash_job_free (job);
+    return FALSE;
+}
 
-    return token;
+static void
+hash_job_run (gpointer data,
+              gpointer unused)
+{
+    HashJob *job = data;
+
+    gsize size;
+    gconstpointer bytes = g_bytes_get_data (job->avatar, &size);
+
+    job->token = get_token (bytes, size);
+    haze_avatar_store_add (job->token, bytes, size);
+    g_idle_add (hash_job_done_cb, job);
 }
 
-static gchar *
-get_handle_token (HazeConnection *conn,
-                  TpHandle handle)
+/* Works out handle's token and stores it once it's known.  Unless the
+ * contact turns out to have no icon, this completes asynchronously.
+ */
+static void
+queue_token_update (HazeConnection *conn,
+                    TpHandle handle)
 {
-    GArray *avatar = get_avatar (conn, handle);
-    gchar *token;
+    HazeConnectionAvatarsPrivate *priv = conn->avatars_priv;
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    GBytes *avatar = get_avatar (conn, handle);
+    HashJob *job;
 
-    if (avatar != NULL)
+    if (avatar == NULL)
+    {
+        /* Nothing to hash, and any job still running is now stale. */
+        g_hash_table_remove (priv->pending, GUINT_TO_POINTER (handle));
+        remember_token (conn, handle, "");
+        store_token (conn, handle, g_strdup (""));
+        return;
+    }
+
+    if (hash_pool == NULL)
+        hash_pool = g_thread_pool_new (hash_job_run, NULL, HASH_THREADS,
+            FALSE, NULL);
+
+    if (++priv->last_serial == 0)
+        priv->last_serial = 1;
+
+    job = g_slice_new0 (HashJob);
+    job->conn = g_object_ref (conn);
+    job->handle = handle;
+    job->serial = priv->last_serial;
+
+    /* Stored images are immutable, but purple_buddy_icon_set_data() can free
+     * a buddy icon's bytes while a worker is still reading them, so those
+     * get copied; this happens once per icon change, not once per lookup.
+     */
+    if (handle == tp_base_connection_get_self_handle (base))
     {
-        token = get_token (avatar);
-        g_array_free (avatar, TRUE);
+        job->avatar = avatar;
     }
     else
     {
-        token = g_strdup ("");
+        gsize size;
+        gconstpointer data = g_bytes_get_data (avatar, &size);
+
+        job->avatar = g_bytes_new (data, size);
+        g_bytes_unref (avatar);
     }
 
-    return token;
+    g_hash_table_insert (priv->pending, GUINT_TO_POINTER (handle),
+        GUINT_TO_POINTER (job->serial));
+    g_thread_pool_push (hash_pool, job, NULL);
+}
+
+/* Returns handle's cached token, "" if the contact is known to have no
+ * avatar, or NULL if the token isn't known yet, in which case it is worked
+ * out in the background.
+ */
+static const gchar *
+lookup_token (HazeConnection *conn,
+              TpHandle handle)
+{
+    HazeConnectionAvatarsPrivate *priv = conn->avatars_priv;
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    gpointer key = GUINT_TO_POINTER (handle);
+    const gchar *token = g_hash_table_lookup (priv->tokens, key);
+
+    if (token != NULL)
+        return token;
+
+    /* Don't cache anything for contacts who aren't on the roster: their
+     * icon will turn up without buddy-icon-changed if they're added later.
+     */
+    if (handle != tp_base_connection_get_self_handle (base) &&
+        haze_connection_get_buddy (conn, handle) == NULL)
+        return "";
+
+    if (g_hash_table_lookup (priv->pending, key) == NULL)
+        queue_token_update (conn, handle);
+
+    return g_hash_table_lookup (priv->tokens, key);
+}
+
+/* Returns contacts' tokens, in order, or NULL if some of them aren't known
+ * yet; in which case they're being worked out, and store_token() will
+ * arrange to try again.
+ */
+static gchar **
+dup_known_tokens (HazeConnection *conn,
+                  const GArray *contacts)
+{
+    gchar **tokens = g_new0 (gchar *, contacts->len + 1);
+    gboolean complete = TRUE;
+    guint i;
+
+    /* Carry on past unknown ones, so all of them get queued for hashing at
+     * once. */
+    for (i = 0; i < contacts->len; i++)
+    {
+        TpHandle handle = g_array_index (contacts, TpHandle, i);
+        const gchar *token = lookup_token (conn, handle);
+
+        if (token == NULL)
+            complete = FALSE;
+        else if (complete)
+            tokens[i] = g_strdup (token);
+    }
+
+    if (!complete)
+    {
+        g_strfreev (tokens);
+        return NULL;
+    }
+
+    return tokens;
+}
+
+static void
+tokens_request_free (TokensRequest *request)
+{
+    g_array_unref (request->contacts);
+    g_slice_free (TokensRequest, request);
+}
+
+static gboolean
+answer_tokens_requests_cb (gpointer data)
+{
+    HazeConnection *conn = data;
+    HazeConnectionAvatarsPrivate *priv = conn->avatars_priv;
+    GSList *waiting = priv->tokens_requests;
+    GSList *l;
+
+    priv->tokens_requests_id = 0;
+    priv->tokens_requests = NULL;
+
+    for (l = waiting; l != NULL; l = l->next)
+    {
+        TokensRequest *request = l->data;
+        gchar **tokens = dup_known_tokens (conn, request->contacts);
+
+        if (tokens == NULL)
+        {
+            priv->tokens_requests = g_slist_prepend (priv->tokens_requests,
+                request);
+            continue;
+        }
+
+        tp_svc_connection_interface_avatars_return_from_get_avatar_tokens (
+            request->context, (const gchar **) tokens);
+        g_strfreev (tokens);
+        tokens_request_free (request);
+    }
+
+    priv->tokens_requests = g_slist_reverse (priv->tokens_requests);
+    g_slist_free (waiting);
+    return FALSE;
 }
 
 static void
@@ -315,20 +642,29 @@ haze_connection_get_avatar_tokens (TpSvcConnectionInterfaceAvatars *self,
     gchar **icons;
     HazeConnection *conn = HAZE_CONNECTION (self);
     TpBaseConnection *base = TP_BASE_CONNECTION (self);
-    guint i;
+    TokensRequest *request;
 
     TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
 
-    icons = g_new0 (gchar *, contacts->len + 1);
-    for (i = 0; i < contacts->len; i++)
+    icons = dup_known_tokens (conn, contacts);
+
+    if (icons != NULL)
     {
-        TpHandle handle = g_array_index (contacts, TpHandle, i);
-        icons[i] = get_handle_token (conn, handle);
+        tp_svc_connection_interface_avatars_return_from_get_avatar_tokens (
+            context, (const gchar **) icons);
+        g_strfreev (icons);
+        return;
     }
 
-    tp_svc_connection_interface_avatars_return_from_get_avatar_tokens (
-        context, (const gchar **) icons);
-    g_strfreev (icons);
+    /* An empty string here would mean "no avatar", so rather than guess,
+     * wait until the tokens still being hashed are known. */
+    request = g_slice_new (TokensRequest);
+    request->context = context;
+    request->contacts = g_array_sized_new (FALSE, FALSE, sizeof (TpHandle),
+        contacts->len);
+    g_array_append_vals (request->contacts, contacts->data, contacts->len);
+    conn->avatars_priv->tokens_requests = g_slist_append (
+        conn->avatars_priv->tokens_requests, request);
 }
 
 static void
@@ -357,7 +693,7 @@ haze_connection_get_known_avatar_tokens (TpSvcConnectionInterfaceAvatars *self,
     for (i = 0; i < contacts->len; i++)
     {
         TpHandle handle = g_array_index (contacts, TpHandle, i);
-        gchar *token = NULL;
+        const gchar *token = lookup_token (conn, handle);
 
         /* Purple doesn't provide any way to distinguish between a contact with
          * no avatar and a contact whose avatar we haven't retrieved yet,
@@ -368,24 +704,18 @@ haze_connection_get_known_avatar_tokens (TpSvcConnectionInterfaceAvatars *self,
          * But on protocols where avatars aren't saved server-side, we should
          * report that it's unknown, so that the UI (aka. mcd) can re-set the
          * avatar you last used.  So we special-case self_handle here.
+         *
+         * Tokens still being hashed are unknown too; clients can call
+         * RequestAvatars for those, or ask again later.
          */
 
-        if (handle == tp_base_connection_get_self_handle (base_conn))
-        {
-            GArray *avatar = get_avatar (conn, handle);
-            if (avatar != NULL)
-            {
-                token = get_token (avatar);
-                g_array_free (avatar, TRUE);
-            }
-        }
-        else
-        {
-            token = get_handle_token (conn, handle);
-        }
+        if (handle == tp_base_connection_get_self_handle (base_conn) &&
+            !tp_strdiff (token, ""))
+            token = NULL;
 
         if (token != NULL)
-            g_hash_table_insert (tokens, GUINT_TO_POINTER (handle), token);
+            g_hash_table_insert (tokens, GUINT_TO_POINTER (handle),
+                g_strdup (token));
     }
 
     tp_svc_connection_interface_avatars_return_from_get_known_avatar_tokens (
@@ -401,7 +731,7 @@ haze_connection_request_avatar (TpSvcConnectionInterfaceAvatars *self,
 {
     HazeConnection *conn = HAZE_CONNECTION (self);
     TpBaseConnection *base = TP_BASE_CONNECTION (conn);
-    GArray *avatar;
+    GBytes *avatar;
     GError *error = NULL;
 
     TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
@@ -409,10 +739,21 @@ haze_connection_request_avatar (TpSvcConnectionInterfaceAvatars *self,
     avatar = get_avatar (conn, contact);
     if (avatar)
     {
-        DEBUG ("returning avatar for %u, length %u", contact, avatar->len);
+        gsize size;
+        GArray array;
+
+        /* dbus_g_method_return() collects its arguments without copying
+         * them and only reads ->data and ->len when marshalling a byte
+         * array, so the reply can borrow avatar's bytes through a GArray on
+         * the stack rather than a copy.  That's only safe here: it isn't a
+         * real GArray, so it mustn't be reffed, freed or copied, as
+         * g_signal_emit() would. */
+        array.data = (gchar *) g_bytes_get_data (avatar, &size);
+        array.len = size;
+        DEBUG ("returning avatar for %u, length %u", contact, array.len);
         tp_svc_connection_interface_avatars_return_from_request_avatar (
-            context, avatar, "" /* no way to get MIME type from purple */);
-        g_array_free (avatar, TRUE);
+            context, &array, "" /* no way to get MIME type from purple */);
+        g_bytes_unref (avatar);
     }
     else
     {
@@ -427,6 +768,146 @@ haze_connection_request_avatar (TpSvcConnectionInterfaceAvatars *self,
     }
 }
 
+/* Emits AvatarRetrieved for handle, unless it has no avatar, and returns
+ * how many bytes were sent.  If its token is still being hashed, it's put
+ * back on the queue once the token is known.
+ */
+static gsize
+retrieve_avatar (HazeConnection *conn,
+                 TpHandle handle)
+{
+    HazeConnectionAvatarsPrivate *priv = conn->avatars_priv;
+    const gchar *token = lookup_token (conn, handle);
+    GBytes *avatar;
+    GArray *array;
+    gconstpointer data;
+    gsize size;
+
+    if (token == NULL)
+    {
+        DEBUG ("waiting for %u's token", handle);
+        g_hash_table_insert (priv->retrieve_waiting, GUINT_TO_POINTER (handle),
+            GINT_TO_POINTER (TRUE));
+        return 0;
+    }
+
+    if (*token == '\0')
+        return 0;
+
+    avatar = get_avatar (conn, handle);
+
+    if (avatar == NULL)
+        return 0;
+
+    /* Signal arguments are copied by g_signal_emit(), which needs a real
+     * GArray to copy from; so, unlike RequestAvatar's reply, these cost a
+     * copy of their own too. */
+    data = g_bytes_get_data (avatar, &size);
+    array = g_array_sized_new (FALSE, FALSE, sizeof (guchar), size);
+    g_array_append_vals (array, data, size);
+    g_bytes_unref (avatar);
+
+    tp_svc_connection_interface_avatars_emit_avatar_retrieved (
+        conn, handle, token, array, "" /* unknown MIME type */);
+
+    g_array_unref (array);
+    return size;
+}
+
+static gboolean
+outgoing_queue_is_full (HazeConnection *conn)
+{
+    static guint max_outgoing_kb = G_MAXUINT;
+    TpDBusDaemon *bus = tp_base_connection_get_dbus_daemon (
+        TP_BASE_CONNECTION (conn));
+    DBusConnection *dbus_conn;
+
+    if (max_outgoing_kb == G_MAXUINT)
+        max_outgoing_kb = haze_get_tunable ("HAZE_AVATAR_MAX_OUTGOING_KB",
+            RETRIEVE_MAX_OUTGOING_KB_DEFAULT);
+
+    if (bus == NULL || max_outgoing_kb == 0)
+        return FALSE;
+
+    dbus_conn = dbus_g_connection_get_connection (
+        tp_proxy_get_dbus_connection (bus));
+
+    return dbus_connection_get_outgoing_size (dbus_conn) >
+        (long) max_outgoing_kb * 1024;
+}
+
+static gboolean
+retrieve_avatars_cb (gpointer data)
+{
+    HazeConnection *conn = data;
+    HazeConnectionAvatarsPrivate *priv = conn->avatars_priv;
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    static guint kb_per_tick = G_MAXUINT;
+    gsize sent = 0;
+
+    if (kb_per_tick == G_MAXUINT)
+        kb_per_tick = haze_get_tunable ("HAZE_AVATAR_KB_PER_TICK",
+            RETRIEVE_KB_PER_TICK_DEFAULT);
+
+    if (tp_base_connection_get_status (base) ==
+        TP_CONNECTION_STATUS_DISCONNECTED)
+    {
+        g_queue_clear (&priv->retrieve_queue);
+        g_hash_table_remove_all (priv->retrieve_queued);
+        g_hash_table_remove_all (priv->retrieve_waiting);
+        priv->retrieve_id = 0;
+        return FALSE;
+    }
+
+    if (outgoing_queue_is_full (conn))
+    {
+        DEBUG ("D-Bus queue is full; %u avatars waiting",
+            priv->retrieve_queue.length);
+        priv->retrieve_id = g_timeout_add (RETRIEVE_BACKOFF_MS,
+            retrieve_avatars_cb, conn);
+        return FALSE;
+    }
+
+    /* Always send at least one, however big, so we make progress. */
+    while (!g_queue_is_empty (&priv->retrieve_queue) &&
+        (sent == 0 || sent < (gsize) kb_per_tick * 1024))
+    {
+        TpHandle handle = GPOINTER_TO_UINT (
+            g_queue_pop_head (&priv->retrieve_queue));
+
+        g_hash_table_remove (priv->retrieve_queued, GUINT_TO_POINTER (handle));
+        sent += retrieve_avatar (conn, handle);
+    }
+
+    if (g_queue_is_empty (&priv->retrieve_queue))
+    {
+        priv->retrieve_id = 0;
+        return FALSE;
+    }
+
+    /* We may have been called back from the back-off timeout. */
+    priv->retrieve_id = g_idle_add (retrieve_avatars_cb, conn);
+    return FALSE;
+}
+
+/* Arranges for handle's avatar to be sent, unless it is already queued. */
+static void
+queue_retrieve (HazeConnection *conn,
+                TpHandle handle)
+{
+    HazeConnectionAvatarsPrivate *priv = conn->avatars_priv;
+    gpointer key = GUINT_TO_POINTER (handle);
+
+    if (g_hash_table_lookup (priv->retrieve_queued, key) != NULL)
+        return;
+
+    g_hash_table_insert (priv->retrieve_queued, key, GINT_TO_POINTER (TRUE));
+    g_queue_push_tail (&priv->retrieve_queue, key);
+
+    if (priv->retrieve_id == 0)
+        priv->retrieve_id = g_idle_add (retrieve_avatars_cb, conn);
+}
+
 static void
 haze_connection_request_avatars (TpSvcConnectionInterfaceAvatars *self,
                                  const GArray *contacts,
@@ -439,18 +920,7 @@ haze_connection_request_avatars (TpSvcConnectionInterfaceAvatars *self,
     TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
 
     for (i = 0; i < contacts->len; i++)
-    {
-        TpHandle handle = g_array_index (contacts, TpHandle, i);
-        GArray *avatar = get_avatar (conn, handle);
-        if (avatar != NULL)
-        {
-            gchar *token = get_token (avatar);
-            tp_svc_connection_interface_avatars_emit_avatar_retrieved (
-                conn, handle, token, avatar, "" /* unknown MIME type */);
-            g_free (token);
-            g_array_free (avatar, TRUE);
-        }
-    }
+        queue_retrieve (conn, g_array_index (contacts, TpHandle, i));
 
     tp_svc_connection_interface_avatars_return_from_request_avatars (context);
 }
@@ -462,47 +932,132 @@ haze_connection_clear_avatar (TpSvcConnectionInterfaceAvatars *self,
     HazeConnection *conn = HAZE_CONNECTION (self);
     TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
     PurpleAccount *account = conn->account;
+    TpHandle self_handle = tp_base_connection_get_self_handle (base_conn);
 
+    conn->avatars_priv->set_avatar_serial++;
     purple_buddy_icons_set_account_icon (account, NULL, 0);
+    g_hash_table_remove (conn->avatars_priv->pending,
+        GUINT_TO_POINTER (self_handle));
+    store_token (conn, self_handle, g_strdup (""));
 
     tp_svc_connection_interface_avatars_return_from_clear_avatar (context);
     tp_svc_connection_interface_avatars_emit_avatar_updated (conn,
-        tp_base_connection_get_self_handle (base_conn), "");
+        self_handle, "");
+}
+
+/* Makes avatar, which this function steals, the account's icon, and returns
+ * its token.
+ */
+static gchar *
+set_account_icon (HazeConnection *conn,
+                  GBytes *avatar)
+{
+    TpHandle self_handle =
+        tp_base_connection_get_self_handle (TP_BASE_CONNECTION (conn));
+    gchar *token = get_avatar_token (avatar);
+    gsize icon_len;
+    /* purple_buddy_icons_set_account_icon () takes ownership of the pointer
+     * passed to it; this only copies the bytes if someone else still holds
+     * a ref to them.
+     */
+    guchar *icon_data = g_bytes_unref_to_data (avatar, &icon_len);
+
+    purple_buddy_icons_set_account_icon (conn->account, icon_data, icon_len);
+    DEBUG ("%s", token);
+
+    g_hash_table_remove (conn->avatars_priv->pending,
+        GUINT_TO_POINTER (self_handle));
+    store_token (conn, self_handle, g_strdup (token));
+
+    return token;
 }
 
 static void
-haze_connection_set_avatar (TpSvcConnectionInterfaceAvatars *self,
-                            const GArray *avatar,
-                            const gchar *mime_type,
-                            DBusGMethodInvocation *context)
+finish_set_avatar (HazeConnection *conn,
+                   GBytes *avatar,
+                   DBusGMethodInvocation *context)
 {
-    HazeConnection *conn = HAZE_CONNECTION (self);
-    TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
-    PurpleAccount *account = conn->account;
-    PurplePluginProtocolInfo *prpl_info = HAZE_CONNECTION_GET_PRPL_INFO (conn);
+    gchar *token = set_account_icon (conn, avatar);
+
+    tp_svc_connection_interface_avatars_return_from_set_avatar (context, token);
+    tp_svc_connection_interface_avatars_emit_avatar_updated (conn,
+        tp_base_connection_get_self_handle (TP_BASE_CONNECTION (conn)), token);
+    g_free (token);
+}
 
+#ifdef ENABLE_AVATAR_NORMALISATION
+
+typedef struct {
+    HazeConnection *conn;
+    DBusGMethodInvocation *context;
+    guint serial;
+} SetAvatarContext;
+
+static void
+avatar_normalised_cb (GObject *source,
+                      GAsyncResult *result,
+                      gpointer user_data)
+{
+    SetAvatarContext *ctx = user_data;
+    TpBaseConnection *base_conn = TP_BASE_CONNECTION (ctx->conn);
     GError *error = NULL;
+    GBytes *avatar = haze_avatar_normalise_finish (result, &error);
 
-    guchar *icon_data = NULL;
-    size_t icon_len = avatar->len;
-    gchar *token;
-    gchar **mime_types = _get_acceptable_mime_types (conn);
+    if (ctx->serial != ctx->conn->avatars_priv->set_avatar_serial)
+    {
+        DEBUG ("SetAvatar call %u was superseded", ctx->serial);
+        g_clear_error (&error);
+        g_set_error (&error, TP_ERROR, TP_ERROR_CANCELLED,
+            "superseded by a later SetAvatar or ClearAvatar call");
+        dbus_g_method_return_error (ctx->context, error);
+        g_error_free (error);
+
+        if (avatar != NULL)
+            g_bytes_unref (avatar);
+    }
+    else if (avatar == NULL)
+    {
+        DEBUG ("%s", error->message);
+        dbus_g_method_return_error (ctx->context, error);
+        g_error_free (error);
+    }
+    else if (tp_base_connection_get_status (base_conn) !=
+             TP_CONNECTION_STATUS_CONNECTED)
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_DISCONNECTED,
+            "disconnected while the avatar was being processed");
+        dbus_g_method_return_error (ctx->context, error);
+        g_error_free (error);
+        g_bytes_unref (avatar);
+    }
+    else
+    {
+        finish_set_avatar (ctx->conn, avatar, ctx->context);
+    }
+
+    g_object_unref (ctx->conn);
+    g_slice_free (SetAvatarContext, ctx);
+}
 
-    gboolean acceptable_mime_type = FALSE;
+#else
 
+static gboolean
+avatar_is_acceptable (HazeConnection *conn,
+                      gsize icon_len,
+                      const gchar *mime_type,
+                      GError **error)
+{
+    PurplePluginProtocolInfo *prpl_info = HAZE_CONNECTION_GET_PRPL_INFO (conn);
+    gchar **mime_types = _get_acceptable_mime_types (conn);
     const size_t max_filesize = prpl_info->icon_spec.max_filesize;
 
     if (max_filesize > 0 && icon_len > max_filesize)
     {
-        g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+        g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
                      "avatar is %" G_GSIZE_FORMAT "B, "
                      "but the limit is %" G_GSIZE_FORMAT "B",
                      icon_len, max_filesize);
-
-        dbus_g_method_return_error (context, error);
-
-        g_error_free (error);
-        return;
+        return FALSE;
     }
 
     /* FIXME: This is a work-around for mission control passing an empty
@@ -512,41 +1067,58 @@ haze_connection_set_avatar (TpSvcConnectionInterfaceAvatars *self,
      *        probably go away when MC is fixed.
      */
     if (*mime_type == '\0')
-        acceptable_mime_type = TRUE;
+        return TRUE;
 
-    while (!acceptable_mime_type && *mime_types != NULL)
+    for (; *mime_types != NULL; mime_types++)
     {
         if (!tp_strdiff (*mime_types, mime_type))
-            acceptable_mime_type = TRUE;
-        mime_types++;
+            return TRUE;
     }
 
-    if (!acceptable_mime_type)
-    {
-        g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
-            "'%s' is not a supported MIME type", mime_type);
+    g_set_error (error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+        "'%s' is not a supported MIME type", mime_type);
+    return FALSE;
+}
 
-        dbus_g_method_return_error (context, error);
+#endif
 
-        g_error_free (error);
+static void
+haze_connection_set_avatar (TpSvcConnectionInterfaceAvatars *self,
+                            const GArray *avatar,
+                            const gchar *mime_type,
+                            DBusGMethodInvocation *context)
+{
+    HazeConnection *conn = HAZE_CONNECTION (self);
+    /* 'avatar' belongs to dbus-glib, which will free it soon; this is the one
+     * copy of the bytes we make.
+     */
+    GBytes *bytes = g_bytes_new (avatar->data, avatar->len);
+#ifdef ENABLE_AVATAR_NORMALISATION
+    PurplePluginProtocolInfo *prpl_info = HAZE_CONNECTION_GET_PRPL_INFO (conn);
+    SetAvatarContext *ctx = g_slice_new (SetAvatarContext);
+
+    /* Decoding, scaling and re-encoding happen in a worker thread; we reply
+     * once the result is back on the main loop.
+     */
+    ctx->conn = g_object_ref (conn);
+    ctx->context = context;
+    ctx->serial = ++conn->avatars_priv->set_avatar_serial;
+    haze_avatar_normalise_async (&prpl_info->icon_spec, bytes, mime_type,
+        avatar_normalised_cb, ctx);
+    g_bytes_unref (bytes);
+#else
+    GError *error = NULL;
 
+    if (!avatar_is_acceptable (conn, avatar->len, mime_type, &error))
+    {
+        dbus_g_method_return_error (context, error);
+        g_error_free (error);
+        g_bytes_unref (bytes);
         return;
     }
 
-
-    /* purple_buddy_icons_set_account_icon () takes ownership of the pointer
-     * passed to it, but 'avatar' will be freed soon.
-     */
-    icon_data = g_malloc (avatar->len);
-    memcpy (icon_data, avatar->data, icon_len);
-    purple_buddy_icons_set_account_icon (account, icon_data, icon_len);
-    token = get_token (avatar);
-    DEBUG ("%s", token);
-
-    tp_svc_connection_interface_avatars_return_from_set_avatar (context, token);
-    tp_svc_connection_interface_avatars_emit_avatar_updated (conn,
-        tp_base_connection_get_self_handle (base_conn), token);
-    g_free (token);
+    finish_set_avatar (conn, bytes, context);
+#endif
 }
 
 void
@@ -568,24 +1140,209 @@ haze_connection_avatars_iface_init (gpointer g_iface,
 #undef IMPLEMENT
 }
 
+typedef struct {
+    DBusGMethodInvocation *context;
+    TpHandle contact;
+    gchar *token;
+    gsize size;
+} AvatarFileRequest;
+
+static void
+avatar_file_stored_cb (GObject *source,
+                       GAsyncResult *result,
+                       gpointer user_data)
+{
+    AvatarFileRequest *request = user_data;
+    GError *error = NULL;
+    gchar *path = haze_avatar_store_add_finish (result, &error);
+
+    if (path == NULL)
+    {
+        DEBUG ("couldn't store handle %u's avatar: %s", request->contact,
+            error->message);
+        dbus_g_method_return_error (request->context, error);
+        g_error_free (error);
+    }
+    else
+    {
+        DEBUG ("avatar for %u is %s", request->contact, path);
+        haze_svc_connection_interface_haze_avatar_files_return_from_get_avatar_file (
+            request->context, request->token, path, request->size);
+        g_free (path);
+    }
+
+    g_free (request->token);
+    g_slice_free (AvatarFileRequest, request);
+}
+
+static void
+haze_connection_get_avatar_file (HazeSvcConnectionInterfaceHazeAvatarFiles *self,
+                                 guint contact,
+                                 DBusGMethodInvocation *context)
+{
+    HazeConnection *conn = HAZE_CONNECTION (self);
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    TpHandleRepoIface *contact_repo =
+        tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
+    GError *error = NULL;
+    GBytes *avatar;
+    const gchar *cached;
+    gchar *token, *path;
+    gsize size;
+
+    TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
+
+    if (!tp_handle_is_valid (contact_repo, contact, &error))
+    {
+        dbus_g_method_return_error (context, error);
+        g_error_free (error);
+        return;
+    }
+
+    avatar = get_avatar (conn, contact);
+    if (avatar == NULL)
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+                     "handle %u has no avatar", contact);
+        dbus_g_method_return_error (context, error);
+        g_error_free (error);
+        return;
+    }
+
+    cached = g_hash_table_lookup (conn->avatars_priv->tokens,
+        GUINT_TO_POINTER (contact));
+    if (!tp_str_empty (cached))
+        token = g_strdup (cached);
+    else
+        token = get_avatar_token (avatar);
+
+    path = haze_avatar_store_dup_path (token);
+    size = g_bytes_get_size (avatar);
+
+    if (path != NULL)
+    {
+        DEBUG ("avatar for %u is %s", contact, path);
+        haze_svc_connection_interface_haze_avatar_files_return_from_get_avatar_file (
+            context, token, path, size);
+        g_free (path);
+        g_free (token);
+    }
+    else if (!haze_avatar_store_is_enabled ())
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+                     "the avatar store is disabled");
+        dbus_g_method_return_error (context, error);
+        g_error_free (error);
+        g_free (token);
+    }
+    else
+    {
+        /* One still being hashed may not be stored yet; rather than block
+         * the main loop writing it, reply once a worker has done so. */
+        AvatarFileRequest *request = g_slice_new0 (AvatarFileRequest);
+        GBytes *copy = avatar;
+
+        /* As in queue_token_update(), a buddy icon's bytes may be freed
+         * under the worker's feet. */
+        if (contact != tp_base_connection_get_self_handle (base))
+            copy = g_bytes_new (g_bytes_get_data (avatar, NULL), size);
+        else
+            g_bytes_ref (copy);
+
+        request->context = context;
+        request->contact = contact;
+        request->token = token;
+        request->size = size;
+        haze_avatar_store_add_async (token, copy, avatar_file_stored_cb,
+            request);
+        g_bytes_unref (copy);
+    }
+
+    g_bytes_unref (avatar);
+}
+
+void
+haze_connection_avatar_files_iface_init (gpointer g_iface,
+                                         gpointer iface_data)
+{
+    HazeSvcConnectionInterfaceHazeAvatarFilesClass *klass =
+        (HazeSvcConnectionInterfaceHazeAvatarFilesClass *) g_iface;
+
+    haze_svc_connection_interface_haze_avatar_files_implement_get_avatar_file (
+        klass, haze_connection_get_avatar_file);
+}
+
 static void
 buddy_icon_changed_cb (PurpleBuddy *buddy,
                        gpointer unused)
 {
     HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (buddy->account);
-    TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
-    TpHandleRepoIface *contact_repo =
-        tp_base_connection_get_handles (base_conn, TP_HANDLE_TYPE_CONTACT);
+    HazeConnectionAvatarsPrivate *priv = conn->avatars_priv;
+    TpHandle contact = haze_connection_get_buddy_handle (conn, buddy);
+    gpointer key = GUINT_TO_POINTER (contact);
+
+    DEBUG ("%s", purple_buddy_get_name (buddy));
+
+    if (contact == 0)
+        return;
+
+    /* Forget the old token straight away, so nobody's told it in the
+     * meantime; AvatarUpdated goes out when the new one's ready, if it's
+     * different.  If the icon changes again before then, it's still the
+     * first token that clients were told about.
+     */
+    if (g_hash_table_lookup (priv->superseded, key) == NULL)
+    {
+        gchar *old = g_hash_table_lookup (priv->tokens, key);
+
+        if (old != NULL)
+        {
+            g_hash_table_steal (priv->tokens, key);
+            g_hash_table_insert (priv->superseded, key, old);
+        }
+    }
+    else
+    {
+        g_hash_table_remove (priv->tokens, key);
+    }
+
+    queue_token_update (conn, contact);
+}
 
-    const char* bname = purple_buddy_get_name (buddy);
-    TpHandle contact = tp_handle_ensure (contact_repo, bname, NULL, NULL);
+static void
+buddy_added_cb (PurpleBuddy *buddy,
+                gpointer unused)
+{
+    PurpleAccount *account = purple_buddy_get_account (buddy);
+    PurpleConnection *gc = purple_account_get_connection (account);
+    const gchar *name = purple_buddy_get_name (buddy);
+    gchar *token, *checksum;
+    GBytes *avatar = NULL;
+
+    if (gc == NULL ||
+        PURPLE_PLUGIN_PROTOCOL_INFO (gc->prpl)->icon_spec.format == NULL ||
+        purple_buddy_get_icon (buddy) != NULL)
+        return;
 
-    gchar *token = get_handle_token (conn, contact);
+    token = haze_avatar_store_recall (account, name, &checksum);
+    if (token != NULL)
+        avatar = haze_avatar_store_lookup (token);
+
+    if (avatar != NULL)
+    {
+        gsize size;
+        gconstpointer data = g_bytes_get_data (avatar, &size);
 
-    DEBUG ("%s '%s'", bname, token);
+        /* Given the checksum it had last time, the prpl can tell that it
+         * needn't fetch the icon again.  libpurple wants a buffer of its own.
+         */
+        DEBUG ("restoring %s's icon %s", name, token);
+        purple_buddy_icons_set_for_user (account, name,
+            g_memdup (data, size), size, checksum);
+        g_bytes_unref (avatar);
+    }
 
-    tp_svc_connection_interface_avatars_emit_avatar_updated (conn, contact,
-        token);
+    g_free (checksum);
     g_free (token);
 }
 
@@ -596,6 +1353,10 @@ haze_connection_avatars_class_init (GObjectClass *object_class)
 
     purple_signal_connect (blist_handle, "buddy-icon-changed", object_class,
         PURPLE_CALLBACK (buddy_icon_changed_cb), NULL);
+    /* Run after contact-list.c has given the buddy a handle. */
+    purple_signal_connect_priority (blist_handle, "buddy-added", object_class,
+        PURPLE_CALLBACK (buddy_added_cb), NULL,
+        PURPLE_SIGNAL_PRIORITY_DEFAULT + 1);
 }
 
 static void
@@ -609,11 +1370,14 @@ fill_contact_attributes (GObject *object,
     for (i = 0; i < contacts->len; i++)
     {
         TpHandle handle = g_array_index (contacts, guint, i);
-        gchar *token = get_handle_token (self, handle);
-        GValue *value = tp_g_value_slice_new (G_TYPE_STRING);
+        const gchar *token = lookup_token (self, handle);
+        GValue *value;
+
+        /* Leaving the attribute out means "not known yet" */
+        if (token == NULL)
+            continue;
 
-        g_assert (token != NULL);
-        g_value_set_string (value, token);
+        value = tp_g_value_slice_new_string (token);
 
         /* this steals the GValue */
         tp_contacts_mixin_set_contact_attribute (attributes_hash, handle,
@@ -624,7 +1388,56 @@ fill_contact_attributes (GObject *object,
 void
 haze_connection_avatars_init (GObject *object)
 {
+    HazeConnection *conn = HAZE_CONNECTION (object);
+
+    conn->avatars_priv = g_slice_new0 (HazeConnectionAvatarsPrivate);
+    conn->avatars_priv->tokens = g_hash_table_new_full (NULL, NULL, NULL,
+        g_free);
+    conn->avatars_priv->superseded = g_hash_table_new_full (NULL, NULL, NULL,
+        g_free);
+    conn->avatars_priv->pending = g_hash_table_new (NULL, NULL);
+    g_queue_init (&conn->avatars_priv->retrieve_queue);
+    conn->avatars_priv->retrieve_queued = g_hash_table_new (NULL, NULL);
+    conn->avatars_priv->retrieve_waiting = g_hash_table_new (NULL, NULL);
+
     tp_contacts_mixin_add_contact_attributes_iface (object,
         TP_IFACE_CONNECTION_INTERFACE_AVATARS,
         fill_contact_attributes);
 }
+
+void
+haze_connection_avatars_finalize (GObject *object)
+{
+    HazeConnection *conn = HAZE_CONNECTION (object);
+    HazeConnectionAvatarsPrivate *priv = conn->avatars_priv;
+
+    if (priv->retrieve_id != 0)
+        g_source_remove (priv->retrieve_id);
+
+    /* Anyone still waiting for tokens won't get them now. */
+    if (priv->tokens_requests_id != 0)
+        g_source_remove (priv->tokens_requests_id);
+
+    while (priv->tokens_requests != NULL)
+    {
+        TokensRequest *request = priv->tokens_requests->data;
+        GError e = { TP_ERROR, TP_ERROR_DISCONNECTED,
+            "Connection closed before the avatar tokens were known" };
+
+        dbus_g_method_return_error (request->context, &e);
+        tokens_request_free (request);
+        priv->tokens_requests = g_slist_delete_link (priv->tokens_requests,
+            priv->tokens_requests);
+    }
+
+    g_queue_clear (&priv->retrieve_queue);
+    g_hash_table_unref (priv->retrieve_queued);
+    g_hash_table_unref (priv->retrieve_waiting);
+
+    /* Hash jobs hold a ref, so none can be outstanding by now. */
+    g_hash_table_unref (priv->pending);
+    g_hash_table_unref (priv->superseded);
+    g_hash_table_unref (priv->tokens);
+    g_slice_free (HazeConnectionAvatarsPrivate, priv);
+    conn->avatars_priv = NULL;
+}
@@ -28,8 +28,11 @@
 #include <libpurple/purple.h>
 
 void haze_connection_avatars_iface_init (gpointer g_iface, gpointer iface_data);
+void haze_connection_avatar_files_iface_init (gpointer g_iface,
+    gpointer iface_data);
 void haze_connection_avatars_class_init (GObjectClass *object_class);
 void haze_connection_avatars_init (GObject *object);
+void haze_connection_avatars_finalize (GObject *object);
 
 extern TpDBusPropertiesMixinPropImpl *haze_connection_avatars_properties;
 void haze_connection_avatars_properties_getter (GObject *object,
@@ -0,0 +1,354 @@
+/*
+ * connection-bulk.c - Haze.BulkMessages interface implementation of
+ *                     HazeConnection
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <config.h>
+#include "connection-bulk.h"
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "debug.h"
+#include "im-channel-factory.h"
+#include "markup.h"
+
+#include "extensions/extensions.h"
+
+/* Bots and gateways talk to far too many contacts to want a channel, a
+ * PurpleConversation and a D-Bus object for each of them.  Messages sent
+ * with this interface go straight to serv_send_im() through the connection's
+ * send scheduler.  Received ones can't avoid a PurpleConversation, since
+ * libpurple makes one before telling us about the message, but that is
+ * thrown away again once the message has been signalled, so nothing is kept
+ * per contact in between.
+ */
+
+struct _HazeConnectionBulkPrivate {
+    /* unique name of the client which enabled receiving without channels,
+     * which we watch so as to stop when it leaves the bus; NULL if disabled */
+    gchar *receiver;
+
+    /* GValueArrays (Bulk_Received_Message) waiting for flush_id */
+    GPtrArray *received;
+    /* set of TpHandle whose conversations libpurple made for messages
+     * which went into received */
+    GHashTable *senders;
+    guint flush_id;
+};
+
+static TpHandleRepoIface *
+get_contact_repo (HazeConnection *conn)
+{
+    return tp_base_connection_get_handles (TP_BASE_CONNECTION (conn),
+        TP_HANDLE_TYPE_CONTACT);
+}
+
+static void
+send_piece (GObject *obj,
+            const gchar *recipient,
+            const gchar *text,
+            PurpleMessageFlags flags)
+{
+    HazeConnection *conn = HAZE_CONNECTION (obj);
+    PurpleConnection *gc = purple_account_get_connection (conn->account);
+
+    if (gc == NULL || serv_send_im (gc, recipient, text, flags) < 0)
+        DEBUG ("couldn't send a message to %s", recipient);
+}
+
+static void
+queue_message (HazeConnection *conn,
+               TpHandle contact,
+               const gchar *text)
+{
+    haze_send_scheduler_push (conn->send_scheduler, (GObject *) conn,
+        tp_handle_inspect (get_contact_repo (conn), contact), NULL, NULL,
+        text, 0, send_piece);
+}
+
+static void
+haze_connection_bulk_send_messages (
+    HazeSvcConnectionInterfaceHazeBulkMessages *iface,
+    GHashTable *messages,
+    DBusGMethodInvocation *context)
+{
+    HazeConnection *conn = HAZE_CONNECTION (iface);
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    GHashTableIter iter;
+    gpointer key, value;
+    GError *error = NULL;
+
+    TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
+
+    g_hash_table_iter_init (&iter, messages);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+        if (!tp_handle_is_valid (get_contact_repo (conn),
+                GPOINTER_TO_UINT (key), &error))
+        {
+            dbus_g_method_return_error (context, error);
+            g_error_free (error);
+            return;
+        }
+    }
+
+    DEBUG ("queueing %u messages", g_hash_table_size (messages));
+
+    g_hash_table_iter_init (&iter, messages);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        queue_message (conn, GPOINTER_TO_UINT (key), value);
+
+    haze_svc_connection_interface_haze_bulk_messages_return_from_send_messages (
+        context);
+}
+
+static void
+haze_connection_bulk_broadcast (
+    HazeSvcConnectionInterfaceHazeBulkMessages *iface,
+    const GArray *contacts,
+    const gchar *text,
+    DBusGMethodInvocation *context)
+{
+    HazeConnection *conn = HAZE_CONNECTION (iface);
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    GError *error = NULL;
+    guint i;
+
+    TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
+
+    if (!tp_handles_are_valid (get_contact_repo (conn), contacts, FALSE,
+            &error))
+    {
+        dbus_g_method_return_error (context, error);
+        g_error_free (error);
+        return;
+    }
+
+    DEBUG ("broadcasting to %u contacts", contacts->len);
+
+    for (i = 0; i < contacts->len; i++)
+        queue_message (conn, g_array_index (contacts, TpHandle, i), text);
+
+    haze_svc_connection_interface_haze_bulk_messages_return_from_broadcast (
+        context);
+}
+
+static void receiver_owner_changed_cb (TpDBusDaemon *bus_daemon,
+    const gchar *name, const gchar *new_owner, gpointer user_data);
+
+static void
+set_receiver (HazeConnection *conn,
+              gchar *receiver)
+{
+    HazeConnectionBulkPrivate *priv = conn->bulk_priv;
+    TpDBusDaemon *bus_daemon = tp_base_connection_get_dbus_daemon (
+        TP_BASE_CONNECTION (conn));
+
+    if (priv->receiver != NULL)
+    {
+        tp_dbus_daemon_cancel_name_owner_watch (bus_daemon, priv->receiver,
+            receiver_owner_changed_cb, conn);
+        g_free (priv->receiver);
+    }
+
+    priv->receiver = receiver;
+
+    if (receiver != NULL)
+        tp_dbus_daemon_watch_name_owner (bus_daemon, receiver,
+            receiver_owner_changed_cb, conn, NULL);
+}
+
+static void
+receiver_owner_changed_cb (TpDBusDaemon *bus_daemon,
+                           const gchar *name,
+                           const gchar *new_owner,
+                           gpointer user_data)
+{
+    HazeConnection *conn = HAZE_CONNECTION (user_data);
+
+    /* Nobody else would know to listen for MessagesReceived, so go back to
+     * making channels rather than losing messages. */
+    if (tp_str_empty (new_owner))
+    {
+        DEBUG ("%s has gone; disabled", name);
+        set_receiver (conn, NULL);
+    }
+}
+
+static void
+haze_connection_bulk_set_receiving_without_channels (
+    HazeSvcConnectionInterfaceHazeBulkMessages *iface,
+    gboolean enabled,
+    DBusGMethodInvocation *context)
+{
+    HazeConnection *conn = HAZE_CONNECTION (iface);
+
+    if (enabled)
+    {
+        gchar *sender = dbus_g_method_get_sender (context);
+
+        DEBUG ("enabled by %s", sender);
+        set_receiver (conn, sender);
+    }
+    else
+    {
+        DEBUG ("disabled");
+        set_receiver (conn, NULL);
+    }
+
+    haze_svc_connection_interface_haze_bulk_messages_return_from_set_receiving_without_channels (
+        context);
+}
+
+void
+haze_connection_bulk_iface_init (gpointer g_iface,
+                                 gpointer iface_data)
+{
+    HazeSvcConnectionInterfaceHazeBulkMessagesClass *klass =
+        (HazeSvcConnectionInterfaceHazeBulkMessagesClass *) g_iface;
+
+#define IMPLEMENT(x) \
+    haze_svc_connection_interface_haze_bulk_messages_implement_##x (\
+        klass, haze_connection_bulk_##x)
+    IMPLEMENT(send_messages);
+    IMPLEMENT(broadcast);
+    IMPLEMENT(set_receiving_without_channels);
+#undef IMPLEMENT
+}
+
+static gboolean
+flush_received_cb (gpointer user_data)
+{
+    HazeConnection *conn = HAZE_CONNECTION (user_data);
+    HazeConnectionBulkPrivate *priv = conn->bulk_priv;
+    GHashTableIter iter;
+    gpointer key;
+
+    priv->flush_id = 0;
+
+    if (priv->received->len > 0)
+    {
+        haze_svc_connection_interface_haze_bulk_messages_emit_messages_received (
+            conn, priv->received);
+        g_ptr_array_set_size (priv->received, 0);
+    }
+
+    /* A channel may have been requested for the sender in the meantime, in
+     * which case it has taken over the conversation. */
+    g_hash_table_iter_init (&iter, priv->senders);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+        TpHandle sender = GPOINTER_TO_UINT (key);
+        PurpleConversation *conv;
+
+        if (haze_im_channel_factory_has_channel (conn->im_factory, sender))
+            continue;
+
+        conv = purple_find_conversation_with_account (PURPLE_CONV_TYPE_IM,
+            tp_handle_inspect (get_contact_repo (conn), sender),
+            conn->account);
+
+        if (conv != NULL)
+            purple_conversation_destroy (conv);
+    }
+
+    g_hash_table_remove_all (priv->senders);
+    return FALSE;
+}
+
+/*
+ * haze_connection_bulk_receive:
+ * @sender: a contact with no IM channel
+ *
+ * Returns: %TRUE if a client has asked for messages from contacts without
+ *          channels to be signalled on the connection, in which case this
+ *          message will be; %FALSE if it should go to a new channel.
+ */
+gboolean
+haze_connection_bulk_receive (HazeConnection *conn,
+                              TpHandle sender,
+                              const gchar *xhtml_message,
+                              PurpleMessageFlags flags,
+                              time_t mtime)
+{
+    HazeConnectionBulkPrivate *priv = conn->bulk_priv;
+
+    if (priv->receiver == NULL)
+        return FALSE;
+
+    if (flags & PURPLE_MESSAGE_RECV)
+    {
+        GString *text = g_string_new (NULL);
+
+        haze_markup_strip (xhtml_message, text);
+        g_ptr_array_add (priv->received, tp_value_array_build (3,
+            G_TYPE_UINT, sender,
+            G_TYPE_INT64, (gint64) mtime,
+            G_TYPE_STRING, text->str,
+            G_TYPE_INVALID));
+        g_string_free (text, TRUE);
+    }
+    else
+    {
+        DEBUG ("ignoring message from %u with flags %u", sender, flags);
+    }
+
+    g_hash_table_add (priv->senders, GUINT_TO_POINTER (sender));
+
+    if (priv->flush_id == 0)
+        priv->flush_id = g_idle_add (flush_received_cb, conn);
+
+    return TRUE;
+}
+
+void
+haze_connection_bulk_init (GObject *object)
+{
+    HazeConnection *conn = HAZE_CONNECTION (object);
+
+    conn->bulk_priv = g_slice_new0 (HazeConnectionBulkPrivate);
+    conn->bulk_priv->received = g_ptr_array_new_with_free_func (
+        (GDestroyNotify) tp_value_array_free);
+    conn->bulk_priv->senders = g_hash_table_new (NULL, NULL);
+}
+
+void
+haze_connection_bulk_dispose (GObject *object)
+{
+    /* The name watch needs the connection's TpDBusDaemon, which is gone by
+     * the time we are finalized. */
+    set_receiver (HAZE_CONNECTION (object), NULL);
+}
+
+void
+haze_connection_bulk_finalize (GObject *object)
+{
+    HazeConnection *conn = HAZE_CONNECTION (object);
+    HazeConnectionBulkPrivate *priv = conn->bulk_priv;
+
+    haze_send_scheduler_cancel (conn->send_scheduler, object);
+
+    if (priv->flush_id != 0)
+        g_source_remove (priv->flush_id);
+
+    g_ptr_array_unref (priv->received);
+    g_hash_table_unref (priv->senders);
+    g_slice_free (HazeConnectionBulkPrivate, priv);
+    conn->bulk_priv = NULL;
+}
@@ -49,25 +49,15 @@ haze_connection_update_capabilities (TpSvcConnectionInterfaceContactCapabilities
       context);
 }
 
-static GPtrArray *
-haze_connection_get_handle_contact_capabilities (HazeConnection *self,
-                                                 TpHandle handle)
+static void
+add_contact_channel_class (GPtrArray *arr,
+                           const gchar *channel_type,
+                           const gchar * const *allowed_properties)
 {
-  GPtrArray *arr = g_ptr_array_new ();
   GValue monster = {0, };
   GHashTable *fixed_properties;
   GValue *channel_type_value;
   GValue *target_handle_type_value;
-  const gchar * const text_allowed_properties[] = {
-    TP_PROP_CHANNEL_TARGET_HANDLE, NULL };
-
-  if (0 == handle)
-    {
-      /* obsolete request for the connection's capabilities, do nothing */
-      return arr;
-    }
-
-  /* TODO: Check for presence */
 
   g_value_init (&monster, TP_STRUCT_TYPE_REQUESTABLE_CHANNEL_CLASS);
   g_value_take_boxed (&monster,
@@ -78,7 +68,7 @@ haze_connection_get_handle_contact_capabilities (HazeConnection *self,
       (GDestroyNotify) tp_g_value_slice_free);
 
   channel_type_value = tp_g_value_slice_new (G_TYPE_STRING);
-  g_value_set_static_string (channel_type_value, TP_IFACE_CHANNEL_TYPE_TEXT);
+  g_value_set_static_string (channel_type_value, channel_type);
   g_hash_table_insert (fixed_properties, TP_IFACE_CHANNEL ".ChannelType",
       channel_type_value);
 
@@ -89,12 +79,64 @@ haze_connection_get_handle_contact_capabilities (HazeConnection *self,
 
   dbus_g_type_struct_set (&monster,
       0, fixed_properties,
-      1, text_allowed_properties,
+      1, allowed_properties,
       G_MAXUINT);
 
   g_hash_table_unref (fixed_properties);
 
   g_ptr_array_add (arr, g_value_get_boxed (&monster));
+}
+
+static gboolean
+can_send_file (HazeConnection *self,
+               TpHandle handle)
+{
+  PurpleConnection *gc = self->account->gc;
+  PurplePluginProtocolInfo *prpl_info;
+
+  if (gc == NULL)
+    return FALSE;
+
+  prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO (gc->prpl);
+
+  if (!PURPLE_PROTOCOL_PLUGIN_HAS_FUNC (prpl_info, new_xfer))
+    return FALSE;
+
+  return (prpl_info->can_receive_file == NULL ||
+      prpl_info->can_receive_file (gc, haze_connection_handle_inspect (self,
+          TP_HANDLE_TYPE_CONTACT, handle)));
+}
+
+static GPtrArray *
+haze_connection_get_handle_contact_capabilities (HazeConnection *self,
+                                                 TpHandle handle)
+{
+  GPtrArray *arr = g_ptr_array_new ();
+  const gchar * const text_allowed_properties[] = {
+    TP_PROP_CHANNEL_TARGET_HANDLE, NULL };
+  const gchar * const ft_allowed_properties[] = {
+    TP_PROP_CHANNEL_TARGET_HANDLE,
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_CONTENT_TYPE,
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_FILENAME,
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_SIZE,
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_DESCRIPTION,
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_DATE,
+    NULL };
+
+  if (0 == handle)
+    {
+      /* obsolete request for the connection's capabilities, do nothing */
+      return arr;
+    }
+
+  /* TODO: Check for presence */
+
+  add_contact_channel_class (arr, TP_IFACE_CHANNEL_TYPE_TEXT,
+      text_allowed_properties);
+
+  if (can_send_file (self, handle))
+    add_contact_channel_class (arr, TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER,
+        ft_allowed_properties);
 
   return arr;
 }
@@ -0,0 +1,747 @@
+/*
+ * connection-contact-info.c - ContactInfo interface implementation of
+ *                             HazeConnection
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* libpurple fetches a contact's profile with serv_get_info(), and hands it
+ * back some time later through purple_notify_userinfo() as a list of HTML
+ * label/value pairs; there is no way to tell it failed, and no way to tell
+ * which call a reply is for.  So at most one request per contact is ever
+ * outstanding: RequestContactInfo calls made while one is in flight just
+ * wait for its answer.  Answers are cached for CACHE_SECONDS_DEFAULT seconds,
+ * stripped of their markup and packed into a single string, and only turned
+ * into a Contact_Info_Field_List when someone asks for them.
+ */
+
+#include <config.h>
+#include "connection-contact-info.h"
+
+#include <string.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+#include <telepathy-glib/telepathy-glib-dbus.h>
+
+#include "connection.h"
+#include "debug.h"
+#include "markup.h"
+#include "util.h"
+
+/* How long a contact's info is served from the cache before we ask the
+ * server again.
+ */
+#define CACHE_SECONDS_DEFAULT 300
+/* libpurple never tells us that it has given up on a request; prpls that
+ * time requests out themselves (like XMPP, after 30 seconds) report whatever
+ * they have by then, so this is only a backstop for those that don't.
+ */
+#define REQUEST_TIMEOUT_SECONDS 60
+
+struct _HazeConnectionContactInfoPrivate {
+    /* TpHandle => owned CachedInfo */
+    GHashTable *cache;
+    gint64 last_pruned;
+    /* TpHandle => owned PendingInfo, for contacts whose info we have asked
+     * libpurple for and not yet received */
+    GHashTable *pending;
+};
+
+/* The components of a vCard "n" field are family name, given names,
+ * additional names, honorific prefixes and honorific suffixes; libpurple only
+ * ever tells us the first two. */
+#define N_COMPONENTS 5
+
+typedef struct {
+    /* n_fields vCard fields one after the other, each being its
+     * NUL-terminated name, a byte holding how many values it has, and the
+     * NUL-terminated values: "fn\0\001Jane Doe\0email\0\001jane@example.com\0"
+     */
+    gchar *packed;
+    gsize len;
+    guint n_fields;
+    gint64 fetched;
+} CachedInfo;
+
+typedef struct {
+    HazeConnection *conn;
+    TpHandle handle;
+    /* DBusGMethodInvocation *s from RequestContactInfo, newest first */
+    GSList *contexts;
+    /* TRUE if RefreshContactInfo asked for this, in which case
+     * ContactInfoChanged is emitted even if nothing has changed */
+    gboolean refresh;
+    guint timeout_id;
+} PendingInfo;
+
+typedef enum {
+    DP_FLAGS,
+    DP_SUPPORTED_FIELDS
+} ContactInfoDBusProperty;
+
+static TpDBusPropertiesMixinPropImpl props[] = {
+      { "ContactInfoFlags", GINT_TO_POINTER (DP_FLAGS), NULL },
+      { "SupportedFields", GINT_TO_POINTER (DP_SUPPORTED_FIELDS), NULL },
+      { NULL }
+};
+TpDBusPropertiesMixinPropImpl *haze_connection_contact_info_properties =
+    props;
+
+void
+haze_connection_contact_info_properties_getter (GObject *object,
+                                                GQuark interface,
+                                                GQuark name,
+                                                GValue *value,
+                                                gpointer getter_data)
+{
+    ContactInfoDBusProperty which = GPOINTER_TO_INT (getter_data);
+
+    switch (which)
+    {
+        case DP_FLAGS:
+            /* libpurple can neither set our own info in a structured way
+             * nor push contacts' info to us unasked. */
+            g_value_set_uint (value, 0);
+            break;
+        case DP_SUPPORTED_FIELDS:
+            /* Only the fields we could set are listed, which is none. */
+            g_value_take_boxed (value, g_ptr_array_new ());
+            break;
+        default:
+            g_assert_not_reached ();
+    }
+}
+
+static gint64
+get_cache_usec (void)
+{
+    static guint cache_seconds = G_MAXUINT;
+
+    if (cache_seconds == G_MAXUINT)
+        cache_seconds = haze_get_tunable ("HAZE_CONTACT_INFO_CACHE_SECONDS",
+            CACHE_SECONDS_DEFAULT);
+
+    return (gint64) cache_seconds * G_USEC_PER_SEC;
+}
+
+static void
+pack_field (GString *packed,
+            const gchar *name,
+            const gchar * const *values,
+            guint n_values)
+{
+    guint i;
+
+    g_string_append_len (packed, name, strlen (name) + 1);
+    g_string_append_c (packed, (gchar) n_values);
+
+    for (i = 0; i < n_values; i++)
+        g_string_append_len (packed, values[i], strlen (values[i]) + 1);
+}
+
+static CachedInfo *
+cached_info_new (PurpleNotifyUserInfo *user_info)
+{
+    CachedInfo *info = g_slice_new0 (CachedInfo);
+    GString *packed = g_string_new (NULL);
+    GString *scratch = g_string_new (NULL);
+    /* the components of the "n" field, which libpurple gives us separately */
+    gchar *n[N_COMPONENTS] = { NULL };
+    gboolean have_n = FALSE;
+    GList *l;
+
+    for (l = purple_notify_user_info_get_entries (user_info);
+         l != NULL;
+         l = l->next)
+    {
+        PurpleNotifyUserInfoEntry *entry = l->data;
+        const gchar *label = purple_notify_user_info_entry_get_label (entry);
+        const gchar *html = purple_notify_user_info_entry_get_value (entry);
+        gchar *name, *text;
+        guint component;
+
+        /* Section headers and breaks are just layout. */
+        if (purple_notify_user_info_entry_get_type (entry) !=
+                PURPLE_NOTIFY_USER_INFO_ENTRY_PAIR ||
+            tp_str_empty (label) || tp_str_empty (html))
+            continue;
+
+        haze_markup_strip (html, scratch);
+        text = g_strstrip (g_strdup (scratch->str));
+
+        /* Such as a photo, which is nothing but an <img>. */
+        if (*text == '\0')
+        {
+            g_free (text);
+            continue;
+        }
+
+        name = haze_vcard_field_name (label);
+
+        /* These are ContactSearch's names for the parts of "n", which is the
+         * vCard field for ContactInfo. */
+        if (!tp_strdiff (name, "x-n-family"))
+            component = 0;
+        else if (!tp_strdiff (name, "x-n-given"))
+            component = 1;
+        else
+            component = N_COMPONENTS;
+
+        if (component < N_COMPONENTS)
+        {
+            if (n[component] == NULL)
+            {
+                n[component] = text;
+                text = NULL;
+                have_n = TRUE;
+            }
+        }
+        else
+        {
+            pack_field (packed, name, (const gchar * const *) &text, 1);
+            info->n_fields++;
+        }
+
+        g_free (name);
+        g_free (text);
+    }
+
+    if (have_n)
+    {
+        for (component = 0; component < N_COMPONENTS; component++)
+        {
+            if (n[component] == NULL)
+                n[component] = g_strdup ("");
+        }
+
+        pack_field (packed, "n", (const gchar * const *) n, N_COMPONENTS);
+        info->n_fields++;
+
+        for (component = 0; component < N_COMPONENTS; component++)
+            g_free (n[component]);
+    }
+
+    g_string_free (scratch, TRUE);
+
+    /* Copy rather than keep the GString, which may have over-allocated. */
+    info->len = packed->len;
+    info->packed = g_malloc (info->len);
+    memcpy (info->packed, packed->str, info->len);
+    g_string_free (packed, TRUE);
+
+    info->fetched = g_get_monotonic_time ();
+    return info;
+}
+
+static void
+cached_info_free (gpointer data)
+{
+    CachedInfo *info = data;
+
+    g_free (info->packed);
+    g_slice_free (CachedInfo, info);
+}
+
+static gboolean
+cached_info_equal (const CachedInfo *a,
+                   const CachedInfo *b)
+{
+    return (a->len == b->len && memcmp (a->packed, b->packed, a->len) == 0);
+}
+
+/* Returns a new Contact_Info_Field_List of the fields in @info. */
+static GPtrArray *
+cached_info_dup_fields (const CachedInfo *info)
+{
+    static const gchar *no_parameters[] = { NULL };
+    GPtrArray *fields = g_ptr_array_new_full (info->n_fields,
+        (GDestroyNotify) tp_value_array_free);
+    const gchar *p = info->packed;
+    const gchar *end = info->packed + info->len;
+
+    while (p < end)
+    {
+        const gchar *name = p;
+        const gchar *values[N_COMPONENTS + 1] = { NULL };
+        guint n_values, i;
+
+        p = name + strlen (name) + 1;
+        n_values = (guchar) *p++;
+        g_assert (n_values <= N_COMPONENTS);
+
+        for (i = 0; i < n_values; i++)
+        {
+            values[i] = p;
+            p += strlen (p) + 1;
+        }
+
+        g_ptr_array_add (fields, tp_value_array_build (3,
+            G_TYPE_STRING, name,
+            G_TYPE_STRV, no_parameters,
+            G_TYPE_STRV, values,
+            G_TYPE_INVALID));
+    }
+
+    return fields;
+}
+
+/* Returns @handle's cached info if it is recent enough to use. */
+static const CachedInfo *
+lookup_fresh (HazeConnection *conn,
+              TpHandle handle)
+{
+    CachedInfo *info = g_hash_table_lookup (conn->contact_info_priv->cache,
+        GUINT_TO_POINTER (handle));
+
+    if (info == NULL ||
+        g_get_monotonic_time () - info->fetched >= get_cache_usec ())
+        return NULL;
+
+    return info;
+}
+
+static gboolean
+remove_if_stale (gpointer key,
+                 gpointer value,
+                 gpointer user_data)
+{
+    const CachedInfo *info = value;
+    const gint64 *oldest = user_data;
+
+    return (info->fetched < *oldest);
+}
+
+static void
+store_info (HazeConnection *conn,
+            TpHandle handle,
+            CachedInfo *info)
+{
+    HazeConnectionContactInfoPrivate *priv = conn->contact_info_priv;
+    gint64 ttl = get_cache_usec ();
+
+    /* Stale entries are only replaced when the same contact is looked up
+     * again; sweep out the rest every so often so that looking at lots of
+     * contacts once doesn't keep their info around for ever. */
+    if (info->fetched - priv->last_pruned >= ttl)
+    {
+        gint64 oldest = info->fetched - ttl;
+
+        g_hash_table_foreach_remove (priv->cache, remove_if_stale, &oldest);
+        priv->last_pruned = info->fetched;
+    }
+
+    g_hash_table_insert (priv->cache, GUINT_TO_POINTER (handle), info);
+}
+
+static void
+pending_info_free (gpointer data)
+{
+    PendingInfo *pending = data;
+
+    g_assert (pending->contexts == NULL);
+
+    if (pending->timeout_id != 0)
+        g_source_remove (pending->timeout_id);
+
+    g_slice_free (PendingInfo, pending);
+}
+
+/* Answers everyone waiting on @pending with either @fields or @error. */
+static void
+pending_info_finish (PendingInfo *pending,
+                     const GPtrArray *fields,
+                     const GError *error)
+{
+    GSList *l;
+
+    pending->contexts = g_slist_reverse (pending->contexts);
+
+    for (l = pending->contexts; l != NULL; l = l->next)
+    {
+        if (fields != NULL)
+            tp_svc_connection_interface_contact_info_return_from_request_contact_info (
+                l->data, fields);
+        else
+            dbus_g_method_return_error (l->data, error);
+    }
+
+    g_slist_free (pending->contexts);
+    pending->contexts = NULL;
+}
+
+static gboolean
+request_timeout_cb (gpointer data)
+{
+    PendingInfo *pending = data;
+    HazeConnection *conn = pending->conn;
+    GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+        "The server did not send the contact's information" };
+
+    DEBUG ("gave up waiting for handle %u's info", pending->handle);
+
+    pending->timeout_id = 0;
+    pending_info_finish (pending, NULL, &e);
+    g_hash_table_remove (conn->contact_info_priv->pending,
+        GUINT_TO_POINTER (pending->handle));
+
+    return FALSE;
+}
+
+/* Asks libpurple for @handle's info, unless it has already been asked, and
+ * if @context is not NULL arranges for it to be answered with the result. */
+static void
+request_info (HazeConnection *conn,
+              TpHandle handle,
+              DBusGMethodInvocation *context,
+              gboolean refresh)
+{
+    HazeConnectionContactInfoPrivate *priv = conn->contact_info_priv;
+    TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+        TP_BASE_CONNECTION (conn), TP_HANDLE_TYPE_CONTACT);
+    PendingInfo *pending = g_hash_table_lookup (priv->pending,
+        GUINT_TO_POINTER (handle));
+    gboolean in_flight = (pending != NULL);
+
+    if (!in_flight)
+    {
+        pending = g_slice_new0 (PendingInfo);
+        pending->conn = conn;
+        pending->handle = handle;
+        pending->timeout_id = g_timeout_add_seconds (REQUEST_TIMEOUT_SECONDS,
+            request_timeout_cb, pending);
+        g_hash_table_insert (priv->pending, GUINT_TO_POINTER (handle),
+            pending);
+    }
+
+    pending->refresh |= refresh;
+
+    if (context != NULL)
+        pending->contexts = g_slist_prepend (pending->contexts, context);
+
+    if (in_flight)
+    {
+        DEBUG ("already waiting for handle %u's info", handle);
+        return;
+    }
+
+    /* Last, since some prpls answer straight away. */
+    DEBUG ("asking for handle %u's info", handle);
+    serv_get_info (purple_account_get_connection (conn->account),
+        tp_handle_inspect (contact_repo, handle));
+}
+
+static gboolean
+check_supported (HazeConnection *conn,
+                 DBusGMethodInvocation *context)
+{
+    if (HAZE_CONNECTION_GET_PRPL_INFO (conn)->get_info == NULL)
+    {
+        GError e = { TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+            "This protocol does not support contact info" };
+
+        dbus_g_method_return_error (context, &e);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+haze_connection_get_contact_info (TpSvcConnectionInterfaceContactInfo *iface,
+                                  const GArray *contacts,
+                                  DBusGMethodInvocation *context)
+{
+    HazeConnection *conn = HAZE_CONNECTION (iface);
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    TpHandleRepoIface *contact_repo =
+        tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
+    GHashTable *ret;
+    GError *error = NULL;
+    guint i;
+
+    TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
+
+    if (!tp_handles_are_valid (contact_repo, contacts, FALSE, &error))
+    {
+        dbus_g_method_return_error (context, error);
+        g_error_free (error);
+        return;
+    }
+
+    ret = g_hash_table_new_full (NULL, NULL, NULL,
+        (GDestroyNotify) g_ptr_array_unref);
+
+    /* Only what we already know; RequestContactInfo goes to the server. */
+    for (i = 0; i < contacts->len; i++)
+    {
+        TpHandle handle = g_array_index (contacts, TpHandle, i);
+        const CachedInfo *info = lookup_fresh (conn, handle);
+
+        if (info != NULL)
+            g_hash_table_insert (ret, GUINT_TO_POINTER (handle),
+                cached_info_dup_fields (info));
+    }
+
+    tp_svc_connection_interface_contact_info_return_from_get_contact_info (
+        context, ret);
+    g_hash_table_unref (ret);
+}
+
+static void
+haze_connection_refresh_contact_info (
+        TpSvcConnectionInterfaceContactInfo *iface,
+        const GArray *contacts,
+        DBusGMethodInvocation *context)
+{
+    HazeConnection *conn = HAZE_CONNECTION (iface);
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    TpHandleRepoIface *contact_repo =
+        tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
+    GError *error = NULL;
+    guint i;
+
+    TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
+
+    if (!check_supported (conn, context))
+        return;
+
+    if (!tp_handles_are_valid (contact_repo, contacts, FALSE, &error))
+    {
+        dbus_g_method_return_error (context, error);
+        g_error_free (error);
+        return;
+    }
+
+    for (i = 0; i < contacts->len; i++)
+        request_info (conn, g_array_index (contacts, TpHandle, i), NULL,
+            TRUE);
+
+    tp_svc_connection_interface_contact_info_return_from_refresh_contact_info (
+        context);
+}
+
+static void
+haze_connection_request_contact_info (
+        TpSvcConnectionInterfaceContactInfo *iface,
+        guint contact,
+        DBusGMethodInvocation *context)
+{
+    HazeConnection *conn = HAZE_CONNECTION (iface);
+    TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+    TpHandleRepoIface *contact_repo =
+        tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
+    const CachedInfo *info;
+    GError *error = NULL;
+
+    TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
+
+    if (!check_supported (conn, context))
+        return;
+
+    if (!tp_handle_is_valid (contact_repo, contact, &error))
+    {
+        dbus_g_method_return_error (context, error);
+        g_error_free (error);
+        return;
+    }
+
+    info = lookup_fresh (conn, contact);
+
+    if (info != NULL)
+    {
+        GPtrArray *fields = cached_info_dup_fields (info);
+
+        tp_svc_connection_interface_contact_info_return_from_request_contact_info (
+            context, fields);
+        g_ptr_array_unref (fields);
+        return;
+    }
+
+    request_info (conn, contact, context, FALSE);
+}
+
+static void
+haze_connection_set_contact_info (TpSvcConnectionInterfaceContactInfo *iface,
+                                  const GPtrArray *contact_info,
+                                  DBusGMethodInvocation *context)
+{
+    GError e = { TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+        "LibPurple does not provide a way to set structured contact info" };
+
+    dbus_g_method_return_error (context, &e);
+}
+
+void
+haze_connection_contact_info_iface_init (gpointer g_iface,
+                                         gpointer iface_data)
+{
+    TpSvcConnectionInterfaceContactInfoClass *klass = g_iface;
+
+#define IMPLEMENT(x) tp_svc_connection_interface_contact_info_implement_##x (\
+    klass, haze_connection_##x)
+    IMPLEMENT(get_contact_info);
+    IMPLEMENT(refresh_contact_info);
+    IMPLEMENT(request_contact_info);
+    IMPLEMENT(set_contact_info);
+#undef IMPLEMENT
+}
+
+gpointer
+haze_connection_contact_info_notify_userinfo (PurpleConnection *gc,
+                                              const char *who,
+                                              PurpleNotifyUserInfo *user_info)
+{
+    PurpleAccount *account = purple_connection_get_account (gc);
+    HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (account);
+    TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+        TP_BASE_CONNECTION (conn), TP_HANDLE_TYPE_CONTACT);
+    HazeConnectionContactInfoPrivate *priv = conn->contact_info_priv;
+    CachedInfo *info, *old;
+    PendingInfo *pending;
+    GPtrArray *fields = NULL;
+    gboolean changed;
+    GError *error = NULL;
+    TpHandle handle;
+
+    handle = tp_handle_ensure (contact_repo, who, NULL, &error);
+
+    if (handle == 0)
+    {
+        DEBUG ("ignoring info for '%s': %s", who, error->message);
+        g_error_free (error);
+        return NULL;
+    }
+
+    info = cached_info_new (user_info);
+    DEBUG ("got %u fields for %s (handle %u)", info->n_fields, who, handle);
+
+    old = g_hash_table_lookup (priv->cache, GUINT_TO_POINTER (handle));
+    changed = (old == NULL || !cached_info_equal (old, info));
+    pending = g_hash_table_lookup (priv->pending, GUINT_TO_POINTER (handle));
+
+    if (changed || pending != NULL)
+        fields = cached_info_dup_fields (info);
+
+    /* This frees old, if any. */
+    store_info (conn, handle, info);
+
+    if (changed || (pending != NULL && pending->refresh))
+        tp_svc_connection_interface_contact_info_emit_contact_info_changed (
+            conn, handle, fields);
+
+    if (pending != NULL)
+    {
+        pending_info_finish (pending, fields, NULL);
+        g_hash_table_remove (priv->pending, GUINT_TO_POINTER (handle));
+    }
+
+    if (fields != NULL)
+        g_ptr_array_unref (fields);
+
+    /* Nothing for libpurple to close later. */
+    return NULL;
+}
+
+static void
+fill_contact_attributes (GObject *object,
+                         const GArray *contacts,
+                         GHashTable *attributes_hash)
+{
+    HazeConnection *self = HAZE_CONNECTION (object);
+    guint i;
+
+    for (i = 0; i < contacts->len; i++)
+    {
+        TpHandle handle = g_array_index (contacts, TpHandle, i);
+        const CachedInfo *info = lookup_fresh (self, handle);
+        GValue *value;
+
+        /* Leaving the attribute out means "not known yet" */
+        if (info == NULL)
+            continue;
+
+        value = tp_g_value_slice_new_take_boxed (
+            TP_ARRAY_TYPE_CONTACT_INFO_FIELD_LIST,
+            cached_info_dup_fields (info));
+
+        /* this steals the GValue */
+        tp_contacts_mixin_set_contact_attribute (attributes_hash, handle,
+            TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO "/info", value);
+    }
+}
+
+/* Answers everyone still waiting with an error, and stops the timeouts. */
+static void
+fail_pending_requests (HazeConnection *conn)
+{
+    HazeConnectionContactInfoPrivate *priv = conn->contact_info_priv;
+    GError e = { TP_ERROR, TP_ERROR_DISCONNECTED,
+        "Connection closed before the contact's information arrived" };
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init (&iter, priv->pending);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        pending_info_finish (value, NULL, &e);
+
+    g_hash_table_remove_all (priv->pending);
+}
+
+static void
+status_changed_cb (HazeConnection *conn,
+                   guint status,
+                   guint reason,
+                   gpointer user_data)
+{
+    if (status == TP_CONNECTION_STATUS_DISCONNECTED)
+        fail_pending_requests (conn);
+}
+
+void
+haze_connection_contact_info_init (GObject *object)
+{
+    HazeConnection *conn = HAZE_CONNECTION (object);
+
+    conn->contact_info_priv = g_slice_new0 (HazeConnectionContactInfoPrivate);
+    conn->contact_info_priv->cache = g_hash_table_new_full (NULL, NULL, NULL,
+        cached_info_free);
+    conn->contact_info_priv->last_pruned = g_get_monotonic_time ();
+    conn->contact_info_priv->pending = g_hash_table_new_full (NULL, NULL,
+        NULL, pending_info_free);
+
+    g_signal_connect (object, "status-changed",
+        (GCallback) status_changed_cb, NULL);
+
+    tp_contacts_mixin_add_contact_attributes_iface (object,
+        TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO,
+        fill_contact_attributes);
+}
+
+void
+haze_connection_contact_info_finalize (GObject *object)
+{
+    HazeConnection *conn = HAZE_CONNECTION (object);
+    HazeConnectionContactInfoPrivate *priv = conn->contact_info_priv;
+
+    /* Everything pending was failed when the connection went away. */
+    g_assert (g_hash_table_size (priv->pending) == 0);
+
+    g_hash_table_unref (priv->pending);
+    g_hash_table_unref (priv->cache);
+    g_slice_free (HazeConnectionContactInfoPrivate, priv);
+    conn->contact_info_priv = NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef __HAZE_CONNECTION_CONTACT_INFO_H__
+#define __HAZE_CONNECTION_CONTACT_INFO_H__
+/*
+ * connection-contact-info.h - ContactInfo interface headers of HazeConnection
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib-object.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include <libpurple/purple.h>
+
+G_BEGIN_DECLS
+
+void haze_connection_contact_info_iface_init (gpointer g_iface,
+    gpointer iface_data);
+void haze_connection_contact_info_init (GObject *object);
+void haze_connection_contact_info_finalize (GObject *object);
+
+extern TpDBusPropertiesMixinPropImpl *haze_connection_contact_info_properties;
+void haze_connection_contact_info_properties_getter (GObject *object,
+    GQuark interface, GQuark name, GValue *value, gpointer getter_data);
+
+gpointer haze_connection_contact_info_notify_userinfo (PurpleConnection *gc,
+    const char *who, PurpleNotifyUserInfo *user_info);
+
+G_END_DECLS
+
+#endif
@@ -23,9 +23,58 @@
 #include "connection-presence.h"
 
 #include "debug.h"
+#include "util.h"
 
 #include <telepathy-glib/telepathy-glib.h>
 
+/* Contacts' presence changes are collected for at most this many
+ * milliseconds before being signalled together...
+ */
+#define PRESENCE_BATCH_MS_DEFAULT 100
+/* ... or until this many contacts have changed, whichever comes first. */
+#define PRESENCE_BATCH_SIZE_DEFAULT 1000
+
+/* If non-zero, contacts going offline are not signalled until they have
+ * stayed offline for this many milliseconds, so that contacts on flaky links
+ * who drop off and come straight back only cause one signal, not two.
+ */
+#define PRESENCE_DAMPING_MS_DEFAULT 0
+
+typedef struct {
+    HazeConnection *conn;
+    TpHandle handle;
+    /* The status the contact had before going offline, from _get_tp_status(),
+     * or NULL if we don't know it. */
+    TpPresenceStatus *last_online_status;
+    guint timeout_id;
+    /* How many offline updates we've held back */
+    guint n_updates;
+} HeldOffline;
+
+struct _HazeConnectionPresencePrivate {
+    /* TpHandle => TpPresenceStatus * from _get_tp_status(): the latest status
+     * of each contact whose presence has changed since we last emitted
+     * PresencesChanged.
+     */
+    GHashTable *pending_statuses;
+    guint flush_id;
+
+    /* TpHandle => owned HeldOffline *: contacts who have gone offline, but
+     * who we're pretending are still online in case they come straight back.
+     */
+    GHashTable *held_offline;
+
+    /* Statistics for tuning HAZE_PRESENCE_DAMPING_MS: how many contacts went
+     * offline, how many of those came back before we signalled it, and how
+     * many transitions we therefore didn't signal.  They're only reported
+     * with DEBUG(), which also reaches the Telepathy Debug interface, so
+     * they can be read from a running Haze without a D-Bus API of their own.
+     */
+    guint n_held;
+    guint n_flaps;
+    guint n_suppressed;
+};
+
 static const TpPresenceStatusOptionalArgumentSpec arg_specs[] = {
     { "message", "s" },
     { NULL, NULL }
@@ -80,17 +129,158 @@ static const HazeStatusIndex status_indices[] = {
     HAZE_STATUS_EXT_AWAY   /* PURPLE_STATUS_EXTENDED_AWAY */
 };
 
+/* Most contacts share a handful of (status, message) pairs, so rather than
+ * building a new TpPresenceStatus every time a presence is read or changed
+ * we intern them.  Each InternedStatus is shared between everyone who asks
+ * for that pair, and is immutable once created.  Those nobody currently
+ * holds a reference to are kept in unused_statuses, least recently used
+ * first, so that the next request for them is also free; only the oldest
+ * get thrown away.
+ */
+typedef struct {
+    /* Must be first, so that an InternedStatus * is a TpPresenceStatus * */
+    TpPresenceStatus status;
+
+    /* The key: status.index, and the raw xhtml message, or NULL */
+    gchar *xhtml_message;
+
+    guint refcount;
+    /* Our link in unused_statuses while refcount is 0, or NULL */
+    GList *unused_link;
+} InternedStatus;
+
+/* Maximum length of unused_statuses */
+#define PRESENCE_CACHE_SIZE_DEFAULT 256
+
+/* InternedStatus * => itself */
+static GHashTable *interned_statuses = NULL;
+/* InternedStatus * with refcount 0, most recently used last */
+static GQueue unused_statuses = G_QUEUE_INIT;
+
+static guint
+interned_status_hash (gconstpointer key)
+{
+    const InternedStatus *is = key;
+    guint hash = is->status.index;
+
+    if (is->xhtml_message != NULL)
+        hash ^= g_str_hash (is->xhtml_message);
+
+    return hash;
+}
+
+static gboolean
+interned_status_equal (gconstpointer a,
+                       gconstpointer b)
+{
+    const InternedStatus *is_a = a, *is_b = b;
+
+    return (is_a->status.index == is_b->status.index &&
+        !tp_strdiff (is_a->xhtml_message, is_b->xhtml_message));
+}
+
+static void
+interned_status_destroy (InternedStatus *is)
+{
+    g_assert (is->refcount == 0);
+    g_assert (is->unused_link == NULL);
+
+    g_hash_table_unref (is->status.optional_arguments);
+    g_free (is->xhtml_message);
+    g_slice_free (InternedStatus, is);
+}
+
+static TpPresenceStatus *
+interned_status_lookup (guint status_ix,
+                        const gchar *xhtml_message)
+{
+    InternedStatus key = { { status_ix, NULL }, (gchar *) xhtml_message };
+    InternedStatus *is;
+
+    if (G_UNLIKELY (interned_statuses == NULL))
+        interned_statuses = g_hash_table_new (interned_status_hash,
+            interned_status_equal);
+
+    is = g_hash_table_lookup (interned_statuses, &key);
+
+    if (is == NULL)
+    {
+        is = g_slice_new0 (InternedStatus);
+        is->status.index = status_ix;
+        is->status.optional_arguments = g_hash_table_new_full (g_str_hash,
+            g_str_equal, NULL, (GDestroyNotify) tp_g_value_slice_free);
+        is->xhtml_message = g_strdup (xhtml_message);
+
+        if (xhtml_message != NULL)
+        {
+            gchar *message = purple_markup_strip_html (xhtml_message);
+
+            g_hash_table_insert (is->status.optional_arguments, "message",
+                tp_g_value_slice_new_take_string (message));
+        }
+
+        g_hash_table_insert (interned_statuses, is, is);
+    }
+    else if (is->unused_link != NULL)
+    {
+        g_queue_delete_link (&unused_statuses, is->unused_link);
+        is->unused_link = NULL;
+    }
+
+    is->refcount++;
+    return &is->status;
+}
+
+static TpPresenceStatus *
+interned_status_ref (TpPresenceStatus *status)
+{
+    InternedStatus *is = (InternedStatus *) status;
+
+    g_return_val_if_fail (is->refcount > 0, status);
+
+    is->refcount++;
+    return status;
+}
+
+/* Drops a reference to a TpPresenceStatus returned by _get_tp_status(). */
+static void
+interned_status_unref (TpPresenceStatus *status)
+{
+    static guint cache_size = G_MAXUINT;
+    InternedStatus *is = (InternedStatus *) status;
+
+    g_return_if_fail (is->refcount > 0);
+
+    if (--is->refcount > 0)
+        return;
+
+    if (cache_size == G_MAXUINT)
+        cache_size = haze_get_tunable ("HAZE_PRESENCE_CACHE_SIZE",
+            PRESENCE_CACHE_SIZE_DEFAULT);
+
+    g_queue_push_tail (&unused_statuses, is);
+    is->unused_link = unused_statuses.tail;
+
+    while (unused_statuses.length > cache_size)
+    {
+        InternedStatus *victim = g_queue_pop_head (&unused_statuses);
+
+        victim->unused_link = NULL;
+        g_hash_table_remove (interned_statuses, victim);
+        interned_status_destroy (victim);
+    }
+}
+
+/* Returns a new reference to an immutable TpPresenceStatus, which must be
+ * released with interned_status_unref().
+ */
 static TpPresenceStatus *
 _get_tp_status (PurpleStatus *p_status)
 {
     PurpleStatusType *type;
     PurpleStatusPrimitive prim;
-    GHashTable *arguments = g_hash_table_new_full (g_str_hash, g_str_equal,
-        NULL, (GDestroyNotify) tp_g_value_slice_free);
     guint status_ix = -1;
-    const gchar *xhtml_message;
-    gchar *message;
-    TpPresenceStatus *tp_status;
+    const gchar *xhtml_message = NULL;
 
     if (p_status == NULL)
     {
@@ -112,21 +302,9 @@ _get_tp_status (PurpleStatus *p_status)
         }
 
         xhtml_message = purple_status_get_attr_string (p_status, "message");
-        if (xhtml_message)
-        {
-            GValue *message_v = g_slice_new0 (GValue);
-
-            message = purple_markup_strip_html (xhtml_message);
-            g_value_init (message_v, G_TYPE_STRING);
-            g_value_set_string (message_v, message);
-            g_hash_table_insert (arguments, "message", message_v);
-            g_free (message);
-        }
     }
 
-    tp_status = tp_presence_status_new (status_ix, arguments);
-    g_hash_table_destroy (arguments);
-    return tp_status;
+    return interned_status_lookup (status_ix, xhtml_message);
 }
 
 static const char *
@@ -168,7 +346,7 @@ _get_contact_statuses (GObject *obj,
                        GError **error)
 {
     GHashTable *status_table = g_hash_table_new_full (g_direct_hash,
-        g_direct_equal, NULL, NULL);
+        g_direct_equal, NULL, (GDestroyNotify) interned_status_unref);
     HazeConnection *conn = HAZE_CONNECTION (obj);
     TpBaseConnection *base_conn = TP_BASE_CONNECTION (obj);
     TpHandleRepoIface *handle_repo =
@@ -182,17 +360,28 @@ _get_contact_statuses (GObject *obj,
         TpPresenceStatus *tp_status;
         PurpleBuddy *buddy;
         PurpleStatus *p_status;
+        HeldOffline *held;
 
         g_assert (tp_handle_is_valid (handle_repo, handle, NULL));
 
+        held = g_hash_table_lookup (conn->presence_priv->held_offline,
+            GUINT_TO_POINTER (handle));
+
+        if (held != NULL && held->last_online_status != NULL)
+        {
+            /* Stay consistent with what we've signalled. */
+            g_hash_table_insert (status_table, GUINT_TO_POINTER (handle),
+                interned_status_ref (held->last_online_status));
+            continue;
+        }
+
         if (handle == tp_base_connection_get_self_handle (base_conn))
         {
             p_status = purple_account_get_active_status (conn->account);
         }
         else
         {
-            bname = tp_handle_inspect (handle_repo, handle);
-            buddy = purple_find_buddy (conn->account, bname);
+            buddy = haze_connection_get_buddy (conn, handle);
 
             if (buddy)
             {
@@ -202,6 +391,7 @@ _get_contact_statuses (GObject *obj,
             }
             else
             {
+                bname = tp_handle_inspect (handle_repo, handle);
                 DEBUG ("[%s] %s isn't on the blist, ergo no status!",
                          conn->account->username, bname);
                 p_status = NULL;
@@ -215,12 +405,85 @@ _get_contact_statuses (GObject *obj,
     return status_table;
 }
 
+static void
+flush_pending_statuses (HazeConnection *conn)
+{
+    HazeConnectionPresencePrivate *priv = conn->presence_priv;
+
+    if (priv->flush_id != 0)
+    {
+        g_source_remove (priv->flush_id);
+        priv->flush_id = 0;
+    }
+
+    if (g_hash_table_size (priv->pending_statuses) == 0)
+        return;
+
+    DEBUG ("signalling presence changes for %u contacts",
+        g_hash_table_size (priv->pending_statuses));
+
+    tp_presence_mixin_emit_presence_update (G_OBJECT (conn),
+        priv->pending_statuses);
+    g_hash_table_remove_all (priv->pending_statuses);
+}
+
+static gboolean
+flush_pending_statuses_cb (gpointer data)
+{
+    HazeConnection *conn = HAZE_CONNECTION (data);
+
+    conn->presence_priv->flush_id = 0;
+    flush_pending_statuses (conn);
+    return FALSE;
+}
+
+/* Takes ownership of @tp_status, which will be signalled as the presence of
+ * @handle as part of the next batch.  Our own presence is signalled at once
+ * (along with anything else that is pending), since the UI is probably
+ * waiting to hear about it.
+ */
+static void
+queue_presence_update (HazeConnection *conn,
+                       TpHandle handle,
+                       TpPresenceStatus *tp_status)
+{
+    static guint batch_ms = G_MAXUINT;
+    static guint batch_size = G_MAXUINT;
+    HazeConnectionPresencePrivate *priv = conn->presence_priv;
+    TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
+
+    if (batch_ms == G_MAXUINT)
+    {
+        batch_ms = haze_get_tunable ("HAZE_PRESENCE_BATCH_MS",
+            PRESENCE_BATCH_MS_DEFAULT);
+        batch_size = haze_get_tunable ("HAZE_PRESENCE_BATCH_SIZE",
+            PRESENCE_BATCH_SIZE_DEFAULT);
+    }
+
+    g_hash_table_insert (priv->pending_statuses, GUINT_TO_POINTER (handle),
+        tp_status);
+
+    if (handle == tp_base_connection_get_self_handle (base_conn) ||
+        batch_ms == 0 ||
+        g_hash_table_size (priv->pending_statuses) >= batch_size)
+    {
+        flush_pending_statuses (conn);
+    }
+    else if (priv->flush_id == 0)
+    {
+        /* Don't push the deadline back as more changes arrive, so no change
+         * is delayed by more than batch_ms. */
+        priv->flush_id = g_timeout_add (batch_ms, flush_pending_statuses_cb,
+            conn);
+    }
+}
+
 void
 haze_connection_presence_account_status_changed (PurpleAccount *account,
                                                  PurpleStatus *status)
 {
     TpBaseConnection *base_conn;
-    TpPresenceStatus *tp_status;
+    TpHandle self_handle;
 
     /* This gets called as soon as the account is created, before we get a
      * chance to set ui_data.  This is a "shame".  (You'd think that an account
@@ -229,34 +492,135 @@ haze_connection_presence_account_status_changed (PurpleAccount *account,
     if (account->ui_data)
     {
         base_conn = ACCOUNT_GET_TP_BASE_CONNECTION (account);
-        tp_status = _get_tp_status (status);
+        self_handle = tp_base_connection_get_self_handle (base_conn);
 
-        tp_presence_mixin_emit_one_presence_update (G_OBJECT (base_conn),
-            tp_base_connection_get_self_handle (base_conn), tp_status);
+        /* ... and before we know who we are, too. */
+        if (self_handle == 0)
+            return;
+
+        queue_presence_update (HAZE_CONNECTION (base_conn), self_handle,
+            _get_tp_status (status));
     }
 }
 
+static void
+held_offline_free (HeldOffline *held)
+{
+    if (held->timeout_id != 0)
+        g_source_remove (held->timeout_id);
+
+    if (held->last_online_status != NULL)
+        interned_status_unref (held->last_online_status);
+
+    g_slice_free (HeldOffline, held);
+}
+
+static gboolean
+held_offline_expired_cb (gpointer data)
+{
+    HeldOffline *held = data;
+    HazeConnection *conn = held->conn;
+    TpHandle handle = held->handle;
+    PurpleBuddy *buddy;
+    PurpleStatus *p_status = NULL;
+
+    /* They stayed away, so it's time to tell the truth. */
+    held->timeout_id = 0;
+    g_hash_table_remove (conn->presence_priv->held_offline,
+        GUINT_TO_POINTER (handle));
+
+    buddy = haze_connection_get_buddy (conn, handle);
+
+    if (buddy != NULL)
+        p_status = purple_presence_get_active_status (
+            purple_buddy_get_presence (buddy));
+
+    queue_presence_update (conn, handle, _get_tp_status (p_status));
+    return FALSE;
+}
+
+/* Returns TRUE if the change of @handle's status from @old_status (which may
+ * be NULL if unknown) to @new_status should not be signalled yet.
+ */
+static gboolean
+damp_status_change (HazeConnection *conn,
+                    TpHandle handle,
+                    PurpleStatus *old_status,
+                    PurpleStatus *new_status)
+{
+    static guint damping_ms = G_MAXUINT;
+    HazeConnectionPresencePrivate *priv = conn->presence_priv;
+    HeldOffline *held;
+
+    if (damping_ms == G_MAXUINT)
+        damping_ms = haze_get_tunable ("HAZE_PRESENCE_DAMPING_MS",
+            PRESENCE_DAMPING_MS_DEFAULT);
+
+    if (damping_ms == 0)
+        return FALSE;
+
+    held = g_hash_table_lookup (priv->held_offline, GUINT_TO_POINTER (handle));
+
+    if (!purple_status_is_online (new_status))
+    {
+        if (held == NULL)
+        {
+            held = g_slice_new0 (HeldOffline);
+            held->conn = conn;
+            held->handle = handle;
+            held->timeout_id = g_timeout_add (damping_ms,
+                held_offline_expired_cb, held);
+            g_hash_table_insert (priv->held_offline, GUINT_TO_POINTER (handle),
+                held);
+            priv->n_held++;
+        }
+
+        /* libpurple emits both buddy-status-changed, which tells us what
+         * they were before, and buddy-signed-off, which doesn't. */
+        if (held->last_online_status == NULL && old_status != NULL &&
+            purple_status_is_online (old_status))
+            held->last_online_status = _get_tp_status (old_status);
+
+        held->n_updates++;
+        return TRUE;
+    }
+
+    if (held != NULL)
+    {
+        /* Back already: we never said they'd gone, so we'll just signal
+         * their status now instead of offline then online. */
+        priv->n_flaps++;
+        priv->n_suppressed += held->n_updates;
+        g_hash_table_remove (priv->held_offline, GUINT_TO_POINTER (handle));
+
+        DEBUG ("handle %u flapped; %u of %u contacts going offline came back "
+            "within %ums, %u transitions suppressed", handle, priv->n_flaps,
+            priv->n_held, damping_ms, priv->n_suppressed);
+    }
+
+    return FALSE;
+}
+
 static void
 update_status (PurpleBuddy *buddy,
+               PurpleStatus *old_status,
                PurpleStatus *status)
 {
     PurpleAccount *account = purple_buddy_get_account (buddy);
     HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (account);
-    TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
-    TpHandleRepoIface *handle_repo =
-        tp_base_connection_get_handles (base_conn, TP_HANDLE_TYPE_CONTACT);
 
     const gchar *bname = purple_buddy_get_name (buddy);
-    TpHandle handle = tp_handle_ensure (handle_repo, bname, NULL, NULL);
-
-    TpPresenceStatus *tp_status;
+    TpHandle handle = haze_connection_get_buddy_handle (conn, buddy);
 
     DEBUG ("%s changed to status %s", bname, purple_status_get_id (status));
 
-    tp_status = _get_tp_status (status);
+    if (G_UNLIKELY (handle == 0))
+        return;
 
-    tp_presence_mixin_emit_one_presence_update (G_OBJECT (conn), handle,
-        tp_status);
+    if (damp_status_change (conn, handle, old_status, status))
+        return;
+
+    queue_presence_update (conn, handle, _get_tp_status (status));
 }
 
 static void
@@ -265,7 +629,7 @@ status_changed_cb (PurpleBuddy *buddy,
                    PurpleStatus *new_status,
                    gpointer unused)
 {
-    update_status (buddy, new_status);
+    update_status (buddy, old_status, new_status);
 }
 
 static void
@@ -276,7 +640,7 @@ signed_on_off_cb (PurpleBuddy *buddy,
     gboolean signed_on = GPOINTER_TO_INT (data);
     */
     PurplePresence *presence = purple_buddy_get_presence (buddy);
-    update_status (buddy, purple_presence_get_active_status (presence));
+    update_status (buddy, NULL, purple_presence_get_active_status (presence));
 }
 
 static gboolean
@@ -339,7 +703,36 @@ haze_connection_presence_class_init (GObjectClass *object_class)
 void
 haze_connection_presence_init (GObject *object)
 {
+    HazeConnection *conn = HAZE_CONNECTION (object);
+
+    conn->presence_priv = g_slice_new0 (HazeConnectionPresencePrivate);
+    conn->presence_priv->pending_statuses = g_hash_table_new_full (NULL, NULL,
+        NULL, (GDestroyNotify) interned_status_unref);
+    conn->presence_priv->held_offline = g_hash_table_new_full (NULL, NULL,
+        NULL, (GDestroyNotify) held_offline_free);
+
     tp_presence_mixin_init (object, G_STRUCT_OFFSET (HazeConnection,
         presence));
     tp_presence_mixin_simple_presence_register_with_contacts_mixin (object);
 }
+
+void
+haze_connection_presence_finalize (GObject *object)
+{
+    HazeConnection *conn = HAZE_CONNECTION (object);
+    HazeConnectionPresencePrivate *priv = conn->presence_priv;
+
+    /* Anything still pending is of no interest: we're long disconnected. */
+    if (priv->flush_id != 0)
+        g_source_remove (priv->flush_id);
+
+    if (priv->n_held > 0)
+        DEBUG ("%u of %u contacts going offline came back in time; "
+            "%u transitions suppressed", priv->n_flaps, priv->n_held,
+            priv->n_suppressed);
+
+    g_hash_table_unref (priv->held_offline);
+    g_hash_table_unref (priv->pending_statuses);
+    g_slice_free (HazeConnectionPresencePrivate, priv);
+    conn->presence_priv = NULL;
+}
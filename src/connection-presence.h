@@ -26,6 +26,7 @@
 
 void haze_connection_presence_class_init (GObjectClass *object_class);
 void haze_connection_presence_init (GObject *object);
+void haze_connection_presence_finalize (GObject *object);
 
 void
 haze_connection_presence_account_status_changed (PurpleAccount *account,
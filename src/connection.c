@@ -28,6 +28,7 @@
 #include <libpurple/accountopt.h>
 #include <libpurple/version.h>
 
+#include "avatar-store.h"
 #include "debug.h"
 #include "defines.h"
 #include "connection-manager.h"
@@ -35,9 +36,12 @@
 #include "connection-presence.h"
 #include "connection-aliasing.h"
 #include "connection-avatars.h"
+#include "connection-bulk.h"
+#include "connection-contact-info.h"
 #include "connection-mail.h"
 #include "extensions/extensions.h"
 #include "request.h"
+#include "roomlist-manager.h"
 
 #include "connection-capabilities.h"
 
@@ -54,6 +58,7 @@ enum
     PROP_PASSWORD,
     PROP_PRPL_ID,
     PROP_PRPL_INFO,
+    PROP_SEND_LIMITS,
 
     LAST_PROPERTY
 } HazeConnectionProperties;
@@ -69,8 +74,16 @@ G_DEFINE_TYPE_WITH_CODE(HazeConnection,
         haze_connection_aliasing_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CONNECTION_INTERFACE_AVATARS,
         haze_connection_avatars_iface_init);
+    G_IMPLEMENT_INTERFACE (
+        HAZE_TYPE_SVC_CONNECTION_INTERFACE_HAZE_AVATAR_FILES,
+        haze_connection_avatar_files_iface_init);
+    G_IMPLEMENT_INTERFACE (
+        HAZE_TYPE_SVC_CONNECTION_INTERFACE_HAZE_BULK_MESSAGES,
+        haze_connection_bulk_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CONNECTION_INTERFACE_CONTACT_CAPABILITIES,
         haze_connection_contact_capabilities_iface_init);
+    G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CONNECTION_INTERFACE_CONTACT_INFO,
+        haze_connection_contact_info_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CONNECTION_INTERFACE_CONTACTS,
         tp_contacts_mixin_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CONNECTION_INTERFACE_CONTACT_LIST,
@@ -87,9 +100,11 @@ static const gchar * implemented_interfaces[] = {
     /* Conditionally present */
 
     TP_IFACE_CONNECTION_INTERFACE_AVATARS,
+    HAZE_IFACE_CONNECTION_INTERFACE_HAZE_AVATAR_FILES,
     TP_IFACE_CONNECTION_INTERFACE_MAIL_NOTIFICATION,
     TP_IFACE_CONNECTION_INTERFACE_CONTACT_BLOCKING,
-#   define HAZE_NUM_CONDITIONAL_INTERFACES 3
+    TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO,
+#   define HAZE_NUM_CONDITIONAL_INTERFACES 5
 
     /* Always present */
 
@@ -99,6 +114,7 @@ static const gchar * implemented_interfaces[] = {
     TP_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE,
     TP_IFACE_CONNECTION_INTERFACE_CONTACT_CAPABILITIES,
     TP_IFACE_CONNECTION_INTERFACE_CONTACTS,
+    HAZE_IFACE_CONNECTION_INTERFACE_HAZE_BULK_MESSAGES,
     /* TODO: This is a lie.  Not all protocols supported by libpurple
      *       actually have the concept of a user-settable alias, but
      *       there's no way for the UI to know (yet).
@@ -155,6 +171,7 @@ struct _HazeConnectionPrivate
 
     gchar *prpl_id;
     PurplePluginProtocolInfo *prpl_info;
+    const HazeSendLimits *send_limits;
 
     /* Set if purple_account_request_password() was called */
     gpointer password_request;
@@ -167,9 +184,20 @@ struct _HazeConnectionPrivate
     /* Set to TRUE when purple_account_connect has been called. */
     gboolean connect_called;
 
+    /* Indexed by TpHandle; each element is a GSList of borrowed PurpleBuddy *
+     * on this account whose name normalizes to that handle, or NULL.  Kept up
+     * to date by the buddy-added and buddy-removed handlers in contact-list.c
+     * so that hot paths needn't turn handles back into strings and ask
+     * libpurple to normalize and look them up again.
+     */
+    GPtrArray *buddies_by_handle;
+
     gboolean dispose_has_run;
 };
 
+/* the resolution of the connection's timer wheel */
+#define TIMER_WHEEL_TICK_MS 250
+
 #define PC_GET_BASE_CONN(pc) \
     (ACCOUNT_GET_TP_BASE_CONNECTION (purple_connection_get_account (pc)))
 
@@ -185,6 +213,12 @@ protocol_info_supports_blocking (PurplePluginProtocolInfo *prpl_info)
     return (prpl_info->add_deny != NULL);
 }
 
+static gboolean
+protocol_info_supports_contact_info (PurplePluginProtocolInfo *prpl_info)
+{
+    return (prpl_info->get_info != NULL);
+}
+
 static gboolean
 protocol_info_supports_mail_notification (PurplePluginProtocolInfo *prpl_info)
 {
@@ -196,13 +230,23 @@ add_optional_connection_interfaces (GPtrArray *ifaces,
         PurplePluginProtocolInfo *prpl_info)
 {
     if (protocol_info_supports_avatar (prpl_info))
+    {
         g_ptr_array_add (ifaces,
                 TP_IFACE_CONNECTION_INTERFACE_AVATARS);
 
+        if (haze_avatar_store_is_enabled ())
+            g_ptr_array_add (ifaces,
+                    HAZE_IFACE_CONNECTION_INTERFACE_HAZE_AVATAR_FILES);
+    }
+
     if (protocol_info_supports_blocking (prpl_info))
         g_ptr_array_add (ifaces,
                 TP_IFACE_CONNECTION_INTERFACE_CONTACT_BLOCKING);
 
+    if (protocol_info_supports_contact_info (prpl_info))
+        g_ptr_array_add (ifaces,
+                TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO);
+
     if (protocol_info_supports_mail_notification (prpl_info))
         g_ptr_array_add (ifaces,
                 TP_IFACE_CONNECTION_INTERFACE_MAIL_NOTIFICATION);
@@ -224,6 +268,10 @@ connected_cb (PurpleConnection *pc)
             (const gchar **) ifaces->pdata);
     g_ptr_array_unref (ifaces);
 
+    /* Get any buddies libpurple added while it was fetching the roster out
+     * of the way first, as the base class would have done if we'd signalled
+     * them immediately. */
+    haze_contact_list_flush_pending_changes (conn->contact_list);
     tp_base_contact_list_set_list_received (
         (TpBaseContactList *) conn->contact_list);
 
@@ -648,7 +696,10 @@ _haze_connection_create_handle_repos (TpBaseConnection *base,
     repos[TP_HANDLE_TYPE_CONTACT] =
         tp_dynamic_handle_repo_new (TP_HANDLE_TYPE_CONTACT, _contact_normalize,
                                     base);
-    /* repos[TP_HANDLE_TYPE_ROOM] = XXX MUC */
+    /* libpurple compares rooms' names with purple_normalize() too. */
+    repos[TP_HANDLE_TYPE_ROOM] =
+        tp_dynamic_handle_repo_new (TP_HANDLE_TYPE_ROOM, _contact_normalize,
+                                    base);
 }
 
 static GPtrArray *
@@ -661,6 +712,23 @@ _haze_connection_create_channel_managers (TpBaseConnection *base)
         g_object_new (HAZE_TYPE_IM_CHANNEL_FACTORY, "connection", self, NULL));
     g_ptr_array_add (channel_managers, self->im_factory);
 
+    self->muc_factory = HAZE_MUC_CHANNEL_FACTORY (
+        g_object_new (HAZE_TYPE_MUC_CHANNEL_FACTORY, "connection", self,
+            NULL));
+    g_ptr_array_add (channel_managers, self->muc_factory);
+
+    g_ptr_array_add (channel_managers, g_object_new (
+        HAZE_TYPE_ROOMLIST_MANAGER, "connection", self, NULL));
+
+    self->ft_manager = HAZE_FT_MANAGER (
+        g_object_new (HAZE_TYPE_FT_MANAGER, "connection", self, NULL));
+    g_ptr_array_add (channel_managers, self->ft_manager);
+
+    self->contact_search_manager = HAZE_CONTACT_SEARCH_MANAGER (
+        g_object_new (HAZE_TYPE_CONTACT_SEARCH_MANAGER, "connection", self,
+            NULL));
+    g_ptr_array_add (channel_managers, self->contact_search_manager);
+
     self->contact_list = HAZE_CONTACT_LIST (
         g_object_new (HAZE_TYPE_CONTACT_LIST, "connection", self, NULL));
     g_ptr_array_add (channel_managers, self->contact_list);
@@ -705,6 +773,9 @@ haze_connection_get_property (GObject    *object,
         case PROP_PRPL_INFO:
             g_value_set_pointer (value, priv->prpl_info);
             break;
+        case PROP_SEND_LIMITS:
+            g_value_set_pointer (value, (gpointer) priv->send_limits);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -737,6 +808,9 @@ haze_connection_set_property (GObject      *object,
         case PROP_PRPL_INFO:
             priv->prpl_info = g_value_get_pointer (value);
             break;
+        case PROP_SEND_LIMITS:
+            priv->send_limits = g_value_get_pointer (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -758,6 +832,8 @@ haze_connection_constructor (GType type,
     DEBUG ("Post-construction: (HazeConnection *)%p", self);
 
     self->acceptable_avatar_mime_types = NULL;
+    self->send_scheduler = haze_send_scheduler_new (priv->send_limits);
+    self->timer_wheel = haze_timer_wheel_new (TIMER_WHEEL_TICK_MS);
 
     priv->dispose_has_run = FALSE;
 
@@ -770,7 +846,9 @@ haze_connection_constructor (GType type,
 
     haze_connection_aliasing_init (object);
     haze_connection_avatars_init (object);
+    haze_connection_bulk_init (object);
     haze_connection_capabilities_init (object);
+    haze_connection_contact_info_init (object);
     haze_connection_presence_init (object);
     haze_connection_mail_init (object);
 
@@ -793,6 +871,8 @@ haze_connection_dispose (GObject *object)
     g_hash_table_unref (priv->parameters);
     priv->parameters = NULL;
 
+    haze_connection_bulk_dispose (object);
+
     G_OBJECT_CLASS (haze_connection_parent_class)->dispose (object);
 }
 
@@ -803,9 +883,14 @@ haze_connection_finalize (GObject *object)
     HazeConnectionPrivate *priv = self->priv;
 
     tp_contacts_mixin_finalize (object);
+    haze_connection_avatars_finalize (object);
+    haze_connection_bulk_finalize (object);
+    haze_connection_contact_info_finalize (object);
+    haze_connection_presence_finalize (object);
     tp_presence_mixin_finalize (object);
 
     g_strfreev (self->acceptable_avatar_mime_types);
+    haze_send_scheduler_free (self->send_scheduler);
     g_free (priv->username);
     g_free (priv->password);
 
@@ -815,6 +900,16 @@ haze_connection_finalize (GObject *object)
         purple_accounts_delete (self->account);
       }
 
+    /* Only now, since deleting the account may destroy conversations, which
+     * cancel their timers. */
+    haze_timer_wheel_free (self->timer_wheel);
+
+    /* Deleting the account removes all its buddies, which should have emptied
+     * the index; but be thorough in case some never made it onto the blist.
+     */
+    g_ptr_array_foreach (priv->buddies_by_handle, (GFunc) g_slist_free, NULL);
+    g_ptr_array_unref (priv->buddies_by_handle);
+
     G_OBJECT_CLASS (haze_connection_parent_class)->finalize (object);
 }
 
@@ -836,6 +931,10 @@ haze_connection_class_init (HazeConnectionClass *klass)
             haze_connection_avatars_properties_getter,
             NULL,
             NULL },     /* initialized a bit later */
+        { TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO,
+            haze_connection_contact_info_properties_getter,
+            NULL,
+            NULL },     /* likewise */
         { TP_IFACE_CONNECTION_INTERFACE_MAIL_NOTIFICATION,
             haze_connection_mail_properties_getter,
             NULL,
@@ -889,7 +988,15 @@ haze_connection_class_init (HazeConnectionClass *klass)
         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
     g_object_class_install_property (object_class, PROP_PRPL_INFO, param_spec);
 
+    param_spec = g_param_spec_pointer ("send-limits", "HazeSendLimits",
+        "how fast and in what size pieces to send messages, or NULL to send "
+        "them as they come",
+        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+    g_object_class_install_property (object_class, PROP_SEND_LIMITS,
+        param_spec);
+
     prop_interfaces[0].props = haze_connection_avatars_properties;
+    prop_interfaces[1].props = haze_connection_contact_info_properties;
     klass->properties_class.interfaces = prop_interfaces;
     tp_dbus_properties_mixin_class_init (object_class,
         G_STRUCT_OFFSET (HazeConnectionClass, properties_class));
@@ -909,6 +1016,7 @@ haze_connection_init (HazeConnection *self)
     DEBUG ("Initializing (HazeConnection *)%p", self);
     self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, HAZE_TYPE_CONNECTION,
                                               HazeConnectionPrivate);
+    self->priv->buddies_by_handle = g_ptr_array_new ();
 }
 
 static PurpleAccountUiOps
@@ -967,6 +1075,144 @@ haze_connection_handle_inspect (HazeConnection *conn,
     return tp_handle_inspect (handle_repo, handle);
 }
 
+/**
+ * haze_connection_index_buddy:
+ *
+ * Records that @buddy, which must belong to @self's account, is a blist entry
+ * for @handle.  Indexing the same buddy more than once is harmless: libpurple
+ * emits buddy-added again when a buddy is moved between groups.
+ */
+void
+haze_connection_index_buddy (HazeConnection *self,
+                             PurpleBuddy *buddy,
+                             TpHandle handle)
+{
+    GPtrArray *index = self->priv->buddies_by_handle;
+    PurpleBlistNode *node = (PurpleBlistNode *) buddy;
+    GSList *buddies;
+
+    g_return_if_fail (handle != 0);
+
+    if (purple_blist_node_get_ui_data (node) != NULL)
+        return;
+
+    if (handle >= index->len)
+        g_ptr_array_set_size (index, handle + 1);
+
+    buddies = g_ptr_array_index (index, handle);
+    g_ptr_array_index (index, handle) = g_slist_append (buddies, buddy);
+    purple_blist_node_set_ui_data (node, GUINT_TO_POINTER (handle));
+}
+
+/**
+ * haze_connection_unindex_buddy:
+ *
+ * Forgets @buddy, if it was previously passed to
+ * haze_connection_index_buddy().  This only uses the handle stashed on the
+ * blist node, so it is safe to call while the connection is being torn down.
+ *
+ * Returns: the handle @buddy was indexed under, or 0 if it was not indexed
+ */
+TpHandle
+haze_connection_unindex_buddy (HazeConnection *self,
+                               PurpleBuddy *buddy)
+{
+    GPtrArray *index = self->priv->buddies_by_handle;
+    PurpleBlistNode *node = (PurpleBlistNode *) buddy;
+    TpHandle handle = GPOINTER_TO_UINT (purple_blist_node_get_ui_data (node));
+    GSList *buddies;
+
+    if (handle == 0)
+        return 0;
+
+    g_return_val_if_fail (handle < index->len, 0);
+
+    buddies = g_ptr_array_index (index, handle);
+    g_ptr_array_index (index, handle) = g_slist_remove (buddies, buddy);
+    purple_blist_node_set_ui_data (node, NULL);
+
+    return handle;
+}
+
+/**
+ * haze_connection_peek_buddies:
+ *
+ * Returns: (transfer none) (element-type PurpleBuddy): every blist entry for
+ *          @handle on this connection's account, in the order they were added,
+ *          or %NULL if @handle is not on the buddy list.
+ */
+const GSList *
+haze_connection_peek_buddies (HazeConnection *self,
+                              TpHandle handle)
+{
+    GPtrArray *index = self->priv->buddies_by_handle;
+
+    if (handle >= index->len)
+        return NULL;
+
+    return g_ptr_array_index (index, handle);
+}
+
+/**
+ * haze_connection_add_buddy_handles:
+ *
+ * Adds every handle with at least one blist entry on this connection's
+ * account to @handles.
+ */
+void
+haze_connection_add_buddy_handles (HazeConnection *self,
+                                   TpHandleSet *handles)
+{
+    GPtrArray *index = self->priv->buddies_by_handle;
+    TpHandle handle;
+
+    for (handle = 1; handle < index->len; handle++)
+      {
+        if (g_ptr_array_index (index, handle) != NULL)
+            tp_handle_set_add (handles, handle);
+      }
+}
+
+/**
+ * haze_connection_get_buddy:
+ *
+ * Cheaper equivalent of calling purple_find_buddy() with the name of @handle.
+ *
+ * Returns: (transfer none): a blist entry for @handle, or %NULL
+ */
+PurpleBuddy *
+haze_connection_get_buddy (HazeConnection *self,
+                           TpHandle handle)
+{
+    const GSList *buddies = haze_connection_peek_buddies (self, handle);
+
+    return (buddies != NULL ? buddies->data : NULL);
+}
+
+/**
+ * haze_connection_get_buddy_handle:
+ *
+ * Returns: the contact handle for @buddy, without normalizing its name if it
+ *          has already been indexed; or 0 if its name is not a valid contact
+ *          identifier.
+ */
+TpHandle
+haze_connection_get_buddy_handle (HazeConnection *self,
+                                  PurpleBuddy *buddy)
+{
+    TpHandleRepoIface *contact_repo;
+    TpHandle handle = GPOINTER_TO_UINT (
+        purple_blist_node_get_ui_data ((PurpleBlistNode *) buddy));
+
+    if (handle != 0)
+        return handle;
+
+    contact_repo = tp_base_connection_get_handles (TP_BASE_CONNECTION (self),
+        TP_HANDLE_TYPE_CONTACT);
+    return tp_handle_ensure (contact_repo, purple_buddy_get_name (buddy),
+        NULL, NULL);
+}
+
 /**
  * Get the group that "most" libpurple prpls will use for ungrouped contacts.
  */
@@ -25,16 +25,27 @@
 #include <telepathy-glib/telepathy-glib.h>
 
 #include <libpurple/account.h>
+#include <libpurple/blist.h>
 #include <libpurple/prpl.h>
 
 #include "contact-list.h"
+#include "contact-search-manager.h"
+#include "ft-manager.h"
 #include "im-channel-factory.h"
+#include "muc-channel-factory.h"
+#include "send-scheduler.h"
+#include "timer-wheel.h"
 
 G_BEGIN_DECLS
 
 typedef struct _HazeConnection HazeConnection;
 typedef struct _HazeConnectionPrivate HazeConnectionPrivate;
 typedef struct _HazeConnectionClass HazeConnectionClass;
+typedef struct _HazeConnectionPresencePrivate HazeConnectionPresencePrivate;
+typedef struct _HazeConnectionAvatarsPrivate HazeConnectionAvatarsPrivate;
+typedef struct _HazeConnectionBulkPrivate HazeConnectionBulkPrivate;
+typedef struct _HazeConnectionContactInfoPrivate
+    HazeConnectionContactInfoPrivate;
 
 struct _HazeConnectionClass {
     TpBaseConnectionClass parent_class;
@@ -50,12 +61,26 @@ struct _HazeConnection {
 
     HazeContactList *contact_list;
     HazeImChannelFactory *im_factory;
+    HazeMUCChannelFactory *muc_factory;
+    HazeFtManager *ft_manager;
+    HazeContactSearchManager *contact_search_manager;
     TpSimplePasswordManager *password_manager;
 
     TpContactsMixin contacts;
     TpPresenceMixin presence;
+    HazeConnectionPresencePrivate *presence_priv;
 
     gchar **acceptable_avatar_mime_types;
+    HazeConnectionAvatarsPrivate *avatars_priv;
+
+    HazeConnectionContactInfoPrivate *contact_info_priv;
+
+    HazeSendScheduler *send_scheduler;
+    HazeConnectionBulkPrivate *bulk_priv;
+    /* drives typing notification resends and chat state debouncing */
+    HazeTimerWheel *timer_wheel;
+    /* messages waiting for acknowledgement in all IM channels' mixins */
+    guint pending_messages;
 
     HazeConnectionPrivate *priv;
 };
@@ -77,6 +102,18 @@ haze_connection_handle_inspect (HazeConnection *conn,
 
 gboolean haze_connection_create_account (HazeConnection *self, GError **error);
 
+void haze_connection_index_buddy (HazeConnection *self, PurpleBuddy *buddy,
+    TpHandle handle);
+TpHandle haze_connection_unindex_buddy (HazeConnection *self,
+    PurpleBuddy *buddy);
+const GSList *haze_connection_peek_buddies (HazeConnection *self,
+    TpHandle handle);
+void haze_connection_add_buddy_handles (HazeConnection *self,
+    TpHandleSet *handles);
+PurpleBuddy *haze_connection_get_buddy (HazeConnection *self, TpHandle handle);
+TpHandle haze_connection_get_buddy_handle (HazeConnection *self,
+    PurpleBuddy *buddy);
+
 GType haze_connection_get_type (void);
 
 /* TYPE MACROS */
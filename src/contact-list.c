@@ -28,6 +28,7 @@
 
 #include "connection.h"
 #include "debug.h"
+#include "util.h"
 
 typedef struct _PublishRequestData PublishRequestData;
 
@@ -72,9 +73,26 @@ struct _HazeContactListPrivate {
     TpHandleSet *publishing_to;
     TpHandleSet *not_publishing_to;
 
+    /* Changes made by libpurple to the buddy list which haven't been
+     * signalled yet.  A roster push can add thousands of buddies in one go,
+     * so rather than emitting signals per buddy we collect them here and
+     * flush them from flush_pending_changes_id.
+     */
+    TpHandleSet *pending_changed;
+    TpHandleSet *pending_removed;
+    /* Map from owned group names to (TpHandleSet *)s of contacts */
+    GHashTable *pending_group_additions;
+    GHashTable *pending_group_removals;
+    guint flush_pending_changes_id;
+
     gboolean dispose_has_run;
 };
 
+/* How long to collect buddy list changes before signalling them, in
+ * milliseconds. 0 means "until the main loop is next idle".
+ */
+#define ROSTER_BATCH_MS_DEFAULT 0
+
 static void haze_contact_list_mutable_init (TpMutableContactListInterface *);
 static void haze_contact_list_groups_init (TpContactGroupListInterface *);
 static void haze_contact_list_mutable_groups_init (
@@ -132,6 +150,13 @@ haze_contact_list_constructor (GType type, guint n_props,
     self->priv->pending_publish_requests = g_hash_table_new_full (NULL, NULL,
         NULL, (GDestroyNotify) publish_request_data_free);
 
+    self->priv->pending_changed = tp_handle_set_new (contact_repo);
+    self->priv->pending_removed = tp_handle_set_new (contact_repo);
+    self->priv->pending_group_additions = g_hash_table_new_full (g_str_hash,
+        g_str_equal, g_free, (GDestroyNotify) tp_handle_set_destroy);
+    self->priv->pending_group_removals = g_hash_table_new_full (g_str_hash,
+        g_str_equal, g_free, (GDestroyNotify) tp_handle_set_destroy);
+
     return obj;
 }
 
@@ -146,6 +171,16 @@ haze_contact_list_dispose (GObject *object)
 
     priv->dispose_has_run = TRUE;
 
+    if (priv->flush_pending_changes_id != 0)
+    {
+        g_source_remove (priv->flush_pending_changes_id);
+        priv->flush_pending_changes_id = 0;
+    }
+
+    tp_clear_pointer (&priv->pending_changed, tp_handle_set_destroy);
+    tp_clear_pointer (&priv->pending_removed, tp_handle_set_destroy);
+    tp_clear_pointer (&priv->pending_group_additions, g_hash_table_unref);
+    tp_clear_pointer (&priv->pending_group_removals, g_hash_table_unref);
     tp_clear_pointer (&priv->publishing_to, tp_handle_set_destroy);
     tp_clear_pointer (&priv->not_publishing_to, tp_handle_set_destroy);
 
@@ -173,29 +208,15 @@ static TpHandleSet *
 haze_contact_list_dup_contacts (TpBaseContactList *cl)
 {
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
-  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
-      TP_HANDLE_TYPE_CONTACT);
   /* The list initially contains anyone we're definitely publishing to.
    * Because libpurple, that's only people whose request we accepted during
    * this session :-( */
   TpHandleSet *handles = tp_handle_set_copy (self->priv->publishing_to);
-  GSList *buddies = purple_find_buddies (self->priv->conn->account, NULL);
-  GSList *sl_iter;
   GHashTableIter hash_iter;
   gpointer k;
 
   /* Also include anyone on our buddy list */
-  for (sl_iter = buddies; sl_iter != NULL; sl_iter = sl_iter->next)
-    {
-      TpHandle handle = tp_handle_ensure (contact_repo,
-          purple_buddy_get_name (sl_iter->data), NULL, NULL);
-
-      if (G_LIKELY (handle != 0))
-        tp_handle_set_add (handles, handle);
-    }
-
-  g_slist_free (buddies);
+  haze_connection_add_buddy_handles (self->priv->conn, handles);
 
   /* Also include anyone with an outstanding request */
   g_hash_table_iter_init (&hash_iter, self->priv->pending_publish_requests);
@@ -216,9 +237,7 @@ haze_contact_list_dup_states (TpBaseContactList *cl,
     gchar **publish_request_out)
 {
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  const gchar *bname = haze_connection_handle_inspect (self->priv->conn,
-      TP_HANDLE_TYPE_CONTACT, contact);
-  PurpleBuddy *buddy = purple_find_buddy (self->priv->conn->account, bname);
+  PurpleBuddy *buddy = haze_connection_get_buddy (self->priv->conn, contact);
   TpSubscriptionState pub, sub;
   PublishRequestData *pub_req = g_hash_table_lookup (
       self->priv->pending_publish_requests, GUINT_TO_POINTER (contact));
@@ -289,11 +308,152 @@ haze_contact_list_class_init (HazeContactListClass *klass)
                            klass, PURPLE_CALLBACK(buddy_removed_cb), NULL);
 }
 
+/* Moves @handle from @from_groups[@group_name] to @to_groups[@group_name],
+ * so that being added to and removed from a group before we get round to
+ * signalling it cancels out.
+ */
+static void
+queue_group_change (HazeContactList *self,
+                    GHashTable *from_groups,
+                    GHashTable *to_groups,
+                    const gchar *group_name,
+                    TpHandle handle)
+{
+    TpHandleSet *set = g_hash_table_lookup (from_groups, group_name);
+
+    if (set != NULL && tp_handle_set_remove (set, handle))
+        return;
+
+    set = g_hash_table_lookup (to_groups, group_name);
+
+    if (set == NULL)
+    {
+        TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+            (TpBaseConnection *) self->priv->conn, TP_HANDLE_TYPE_CONTACT);
+
+        set = tp_handle_set_new (contact_repo);
+        g_hash_table_insert (to_groups, g_strdup (group_name), set);
+    }
+
+    tp_handle_set_add (set, handle);
+}
+
+static void
+emit_pending_group_changes (HazeContactList *self,
+                            GHashTable *groups,
+                            gboolean added)
+{
+    GHashTableIter iter;
+    gpointer k, v;
+
+    g_hash_table_iter_init (&iter, groups);
+
+    while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+        const gchar *group_name = k;
+
+        if (tp_handle_set_is_empty (v))
+            continue;
+
+        if (added)
+            tp_base_contact_list_groups_changed ((TpBaseContactList *) self,
+                v, &group_name, 1, NULL, 0);
+        else
+            tp_base_contact_list_groups_changed ((TpBaseContactList *) self,
+                v, NULL, 0, &group_name, 1);
+    }
+
+    g_hash_table_remove_all (groups);
+}
+
+/**
+ * haze_contact_list_flush_pending_changes:
+ *
+ * Signals any buddy list changes which have been collected by
+ * buddy_added_cb() and buddy_removed_cb() but not yet announced.
+ */
+void
+haze_contact_list_flush_pending_changes (HazeContactList *self)
+{
+    HazeContactListPrivate *priv = self->priv;
+    TpBaseConnection *base_conn = TP_BASE_CONNECTION (priv->conn);
+
+    if (priv->flush_pending_changes_id != 0)
+    {
+        g_source_remove (priv->flush_pending_changes_id);
+        priv->flush_pending_changes_id = 0;
+    }
+
+    /* Every buddy gets removed after disconnection, because the PurpleAccount
+     * gets deleted.  Nobody's listening by then anyway.
+     */
+    if (tp_base_connection_get_status (base_conn) ==
+        TP_CONNECTION_STATUS_DISCONNECTED)
+    {
+        tp_handle_set_clear (priv->pending_changed);
+        tp_handle_set_clear (priv->pending_removed);
+        g_hash_table_remove_all (priv->pending_group_additions);
+        g_hash_table_remove_all (priv->pending_group_removals);
+        return;
+    }
+
+    DEBUG ("%d contacts changed, %d removed",
+        tp_handle_set_size (priv->pending_changed),
+        tp_handle_set_size (priv->pending_removed));
+
+    /* Take contacts out of groups before they disappear, and only put them
+     * into groups once they've appeared, as if we'd signalled each buddy as
+     * it came and went. */
+    emit_pending_group_changes (self, priv->pending_group_removals, FALSE);
+
+    if (!tp_handle_set_is_empty (priv->pending_changed) ||
+        !tp_handle_set_is_empty (priv->pending_removed))
+    {
+        tp_base_contact_list_contacts_changed ((TpBaseContactList *) self,
+            priv->pending_changed, priv->pending_removed);
+        tp_handle_set_clear (priv->pending_changed);
+        tp_handle_set_clear (priv->pending_removed);
+    }
+
+    emit_pending_group_changes (self, priv->pending_group_additions, TRUE);
+}
+
+static gboolean
+flush_pending_changes_cb (gpointer user_data)
+{
+    HazeContactList *self = HAZE_CONTACT_LIST (user_data);
+
+    self->priv->flush_pending_changes_id = 0;
+    haze_contact_list_flush_pending_changes (self);
+    return FALSE;
+}
+
+static void
+schedule_flush (HazeContactList *self)
+{
+    static guint batch_ms = G_MAXUINT;
+
+    if (self->priv->flush_pending_changes_id != 0)
+        return;
+
+    if (batch_ms == G_MAXUINT)
+        batch_ms = haze_get_tunable ("HAZE_ROSTER_BATCH_MS",
+            ROSTER_BATCH_MS_DEFAULT);
+
+    if (batch_ms == 0)
+        self->priv->flush_pending_changes_id = g_idle_add_full (
+            G_PRIORITY_DEFAULT, flush_pending_changes_cb, self, NULL);
+    else
+        self->priv->flush_pending_changes_id = g_timeout_add (batch_ms,
+            flush_pending_changes_cb, self);
+}
+
 static void
 buddy_added_cb (PurpleBuddy *buddy, gpointer unused)
 {
     HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (buddy->account);
     HazeContactList *contact_list = conn->contact_list;
+    HazeContactListPrivate *priv = contact_list->priv;
     TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
     TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
         base_conn, TP_HANDLE_TYPE_CONTACT);
@@ -301,12 +461,22 @@ buddy_added_cb (PurpleBuddy *buddy, gpointer unused)
     TpHandle handle = tp_handle_ensure (contact_repo, name, NULL, NULL);
     const char *group_name;
 
-    tp_base_contact_list_one_contact_changed (
-        (TpBaseContactList *) contact_list, handle);
+    if (G_UNLIKELY (handle == 0))
+      {
+        g_warning ("buddy '%s' is not a valid contact identifier", name);
+        return;
+      }
+
+    haze_connection_index_buddy (conn, buddy, handle);
+
+    tp_handle_set_remove (priv->pending_removed, handle);
+    tp_handle_set_add (priv->pending_changed, handle);
 
     group_name = purple_group_get_name (purple_buddy_get_group (buddy));
-    tp_base_contact_list_one_contact_groups_changed (
-        (TpBaseContactList *) contact_list, handle, &group_name, 1, NULL, 0);
+    queue_group_change (contact_list, priv->pending_group_removals,
+        priv->pending_group_additions, group_name, handle);
+
+    schedule_flush (contact_list);
 }
 
 static void
@@ -315,11 +485,11 @@ buddy_removed_cb (PurpleBuddy *buddy, gpointer unused)
     HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (buddy->account);
     TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
     HazeContactList *contact_list;
-    TpHandleRepoIface *contact_repo;
+    HazeContactListPrivate *priv;
     TpHandle handle;
-    const char *group_name, *buddy_name;
-    GSList *buddies, *l;
-    gboolean last_instance = TRUE;
+    const char *group_name;
+
+    handle = haze_connection_unindex_buddy (conn, buddy);
 
     /* Every buddy gets removed after disconnection, because the PurpleAccount
      * gets deleted.  So let's ignore removals when we're offline.
@@ -328,38 +498,26 @@ buddy_removed_cb (PurpleBuddy *buddy, gpointer unused)
         TP_CONNECTION_STATUS_DISCONNECTED)
         return;
 
-    contact_list = conn->contact_list;
-    contact_repo = tp_base_connection_get_handles (base_conn,
-        TP_HANDLE_TYPE_CONTACT);
+    /* It was never indexed, so buddy_added_cb didn't announce it either. */
+    if (G_UNLIKELY (handle == 0))
+        return;
 
-    buddy_name = purple_buddy_get_name (buddy);
-    handle = tp_handle_ensure (contact_repo, buddy_name, NULL, NULL);
+    contact_list = conn->contact_list;
+    priv = contact_list->priv;
     group_name = purple_group_get_name (purple_buddy_get_group (buddy));
 
-    tp_base_contact_list_one_contact_groups_changed (
-        (TpBaseContactList *) contact_list, handle, NULL, 0, &group_name, 1);
-
-    buddies = purple_find_buddies (conn->account, buddy_name);
+    queue_group_change (contact_list, priv->pending_group_additions,
+        priv->pending_group_removals, group_name, handle);
 
-    for (l = buddies; l != NULL; l = l->next)
+    if (haze_connection_peek_buddies (conn, handle) == NULL)
     {
-        if (l->data != buddy)
-        {
-            last_instance = FALSE;
-            break;
-        }
+        tp_handle_set_remove (priv->pending_changed, handle);
+        tp_handle_set_add (priv->pending_removed, handle);
     }
 
-    g_slist_free (buddies);
-
-    if (last_instance)
-    {
-        tp_base_contact_list_one_contact_removed (
-            (TpBaseContactList *) contact_list, handle);
-    }
+    schedule_flush (contact_list);
 }
 
-
 /* Objects needed or populated while iterating across the purple buddy list at
  * login.
  */
@@ -532,7 +690,7 @@ haze_contact_list_request_subscription (HazeContactList *self,
   /* If the buddy already exists, then it should already be on the
    * subscribe list.
    */
-  if (purple_find_buddy (account, bname) != NULL)
+  if (haze_connection_get_buddy (self->priv->conn, handle) != NULL)
     return;
 
   buddy = purple_buddy_new (account, bname, NULL);
@@ -863,16 +1021,12 @@ haze_contact_list_dup_contact_groups (TpBaseContactList *cl,
     TpHandle contact)
 {
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  const gchar *bname = haze_connection_handle_inspect (self->priv->conn,
-      TP_HANDLE_TYPE_CONTACT, contact);
-  GSList *buddies, *sl_iter;
+  const GSList *buddies, *sl_iter;
   GPtrArray *arr;
 
-  g_return_val_if_fail (bname != NULL, NULL);
-
-  buddies = purple_find_buddies (self->priv->conn->account, bname);
+  buddies = haze_connection_peek_buddies (self->priv->conn, contact);
 
-  arr = g_ptr_array_sized_new (g_slist_length (buddies));
+  arr = g_ptr_array_sized_new (g_slist_length ((GSList *) buddies) + 1);
 
   for (sl_iter = buddies; sl_iter != NULL; sl_iter = sl_iter->next)
     {
@@ -881,7 +1035,6 @@ haze_contact_list_dup_contact_groups (TpBaseContactList *cl,
       g_ptr_array_add (arr, g_strdup (purple_group_get_name (group)));
     }
 
-  g_slist_free (buddies);
   g_ptr_array_add (arr, NULL);
   return (GStrv) g_ptr_array_free (arr, FALSE);
 }
@@ -0,0 +1,956 @@
+/*
+ * contact-search-channel.c - HazeContactSearchChannel source
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* A ContactSearch channel, driving one of libpurple's user directory
+ * searches.  The prpl asks for a form to be filled in through the request
+ * API, and HazeContactSearchManager hands that form to us: its text fields
+ * are our AvailableSearchKeys, and Search() fills them in and submits it.
+ *
+ * The results come back through purple_notify_searchresults(), and a
+ * directory can return thousands of rows at once.  Rather than converting
+ * them all in one go, they are signalled MAX_RESULTS_PER_BATCH at a time, one
+ * batch per main loop iteration, so the first results go out straight away
+ * and Stop(), Close() or reaching the result cap means the rest are never
+ * looked at.  Further pages, for prpls that have them, arrive through
+ * purple_notify_searchresults_new_rows() after More().
+ */
+
+#include <config.h>
+#include "contact-search-channel.h"
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "connection.h"
+#include "debug.h"
+#include "request.h"
+#include "util.h"
+
+/* The most results signalled in one SearchResultReceived */
+#define MAX_RESULTS_PER_BATCH 100
+
+#define DEFAULT_MAX_RESULTS 1000
+
+/* Our ui_handle for a set of results from libpurple.  It belongs to
+ * libpurple, which frees it through haze_contact_search_results_free(), so
+ * it can outlive the channel. */
+typedef struct {
+  HazeContactSearchChannel *channel;
+  PurpleNotifySearchResults *results;
+  /* for the prpl's buttons */
+  gpointer prpl_data;
+} ResultsHandle;
+
+enum
+{
+  PROP_SERVER = 1,
+  PROP_LIMIT,
+  PROP_FIELDS,
+  PROP_REQUEST,
+};
+
+struct _HazeContactSearchChannelPrivate
+{
+  gchar *server;
+  guint limit;
+  gchar **keys;
+  /* search key => the form's PurpleRequestField for it, until the form is
+   * submitted or withdrawn */
+  GHashTable *key_fields;
+  PurpleRequestFields *fields;
+  gpointer request;
+
+  TpChannelContactSearchState state;
+  guint timeout_id;
+
+  ResultsHandle *handle;
+  /* field names for handle->results' columns, and the first of its rows not
+   * yet signalled */
+  gchar **columns;
+  GList *next_row;
+  guint stream_id;
+  guint release_id;
+
+  /* how many results we'll signal at most (0 for no limit), and have */
+  guint max_results;
+  guint n_results;
+  /* identifier => Contact_Info_Field_List, not yet signalled */
+  GHashTable *batch;
+
+  gboolean dispose_has_run;
+};
+
+static void contact_search_iface_init (gpointer g_iface, gpointer iface_data);
+
+G_DEFINE_TYPE_WITH_CODE (HazeContactSearchChannel,
+    haze_contact_search_channel, TP_TYPE_BASE_CHANNEL,
+    G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_TYPE_CONTACT_SEARCH,
+        contact_search_iface_init))
+
+static guint
+get_max_results (void)
+{
+  static guint max_results = G_MAXUINT;
+
+  if (max_results == G_MAXUINT)
+    max_results = haze_get_tunable ("HAZE_SEARCH_MAX_RESULTS",
+        DEFAULT_MAX_RESULTS);
+
+  return max_results;
+}
+
+static void
+set_state (HazeContactSearchChannel *self,
+           TpChannelContactSearchState state,
+           const gchar *error,
+           const gchar *debug_message)
+{
+  GHashTable *details = tp_asv_new (NULL, NULL);
+
+  if (debug_message != NULL)
+    {
+      DEBUG ("%s", debug_message);
+      tp_asv_set_string (details, "debug-message", debug_message);
+    }
+
+  self->priv->state = state;
+  tp_svc_channel_type_contact_search_emit_search_state_changed (self, state,
+      error != NULL ? error : "", details);
+  g_hash_table_unref (details);
+}
+
+static gboolean
+timeout_cb (gpointer user_data);
+
+static void
+start_timeout (HazeContactSearchChannel *self)
+{
+  if (self->priv->timeout_id == 0)
+    self->priv->timeout_id = g_timeout_add_seconds (
+        HAZE_CONTACT_SEARCH_TIMEOUT_SECONDS, timeout_cb, self);
+}
+
+static void
+cancel_timeout (HazeContactSearchChannel *self)
+{
+  if (self->priv->timeout_id != 0)
+    {
+      g_source_remove (self->priv->timeout_id);
+      self->priv->timeout_id = 0;
+    }
+}
+
+static void
+flush_results (HazeContactSearchChannel *self)
+{
+  HazeContactSearchChannelPrivate *priv = self->priv;
+
+  if (g_hash_table_size (priv->batch) == 0)
+    return;
+
+  tp_svc_channel_type_contact_search_emit_search_result_received (self,
+      priv->batch);
+  g_hash_table_remove_all (priv->batch);
+}
+
+static void
+stop_streaming (HazeContactSearchChannel *self)
+{
+  HazeContactSearchChannelPrivate *priv = self->priv;
+
+  if (priv->stream_id != 0)
+    {
+      g_source_remove (priv->stream_id);
+      priv->stream_id = 0;
+    }
+
+  priv->next_row = NULL;
+  g_strfreev (priv->columns);
+  priv->columns = NULL;
+}
+
+/* Gives the results back to libpurple, which lets the prpl stop fetching any
+ * more of them. */
+static void
+release_results (HazeContactSearchChannel *self)
+{
+  HazeContactSearchChannelPrivate *priv = self->priv;
+  ResultsHandle *handle = priv->handle;
+
+  stop_streaming (self);
+
+  if (priv->release_id != 0)
+    {
+      g_source_remove (priv->release_id);
+      priv->release_id = 0;
+    }
+
+  if (handle == NULL)
+    return;
+
+  handle->channel = NULL;
+  priv->handle = NULL;
+  purple_notify_close (PURPLE_NOTIFY_SEARCHRESULTS, handle);
+}
+
+static gboolean
+release_results_cb (gpointer user_data)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (user_data);
+
+  self->priv->release_id = 0;
+  release_results (self);
+  return FALSE;
+}
+
+/* The prpl might be in the middle of something when it gives us rows, so
+ * don't close its results from under it. */
+static void
+release_results_later (HazeContactSearchChannel *self)
+{
+  if (self->priv->release_id == 0)
+    self->priv->release_id = g_idle_add (release_results_cb, self);
+}
+
+static void
+stop_search (HazeContactSearchChannel *self,
+             const gchar *error,
+             const gchar *debug_message)
+{
+  cancel_timeout (self);
+  release_results (self);
+  g_hash_table_remove_all (self->priv->batch);
+  set_state (self, TP_CHANNEL_CONTACT_SEARCH_STATE_FAILED, error,
+      debug_message);
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (user_data);
+
+  self->priv->timeout_id = 0;
+  stop_search (self, TP_ERROR_STR_NETWORK_ERROR,
+      "the directory didn't answer in time");
+  return FALSE;
+}
+
+static gchar **
+dup_column_names (PurpleNotifySearchResults *results)
+{
+  guint n = purple_notify_searchresults_get_columns_count (results);
+  gchar **names = g_new0 (gchar *, n + 1);
+  guint i;
+
+  for (i = 0; i < n; i++)
+    {
+      const gchar *title = purple_notify_searchresults_column_get_title (
+          results, i);
+
+      names[i] = haze_vcard_field_name (title != NULL ? title : "");
+    }
+
+  return names;
+}
+
+/* Returns FALSE, without adding @row, once we've had as many results as we
+ * are going to signal. */
+static gboolean
+add_row (HazeContactSearchChannel *self,
+         gchar **columns,
+         GList *row)
+{
+  HazeContactSearchChannelPrivate *priv = self->priv;
+  const gchar * const no_parameters[] = { NULL };
+  const gchar *identifier;
+  GPtrArray *info;
+  GList *cell;
+  guint i;
+
+  if (priv->max_results != 0 && priv->n_results >= priv->max_results)
+    return FALSE;
+
+  /* The first column says who it is: a JID, a UIN, and so on. */
+  identifier = row != NULL ? row->data : NULL;
+
+  if (tp_str_empty (identifier))
+    return TRUE;
+
+  info = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) tp_value_array_free);
+
+  for (i = 0, cell = row;
+       columns[i] != NULL && cell != NULL;
+       i++, cell = cell->next)
+    {
+      const gchar *values[] = { NULL, NULL };
+
+      if (tp_str_empty (cell->data))
+        continue;
+
+      values[0] = cell->data;
+      g_ptr_array_add (info, tp_value_array_build (3,
+          G_TYPE_STRING, columns[i],
+          G_TYPE_STRV, no_parameters,
+          G_TYPE_STRV, values,
+          G_TYPE_INVALID));
+    }
+
+  g_hash_table_insert (priv->batch, g_strdup (identifier), info);
+  priv->n_results++;
+  return TRUE;
+}
+
+static PurpleNotifySearchButton *
+find_continue_button (HazeContactSearchChannel *self)
+{
+  GList *l;
+
+  if (self->priv->handle == NULL)
+    return NULL;
+
+  for (l = self->priv->handle->results->buttons; l != NULL; l = l->next)
+    {
+      PurpleNotifySearchButton *button = l->data;
+
+      if (button->type == PURPLE_NOTIFY_BUTTON_CONTINUE)
+        return button;
+    }
+
+  return NULL;
+}
+
+/* Called once we've been through every row we have been given so far. */
+static void
+page_finished (HazeContactSearchChannel *self,
+               gboolean capped)
+{
+  flush_results (self);
+
+  if (capped)
+    {
+      release_results_later (self);
+      set_state (self, TP_CHANNEL_CONTACT_SEARCH_STATE_COMPLETED, NULL,
+          "reached the result limit; ignoring the rest");
+    }
+  else if (find_continue_button (self) != NULL)
+    {
+      set_state (self, TP_CHANNEL_CONTACT_SEARCH_STATE_MORE_AVAILABLE, NULL,
+          NULL);
+    }
+  else
+    {
+      release_results_later (self);
+      set_state (self, TP_CHANNEL_CONTACT_SEARCH_STATE_COMPLETED, NULL, NULL);
+    }
+}
+
+static gboolean
+stream_rows_cb (gpointer user_data)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (user_data);
+  HazeContactSearchChannelPrivate *priv = self->priv;
+  gboolean capped = FALSE;
+  guint n;
+
+  for (n = 0; priv->next_row != NULL && n < MAX_RESULTS_PER_BATCH; n++)
+    {
+      if (!add_row (self, priv->columns, priv->next_row->data))
+        {
+          capped = TRUE;
+          break;
+        }
+
+      priv->next_row = priv->next_row->next;
+    }
+
+  if (!capped && priv->next_row != NULL)
+    {
+      flush_results (self);
+      return TRUE;
+    }
+
+  priv->stream_id = 0;
+  page_finished (self, capped);
+  return FALSE;
+}
+
+gboolean
+haze_contact_search_channel_is_waiting (HazeContactSearchChannel *self)
+{
+  return (self->priv->state == TP_CHANNEL_CONTACT_SEARCH_STATE_IN_PROGRESS &&
+      self->priv->handle == NULL);
+}
+
+/*
+ * Takes the first page of results for the search we submitted, and returns
+ * the ui_handle libpurple should use for them.
+ */
+gpointer
+haze_contact_search_channel_take_results (HazeContactSearchChannel *self,
+                                          PurpleNotifySearchResults *results,
+                                          gpointer prpl_data)
+{
+  HazeContactSearchChannelPrivate *priv = self->priv;
+  ResultsHandle *handle;
+
+  g_return_val_if_fail (haze_contact_search_channel_is_waiting (self), NULL);
+
+  handle = g_slice_new0 (ResultsHandle);
+  handle->channel = self;
+  handle->results = results;
+  handle->prpl_data = prpl_data;
+  priv->handle = handle;
+
+  cancel_timeout (self);
+
+  priv->columns = dup_column_names (results);
+  priv->next_row = results->rows;
+  priv->stream_id = g_idle_add (stream_rows_cb, self);
+
+  return handle;
+}
+
+void
+haze_contact_search_results_new_rows (gpointer ui_handle,
+                                      PurpleNotifySearchResults *results)
+{
+  ResultsHandle *handle = ui_handle;
+  HazeContactSearchChannel *self = handle->channel;
+  HazeContactSearchChannelPrivate *priv;
+  gboolean capped = FALSE;
+  gchar **columns;
+  GList *row;
+
+  if (self == NULL ||
+      self->priv->state != TP_CHANNEL_CONTACT_SEARCH_STATE_IN_PROGRESS)
+    {
+      DEBUG ("nobody wants these rows any more");
+      return;
+    }
+
+  priv = self->priv;
+  cancel_timeout (self);
+
+  /* These belong to the prpl, which may free them as soon as we return, so
+   * there's no putting them off until later. */
+  columns = dup_column_names (results);
+
+  for (row = results->rows; row != NULL; row = row->next)
+    {
+      if (!add_row (self, columns, row->data))
+        {
+          capped = TRUE;
+          break;
+        }
+
+      if (g_hash_table_size (priv->batch) >= MAX_RESULTS_PER_BATCH)
+        flush_results (self);
+    }
+
+  g_strfreev (columns);
+
+  /* If we're still going through the first page, that will finish it. */
+  if (priv->stream_id == 0)
+    page_finished (self, capped);
+  else
+    flush_results (self);
+}
+
+void
+haze_contact_search_results_free (gpointer ui_handle)
+{
+  ResultsHandle *handle = ui_handle;
+  HazeContactSearchChannel *self = handle->channel;
+
+  if (self != NULL)
+    {
+      handle->channel = NULL;
+      self->priv->handle = NULL;
+      stop_streaming (self);
+
+      if (self->priv->state == TP_CHANNEL_CONTACT_SEARCH_STATE_IN_PROGRESS ||
+          self->priv->state == TP_CHANNEL_CONTACT_SEARCH_STATE_MORE_AVAILABLE)
+        {
+          flush_results (self);
+          stop_search (self, TP_ERROR_STR_CANCELLED,
+              "libpurple withdrew the results");
+        }
+    }
+
+  purple_notify_searchresults_free (handle->results);
+  g_slice_free (ResultsHandle, handle);
+}
+
+static void
+cancel_form (HazeContactSearchChannel *self)
+{
+  gpointer request = self->priv->request;
+
+  if (request == NULL)
+    return;
+
+  self->priv->request = NULL;
+  g_hash_table_remove_all (self->priv->key_fields);
+  haze_request_fields_done (request, FALSE);
+}
+
+/* Called when libpurple closes a request we may be holding. */
+void
+haze_contact_search_channel_forget_request (HazeContactSearchChannel *self,
+                                            gpointer request)
+{
+  if (self->priv->request != request)
+    return;
+
+  self->priv->request = NULL;
+  g_hash_table_remove_all (self->priv->key_fields);
+}
+
+/**
+ * haze_contact_search_channel_search
+ *
+ * Implements D-Bus method Search
+ * on interface org.freedesktop.Telepathy.Channel.Type.ContactSearch
+ */
+static void
+haze_contact_search_channel_search (TpSvcChannelTypeContactSearch *iface,
+                                    GHashTable *terms,
+                                    DBusGMethodInvocation *context)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (iface);
+  HazeContactSearchChannelPrivate *priv = self->priv;
+  GHashTableIter iter;
+  gpointer key, value;
+  gpointer request;
+
+  if (priv->state != TP_CHANNEL_CONTACT_SEARCH_STATE_NOT_STARTED)
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "This channel has already been used for a search" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  if (priv->request == NULL)
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "libpurple has withdrawn the search form" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  if (g_hash_table_size (terms) == 0)
+    {
+      GError e = { TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "No search terms were given" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  g_hash_table_iter_init (&iter, terms);
+
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      if (g_hash_table_lookup (priv->key_fields, key) == NULL)
+        {
+          GError *error = g_error_new (TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+              "'%s' is not one of AvailableSearchKeys", (gchar *) key);
+
+          dbus_g_method_return_error (context, error);
+          g_error_free (error);
+          return;
+        }
+    }
+
+  g_hash_table_iter_init (&iter, terms);
+
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    purple_request_field_string_set_value (
+        g_hash_table_lookup (priv->key_fields, key), value);
+
+  request = priv->request;
+  priv->request = NULL;
+  g_hash_table_remove_all (priv->key_fields);
+
+  set_state (self, TP_CHANNEL_CONTACT_SEARCH_STATE_IN_PROGRESS, NULL, NULL);
+  tp_svc_channel_type_contact_search_return_from_search (context);
+
+  start_timeout (self);
+  haze_request_fields_done (request, TRUE);
+}
+
+/**
+ * haze_contact_search_channel_more
+ *
+ * Implements D-Bus method More
+ * on interface org.freedesktop.Telepathy.Channel.Type.ContactSearch
+ */
+static void
+haze_contact_search_channel_more (TpSvcChannelTypeContactSearch *iface,
+                                  DBusGMethodInvocation *context)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (iface);
+  HazeContactSearchChannelPrivate *priv = self->priv;
+  HazeConnection *conn = HAZE_CONNECTION (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (self)));
+  PurpleNotifySearchButton *button = find_continue_button (self);
+
+  if (priv->state != TP_CHANNEL_CONTACT_SEARCH_STATE_MORE_AVAILABLE ||
+      button == NULL || conn->account->gc == NULL)
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "There are no more results to fetch" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  set_state (self, TP_CHANNEL_CONTACT_SEARCH_STATE_IN_PROGRESS, NULL, NULL);
+  tp_svc_channel_type_contact_search_return_from_more (context);
+
+  start_timeout (self);
+  button->callback (conn->account->gc, NULL, priv->handle->prpl_data);
+}
+
+/**
+ * haze_contact_search_channel_stop
+ *
+ * Implements D-Bus method Stop
+ * on interface org.freedesktop.Telepathy.Channel.Type.ContactSearch
+ */
+static void
+haze_contact_search_channel_stop (TpSvcChannelTypeContactSearch *iface,
+                                  DBusGMethodInvocation *context)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (iface);
+
+  switch (self->priv->state)
+    {
+    case TP_CHANNEL_CONTACT_SEARCH_STATE_NOT_STARTED:
+      {
+        GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+            "The search hasn't started" };
+
+        dbus_g_method_return_error (context, &e);
+        return;
+      }
+    case TP_CHANNEL_CONTACT_SEARCH_STATE_IN_PROGRESS:
+    case TP_CHANNEL_CONTACT_SEARCH_STATE_MORE_AVAILABLE:
+      stop_search (self, TP_ERROR_STR_CANCELLED, "Stop() called");
+      break;
+    default:
+      break;
+    }
+
+  tp_svc_channel_type_contact_search_return_from_stop (context);
+}
+
+static void
+contact_search_iface_init (gpointer g_iface,
+                           gpointer iface_data)
+{
+  TpSvcChannelTypeContactSearchClass *klass = g_iface;
+
+#define IMPLEMENT(x) tp_svc_channel_type_contact_search_implement_##x (\
+    klass, haze_contact_search_channel_##x)
+  IMPLEMENT(search);
+  IMPLEMENT(more);
+  IMPLEMENT(stop);
+#undef IMPLEMENT
+}
+
+static void
+get_contact_search_property (GObject *object,
+                             GQuark iface,
+                             GQuark name,
+                             GValue *value,
+                             gpointer getter_data)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (object);
+  HazeContactSearchChannelPrivate *priv = self->priv;
+  const gchar *prop = g_quark_to_string (name);
+
+  if (!tp_strdiff (prop, "SearchState"))
+    g_value_set_uint (value, priv->state);
+  else if (!tp_strdiff (prop, "Limit"))
+    g_value_set_uint (value, priv->limit);
+  else if (!tp_strdiff (prop, "AvailableSearchKeys"))
+    g_value_set_boxed (value, priv->keys);
+  else if (!tp_strdiff (prop, "Server"))
+    g_value_set_string (value, priv->server != NULL ? priv->server : "");
+  else
+    g_assert_not_reached ();
+}
+
+static void
+haze_contact_search_channel_close (TpBaseChannel *base)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (base);
+
+  cancel_form (self);
+
+  if (self->priv->state == TP_CHANNEL_CONTACT_SEARCH_STATE_IN_PROGRESS ||
+      self->priv->state == TP_CHANNEL_CONTACT_SEARCH_STATE_MORE_AVAILABLE)
+    stop_search (self, TP_ERROR_STR_CANCELLED, "channel closed");
+
+  tp_base_channel_destroyed (base);
+}
+
+static void
+haze_contact_search_channel_fill_immutable_properties (TpBaseChannel *chan,
+    GHashTable *properties)
+{
+  TpBaseChannelClass *cls = TP_BASE_CHANNEL_CLASS (
+      haze_contact_search_channel_parent_class);
+
+  cls->fill_immutable_properties (chan, properties);
+
+  tp_dbus_properties_mixin_fill_properties_hash (
+      G_OBJECT (chan), properties,
+      TP_IFACE_CHANNEL_TYPE_CONTACT_SEARCH, "Limit",
+      TP_IFACE_CHANNEL_TYPE_CONTACT_SEARCH, "AvailableSearchKeys",
+      TP_IFACE_CHANNEL_TYPE_CONTACT_SEARCH, "Server",
+      NULL);
+}
+
+static gchar *
+haze_contact_search_channel_get_object_path_suffix (TpBaseChannel *chan)
+{
+  static guint count = 0;
+
+  return g_strdup_printf ("SearchChannel%u", count++);
+}
+
+static void
+haze_contact_search_channel_init (HazeContactSearchChannel *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      HAZE_TYPE_CONTACT_SEARCH_CHANNEL, HazeContactSearchChannelPrivate);
+
+  self->priv->key_fields = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
+  self->priv->batch = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_ptr_array_unref);
+  self->priv->state = TP_CHANNEL_CONTACT_SEARCH_STATE_NOT_STARTED;
+}
+
+static void
+haze_contact_search_channel_constructed (GObject *obj)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (obj);
+  HazeContactSearchChannelPrivate *priv = self->priv;
+  void (*chain_up) (GObject *) =
+      G_OBJECT_CLASS (haze_contact_search_channel_parent_class)->constructed;
+  GPtrArray *keys = g_ptr_array_new ();
+  GList *groups, *l;
+
+  if (chain_up != NULL)
+    chain_up (obj);
+
+  /* Only free-text fields make sense as search keys. */
+  for (groups = purple_request_fields_get_groups (priv->fields);
+       groups != NULL;
+       groups = groups->next)
+    {
+      for (l = purple_request_field_group_get_fields (groups->data);
+           l != NULL;
+           l = l->next)
+        {
+          PurpleRequestField *field = l->data;
+          const gchar *label = purple_request_field_get_label (field);
+          gchar *key;
+
+          if (purple_request_field_get_type (field) !=
+              PURPLE_REQUEST_FIELD_STRING)
+            continue;
+
+          key = haze_vcard_field_name (label != NULL ? label :
+              purple_request_field_get_id (field));
+
+          if (g_hash_table_lookup (priv->key_fields, key) != NULL)
+            {
+              g_free (key);
+              continue;
+            }
+
+          g_ptr_array_add (keys, g_strdup (key));
+          g_hash_table_insert (priv->key_fields, key, field);
+        }
+    }
+
+  g_ptr_array_add (keys, NULL);
+  priv->keys = (gchar **) g_ptr_array_free (keys, FALSE);
+
+  priv->max_results = get_max_results ();
+
+  if (priv->limit != 0 &&
+      (priv->max_results == 0 || priv->limit < priv->max_results))
+    priv->max_results = priv->limit;
+}
+
+static void
+haze_contact_search_channel_get_property (GObject *object,
+                                          guint property_id,
+                                          GValue *value,
+                                          GParamSpec *pspec)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (object);
+  HazeContactSearchChannelPrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+    case PROP_SERVER:
+      g_value_set_string (value, priv->server);
+      break;
+    case PROP_LIMIT:
+      g_value_set_uint (value, priv->limit);
+      break;
+    case PROP_FIELDS:
+      g_value_set_pointer (value, priv->fields);
+      break;
+    case PROP_REQUEST:
+      g_value_set_pointer (value, priv->request);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+haze_contact_search_channel_set_property (GObject *object,
+                                          guint property_id,
+                                          const GValue *value,
+                                          GParamSpec *pspec)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (object);
+  HazeContactSearchChannelPrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+    case PROP_SERVER:
+      priv->server = g_value_dup_string (value);
+      break;
+    case PROP_LIMIT:
+      priv->limit = g_value_get_uint (value);
+      break;
+    case PROP_FIELDS:
+      priv->fields = g_value_get_pointer (value);
+      break;
+    case PROP_REQUEST:
+      priv->request = g_value_get_pointer (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+haze_contact_search_channel_dispose (GObject *obj)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (obj);
+  HazeContactSearchChannelPrivate *priv = self->priv;
+
+  if (priv->dispose_has_run)
+    return;
+  priv->dispose_has_run = TRUE;
+
+  /* Too late to signal anything. */
+  cancel_form (self);
+  cancel_timeout (self);
+  release_results (self);
+
+  G_OBJECT_CLASS (haze_contact_search_channel_parent_class)->dispose (obj);
+}
+
+static void
+haze_contact_search_channel_finalize (GObject *obj)
+{
+  HazeContactSearchChannel *self = HAZE_CONTACT_SEARCH_CHANNEL (obj);
+  HazeContactSearchChannelPrivate *priv = self->priv;
+
+  g_free (priv->server);
+  g_strfreev (priv->keys);
+  g_hash_table_unref (priv->key_fields);
+  g_hash_table_unref (priv->batch);
+
+  G_OBJECT_CLASS (haze_contact_search_channel_parent_class)->finalize (obj);
+}
+
+static void
+haze_contact_search_channel_class_init (HazeContactSearchChannelClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  TpBaseChannelClass *base_class = TP_BASE_CHANNEL_CLASS (klass);
+  static TpDBusPropertiesMixinPropImpl contact_search_props[] = {
+      { "SearchState", NULL, NULL },
+      { "Limit", NULL, NULL },
+      { "AvailableSearchKeys", NULL, NULL },
+      { "Server", NULL, NULL },
+      { NULL }
+  };
+  GParamSpec *param_spec;
+
+  g_type_class_add_private (klass, sizeof (HazeContactSearchChannelPrivate));
+
+  object_class->constructed = haze_contact_search_channel_constructed;
+  object_class->get_property = haze_contact_search_channel_get_property;
+  object_class->set_property = haze_contact_search_channel_set_property;
+  object_class->dispose = haze_contact_search_channel_dispose;
+  object_class->finalize = haze_contact_search_channel_finalize;
+
+  base_class->channel_type = TP_IFACE_CHANNEL_TYPE_CONTACT_SEARCH;
+  base_class->target_handle_type = TP_HANDLE_TYPE_NONE;
+  base_class->close = haze_contact_search_channel_close;
+  base_class->fill_immutable_properties =
+      haze_contact_search_channel_fill_immutable_properties;
+  base_class->get_object_path_suffix =
+      haze_contact_search_channel_get_object_path_suffix;
+
+  param_spec = g_param_spec_string ("server", "Server",
+      "The directory being searched, or NULL if libpurple chose it",
+      NULL,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_SERVER, param_spec);
+
+  param_spec = g_param_spec_uint ("limit", "Limit",
+      "The most results the client wants, or 0 for no particular limit",
+      0, G_MAXUINT, 0,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_LIMIT, param_spec);
+
+  param_spec = g_param_spec_pointer ("fields", "PurpleRequestFields",
+      "The search form the prpl asked to have filled in",
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_FIELDS, param_spec);
+
+  param_spec = g_param_spec_pointer ("request", "Request",
+      "The request UI's handle for the search form",
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_REQUEST, param_spec);
+
+  tp_dbus_properties_mixin_implement_interface (object_class,
+      TP_IFACE_QUARK_CHANNEL_TYPE_CONTACT_SEARCH, get_contact_search_property,
+      NULL, contact_search_props);
+}
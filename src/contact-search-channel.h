@@ -0,0 +1,83 @@
+#ifndef __HAZE_CONTACT_SEARCH_CHANNEL_H__
+#define __HAZE_CONTACT_SEARCH_CHANNEL_H__
+/*
+ * contact-search-channel.h - HazeContactSearchChannel header
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib-object.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include <libpurple/notify.h>
+#include <libpurple/request.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HazeContactSearchChannel HazeContactSearchChannel;
+typedef struct _HazeContactSearchChannelPrivate
+    HazeContactSearchChannelPrivate;
+typedef struct _HazeContactSearchChannelClass HazeContactSearchChannelClass;
+
+struct _HazeContactSearchChannelClass {
+    TpBaseChannelClass parent_class;
+};
+
+struct _HazeContactSearchChannel {
+    TpBaseChannel parent;
+
+    HazeContactSearchChannelPrivate *priv;
+};
+
+GType haze_contact_search_channel_get_type (void);
+
+/* TYPE MACROS */
+#define HAZE_TYPE_CONTACT_SEARCH_CHANNEL \
+  (haze_contact_search_channel_get_type ())
+#define HAZE_CONTACT_SEARCH_CHANNEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), HAZE_TYPE_CONTACT_SEARCH_CHANNEL, \
+                              HazeContactSearchChannel))
+#define HAZE_CONTACT_SEARCH_CHANNEL_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass), HAZE_TYPE_CONTACT_SEARCH_CHANNEL, \
+                           HazeContactSearchChannelClass))
+#define HAZE_IS_CONTACT_SEARCH_CHANNEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), HAZE_TYPE_CONTACT_SEARCH_CHANNEL))
+#define HAZE_IS_CONTACT_SEARCH_CHANNEL_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass), HAZE_TYPE_CONTACT_SEARCH_CHANNEL))
+#define HAZE_CONTACT_SEARCH_CHANNEL_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), HAZE_TYPE_CONTACT_SEARCH_CHANNEL, \
+                              HazeContactSearchChannelClass))
+
+/* How long a directory server gets to answer each step of a search */
+#define HAZE_CONTACT_SEARCH_TIMEOUT_SECONDS 60
+
+gboolean haze_contact_search_channel_is_waiting (
+    HazeContactSearchChannel *self);
+gpointer haze_contact_search_channel_take_results (
+    HazeContactSearchChannel *self, PurpleNotifySearchResults *results,
+    gpointer prpl_data);
+void haze_contact_search_channel_forget_request (
+    HazeContactSearchChannel *self, gpointer request);
+
+void haze_contact_search_results_new_rows (gpointer handle,
+    PurpleNotifySearchResults *results);
+void haze_contact_search_results_free (gpointer handle);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_CONTACT_SEARCH_CHANNEL_H__*/
@@ -0,0 +1,688 @@
+/*
+ * contact-search-manager.c - HazeContactSearchManager source
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* libpurple has no API for searching a user directory: each prpl has an
+ * account action which asks the user what to search for through the request
+ * API.  So to start a search we run that action, answer its "which
+ * directory?" question with the requested Server, and wait for the search
+ * form; the channel is only announced once the form arrives, since its
+ * fields are the channel's AvailableSearchKeys.
+ *
+ * Some prpls don't say which account a form is for.  A form which arrives
+ * while we're waiting for one goes to the first connection on that account,
+ * or failing that to whichever connection has been waiting longest.
+ */
+
+#include "config.h"
+#include "contact-search-manager.h"
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "connection.h"
+#include "contact-search-channel.h"
+#include "debug.h"
+#include "util.h"
+
+/* prpls' search actions.  Their callbacks are private to the prpls, so all
+ * we can go on is the label, which libpurple translates in its own gettext
+ * domain if the locale is set. */
+typedef struct {
+    const gchar *prpl_id;
+    const gchar *label;
+} SearchAction;
+
+static const SearchAction search_actions[] = {
+    { "prpl-jabber", "Search for Users..." },
+    { "prpl-gg", "Find buddies..." },
+    { NULL, NULL }
+};
+
+/* Returns the untranslated label of @prpl's search action, or NULL. */
+static const gchar *
+get_search_action_label (PurplePlugin *prpl)
+{
+    const gchar *prpl_id = purple_plugin_get_id (prpl);
+    guint i;
+
+    for (i = 0; search_actions[i].prpl_id != NULL; i++)
+    {
+        if (!tp_strdiff (prpl_id, search_actions[i].prpl_id))
+            return search_actions[i].label;
+    }
+
+    return NULL;
+}
+
+struct _HazeContactSearchManagerPrivate {
+    HazeConnection *conn;
+    /* prpls can't tell us which search their results are for, so there's
+     * only one at a time */
+    HazeContactSearchChannel *channel;
+    /* a request waiting for the prpl's search form, and what it asked for */
+    gpointer request_token;
+    gchar *server;
+    guint limit;
+    guint timeout_id;
+    gulong status_changed_id;
+    gboolean dispose_has_run;
+};
+
+/* every manager, oldest first */
+static GList *managers = NULL;
+/* the manager running a prpl's search action right now, if any */
+static HazeContactSearchManager *starting = NULL;
+
+static void channel_manager_iface_init (gpointer, gpointer);
+
+G_DEFINE_TYPE_WITH_CODE(HazeContactSearchManager,
+    haze_contact_search_manager,
+    G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (TP_TYPE_CHANNEL_MANAGER,
+      channel_manager_iface_init))
+
+/* properties: */
+enum {
+    PROP_CONNECTION = 1,
+
+    LAST_PROPERTY
+};
+
+static void close_all (HazeContactSearchManager *self);
+
+static void
+haze_contact_search_manager_init (HazeContactSearchManager *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+        HAZE_TYPE_CONTACT_SEARCH_MANAGER, HazeContactSearchManagerPrivate);
+
+    self->priv->conn = NULL;
+    self->priv->channel = NULL;
+    self->priv->dispose_has_run = FALSE;
+}
+
+static void
+haze_contact_search_manager_dispose (GObject *object)
+{
+    HazeContactSearchManager *self = HAZE_CONTACT_SEARCH_MANAGER (object);
+
+    if (self->priv->dispose_has_run)
+        return;
+
+    self->priv->dispose_has_run = TRUE;
+
+    close_all (self);
+    managers = g_list_remove (managers, self);
+
+    if (G_OBJECT_CLASS (haze_contact_search_manager_parent_class)->dispose)
+        G_OBJECT_CLASS (haze_contact_search_manager_parent_class)->dispose (
+            object);
+}
+
+static void
+haze_contact_search_manager_get_property (GObject *object,
+                                          guint property_id,
+                                          GValue *value,
+                                          GParamSpec *pspec)
+{
+    HazeContactSearchManager *self = HAZE_CONTACT_SEARCH_MANAGER (object);
+
+    switch (property_id) {
+        case PROP_CONNECTION:
+            g_value_set_object (value, self->priv->conn);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+haze_contact_search_manager_set_property (GObject *object,
+                                          guint property_id,
+                                          const GValue *value,
+                                          GParamSpec *pspec)
+{
+    HazeContactSearchManager *self = HAZE_CONTACT_SEARCH_MANAGER (object);
+
+    switch (property_id) {
+        case PROP_CONNECTION:
+            self->priv->conn = g_value_get_object (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+status_changed_cb (HazeConnection *conn,
+                   guint status,
+                   guint reason,
+                   HazeContactSearchManager *self)
+{
+    if (status == TP_CONNECTION_STATUS_DISCONNECTED)
+        close_all (self);
+}
+
+static void
+haze_contact_search_manager_constructed (GObject *object)
+{
+    HazeContactSearchManager *self = HAZE_CONTACT_SEARCH_MANAGER (object);
+    void (*constructed) (GObject *) = ((GObjectClass *)
+        haze_contact_search_manager_parent_class)->constructed;
+
+    if (constructed != NULL)
+    {
+        constructed (object);
+    }
+
+    self->priv->status_changed_id = g_signal_connect (self->priv->conn,
+        "status-changed", (GCallback) status_changed_cb, self);
+
+    managers = g_list_append (managers, self);
+}
+
+static void
+haze_contact_search_manager_class_init (HazeContactSearchManagerClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GParamSpec *param_spec;
+
+    object_class->constructed = haze_contact_search_manager_constructed;
+    object_class->dispose = haze_contact_search_manager_dispose;
+    object_class->get_property = haze_contact_search_manager_get_property;
+    object_class->set_property = haze_contact_search_manager_set_property;
+
+    param_spec = g_param_spec_object ("connection", "HazeConnection object",
+                                      "Haze connection object that owns this "
+                                      "contact search manager object.",
+                                      HAZE_TYPE_CONNECTION,
+                                      G_PARAM_CONSTRUCT_ONLY |
+                                      G_PARAM_READWRITE |
+                                      G_PARAM_STATIC_NICK |
+                                      G_PARAM_STATIC_BLURB);
+    g_object_class_install_property (object_class, PROP_CONNECTION, param_spec);
+
+    g_type_class_add_private (object_class,
+                              sizeof(HazeContactSearchManagerPrivate));
+}
+
+static void
+forget_pending_request (HazeContactSearchManager *self)
+{
+    HazeContactSearchManagerPrivate *priv = self->priv;
+
+    if (priv->timeout_id != 0)
+    {
+        g_source_remove (priv->timeout_id);
+        priv->timeout_id = 0;
+    }
+
+    priv->request_token = NULL;
+    g_free (priv->server);
+    priv->server = NULL;
+}
+
+static void
+fail_pending_request (HazeContactSearchManager *self,
+                      gint code,
+                      const gchar *message)
+{
+    gpointer request_token = self->priv->request_token;
+
+    forget_pending_request (self);
+    tp_channel_manager_emit_request_failed (self, request_token,
+        TP_ERROR, code, message);
+}
+
+static gboolean
+form_timeout_cb (gpointer user_data)
+{
+    HazeContactSearchManager *self = HAZE_CONTACT_SEARCH_MANAGER (user_data);
+
+    self->priv->timeout_id = 0;
+    fail_pending_request (self, TP_ERROR_NETWORK_ERROR,
+        "The directory didn't send a search form in time");
+    return FALSE;
+}
+
+static void
+contact_search_channel_closed_cb (HazeContactSearchChannel *chan,
+                                  gpointer user_data)
+{
+    HazeContactSearchManager *self = HAZE_CONTACT_SEARCH_MANAGER (user_data);
+
+    tp_channel_manager_emit_channel_closed_for_object (self,
+        TP_EXPORTABLE_CHANNEL (chan));
+
+    if (self->priv->channel == chan)
+    {
+        DEBUG ("contact search channel closed");
+        tp_clear_object (&self->priv->channel);
+    }
+}
+
+static void
+close_all (HazeContactSearchManager *self)
+{
+    /* The connection fails any outstanding requests itself. */
+    forget_pending_request (self);
+    tp_clear_object (&self->priv->channel);
+
+    if (self->priv->status_changed_id != 0)
+    {
+        g_signal_handler_disconnect (self->priv->conn,
+            self->priv->status_changed_id);
+        self->priv->status_changed_id = 0;
+    }
+}
+
+static void
+haze_contact_search_manager_foreach (TpChannelManager *iface,
+                                     TpExportableChannelFunc foreach,
+                                     gpointer user_data)
+{
+    HazeContactSearchManager *self = HAZE_CONTACT_SEARCH_MANAGER (iface);
+
+    if (self->priv->channel != NULL)
+        foreach (TP_EXPORTABLE_CHANNEL (self->priv->channel), user_data);
+}
+
+/* Returns the prpl's search action, with its context filled in, or NULL. */
+static PurplePluginAction *
+dup_search_action (HazeContactSearchManager *self)
+{
+    PurpleConnection *gc = self->priv->conn->account->gc;
+    PurplePluginAction *found = NULL;
+    const gchar *label, *translated;
+    GList *actions, *l;
+
+    if (gc == NULL || !PURPLE_PLUGIN_HAS_ACTIONS (gc->prpl))
+        return NULL;
+
+    label = get_search_action_label (gc->prpl);
+
+    if (label == NULL)
+        return NULL;
+
+    translated = g_dgettext (PURPLE_GETTEXT_DOMAIN, label);
+    actions = PURPLE_PLUGIN_ACTIONS (gc->prpl, gc);
+
+    for (l = actions; l != NULL; l = l->next)
+    {
+        PurplePluginAction *action = l->data;
+
+        /* separators are NULL */
+        if (action == NULL)
+            continue;
+
+        if (found == NULL && (!tp_strdiff (action->label, translated) ||
+                !tp_strdiff (action->label, label)))
+        {
+            found = action;
+            found->plugin = gc->prpl;
+            found->context = gc;
+        }
+        else
+        {
+            purple_plugin_action_free (action);
+        }
+    }
+
+    g_list_free (actions);
+    return found;
+}
+
+static const gchar * const fixed_properties[] = {
+    TP_IFACE_CHANNEL ".ChannelType",
+    TP_IFACE_CHANNEL ".TargetHandleType",
+    NULL
+};
+static const gchar * const allowed_properties[] = {
+    TP_PROP_CHANNEL_TYPE_CONTACT_SEARCH_SERVER,
+    TP_PROP_CHANNEL_TYPE_CONTACT_SEARCH_LIMIT,
+    NULL
+};
+
+static void
+haze_contact_search_manager_foreach_channel_class (TpChannelManager *manager,
+    TpChannelManagerChannelClassFunc func,
+    gpointer user_data)
+{
+    HazeContactSearchManager *self = HAZE_CONTACT_SEARCH_MANAGER (manager);
+    PurplePluginAction *action = dup_search_action (self);
+    GHashTable *table;
+    GValue *value;
+
+    if (action == NULL)
+        return;
+
+    purple_plugin_action_free (action);
+
+    table = g_hash_table_new_full (g_str_hash, g_str_equal,
+        NULL, (GDestroyNotify) tp_g_value_slice_free);
+
+    value = tp_g_value_slice_new (G_TYPE_STRING);
+    g_value_set_static_string (value, TP_IFACE_CHANNEL_TYPE_CONTACT_SEARCH);
+    g_hash_table_insert (table, TP_IFACE_CHANNEL ".ChannelType", value);
+
+    value = tp_g_value_slice_new (G_TYPE_UINT);
+    g_value_set_uint (value, TP_HANDLE_TYPE_NONE);
+    g_hash_table_insert (table, TP_IFACE_CHANNEL ".TargetHandleType", value);
+
+    func (manager, table, allowed_properties, user_data);
+
+    g_hash_table_destroy (table);
+}
+
+static gboolean
+haze_contact_search_manager_request (HazeContactSearchManager *self,
+                                     gpointer request_token,
+                                     GHashTable *request_properties)
+{
+    HazeContactSearchManagerPrivate *priv = self->priv;
+    PurplePluginAction *action;
+    GError *error = NULL;
+
+    if (tp_strdiff (tp_asv_get_string (request_properties,
+            TP_IFACE_CHANNEL ".ChannelType"),
+        TP_IFACE_CHANNEL_TYPE_CONTACT_SEARCH))
+    {
+        return FALSE;
+    }
+
+    if (tp_asv_get_uint32 (request_properties,
+        TP_IFACE_CHANNEL ".TargetHandleType", NULL) != TP_HANDLE_TYPE_NONE)
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+            "ContactSearch channels can't have a target handle");
+        goto error;
+    }
+
+    if (tp_channel_manager_asv_has_unknown_properties (request_properties,
+          fixed_properties, allowed_properties, &error))
+    {
+        goto error;
+    }
+
+    if (priv->channel != NULL || priv->request_token != NULL)
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+            "Only one contact search at a time is supported");
+        goto error;
+    }
+
+    action = dup_search_action (self);
+
+    if (action == NULL)
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+            "This protocol has no user directory to search");
+        goto error;
+    }
+
+    priv->request_token = request_token;
+    priv->server = g_strdup (tp_asv_get_string (request_properties,
+        TP_PROP_CHANNEL_TYPE_CONTACT_SEARCH_SERVER));
+    priv->limit = tp_asv_get_uint32 (request_properties,
+        TP_PROP_CHANNEL_TYPE_CONTACT_SEARCH_LIMIT, NULL);
+    priv->timeout_id = g_timeout_add_seconds (
+        HAZE_CONTACT_SEARCH_TIMEOUT_SECONDS, form_timeout_cb, self);
+
+    DEBUG ("starting a search with '%s'", action->label);
+
+    starting = self;
+    action->callback (action);
+    starting = NULL;
+
+    purple_plugin_action_free (action);
+    return TRUE;
+
+error:
+    tp_channel_manager_emit_request_failed (self, request_token,
+        error->domain, error->code, error->message);
+    g_error_free (error);
+    return TRUE;
+}
+
+static gboolean
+haze_contact_search_manager_create_channel (TpChannelManager *manager,
+                                            gpointer request_token,
+                                            GHashTable *request_properties)
+{
+    return haze_contact_search_manager_request (
+        HAZE_CONTACT_SEARCH_MANAGER (manager), request_token,
+        request_properties);
+}
+
+static void
+channel_manager_iface_init (gpointer g_iface,
+                            gpointer iface_data G_GNUC_UNUSED)
+{
+    TpChannelManagerIface *iface = g_iface;
+
+    iface->foreach_channel = haze_contact_search_manager_foreach;
+    iface->foreach_channel_class =
+        haze_contact_search_manager_foreach_channel_class;
+    /* Nobody else can use a search, so there's no sense in ensuring one. */
+    iface->create_channel = haze_contact_search_manager_create_channel;
+    iface->ensure_channel = haze_contact_search_manager_create_channel;
+    iface->request_channel = haze_contact_search_manager_create_channel;
+}
+
+/*
+ * Called with the prpl's "which directory?" question, if it asks one.
+ */
+gboolean
+haze_contact_search_manager_take_input (const gchar *default_value,
+                                        PurpleRequestInputCb ok_cb,
+                                        gpointer user_data)
+{
+    HazeContactSearchManagerPrivate *priv;
+    gchar *server;
+
+    if (starting == NULL || starting->priv->request_token == NULL)
+        return FALSE;
+
+    priv = starting->priv;
+
+    if (!tp_str_empty (priv->server))
+        server = g_strdup (priv->server);
+    else
+        server = g_strdup (default_value);
+
+    if (tp_str_empty (server))
+    {
+        g_free (server);
+        fail_pending_request (starting, TP_ERROR_INVALID_ARGUMENT,
+            "No user directory is known for this account; "
+            "please give a Server");
+        return TRUE;
+    }
+
+    g_free (priv->server);
+    priv->server = server;
+
+    DEBUG ("searching %s", server);
+
+    if (ok_cb != NULL)
+        ok_cb (user_data, server);
+
+    return TRUE;
+}
+
+static gboolean
+form_has_text_fields (PurpleRequestFields *fields)
+{
+    GList *groups, *l;
+
+    for (groups = purple_request_fields_get_groups (fields);
+         groups != NULL;
+         groups = groups->next)
+    {
+        for (l = purple_request_field_group_get_fields (groups->data);
+             l != NULL;
+             l = l->next)
+        {
+            if (purple_request_field_get_type (l->data) ==
+                PURPLE_REQUEST_FIELD_STRING)
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Called with every fields request other than a password prompt; returns
+ * TRUE if it's a search form we were waiting for, in which case it's ours
+ * until we call haze_request_fields_done() on @request.
+ */
+gboolean
+haze_contact_search_manager_take_fields (PurpleAccount *account,
+                                         PurpleRequestFields *fields,
+                                         gpointer request)
+{
+    HazeContactSearchManager *self = NULL;
+    HazeContactSearchManagerPrivate *priv;
+    TpBaseConnection *base_conn;
+    GSList *requests;
+    GList *l;
+
+    if (starting != NULL)
+    {
+        self = starting;
+    }
+    else
+    {
+        for (l = managers; l != NULL; l = l->next)
+        {
+            HazeContactSearchManager *manager = l->data;
+
+            if (manager->priv->request_token == NULL)
+                continue;
+
+            if (manager->priv->conn->account == account)
+            {
+                self = manager;
+                break;
+            }
+
+            if (account == NULL && self == NULL)
+                self = manager;
+        }
+    }
+
+    if (self == NULL || self->priv->request_token == NULL)
+        return FALSE;
+
+    priv = self->priv;
+
+    if (!form_has_text_fields (fields))
+    {
+        fail_pending_request (self, TP_ERROR_NOT_IMPLEMENTED,
+            "The directory's search form has nothing to type into");
+        return FALSE;
+    }
+
+    base_conn = TP_BASE_CONNECTION (priv->conn);
+    priv->channel = g_object_new (HAZE_TYPE_CONTACT_SEARCH_CHANNEL,
+        "connection", priv->conn,
+        "initiator-handle", tp_base_connection_get_self_handle (base_conn),
+        "requested", TRUE,
+        "server", priv->server,
+        "limit", priv->limit,
+        "fields", fields,
+        "request", request,
+        NULL);
+    tp_base_channel_register (TP_BASE_CHANNEL (priv->channel));
+
+    g_signal_connect (priv->channel, "closed",
+        G_CALLBACK (contact_search_channel_closed_cb), self);
+
+    requests = g_slist_prepend (NULL, priv->request_token);
+    forget_pending_request (self);
+    tp_channel_manager_emit_new_channel (self,
+        TP_EXPORTABLE_CHANNEL (priv->channel), requests);
+    g_slist_free (requests);
+
+    return TRUE;
+}
+
+/*
+ * Called when libpurple closes a fields request we took.
+ */
+void
+haze_contact_search_manager_forget_request (gpointer request)
+{
+    GList *l;
+
+    for (l = managers; l != NULL; l = l->next)
+    {
+        HazeContactSearchManager *manager = l->data;
+
+        if (manager->priv->channel != NULL)
+            haze_contact_search_channel_forget_request (
+                manager->priv->channel, request);
+    }
+}
+
+gpointer
+haze_contact_search_notify_results (PurpleConnection *gc,
+                                    const char *title,
+                                    const char *primary,
+                                    const char *secondary,
+                                    PurpleNotifySearchResults *results,
+                                    gpointer user_data)
+{
+    PurpleAccount *account = purple_connection_get_account (gc);
+    HazeContactSearchManager *self;
+
+    if (account->ui_data != NULL)
+    {
+        self = ACCOUNT_GET_HAZE_CONNECTION (account)->contact_search_manager;
+
+        if (self->priv->channel != NULL &&
+            haze_contact_search_channel_is_waiting (self->priv->channel))
+        {
+            return haze_contact_search_channel_take_results (
+                self->priv->channel, results, user_data);
+        }
+    }
+
+    DEBUG ("nobody is searching; dropping results");
+    purple_notify_searchresults_free (results);
+    return NULL;
+}
+
+void
+haze_contact_search_notify_new_rows (PurpleConnection *gc,
+                                     PurpleNotifySearchResults *results,
+                                     gpointer data)
+{
+    if (data != NULL)
+        haze_contact_search_results_new_rows (data, results);
+}
+
+void
+haze_contact_search_close_results (gpointer ui_handle)
+{
+    haze_contact_search_results_free (ui_handle);
+}
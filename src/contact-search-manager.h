@@ -0,0 +1,80 @@
+#ifndef __HAZE_CONTACT_SEARCH_MANAGER_H__
+#define __HAZE_CONTACT_SEARCH_MANAGER_H__
+/*
+ * contact-search-manager.h - HazeContactSearchManager header
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *
+ */
+
+#include <glib-object.h>
+
+#include <libpurple/notify.h>
+#include <libpurple/request.h>
+
+G_BEGIN_DECLS
+
+#define HAZE_TYPE_CONTACT_SEARCH_MANAGER \
+    (haze_contact_search_manager_get_type())
+#define HAZE_CONTACT_SEARCH_MANAGER(obj) \
+    (G_TYPE_CHECK_INSTANCE_CAST((obj), HAZE_TYPE_CONTACT_SEARCH_MANAGER, \
+                                HazeContactSearchManager))
+#define HAZE_CONTACT_SEARCH_MANAGER_CLASS(klass) \
+    (G_TYPE_CHECK_CLASS_CAST((klass), HAZE_TYPE_CONTACT_SEARCH_MANAGER, \
+                             HazeContactSearchManagerClass))
+#define HAZE_IS_CONTACT_SEARCH_MANAGER(obj) \
+    (G_TYPE_CHECK_INSTANCE_TYPE((obj), HAZE_TYPE_CONTACT_SEARCH_MANAGER))
+#define HAZE_IS_CONTACT_SEARCH_MANAGER_CLASS(klass) \
+    (G_TYPE_CHECK_CLASS_TYPE((klass), HAZE_TYPE_CONTACT_SEARCH_MANAGER))
+#define HAZE_CONTACT_SEARCH_MANAGER_GET_CLASS(obj) \
+    (G_TYPE_INSTANCE_GET_CLASS((obj), HAZE_TYPE_CONTACT_SEARCH_MANAGER, \
+                               HazeContactSearchManagerClass))
+
+typedef struct _HazeContactSearchManager      HazeContactSearchManager;
+typedef struct _HazeContactSearchManagerClass HazeContactSearchManagerClass;
+typedef struct _HazeContactSearchManagerPrivate
+    HazeContactSearchManagerPrivate;
+
+struct _HazeContactSearchManager {
+    GObject parent;
+    HazeContactSearchManagerPrivate *priv;
+};
+
+struct _HazeContactSearchManagerClass {
+    GObjectClass parent_class;
+};
+
+GType haze_contact_search_manager_get_type (void) G_GNUC_CONST;
+
+/* request UI hooks */
+gboolean haze_contact_search_manager_take_input (const gchar *default_value,
+    PurpleRequestInputCb ok_cb, gpointer user_data);
+gboolean haze_contact_search_manager_take_fields (PurpleAccount *account,
+    PurpleRequestFields *fields, gpointer request);
+void haze_contact_search_manager_forget_request (gpointer request);
+
+/* notify UI hooks */
+gpointer haze_contact_search_notify_results (PurpleConnection *gc,
+    const char *title, const char *primary, const char *secondary,
+    PurpleNotifySearchResults *results, gpointer user_data);
+void haze_contact_search_notify_new_rows (PurpleConnection *gc,
+    PurpleNotifySearchResults *results, gpointer data);
+void haze_contact_search_close_results (gpointer ui_handle);
+
+G_END_DECLS
+
+#endif /* __HAZE_CONTACT_SEARCH_MANAGER_H__ */
@@ -0,0 +1,1565 @@
+/*
+ * ft-channel.c - HazeFtChannel source
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* A FileTransfer channel for a PurpleXfer.  The client reads or writes the
+ * file through a Unix socket of ours, which libpurple never sees: with the
+ * ui_read and ui_write hooks, libpurple hands us each chunk it receives and
+ * asks us for each chunk it sends, and we keep those chunks in a ring buffer
+ * of fixed size.  libpurple only moves a chunk when we say we're ready for
+ * it, so a slow client holds back the prpl and vice versa, rather than the
+ * file piling up in memory.
+ *
+ * Many prpls do no framing of their own, and just read and write the file on
+ * xfer->fd.  Once libpurple has moved a chunk over that socket, so we know
+ * it is connected, and the ring buffer is empty, we take the socket over
+ * and splice() the rest of the file between it and the client's socket
+ * through a pipe, so that the data never passes through userspace.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for splice() */
+#endif
+
+#include <config.h>
+#include "ft-channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <gio/gio.h>
+#include <dbus/dbus-glib.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include <libpurple/eventloop.h>
+
+#include "connection.h"
+#include "debug.h"
+#include "util.h"
+
+/* libpurple's FT_MAX_BUFFER_SIZE: the most it reads from a prpl at once */
+#define PURPLE_MAX_CHUNK 65535
+#define DEFAULT_BUFFER_KB 256
+/* How much to splice before letting other sources run */
+#define MAX_SPLICE_PER_ITERATION (1024 * 1024)
+/* TransferredBytesChanged is emitted at most this often */
+#define PROGRESS_INTERVAL_MS 1000
+
+typedef struct {
+  guchar *data;
+  gsize size;
+  /* the offset of the first byte held, and how many are held */
+  gsize start;
+  gsize len;
+} RingBuffer;
+
+struct _HazeFtChannelPrivate
+{
+  /* a reference, and ours is its ui_data */
+  PurpleXfer *xfer;
+  TpFileTransferState state;
+  gchar *content_type;
+  gchar *filename;
+  gchar *description;
+  guint64 size;
+  guint64 date;
+
+  /* what TransferredBytesChanged last said, and the timeout which will say
+   * the next value */
+  guint64 transferred;
+  guint progress_id;
+  /* bytes written to the client when receiving, or read from it when
+   * sending */
+  guint64 delivered;
+
+  /* where the client connects, until it has */
+  gchar *socket_dir;
+  gint listen_fd;
+  guint listen_watch;
+  gboolean socket_offered;
+  gint client_fd;
+  guint client_watch;
+  PurpleInputCondition client_cond;
+
+  RingBuffer ring;
+  /* libpurple has started the transfer; it has moved data over the prpl's
+   * socket; it has finished */
+  gboolean started;
+  gboolean prpl_live;
+  gboolean prpl_done;
+  guint pump_id;
+
+  /* once we've taken the prpl's socket over */
+  gboolean splicing;
+  gint pipe_fds[2];
+  gsize in_pipe;
+  /* libpurple's count of bytes moved when we took over, and how many we've
+   * moved since */
+  guint64 splice_base;
+  guint64 spliced;
+  guint prpl_watch;
+  PurpleInputCondition prpl_cond;
+
+  gboolean dispose_has_run;
+};
+
+enum
+{
+  PROP_XFER = 1,
+  PROP_CONTENT_TYPE,
+  PROP_FILENAME,
+  PROP_SIZE,
+  PROP_DESCRIPTION,
+  PROP_DATE,
+};
+
+static void file_transfer_iface_init (gpointer g_iface, gpointer iface_data);
+
+G_DEFINE_TYPE_WITH_CODE (HazeFtChannel, haze_ft_channel, TP_TYPE_BASE_CHANNEL,
+    G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_TYPE_FILE_TRANSFER,
+        file_transfer_iface_init))
+
+static void pump (HazeFtChannel *self);
+static void splice_some (HazeFtChannel *self);
+
+static gsize
+get_buffer_size (void)
+{
+  static guint buffer_kb = G_MAXUINT;
+
+  if (buffer_kb == G_MAXUINT)
+    buffer_kb = haze_get_tunable ("HAZE_FT_BUFFER_KB", DEFAULT_BUFFER_KB);
+
+  /* It must have room for one of libpurple's chunks while holding another. */
+  return MAX ((gsize) buffer_kb * 1024, 2 * PURPLE_MAX_CHUNK);
+}
+
+static void
+ring_ensure (RingBuffer *ring)
+{
+  if (ring->data != NULL)
+    return;
+
+  ring->size = get_buffer_size ();
+  ring->data = g_malloc (ring->size);
+  ring->start = 0;
+  ring->len = 0;
+}
+
+static void
+ring_clear (RingBuffer *ring)
+{
+  g_free (ring->data);
+  memset (ring, 0, sizeof (RingBuffer));
+}
+
+static gsize
+ring_space (const RingBuffer *ring)
+{
+  return ring->size - ring->len;
+}
+
+/* Points @iov at up to @max of the bytes held if @filled, or of the free
+ * space otherwise, and returns how many of its two elements it used. */
+static guint
+ring_get_iov (const RingBuffer *ring,
+              struct iovec iov[2],
+              gboolean filled,
+              gsize max)
+{
+  gsize offset, len, first;
+
+  if (filled)
+    {
+      offset = ring->start;
+      len = ring->len;
+    }
+  else
+    {
+      offset = (ring->start + ring->len) % MAX (ring->size, 1);
+      len = ring_space (ring);
+    }
+
+  len = MIN (len, max);
+
+  if (len == 0)
+    return 0;
+
+  first = MIN (len, ring->size - offset);
+  iov[0].iov_base = ring->data + offset;
+  iov[0].iov_len = first;
+
+  if (first == len)
+    return 1;
+
+  iov[1].iov_base = ring->data;
+  iov[1].iov_len = len - first;
+  return 2;
+}
+
+static void
+ring_produced (RingBuffer *ring,
+               gsize n)
+{
+  g_assert (n <= ring_space (ring));
+  ring->len += n;
+}
+
+static void
+ring_consumed (RingBuffer *ring,
+               gsize n)
+{
+  g_assert (n <= ring->len);
+  ring->start = (ring->start + n) % ring->size;
+  ring->len -= n;
+}
+
+/* Puts back the last @n bytes consumed, which are still where they were. */
+static void
+ring_unconsume (RingBuffer *ring,
+                gsize n)
+{
+  g_assert (n <= ring_space (ring));
+  ring->start = (ring->start + ring->size - n) % ring->size;
+  ring->len += n;
+}
+
+static void
+ring_copy (RingBuffer *ring,
+           guchar *buffer,
+           gsize n,
+           gboolean in)
+{
+  struct iovec iov[2];
+  guint n_iov = ring_get_iov (ring, iov, !in, n);
+  guint i;
+
+  for (i = 0; i < n_iov; i++)
+    {
+      if (in)
+        memcpy (iov[i].iov_base, buffer, iov[i].iov_len);
+      else
+        memcpy (buffer, iov[i].iov_base, iov[i].iov_len);
+
+      buffer += iov[i].iov_len;
+    }
+
+  if (in)
+    ring_produced (ring, n);
+  else
+    ring_consumed (ring, n);
+}
+
+static void
+set_nonblocking (gint fd)
+{
+  gint flags = fcntl (fd, F_GETFL);
+
+  if (flags >= 0)
+    fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void
+set_watch (gint fd,
+           guint *watch,
+           PurpleInputCondition *current,
+           PurpleInputCondition cond,
+           PurpleInputFunction func,
+           gpointer data)
+{
+  if (*watch != 0 && *current == cond)
+    return;
+
+  if (*watch != 0)
+    {
+      purple_input_remove (*watch);
+      *watch = 0;
+    }
+
+  *current = cond;
+
+  if (cond != 0)
+    *watch = purple_input_add (fd, cond, func, data);
+}
+
+static gboolean
+is_incoming (HazeFtChannel *self)
+{
+  return !tp_base_channel_is_requested (TP_BASE_CHANNEL (self));
+}
+
+static gboolean
+transfer_is_over (HazeFtChannel *self)
+{
+  return (self->priv->state == TP_FILE_TRANSFER_STATE_COMPLETED ||
+      self->priv->state == TP_FILE_TRANSFER_STATE_CANCELLED);
+}
+
+static void
+set_state (HazeFtChannel *self,
+           TpFileTransferState state,
+           TpFileTransferStateChangeReason reason)
+{
+  if (self->priv->state == state)
+    return;
+
+  DEBUG ("%s: state %u -> %u (reason %u)", self->priv->filename,
+      self->priv->state, state, reason);
+  self->priv->state = state;
+  tp_svc_channel_type_file_transfer_emit_file_transfer_state_changed (self,
+      state, reason);
+}
+
+static guint64
+count_transferred (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+
+  if (is_incoming (self) || priv->xfer == NULL)
+    return priv->delivered;
+
+  return purple_xfer_get_bytes_sent (priv->xfer);
+}
+
+static void
+emit_progress (HazeFtChannel *self)
+{
+  guint64 transferred = count_transferred (self);
+
+  if (transferred == self->priv->transferred)
+    return;
+
+  self->priv->transferred = transferred;
+  tp_svc_channel_type_file_transfer_emit_transferred_bytes_changed (self,
+      transferred);
+}
+
+static gboolean
+emit_progress_cb (gpointer data)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (data);
+
+  self->priv->progress_id = 0;
+  emit_progress (self);
+  return FALSE;
+}
+
+static void
+progress_made (HazeFtChannel *self)
+{
+  if (self->priv->progress_id == 0)
+    self->priv->progress_id = g_timeout_add (PROGRESS_INTERVAL_MS,
+        emit_progress_cb, self);
+}
+
+static void
+close_listener (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+
+  if (priv->listen_watch != 0)
+    {
+      purple_input_remove (priv->listen_watch);
+      priv->listen_watch = 0;
+    }
+
+  if (priv->listen_fd >= 0)
+    {
+      close (priv->listen_fd);
+      priv->listen_fd = -1;
+    }
+
+  if (priv->socket_dir != NULL)
+    {
+      haze_remove_directory (priv->socket_dir);
+      g_free (priv->socket_dir);
+      priv->socket_dir = NULL;
+    }
+}
+
+/* Stops moving data, and closes the client's socket. */
+static void
+stop_io (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+
+  close_listener (self);
+
+  set_watch (priv->client_fd, &priv->client_watch, &priv->client_cond, 0,
+      NULL, NULL);
+  set_watch (-1, &priv->prpl_watch, &priv->prpl_cond, 0, NULL, NULL);
+
+  if (priv->client_fd >= 0)
+    {
+      close (priv->client_fd);
+      priv->client_fd = -1;
+    }
+
+  if (priv->pipe_fds[0] >= 0)
+    {
+      close (priv->pipe_fds[0]);
+      close (priv->pipe_fds[1]);
+      priv->pipe_fds[0] = priv->pipe_fds[1] = -1;
+    }
+
+  priv->splicing = FALSE;
+
+  if (priv->pump_id != 0)
+    {
+      g_source_remove (priv->pump_id);
+      priv->pump_id = 0;
+    }
+
+  if (priv->progress_id != 0)
+    {
+      g_source_remove (priv->progress_id);
+      priv->progress_id = 0;
+    }
+
+  ring_clear (&priv->ring);
+}
+
+static void
+transfer_completed (HazeFtChannel *self)
+{
+  if (transfer_is_over (self))
+    return;
+
+  stop_io (self);
+  emit_progress (self);
+  set_state (self, TP_FILE_TRANSFER_STATE_COMPLETED,
+      TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
+}
+
+/* Gives up on the transfer for our own reasons, or the client's. */
+static void
+cancel_transfer (HazeFtChannel *self,
+                 TpFileTransferStateChangeReason reason)
+{
+  PurpleXfer *xfer = self->priv->xfer;
+
+  if (transfer_is_over (self))
+    return;
+
+  /* before libpurple calls us back about it */
+  stop_io (self);
+  set_state (self, TP_FILE_TRANSFER_STATE_CANCELLED, reason);
+
+  if (xfer != NULL && !purple_xfer_is_completed (xfer) &&
+      !purple_xfer_is_canceled (xfer))
+    purple_xfer_cancel_local (xfer);
+}
+
+static void
+maybe_open (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+
+  if (priv->started && priv->client_fd >= 0 &&
+      priv->state == TP_FILE_TRANSFER_STATE_ACCEPTED)
+    set_state (self, TP_FILE_TRANSFER_STATE_OPEN,
+        TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
+}
+
+static gboolean
+pump_cb (gpointer data)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (data);
+
+  self->priv->pump_id = 0;
+  pump (self);
+  return FALSE;
+}
+
+static void
+schedule_pump (HazeFtChannel *self)
+{
+  if (self->priv->pump_id == 0 && !transfer_is_over (self))
+    self->priv->pump_id = g_idle_add (pump_cb, self);
+}
+
+/* How many more bytes the client has to give us when sending */
+static guint64
+wanted_from_client (HazeFtChannel *self)
+{
+  return self->priv->size - MIN (self->priv->size, self->priv->delivered);
+}
+
+static void client_io_cb (gpointer data, gint fd, PurpleInputCondition cond);
+
+static void
+update_client_watch (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+  PurpleInputCondition cond = 0;
+
+  if (priv->client_fd < 0 || priv->splicing)
+    return;
+
+  if (is_incoming (self))
+    {
+      if (priv->ring.len > 0)
+        cond = PURPLE_INPUT_WRITE;
+    }
+  else if (wanted_from_client (self) > 0 && ring_space (&priv->ring) > 0)
+    {
+      cond = PURPLE_INPUT_READ;
+    }
+
+  set_watch (priv->client_fd, &priv->client_watch, &priv->client_cond, cond,
+      client_io_cb, self);
+}
+
+#ifdef HAVE_SPLICE
+static void
+prpl_io_cb (gpointer data,
+            gint fd,
+            PurpleInputCondition cond)
+{
+  splice_some (HAZE_FT_CHANNEL (data));
+}
+
+static void
+splice_wait (HazeFtChannel *self,
+             gint fd,
+             PurpleInputCondition cond)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+  gboolean client = (fd == priv->client_fd);
+
+  set_watch (priv->client_fd, &priv->client_watch, &priv->client_cond,
+      client ? cond : 0, client_io_cb, self);
+  set_watch (priv->xfer->fd, &priv->prpl_watch, &priv->prpl_cond,
+      client ? 0 : cond, prpl_io_cb, self);
+}
+
+static void
+splice_finished (HazeFtChannel *self)
+{
+  PurpleXfer *xfer = self->priv->xfer;
+
+  DEBUG ("spliced the rest of %s", self->priv->filename);
+
+  /* This stops watching xfer->fd, which purple_xfer_end() closes. */
+  transfer_completed (self);
+  purple_xfer_set_completed (xfer, TRUE);
+  purple_xfer_end (xfer);
+}
+#endif
+
+static void
+splice_some (HazeFtChannel *self)
+{
+#ifdef HAVE_SPLICE
+  HazeFtChannelPrivate *priv = self->priv;
+  PurpleXfer *xfer = priv->xfer;
+  gboolean incoming = is_incoming (self);
+  gint src = incoming ? xfer->fd : priv->client_fd;
+  gint dst = incoming ? priv->client_fd : xfer->fd;
+  guint64 total = purple_xfer_get_size (xfer) - priv->splice_base;
+  gsize budget = MAX_SPLICE_PER_ITERATION;
+  gssize n;
+
+  for (;;)
+    {
+      if (priv->in_pipe == 0 && priv->spliced == total)
+        {
+          splice_finished (self);
+          return;
+        }
+
+      if (budget == 0)
+        break;
+
+      if (priv->in_pipe == 0)
+        {
+          n = splice (src, NULL, priv->pipe_fds[1], NULL,
+              MIN (total - priv->spliced, budget),
+              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+          if (n < 0 && errno == EINTR)
+            continue;
+
+          if (n < 0 && errno == EAGAIN)
+            {
+              splice_wait (self, src, PURPLE_INPUT_READ);
+              break;
+            }
+
+          if (n <= 0)
+            {
+              DEBUG ("reading from the %s failed: %s",
+                  incoming ? "prpl" : "client",
+                  n == 0 ? "connection closed early" : g_strerror (errno));
+              cancel_transfer (self, incoming ?
+                  TP_FILE_TRANSFER_STATE_CHANGE_REASON_REMOTE_ERROR :
+                  TP_FILE_TRANSFER_STATE_CHANGE_REASON_LOCAL_ERROR);
+              return;
+            }
+
+          priv->in_pipe = n;
+        }
+
+      n = splice (priv->pipe_fds[0], NULL, dst, NULL, priv->in_pipe,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n < 0 && errno == EAGAIN)
+        {
+          splice_wait (self, dst, PURPLE_INPUT_WRITE);
+          break;
+        }
+
+      if (n < 0)
+        {
+          DEBUG ("writing to the %s failed: %s",
+              incoming ? "client" : "prpl", g_strerror (errno));
+          cancel_transfer (self, incoming ?
+              TP_FILE_TRANSFER_STATE_CHANGE_REASON_LOCAL_ERROR :
+              TP_FILE_TRANSFER_STATE_CHANGE_REASON_REMOTE_ERROR);
+          return;
+        }
+
+      priv->in_pipe -= n;
+      priv->spliced += n;
+      priv->delivered += n;
+      budget -= MIN ((gsize) n, budget);
+      purple_xfer_set_bytes_sent (xfer, priv->splice_base + priv->spliced);
+    }
+
+  /* If we stopped because of the budget, the watch fires straight away. */
+  if (budget == 0)
+    splice_wait (self, priv->in_pipe > 0 ? dst : src,
+        priv->in_pipe > 0 ? PURPLE_INPUT_WRITE : PURPLE_INPUT_READ);
+
+  purple_xfer_update_progress (xfer);
+#else
+  g_assert_not_reached ();
+#endif
+}
+
+/* Takes over the prpl's socket, if it carries nothing but the file, and
+ * libpurple has nothing of it buffered with us. */
+static gboolean
+try_splice (HazeFtChannel *self)
+{
+#ifdef HAVE_SPLICE
+  HazeFtChannelPrivate *priv = self->priv;
+  PurpleXfer *xfer = priv->xfer;
+  gboolean incoming = is_incoming (self);
+
+  if (priv->splicing)
+    return TRUE;
+
+  if (!priv->prpl_live || priv->client_fd < 0 || priv->ring.len > 0 ||
+      xfer->fd < 0 ||
+      purple_xfer_get_status (xfer) != PURPLE_XFER_STATUS_STARTED ||
+      purple_xfer_get_size (xfer) == 0)
+    return FALSE;
+
+  /* The prpl frames the data itself, or wants to see it go by. */
+  if ((incoming ? xfer->ops.read != NULL : xfer->ops.write != NULL) ||
+      xfer->ops.ack != NULL)
+    return FALSE;
+
+  if (pipe (priv->pipe_fds) != 0)
+    {
+      DEBUG ("couldn't make a pipe: %s", g_strerror (errno));
+      priv->pipe_fds[0] = priv->pipe_fds[1] = -1;
+      return FALSE;
+    }
+
+  DEBUG ("splicing the rest of %s", priv->filename);
+
+  /* libpurple won't touch the socket again unless we say we're ready. */
+  if (xfer->watcher != 0)
+    {
+      purple_input_remove (xfer->watcher);
+      xfer->watcher = 0;
+    }
+
+  set_nonblocking (xfer->fd);
+  set_watch (priv->client_fd, &priv->client_watch, &priv->client_cond, 0,
+      NULL, NULL);
+  ring_clear (&priv->ring);
+
+  priv->splicing = TRUE;
+  priv->splice_base = purple_xfer_get_bytes_sent (xfer);
+  priv->spliced = 0;
+  priv->in_pipe = 0;
+
+  splice_some (self);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/* Lets libpurple move another chunk between the prpl and the ring buffer, if
+ * there's room or data for one, unless we can take it from here. */
+static void
+pump (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+  gboolean ready;
+
+  if (transfer_is_over (self) || !priv->started || priv->prpl_done ||
+      priv->splicing)
+    return;
+
+  if (try_splice (self))
+    return;
+
+  if (is_incoming (self))
+    ready = (ring_space (&priv->ring) >= PURPLE_MAX_CHUNK);
+  else
+    ready = (priv->ring.len > 0);
+
+  if (ready)
+    purple_xfer_ui_ready (priv->xfer);
+}
+
+static void
+write_to_client (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+  struct iovec iov[2];
+  guint n_iov = ring_get_iov (&priv->ring, iov, TRUE, G_MAXSIZE);
+  gssize n;
+
+  if (n_iov == 0)
+    {
+      update_client_watch (self);
+      return;
+    }
+
+  n = writev (priv->client_fd, iov, n_iov);
+
+  if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EINTR)
+        return;
+
+      DEBUG ("writing to the client failed: %s", g_strerror (errno));
+      cancel_transfer (self, TP_FILE_TRANSFER_STATE_CHANGE_REASON_LOCAL_ERROR);
+      return;
+    }
+
+  ring_consumed (&priv->ring, n);
+  priv->delivered += n;
+
+  if (priv->prpl_done && priv->ring.len == 0)
+    {
+      transfer_completed (self);
+      return;
+    }
+
+  progress_made (self);
+  update_client_watch (self);
+  schedule_pump (self);
+}
+
+static void
+read_from_client (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+  struct iovec iov[2];
+  guint n_iov;
+  gssize n;
+
+  if (try_splice (self))
+    return;
+
+  n_iov = ring_get_iov (&priv->ring, iov, FALSE,
+      MIN (wanted_from_client (self), G_MAXSIZE));
+
+  if (n_iov == 0)
+    {
+      update_client_watch (self);
+      return;
+    }
+
+  n = readv (priv->client_fd, iov, n_iov);
+
+  if (n <= 0)
+    {
+      if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+      DEBUG ("reading from the client failed: %s",
+          n == 0 ? "socket closed early" : g_strerror (errno));
+      cancel_transfer (self, TP_FILE_TRANSFER_STATE_CHANGE_REASON_LOCAL_ERROR);
+      return;
+    }
+
+  ring_produced (&priv->ring, n);
+  priv->delivered += n;
+
+  update_client_watch (self);
+  schedule_pump (self);
+}
+
+static void
+client_io_cb (gpointer data,
+              gint fd,
+              PurpleInputCondition cond)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (data);
+
+  if (self->priv->splicing)
+    splice_some (self);
+  else if (is_incoming (self))
+    write_to_client (self);
+  else
+    read_from_client (self);
+}
+
+static void
+listen_cb (gpointer data,
+           gint source,
+           PurpleInputCondition cond)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (data);
+  HazeFtChannelPrivate *priv = self->priv;
+  gint fd = accept (source, NULL, NULL);
+
+  if (fd < 0)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+        {
+          DEBUG ("accepting the client failed: %s", g_strerror (errno));
+          cancel_transfer (self,
+              TP_FILE_TRANSFER_STATE_CHANGE_REASON_LOCAL_ERROR);
+        }
+
+      return;
+    }
+
+  DEBUG ("client connected for %s", priv->filename);
+
+  set_nonblocking (fd);
+  priv->client_fd = fd;
+  /* Only the one client may connect. */
+  close_listener (self);
+
+  ring_ensure (&priv->ring);
+  maybe_open (self);
+  update_client_watch (self);
+  schedule_pump (self);
+}
+
+/* Returns the address of a new socket for the client, as a GValue. */
+static GValue *
+listen_for_client (HazeFtChannel *self,
+                   GError **error)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+  struct sockaddr_un addr;
+  GError *dir_error = NULL;
+  GArray *address;
+  gchar *path;
+  gint fd;
+
+  priv->socket_dir = g_dir_make_tmp ("telepathy-haze-ft-XXXXXX", &dir_error);
+
+  if (priv->socket_dir == NULL)
+    {
+      g_set_error (error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "couldn't make a directory for the socket: %s", dir_error->message);
+      g_error_free (dir_error);
+      return NULL;
+    }
+
+  path = g_build_filename (priv->socket_dir, "socket", NULL);
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      g_set_error (error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "socket path %s is too long", path);
+      goto error;
+    }
+
+  g_strlcpy (addr.sun_path, path, sizeof (addr.sun_path));
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0 || bind (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 ||
+      listen (fd, 1) != 0)
+    {
+      g_set_error (error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "couldn't listen on %s: %s", path, g_strerror (errno));
+
+      if (fd >= 0)
+        close (fd);
+
+      goto error;
+    }
+
+  set_nonblocking (fd);
+  priv->listen_fd = fd;
+  priv->listen_watch = purple_input_add (fd, PURPLE_INPUT_READ, listen_cb,
+      self);
+  priv->socket_offered = TRUE;
+
+  address = g_array_sized_new (TRUE, FALSE, sizeof (gchar), strlen (path));
+  g_array_append_vals (address, path, strlen (path));
+  g_free (path);
+
+  return tp_g_value_slice_new_take_boxed (DBUS_TYPE_G_UCHAR_ARRAY, address);
+
+error:
+  g_free (path);
+  close_listener (self);
+  return NULL;
+}
+
+static gboolean
+check_socket_type (guint address_type,
+                   guint access_control,
+                   GError **error)
+{
+  if (address_type != TP_SOCKET_ADDRESS_TYPE_UNIX)
+    {
+      g_set_error (error, TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+          "address type %u is not supported", address_type);
+      return FALSE;
+    }
+
+  if (access_control != TP_SOCKET_ACCESS_CONTROL_LOCALHOST)
+    {
+      g_set_error (error, TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+          "access control %u is not supported", access_control);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Sends the offer for a transfer we were asked to make. */
+void
+haze_ft_channel_offer (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+
+  g_return_if_fail (!is_incoming (self));
+
+  purple_xfer_set_size (priv->xfer, priv->size);
+
+  if (priv->description != NULL)
+    purple_xfer_set_message (priv->xfer, priv->description);
+
+  /* With the ui_read hook, libpurple doesn't look for a file by this name;
+   * it just tells the recipient what the file is called. */
+  purple_xfer_request_accepted (priv->xfer, priv->filename);
+}
+
+void
+haze_ft_channel_started (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+
+  if (transfer_is_over (self))
+    return;
+
+  priv->started = TRUE;
+  ring_ensure (&priv->ring);
+
+  /* libpurple doesn't say when the recipient accepts, only this. */
+  if (priv->state == TP_FILE_TRANSFER_STATE_PENDING)
+    set_state (self, TP_FILE_TRANSFER_STATE_ACCEPTED,
+        TP_FILE_TRANSFER_STATE_CHANGE_REASON_NONE);
+
+  maybe_open (self);
+  schedule_pump (self);
+}
+
+void
+haze_ft_channel_update_progress (HazeFtChannel *self)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+
+  if (transfer_is_over (self))
+    return;
+
+  if (!purple_xfer_is_completed (priv->xfer))
+    {
+      progress_made (self);
+      return;
+    }
+
+  priv->prpl_done = TRUE;
+
+  /* What's left in the ring buffer is on its way to the client. */
+  if (is_incoming (self) && priv->ring.len > 0)
+    update_client_watch (self);
+  else
+    transfer_completed (self);
+}
+
+void
+haze_ft_channel_cancelled (HazeFtChannel *self,
+                           gboolean remotely)
+{
+  if (transfer_is_over (self))
+    return;
+
+  self->priv->prpl_done = TRUE;
+  stop_io (self);
+  set_state (self, TP_FILE_TRANSFER_STATE_CANCELLED, remotely ?
+      TP_FILE_TRANSFER_STATE_CHANGE_REASON_REMOTE_STOPPED :
+      TP_FILE_TRANSFER_STATE_CHANGE_REASON_LOCAL_ERROR);
+}
+
+/* libpurple has received @size bytes of the file. */
+gssize
+haze_ft_channel_write (HazeFtChannel *self,
+                       const guchar *buffer,
+                       gssize size)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+
+  if (transfer_is_over (self))
+    return -1;
+
+  priv->prpl_live = TRUE;
+  ring_ensure (&priv->ring);
+
+  /* We only say we're ready when there's room for a whole chunk, but prpls
+   * which read the data themselves might hand over more than that. */
+  if ((gsize) size > ring_space (&priv->ring))
+    {
+      DEBUG ("%" G_GSSIZE_FORMAT " bytes won't fit in the buffer", size);
+      return -1;
+    }
+
+  ring_copy (&priv->ring, (guchar *) buffer, size, TRUE);
+
+  update_client_watch (self);
+  schedule_pump (self);
+  return size;
+}
+
+/* libpurple wants up to @size bytes of the file to send. */
+gssize
+haze_ft_channel_read (HazeFtChannel *self,
+                      guchar **buffer,
+                      gssize size)
+{
+  HazeFtChannelPrivate *priv = self->priv;
+  gsize n = MIN ((gsize) size, priv->ring.len);
+
+  if (transfer_is_over (self))
+    return -1;
+
+  priv->prpl_live = TRUE;
+
+  if (n == 0)
+    return 0;
+
+  *buffer = g_malloc (n);
+  ring_copy (&priv->ring, *buffer, n, FALSE);
+
+  update_client_watch (self);
+  schedule_pump (self);
+  return n;
+}
+
+/* The prpl could only send some of what haze_ft_channel_read() gave it. */
+void
+haze_ft_channel_data_not_sent (HazeFtChannel *self,
+                               gsize size)
+{
+  if (transfer_is_over (self))
+    return;
+
+  ring_unconsume (&self->priv->ring, size);
+  schedule_pump (self);
+}
+
+/**
+ * haze_ft_channel_accept_file
+ *
+ * Implements D-Bus method AcceptFile
+ * on interface org.freedesktop.Telepathy.Channel.Type.FileTransfer
+ */
+static void
+haze_ft_channel_accept_file (TpSvcChannelTypeFileTransfer *iface,
+                             guint address_type,
+                             guint access_control,
+                             const GValue *access_control_param,
+                             guint64 offset,
+                             DBusGMethodInvocation *context)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (iface);
+  HazeFtChannelPrivate *priv = self->priv;
+  GError *error = NULL;
+  GValue *address = NULL;
+
+  if (!is_incoming (self))
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "this is an outgoing transfer" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  if (priv->state != TP_FILE_TRANSFER_STATE_PENDING)
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "the transfer is not pending" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  if (!check_socket_type (address_type, access_control, &error) ||
+      (address = listen_for_client (self, &error)) == NULL)
+    {
+      dbus_g_method_return_error (context, error);
+      g_error_free (error);
+      return;
+    }
+
+  set_state (self, TP_FILE_TRANSFER_STATE_ACCEPTED,
+      TP_FILE_TRANSFER_STATE_CHANGE_REASON_REQUESTED);
+
+  /* libpurple can't resume transfers, so we always start from the top. */
+  tp_svc_channel_type_file_transfer_emit_initial_offset_defined (self, 0);
+  tp_svc_channel_type_file_transfer_return_from_accept_file (context,
+      address);
+  tp_g_value_slice_free (address);
+
+  purple_xfer_request_accepted (priv->xfer, priv->filename);
+}
+
+/**
+ * haze_ft_channel_provide_file
+ *
+ * Implements D-Bus method ProvideFile
+ * on interface org.freedesktop.Telepathy.Channel.Type.FileTransfer
+ */
+static void
+haze_ft_channel_provide_file (TpSvcChannelTypeFileTransfer *iface,
+                              guint address_type,
+                              guint access_control,
+                              const GValue *access_control_param,
+                              DBusGMethodInvocation *context)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (iface);
+  HazeFtChannelPrivate *priv = self->priv;
+  GError *error = NULL;
+  GValue *address = NULL;
+
+  if (is_incoming (self))
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "this is an incoming transfer" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  if (transfer_is_over (self))
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "the transfer is over" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  if (priv->socket_offered)
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "ProvideFile has already been called" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  if (!check_socket_type (address_type, access_control, &error) ||
+      (address = listen_for_client (self, &error)) == NULL)
+    {
+      dbus_g_method_return_error (context, error);
+      g_error_free (error);
+      return;
+    }
+
+  tp_svc_channel_type_file_transfer_return_from_provide_file (context,
+      address);
+  tp_g_value_slice_free (address);
+}
+
+static void
+file_transfer_iface_init (gpointer g_iface,
+                          gpointer iface_data)
+{
+  TpSvcChannelTypeFileTransferClass *klass = g_iface;
+
+#define IMPLEMENT(x) tp_svc_channel_type_file_transfer_implement_##x (\
+    klass, haze_ft_channel_##x)
+  IMPLEMENT(accept_file);
+  IMPLEMENT(provide_file);
+#undef IMPLEMENT
+}
+
+static GHashTable *
+make_available_socket_types (void)
+{
+  GHashTable *types = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) g_array_unref);
+  GArray *access_controls = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+      1);
+  guint localhost = TP_SOCKET_ACCESS_CONTROL_LOCALHOST;
+
+  g_array_append_val (access_controls, localhost);
+  g_hash_table_insert (types, GUINT_TO_POINTER (TP_SOCKET_ADDRESS_TYPE_UNIX),
+      access_controls);
+
+  return types;
+}
+
+static void
+get_file_transfer_property (GObject *object,
+                            GQuark iface,
+                            GQuark name,
+                            GValue *value,
+                            gpointer getter_data)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (object);
+  HazeFtChannelPrivate *priv = self->priv;
+  const gchar *prop = g_quark_to_string (name);
+
+  if (!tp_strdiff (prop, "State"))
+    g_value_set_uint (value, priv->state);
+  else if (!tp_strdiff (prop, "ContentType"))
+    g_value_set_string (value, priv->content_type);
+  else if (!tp_strdiff (prop, "Filename"))
+    g_value_set_string (value, priv->filename);
+  else if (!tp_strdiff (prop, "Size"))
+    g_value_set_uint64 (value, priv->size);
+  else if (!tp_strdiff (prop, "ContentHashType"))
+    g_value_set_uint (value, TP_FILE_HASH_TYPE_NONE);
+  else if (!tp_strdiff (prop, "ContentHash"))
+    g_value_set_static_string (value, "");
+  else if (!tp_strdiff (prop, "Description"))
+    g_value_set_string (value,
+        priv->description != NULL ? priv->description : "");
+  else if (!tp_strdiff (prop, "Date"))
+    g_value_set_uint64 (value, priv->date);
+  else if (!tp_strdiff (prop, "AvailableSocketTypes"))
+    g_value_take_boxed (value, make_available_socket_types ());
+  else if (!tp_strdiff (prop, "TransferredBytes"))
+    g_value_set_uint64 (value, count_transferred (self));
+  else if (!tp_strdiff (prop, "InitialOffset"))
+    g_value_set_uint64 (value, 0);
+  else
+    g_assert_not_reached ();
+}
+
+static void
+haze_ft_channel_close (TpBaseChannel *base)
+{
+  cancel_transfer (HAZE_FT_CHANNEL (base),
+      TP_FILE_TRANSFER_STATE_CHANGE_REASON_LOCAL_STOPPED);
+  tp_base_channel_destroyed (base);
+}
+
+static void
+haze_ft_channel_fill_immutable_properties (TpBaseChannel *chan,
+    GHashTable *properties)
+{
+  TpBaseChannelClass *cls = TP_BASE_CHANNEL_CLASS (
+      haze_ft_channel_parent_class);
+
+  cls->fill_immutable_properties (chan, properties);
+
+  tp_dbus_properties_mixin_fill_properties_hash (
+      G_OBJECT (chan), properties,
+      TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER, "ContentType",
+      TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER, "Filename",
+      TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER, "Size",
+      TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER, "ContentHashType",
+      TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER, "ContentHash",
+      TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER, "Description",
+      TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER, "Date",
+      TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER, "AvailableSocketTypes",
+      NULL);
+}
+
+static gchar *
+haze_ft_channel_get_object_path_suffix (TpBaseChannel *chan)
+{
+  static guint count = 0;
+
+  return g_strdup_printf ("FtChannel%u", count++);
+}
+
+static gchar *
+guess_content_type (const gchar *filename)
+{
+  gchar *content_type = g_content_type_guess (filename, NULL, 0, NULL);
+  gchar *mime_type = g_content_type_get_mime_type (content_type);
+
+  g_free (content_type);
+
+  if (mime_type == NULL)
+    mime_type = g_strdup ("application/octet-stream");
+
+  return mime_type;
+}
+
+static void
+haze_ft_channel_init (HazeFtChannel *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, HAZE_TYPE_FT_CHANNEL,
+      HazeFtChannelPrivate);
+
+  self->priv->state = TP_FILE_TRANSFER_STATE_PENDING;
+  self->priv->listen_fd = -1;
+  self->priv->client_fd = -1;
+  self->priv->pipe_fds[0] = self->priv->pipe_fds[1] = -1;
+}
+
+static void
+haze_ft_channel_constructed (GObject *obj)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (obj);
+  HazeFtChannelPrivate *priv = self->priv;
+  void (*chain_up) (GObject *) =
+      G_OBJECT_CLASS (haze_ft_channel_parent_class)->constructed;
+
+  if (chain_up != NULL)
+    chain_up (obj);
+
+  g_assert (priv->xfer != NULL);
+  purple_xfer_ref (priv->xfer);
+  priv->xfer->ui_data = self;
+
+  /* Incoming transfers are described by the prpl. */
+  if (priv->filename == NULL)
+    priv->filename = g_strdup (purple_xfer_get_filename (priv->xfer));
+
+  if (priv->size == 0)
+    priv->size = purple_xfer_get_size (priv->xfer);
+
+  if (priv->description == NULL)
+    priv->description = g_strdup (priv->xfer->message);
+
+  if (priv->content_type == NULL)
+    priv->content_type = guess_content_type (priv->filename);
+}
+
+static void
+haze_ft_channel_get_property (GObject *object,
+                              guint property_id,
+                              GValue *value,
+                              GParamSpec *pspec)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (object);
+  HazeFtChannelPrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+    case PROP_XFER:
+      g_value_set_pointer (value, priv->xfer);
+      break;
+    case PROP_CONTENT_TYPE:
+      g_value_set_string (value, priv->content_type);
+      break;
+    case PROP_FILENAME:
+      g_value_set_string (value, priv->filename);
+      break;
+    case PROP_SIZE:
+      g_value_set_uint64 (value, priv->size);
+      break;
+    case PROP_DESCRIPTION:
+      g_value_set_string (value, priv->description);
+      break;
+    case PROP_DATE:
+      g_value_set_uint64 (value, priv->date);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+haze_ft_channel_set_property (GObject *object,
+                              guint property_id,
+                              const GValue *value,
+                              GParamSpec *pspec)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (object);
+  HazeFtChannelPrivate *priv = self->priv;
+
+  switch (property_id)
+    {
+    case PROP_XFER:
+      priv->xfer = g_value_get_pointer (value);
+      break;
+    case PROP_CONTENT_TYPE:
+      priv->content_type = g_value_dup_string (value);
+      break;
+    case PROP_FILENAME:
+      priv->filename = g_value_dup_string (value);
+      break;
+    case PROP_SIZE:
+      priv->size = g_value_get_uint64 (value);
+      break;
+    case PROP_DESCRIPTION:
+      priv->description = g_value_dup_string (value);
+      break;
+    case PROP_DATE:
+      priv->date = g_value_get_uint64 (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+haze_ft_channel_dispose (GObject *obj)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (obj);
+  HazeFtChannelPrivate *priv = self->priv;
+  PurpleXfer *xfer = priv->xfer;
+
+  if (priv->dispose_has_run)
+    return;
+  priv->dispose_has_run = TRUE;
+
+  stop_io (self);
+
+  /* Too late to signal anything. */
+  if (xfer != NULL)
+    {
+      priv->xfer = NULL;
+      xfer->ui_data = NULL;
+
+      if (!purple_xfer_is_completed (xfer) && !purple_xfer_is_canceled (xfer))
+        purple_xfer_cancel_local (xfer);
+
+      purple_xfer_unref (xfer);
+    }
+
+  G_OBJECT_CLASS (haze_ft_channel_parent_class)->dispose (obj);
+}
+
+static void
+haze_ft_channel_finalize (GObject *obj)
+{
+  HazeFtChannel *self = HAZE_FT_CHANNEL (obj);
+
+  g_free (self->priv->content_type);
+  g_free (self->priv->filename);
+  g_free (self->priv->description);
+
+  G_OBJECT_CLASS (haze_ft_channel_parent_class)->finalize (obj);
+}
+
+static void
+haze_ft_channel_class_init (HazeFtChannelClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  TpBaseChannelClass *base_class = TP_BASE_CHANNEL_CLASS (klass);
+  static TpDBusPropertiesMixinPropImpl file_transfer_props[] = {
+      { "State", NULL, NULL },
+      { "ContentType", NULL, NULL },
+      { "Filename", NULL, NULL },
+      { "Size", NULL, NULL },
+      { "ContentHashType", NULL, NULL },
+      { "ContentHash", NULL, NULL },
+      { "Description", NULL, NULL },
+      { "Date", NULL, NULL },
+      { "AvailableSocketTypes", NULL, NULL },
+      { "TransferredBytes", NULL, NULL },
+      { "InitialOffset", NULL, NULL },
+      { NULL }
+  };
+  GParamSpec *param_spec;
+
+  g_type_class_add_private (klass, sizeof (HazeFtChannelPrivate));
+
+  object_class->constructed = haze_ft_channel_constructed;
+  object_class->get_property = haze_ft_channel_get_property;
+  object_class->set_property = haze_ft_channel_set_property;
+  object_class->dispose = haze_ft_channel_dispose;
+  object_class->finalize = haze_ft_channel_finalize;
+
+  base_class->channel_type = TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER;
+  base_class->target_handle_type = TP_HANDLE_TYPE_CONTACT;
+  base_class->close = haze_ft_channel_close;
+  base_class->fill_immutable_properties =
+      haze_ft_channel_fill_immutable_properties;
+  base_class->get_object_path_suffix =
+      haze_ft_channel_get_object_path_suffix;
+
+  param_spec = g_param_spec_pointer ("xfer", "PurpleXfer",
+      "The libpurple transfer behind this channel",
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_XFER, param_spec);
+
+  param_spec = g_param_spec_string ("content-type", "Content type",
+      "The file's MIME type, or NULL to guess it from its name",
+      NULL,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_CONTENT_TYPE,
+      param_spec);
+
+  param_spec = g_param_spec_string ("filename", "Filename",
+      "The file's name, or NULL to ask the transfer",
+      NULL,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_FILENAME, param_spec);
+
+  param_spec = g_param_spec_uint64 ("size", "Size",
+      "The file's size in bytes, or 0 to ask the transfer",
+      0, G_MAXUINT64, 0,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_SIZE, param_spec);
+
+  param_spec = g_param_spec_string ("description", "Description",
+      "What the sender said about the file",
+      NULL,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DESCRIPTION,
+      param_spec);
+
+  param_spec = g_param_spec_uint64 ("date", "Date",
+      "When the file was last modified, or 0 if unknown",
+      0, G_MAXUINT64, 0,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_DATE, param_spec);
+
+  tp_dbus_properties_mixin_implement_interface (object_class,
+      TP_IFACE_QUARK_CHANNEL_TYPE_FILE_TRANSFER, get_file_transfer_property,
+      NULL, file_transfer_props);
+}
@@ -0,0 +1,80 @@
+#ifndef __HAZE_FT_CHANNEL_H__
+#define __HAZE_FT_CHANNEL_H__
+/*
+ * ft-channel.h - HazeFtChannel header
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib-object.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include <libpurple/ft.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HazeFtChannel HazeFtChannel;
+typedef struct _HazeFtChannelPrivate HazeFtChannelPrivate;
+typedef struct _HazeFtChannelClass HazeFtChannelClass;
+
+struct _HazeFtChannelClass {
+    TpBaseChannelClass parent_class;
+};
+
+struct _HazeFtChannel {
+    TpBaseChannel parent;
+
+    HazeFtChannelPrivate *priv;
+};
+
+GType haze_ft_channel_get_type (void);
+
+/* TYPE MACROS */
+#define HAZE_TYPE_FT_CHANNEL \
+  (haze_ft_channel_get_type ())
+#define HAZE_FT_CHANNEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), HAZE_TYPE_FT_CHANNEL, HazeFtChannel))
+#define HAZE_FT_CHANNEL_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass), HAZE_TYPE_FT_CHANNEL, \
+                           HazeFtChannelClass))
+#define HAZE_IS_FT_CHANNEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), HAZE_TYPE_FT_CHANNEL))
+#define HAZE_IS_FT_CHANNEL_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass), HAZE_TYPE_FT_CHANNEL))
+#define HAZE_FT_CHANNEL_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), HAZE_TYPE_FT_CHANNEL, \
+                              HazeFtChannelClass))
+
+/* A transfer's ui_data is the channel for it, if any. */
+#define PURPLE_XFER_GET_HAZE_FT_CHANNEL(xfer) \
+    ((HazeFtChannel *) (xfer)->ui_data)
+
+void haze_ft_channel_offer (HazeFtChannel *self);
+void haze_ft_channel_started (HazeFtChannel *self);
+void haze_ft_channel_update_progress (HazeFtChannel *self);
+void haze_ft_channel_cancelled (HazeFtChannel *self, gboolean remotely);
+
+gssize haze_ft_channel_write (HazeFtChannel *self, const guchar *buffer,
+    gssize size);
+gssize haze_ft_channel_read (HazeFtChannel *self, guchar **buffer,
+    gssize size);
+void haze_ft_channel_data_not_sent (HazeFtChannel *self, gsize size);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_FT_CHANNEL_H__*/
@@ -0,0 +1,592 @@
+/*
+ * ft-manager.c - HazeFtManager source
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "config.h"
+#include "ft-manager.h"
+
+#include <string.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "connection.h"
+#include "debug.h"
+#include "ft-channel.h"
+
+struct _HazeFtManagerPrivate {
+    HazeConnection *conn;
+    /* HazeFtChannel => itself, owning a reference */
+    GHashTable *channels;
+    gulong status_changed_id;
+    gboolean dispose_has_run;
+};
+
+static void channel_manager_iface_init (gpointer, gpointer);
+
+G_DEFINE_TYPE_WITH_CODE(HazeFtManager,
+    haze_ft_manager,
+    G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (TP_TYPE_CHANNEL_MANAGER,
+      channel_manager_iface_init))
+
+/* properties: */
+enum {
+    PROP_CONNECTION = 1,
+
+    LAST_PROPERTY
+};
+
+static void close_all (HazeFtManager *self);
+
+static void
+haze_ft_manager_init (HazeFtManager *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+        HAZE_TYPE_FT_MANAGER, HazeFtManagerPrivate);
+
+    self->priv->conn = NULL;
+    self->priv->channels = g_hash_table_new_full (NULL, NULL,
+        g_object_unref, NULL);
+    self->priv->dispose_has_run = FALSE;
+}
+
+static void
+haze_ft_manager_dispose (GObject *object)
+{
+    HazeFtManager *self = HAZE_FT_MANAGER (object);
+
+    if (self->priv->dispose_has_run)
+        return;
+
+    self->priv->dispose_has_run = TRUE;
+
+    close_all (self);
+
+    if (G_OBJECT_CLASS (haze_ft_manager_parent_class)->dispose)
+        G_OBJECT_CLASS (haze_ft_manager_parent_class)->dispose (object);
+}
+
+static void
+haze_ft_manager_get_property (GObject *object,
+                              guint property_id,
+                              GValue *value,
+                              GParamSpec *pspec)
+{
+    HazeFtManager *self = HAZE_FT_MANAGER (object);
+
+    switch (property_id) {
+        case PROP_CONNECTION:
+            g_value_set_object (value, self->priv->conn);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+haze_ft_manager_set_property (GObject *object,
+                              guint property_id,
+                              const GValue *value,
+                              GParamSpec *pspec)
+{
+    HazeFtManager *self = HAZE_FT_MANAGER (object);
+
+    switch (property_id) {
+        case PROP_CONNECTION:
+            self->priv->conn = g_value_get_object (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+status_changed_cb (HazeConnection *conn,
+                   guint status,
+                   guint reason,
+                   HazeFtManager *self)
+{
+    if (status == TP_CONNECTION_STATUS_DISCONNECTED)
+        close_all (self);
+}
+
+static void
+haze_ft_manager_constructed (GObject *object)
+{
+    HazeFtManager *self = HAZE_FT_MANAGER (object);
+    void (*constructed) (GObject *) =
+        ((GObjectClass *) haze_ft_manager_parent_class)->constructed;
+
+    if (constructed != NULL)
+    {
+        constructed (object);
+    }
+
+    self->priv->status_changed_id = g_signal_connect (self->priv->conn,
+        "status-changed", (GCallback) status_changed_cb, self);
+}
+
+static void
+ft_channel_closed_cb (HazeFtChannel *chan, gpointer user_data)
+{
+    HazeFtManager *self = HAZE_FT_MANAGER (user_data);
+
+    tp_channel_manager_emit_channel_closed_for_object (self,
+        TP_EXPORTABLE_CHANNEL (chan));
+
+    if (self->priv->channels != NULL)
+        g_hash_table_remove (self->priv->channels, chan);
+}
+
+static void
+new_ft_channel (HazeFtManager *self,
+                HazeFtChannel *chan,
+                gpointer request_token)
+{
+    GSList *requests = NULL;
+
+    tp_base_channel_register (TP_BASE_CHANNEL (chan));
+
+    DEBUG ("Created file transfer channel with object path %s",
+        tp_base_channel_get_object_path (TP_BASE_CHANNEL (chan)));
+
+    g_signal_connect (chan, "closed", G_CALLBACK (ft_channel_closed_cb),
+        self);
+
+    g_hash_table_add (self->priv->channels, chan);
+
+    if (request_token != NULL)
+        requests = g_slist_prepend (requests, request_token);
+
+    tp_channel_manager_emit_new_channel (self,
+        TP_EXPORTABLE_CHANNEL (chan), requests);
+    g_slist_free (requests);
+}
+
+/* Someone is offering us a file. */
+static void
+file_recv_request_cb (PurpleXfer *xfer,
+                      gpointer unused)
+{
+    PurpleAccount *account = purple_xfer_get_account (xfer);
+    const gchar *who = purple_xfer_get_remote_user (xfer);
+    HazeConnection *conn;
+    HazeFtManager *self;
+    TpHandleRepoIface *contact_repo;
+    HazeFtChannel *chan;
+    TpHandle handle;
+
+    if (account->ui_data == NULL)
+        return;
+
+    conn = ACCOUNT_GET_HAZE_CONNECTION (account);
+    self = conn->ft_manager;
+
+    if (self == NULL || self->priv->channels == NULL)
+        return;
+
+    contact_repo = tp_base_connection_get_handles (TP_BASE_CONNECTION (conn),
+        TP_HANDLE_TYPE_CONTACT);
+
+    /* libpurple asks for a name when the prpl doesn't know it yet, which we
+     * can't do anything about. */
+    if (purple_xfer_get_filename (xfer) == NULL)
+    {
+        DEBUG ("%s is offering an unnamed file; leaving it to libpurple",
+            who);
+        return;
+    }
+
+    handle = tp_handle_ensure (contact_repo, who, NULL, NULL);
+
+    if (handle == 0)
+    {
+        DEBUG ("couldn't get a handle for '%s'", who);
+        return;
+    }
+
+    chan = g_object_new (HAZE_TYPE_FT_CHANNEL,
+                         "connection", conn,
+                         "handle", handle,
+                         "initiator-handle", handle,
+                         "requested", FALSE,
+                         "xfer", xfer,
+                         NULL);
+
+    /* This stops libpurple asking where to save the file; the client says
+     * whether it wants it by calling AcceptFile. */
+    purple_xfer_set_local_filename (xfer, purple_xfer_get_filename (xfer));
+
+    new_ft_channel (self, chan, NULL);
+}
+
+static void
+file_start_cb (PurpleXfer *xfer,
+               gpointer unused)
+{
+    HazeFtChannel *chan = PURPLE_XFER_GET_HAZE_FT_CHANNEL (xfer);
+
+    if (chan != NULL)
+        haze_ft_channel_started (chan);
+}
+
+static void
+haze_ft_manager_class_init (HazeFtManagerClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GParamSpec *param_spec;
+    void *xfers_handle = purple_xfers_get_handle ();
+
+    object_class->constructed = haze_ft_manager_constructed;
+    object_class->dispose = haze_ft_manager_dispose;
+    object_class->get_property = haze_ft_manager_get_property;
+    object_class->set_property = haze_ft_manager_set_property;
+
+    param_spec = g_param_spec_object ("connection", "HazeConnection object",
+                                      "Haze connection object that owns this "
+                                      "file transfer manager object.",
+                                      HAZE_TYPE_CONNECTION,
+                                      G_PARAM_CONSTRUCT_ONLY |
+                                      G_PARAM_READWRITE |
+                                      G_PARAM_STATIC_NICK |
+                                      G_PARAM_STATIC_BLURB);
+    g_object_class_install_property (object_class, PROP_CONNECTION, param_spec);
+
+    g_type_class_add_private (object_class,
+                              sizeof(HazeFtManagerPrivate));
+
+    purple_signal_connect (xfers_handle, "file-recv-request", klass,
+        (PurpleCallback) file_recv_request_cb, NULL);
+    purple_signal_connect (xfers_handle, "file-recv-start", klass,
+        (PurpleCallback) file_start_cb, NULL);
+    purple_signal_connect (xfers_handle, "file-send-start", klass,
+        (PurpleCallback) file_start_cb, NULL);
+}
+
+static void
+close_all (HazeFtManager *self)
+{
+    GHashTable *tmp;
+
+    DEBUG ("closing file transfer channels");
+
+    if (self->priv->channels)
+    {
+        tmp = self->priv->channels;
+        self->priv->channels = NULL;
+        g_hash_table_destroy (tmp);
+    }
+
+    if (self->priv->status_changed_id != 0)
+    {
+        g_signal_handler_disconnect (self->priv->conn,
+            self->priv->status_changed_id);
+        self->priv->status_changed_id = 0;
+    }
+}
+
+static void
+haze_ft_manager_foreach (TpChannelManager *iface,
+                         TpExportableChannelFunc foreach,
+                         gpointer user_data)
+{
+    HazeFtManager *self = HAZE_FT_MANAGER (iface);
+    GHashTableIter iter;
+    gpointer chan;
+
+    if (self->priv->channels == NULL)
+        return;
+
+    g_hash_table_iter_init (&iter, self->priv->channels);
+
+    while (g_hash_table_iter_next (&iter, &chan, NULL))
+        foreach (TP_EXPORTABLE_CHANNEL (chan), user_data);
+}
+
+static const gchar * const fixed_properties[] = {
+    TP_IFACE_CHANNEL ".ChannelType",
+    TP_IFACE_CHANNEL ".TargetHandleType",
+    NULL
+};
+static const gchar * const allowed_properties[] = {
+    TP_IFACE_CHANNEL ".TargetHandle",
+    TP_IFACE_CHANNEL ".TargetID",
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_CONTENT_TYPE,
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_FILENAME,
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_SIZE,
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_DESCRIPTION,
+    TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_DATE,
+    NULL
+};
+
+static void
+haze_ft_manager_foreach_channel_class (TpChannelManager *manager,
+    TpChannelManagerChannelClassFunc func,
+    gpointer user_data)
+{
+    HazeFtManager *self = HAZE_FT_MANAGER (manager);
+    PurplePluginProtocolInfo *prpl_info;
+    GHashTable *table;
+    GValue *value;
+
+    g_object_get (self->priv->conn, "prpl-info", &prpl_info, NULL);
+
+    if (!PURPLE_PROTOCOL_PLUGIN_HAS_FUNC (prpl_info, new_xfer))
+        return;
+
+    table = g_hash_table_new_full (g_str_hash, g_str_equal,
+        NULL, (GDestroyNotify) tp_g_value_slice_free);
+
+    value = tp_g_value_slice_new (G_TYPE_STRING);
+    g_value_set_static_string (value, TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER);
+    g_hash_table_insert (table, TP_IFACE_CHANNEL ".ChannelType", value);
+
+    value = tp_g_value_slice_new (G_TYPE_UINT);
+    g_value_set_uint (value, TP_HANDLE_TYPE_CONTACT);
+    g_hash_table_insert (table, TP_IFACE_CHANNEL ".TargetHandleType", value);
+
+    func (manager, table, allowed_properties, user_data);
+
+    g_hash_table_destroy (table);
+}
+
+static gboolean
+haze_ft_manager_create_channel (TpChannelManager *manager,
+                                gpointer request_token,
+                                GHashTable *request_properties)
+{
+    HazeFtManager *self = HAZE_FT_MANAGER (manager);
+    TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
+    TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+        base_conn, TP_HANDLE_TYPE_CONTACT);
+    PurplePluginProtocolInfo *prpl_info;
+    const gchar *filename;
+    guint64 size;
+    gboolean valid;
+    PurpleXfer *xfer;
+    HazeFtChannel *chan;
+    TpHandle handle;
+    GError *error = NULL;
+
+    if (tp_strdiff (tp_asv_get_string (request_properties,
+            TP_IFACE_CHANNEL ".ChannelType"),
+        TP_IFACE_CHANNEL_TYPE_FILE_TRANSFER))
+    {
+        return FALSE;
+    }
+
+    if (tp_asv_get_uint32 (request_properties,
+        TP_IFACE_CHANNEL ".TargetHandleType", NULL) != TP_HANDLE_TYPE_CONTACT)
+    {
+        return FALSE;
+    }
+
+    handle = tp_asv_get_uint32 (request_properties,
+        TP_IFACE_CHANNEL ".TargetHandle", NULL);
+    g_assert (handle != 0);
+
+    if (tp_channel_manager_asv_has_unknown_properties (request_properties,
+          fixed_properties, allowed_properties, &error))
+    {
+        goto error;
+    }
+
+    filename = tp_asv_get_string (request_properties,
+        TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_FILENAME);
+
+    if (tp_str_empty (filename) || strchr (filename, '/') != NULL)
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+            "Filename must be given, and can't contain '/'");
+        goto error;
+    }
+
+    size = tp_asv_get_uint64 (request_properties,
+        TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_SIZE, &valid);
+
+    if (!valid)
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+            "Size must be given");
+        goto error;
+    }
+
+    if (handle == tp_base_connection_get_self_handle (base_conn))
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+            "Can't send a file to yourself");
+        goto error;
+    }
+
+    prpl_info = HAZE_CONNECTION_GET_PRPL_INFO (self->priv->conn);
+
+    if (!PURPLE_PROTOCOL_PLUGIN_HAS_FUNC (prpl_info, new_xfer))
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+            "This protocol can't send files");
+        goto error;
+    }
+
+    xfer = prpl_info->new_xfer (self->priv->conn->account->gc,
+        tp_handle_inspect (contact_repo, handle));
+
+    if (xfer == NULL)
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+            "libpurple couldn't start a transfer to %s",
+            tp_handle_inspect (contact_repo, handle));
+        goto error;
+    }
+
+    /* The transfer's initial reference is dropped by libpurple when it ends
+     * or is cancelled; the channel takes its own. */
+    chan = g_object_new (HAZE_TYPE_FT_CHANNEL,
+                         "connection", self->priv->conn,
+                         "handle", handle,
+                         "initiator-handle",
+                             tp_base_connection_get_self_handle (base_conn),
+                         "requested", TRUE,
+                         "xfer", xfer,
+                         "filename", filename,
+                         "size", size,
+                         "content-type", tp_asv_get_string (
+                             request_properties,
+                             TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_CONTENT_TYPE),
+                         "description", tp_asv_get_string (
+                             request_properties,
+                             TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_DESCRIPTION),
+                         "date", tp_asv_get_uint64 (request_properties,
+                             TP_PROP_CHANNEL_TYPE_FILE_TRANSFER_DATE, NULL),
+                         NULL);
+
+    new_ft_channel (self, chan, request_token);
+    haze_ft_channel_offer (chan);
+
+    return TRUE;
+
+error:
+    tp_channel_manager_emit_request_failed (self, request_token,
+        error->domain, error->code, error->message);
+    g_error_free (error);
+    return TRUE;
+}
+
+static void
+channel_manager_iface_init (gpointer g_iface,
+                            gpointer iface_data G_GNUC_UNUSED)
+{
+    TpChannelManagerIface *iface = g_iface;
+
+    iface->foreach_channel = haze_ft_manager_foreach;
+    iface->foreach_channel_class = haze_ft_manager_foreach_channel_class;
+    /* Every request is for a new transfer. */
+    iface->create_channel = haze_ft_manager_create_channel;
+    iface->ensure_channel = haze_ft_manager_create_channel;
+    iface->request_channel = haze_ft_manager_create_channel;
+}
+
+static void
+haze_xfer_update_progress (PurpleXfer *xfer,
+                           double percent)
+{
+    HazeFtChannel *chan = PURPLE_XFER_GET_HAZE_FT_CHANNEL (xfer);
+
+    if (chan != NULL)
+        haze_ft_channel_update_progress (chan);
+}
+
+static void
+haze_xfer_cancel_local (PurpleXfer *xfer)
+{
+    HazeFtChannel *chan = PURPLE_XFER_GET_HAZE_FT_CHANNEL (xfer);
+
+    if (chan != NULL)
+        haze_ft_channel_cancelled (chan, FALSE);
+}
+
+static void
+haze_xfer_cancel_remote (PurpleXfer *xfer)
+{
+    HazeFtChannel *chan = PURPLE_XFER_GET_HAZE_FT_CHANNEL (xfer);
+
+    if (chan != NULL)
+        haze_ft_channel_cancelled (chan, TRUE);
+}
+
+/* Having these two means libpurple never opens a local file: every transfer
+ * goes through a channel, or nowhere. */
+static gssize
+haze_xfer_ui_write (PurpleXfer *xfer,
+                    const guchar *buffer,
+                    gssize size)
+{
+    HazeFtChannel *chan = PURPLE_XFER_GET_HAZE_FT_CHANNEL (xfer);
+
+    if (chan == NULL)
+        return -1;
+
+    return haze_ft_channel_write (chan, buffer, size);
+}
+
+static gssize
+haze_xfer_ui_read (PurpleXfer *xfer,
+                   guchar **buffer,
+                   gssize size)
+{
+    HazeFtChannel *chan = PURPLE_XFER_GET_HAZE_FT_CHANNEL (xfer);
+
+    if (chan == NULL)
+        return -1;
+
+    return haze_ft_channel_read (chan, buffer, size);
+}
+
+static void
+haze_xfer_data_not_sent (PurpleXfer *xfer,
+                         const guchar *buffer,
+                         gsize size)
+{
+    HazeFtChannel *chan = PURPLE_XFER_GET_HAZE_FT_CHANNEL (xfer);
+
+    if (chan != NULL)
+        haze_ft_channel_data_not_sent (chan, size);
+}
+
+static PurpleXferUiOps
+xfer_ui_ops =
+{
+    NULL,                       /* new_xfer */
+    NULL,                       /* destroy */
+    NULL,                       /* add_xfer */
+    haze_xfer_update_progress,  /* update_progress */
+    haze_xfer_cancel_local,     /* cancel_local */
+    haze_xfer_cancel_remote,    /* cancel_remote */
+    haze_xfer_ui_write,         /* ui_write */
+    haze_xfer_ui_read,          /* ui_read */
+    haze_xfer_data_not_sent,    /* data_not_sent */
+    NULL,                       /* add_thumbnail */
+};
+
+PurpleXferUiOps *
+haze_get_xfer_ui_ops (void)
+{
+    return &xfer_ui_ops;
+}
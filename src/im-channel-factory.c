@@ -28,12 +28,42 @@
 
 #include "debug.h"
 #include "im-channel.h"
+#include "muc-channel.h"
 #include "connection.h"
+#include "connection-bulk.h"
+#include "util.h"
+
+/* How long an IM channel must be idle before its PurpleConversation is
+ * destroyed, in seconds; 0 means never. */
+#define HIBERNATE_SECONDS_DEFAULT 0
+
+/* How long a contact's chat state must settle before it's signalled */
+#define CHAT_STATE_DEBOUNCE_MS 500
+
+/* How many contacts without channels we remember the chat state of */
+#define MAX_BUFFERED_CHAT_STATES 256
+
+/* How long a buffered chat state stays believable.  Protocols which resend
+ * typing notifications do so every few seconds, so a state which hasn't been
+ * repeated for this long has most likely lapsed without our hearing. */
+#define CHAT_STATE_RESEND_MS 5000
+#define BUFFERED_CHAT_STATE_MAX_AGE_MS \
+    MAX (CHAT_STATE_DEBOUNCE_MS, CHAT_STATE_RESEND_MS)
+
+typedef struct {
+    TpChannelChatState state;
+    /* g_get_monotonic_time() when the contact last said so */
+    gint64 updated;
+} BufferedChatState;
 
 struct _HazeImChannelFactoryPrivate {
     HazeConnection *conn;
     GHashTable *channels;
+    /* TpHandle => BufferedChatState, for contacts who are typing but who
+     * have no channel yet */
+    GHashTable *chat_states;
     gulong status_changed_id;
+    guint hibernate_id;
     gboolean dispose_has_run;
 };
 
@@ -57,20 +87,134 @@ static HazeIMChannel *get_im_channel (HazeImChannelFactory *self,
     gboolean *created);
 static void close_all (HazeImChannelFactory *self);
 
+/* Typing alone doesn't warrant a channel, so if there isn't one the state is
+ * kept until there is. */
+static void
+buffer_chat_state (HazeImChannelFactory *self,
+                   TpHandle handle,
+                   TpChannelChatState state)
+{
+    GHashTable *chat_states = self->priv->chat_states;
+
+    if (chat_states == NULL)
+        return;
+
+    if (state == TP_CHANNEL_CHAT_STATE_ACTIVE ||
+        state == TP_CHANNEL_CHAT_STATE_INACTIVE)
+    {
+        /* Nothing worth telling a new channel about. */
+        g_hash_table_remove (chat_states, GUINT_TO_POINTER (handle));
+    }
+    else if (g_hash_table_size (chat_states) < MAX_BUFFERED_CHAT_STATES ||
+        g_hash_table_lookup_extended (chat_states, GUINT_TO_POINTER (handle),
+            NULL, NULL))
+    {
+        BufferedChatState *buffered = g_slice_new (BufferedChatState);
+
+        buffered->state = state;
+        buffered->updated = g_get_monotonic_time ();
+        g_hash_table_insert (chat_states, GUINT_TO_POINTER (handle),
+            buffered);
+    }
+}
+
+/* The contact repeated the state they're in, so it's still current. */
+static void
+touch_buffered_chat_state (HazeImChannelFactory *self,
+                           TpHandle handle)
+{
+    BufferedChatState *buffered;
+
+    if (self->priv->chat_states == NULL)
+        return;
+
+    buffered = g_hash_table_lookup (self->priv->chat_states,
+        GUINT_TO_POINTER (handle));
+
+    if (buffered != NULL)
+        buffered->updated = g_get_monotonic_time ();
+}
+
+static void
+buffered_chat_state_free (gpointer p)
+{
+    g_slice_free (BufferedChatState, p);
+}
+
+static TpChannelChatState
+chat_state_from_typing (PurpleTypingState typing)
+{
+    switch (typing)
+    {
+        case PURPLE_TYPING:
+            return TP_CHANNEL_CHAT_STATE_COMPOSING;
+        case PURPLE_TYPED:
+            return TP_CHANNEL_CHAT_STATE_PAUSED;
+        case PURPLE_NOT_TYPING:
+            return TP_CHANNEL_CHAT_STATE_ACTIVE;
+        default:
+            g_assert_not_reached ();
+    }
+
+    return TP_CHANNEL_CHAT_STATE_ACTIVE;
+}
+
+static gboolean
+emit_chat_state_cb (gpointer data)
+{
+    PurpleConversation *conv = data;
+    PurpleAccount *account = purple_conversation_get_account (conv);
+    HazeImChannelFactory *im_factory =
+        ACCOUNT_GET_HAZE_CONNECTION (account)->im_factory;
+    HazeConversationUiData *ui_data = PURPLE_CONV_GET_HAZE_UI_DATA (conv);
+    HazeIMChannel *chan = NULL;
+
+    ui_data->chat_state_timer = NULL;
+
+    /* The contact may have gone back to how they were. */
+    if (ui_data->pending_chat_state == ui_data->emitted_chat_state)
+        return FALSE;
+
+    ui_data->emitted_chat_state = ui_data->pending_chat_state;
+
+    if (im_factory->priv->channels != NULL)
+        chan = g_hash_table_lookup (im_factory->priv->channels,
+            GUINT_TO_POINTER (ui_data->contact_handle));
+
+    if (chan == NULL)
+    {
+        buffer_chat_state (im_factory, ui_data->contact_handle,
+            ui_data->emitted_chat_state);
+        return FALSE;
+    }
+
+    tp_svc_channel_interface_chat_state_emit_chat_state_changed (
+        (TpSvcChannelInterfaceChatState*)chan, ui_data->contact_handle,
+        ui_data->emitted_chat_state);
+
+    return FALSE;
+}
+
 static void
 conversation_updated_cb (PurpleConversation *conv,
                          PurpleConvUpdateType type,
                          gpointer unused)
 {
     PurpleAccount *account = purple_conversation_get_account (conv);
-    HazeImChannelFactory *im_factory =
-        ACCOUNT_GET_HAZE_CONNECTION (account)->im_factory;
+    HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (account);
     HazeConversationUiData *ui_data;
-    HazeIMChannel *chan;
-
-    PurpleTypingState typing;
     TpChannelChatState state;
 
+    if (type == PURPLE_CONV_UPDATE_CHATLEFT)
+    {
+        HazeMUCChannel *chan = PURPLE_CONV_GET_HAZE_MUC_CHANNEL (conv);
+
+        if (chan != NULL)
+            haze_muc_channel_left (chan);
+
+        return;
+    }
+
     if (type != PURPLE_CONV_UPDATE_TYPING)
         return;
 
@@ -81,28 +225,71 @@ conversation_updated_cb (PurpleConversation *conv,
     }
 
     ui_data = PURPLE_CONV_GET_HAZE_UI_DATA (conv);
-    typing = purple_conv_im_get_typing_state (PURPLE_CONV_IM (conv));
+    state = chat_state_from_typing (
+        purple_conv_im_get_typing_state (PURPLE_CONV_IM (conv)));
 
-    switch (typing)
+    /* Protocols which resend typing notifications, and contacts who stop
+     * and start typing, produce bursts of updates; only signal where the
+     * contact settles. */
+    ui_data->pending_chat_state = state;
+
+    if (ui_data->chat_state_timer != NULL)
+        return;
+
+    if (state != ui_data->emitted_chat_state)
+        ui_data->chat_state_timer = haze_timer_wheel_add (conn->timer_wheel,
+            CHAT_STATE_DEBOUNCE_MS, emit_chat_state_cb, conv);
+    else
+        touch_buffered_chat_state (conn->im_factory, ui_data->contact_handle);
+}
+
+/* libpurple only keeps track of a contact's typing in their conversation;
+ * when there is none, because their channel is hibernating or they have no
+ * channel, it emits these signals and forgets about it. */
+static void
+buddy_typing_cb (PurpleAccount *account,
+                 const char *who,
+                 gpointer data)
+{
+    PurpleTypingState typing = GPOINTER_TO_INT (data);
+    HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (account);
+    HazeImChannelFactory *self = conn->im_factory;
+    TpHandleRepoIface *contact_repo;
+    PurpleConversation *conv;
+    HazeIMChannel *chan;
+    TpHandle handle;
+
+    /* If there is a conversation, conversation_updated_cb () deals with it. */
+    if (self->priv->channels == NULL ||
+        purple_find_conversation_with_account (PURPLE_CONV_TYPE_IM, who,
+            account) != NULL)
+        return;
+
+    contact_repo = tp_base_connection_get_handles (TP_BASE_CONNECTION (conn),
+        TP_HANDLE_TYPE_CONTACT);
+    handle = tp_handle_ensure (contact_repo, who, NULL, NULL);
+
+    if (handle == 0)
+        return;
+
+    chan = g_hash_table_lookup (self->priv->channels,
+        GUINT_TO_POINTER (handle));
+
+    if (chan == NULL)
     {
-        case PURPLE_TYPING:
-            state = TP_CHANNEL_CHAT_STATE_COMPOSING;
-            break;
-        case PURPLE_TYPED:
-            state = TP_CHANNEL_CHAT_STATE_PAUSED;
-            break;
-        case PURPLE_NOT_TYPING:
-            state = TP_CHANNEL_CHAT_STATE_ACTIVE;
-            break;
-        default:
-            g_assert_not_reached ();
+        buffer_chat_state (self, handle, chat_state_from_typing (typing));
+        return;
     }
 
-    chan = get_im_channel (im_factory, ui_data->contact_handle,
-        ui_data->contact_handle, NULL, NULL);
+    /* Channels only hibernate once the contact has stopped typing, so that
+     * much is already known. */
+    if (typing == PURPLE_NOT_TYPING)
+        return;
 
-    tp_svc_channel_interface_chat_state_emit_chat_state_changed (
-        (TpSvcChannelInterfaceChatState*)chan, ui_data->contact_handle, state);
+    /* Otherwise, wake the channel and tell its new conversation, which
+     * signals the state in the usual way. */
+    conv = haze_im_channel_wake (chan);
+    purple_conv_im_set_typing_state (PURPLE_CONV_IM (conv), typing);
 }
 
 static void
@@ -113,6 +300,8 @@ haze_im_channel_factory_init (HazeImChannelFactory *self)
 
     self->priv->channels = g_hash_table_new_full (NULL, NULL,
         NULL, g_object_unref);
+    self->priv->chat_states = g_hash_table_new_full (NULL, NULL, NULL,
+        buffered_chat_state_free);
     self->priv->conn = NULL;
     self->priv->dispose_has_run = FALSE;
 }
@@ -180,6 +369,43 @@ status_changed_cb (HazeConnection *conn,
         close_all (self);
 }
 
+static guint
+get_hibernate_seconds (void)
+{
+    static guint hibernate_seconds = G_MAXUINT;
+
+    if (hibernate_seconds == G_MAXUINT)
+        hibernate_seconds = haze_get_tunable ("HAZE_IM_HIBERNATE_SECONDS",
+            HIBERNATE_SECONDS_DEFAULT);
+
+    return hibernate_seconds;
+}
+
+static gboolean
+hibernate_idle_channels_cb (gpointer user_data)
+{
+    HazeImChannelFactory *self = HAZE_IM_CHANNEL_FACTORY (user_data);
+    gint64 idle_since = g_get_monotonic_time () -
+        (gint64) get_hibernate_seconds () * G_USEC_PER_SEC;
+    GHashTableIter iter;
+    gpointer value;
+    guint hibernated = 0;
+
+    g_hash_table_iter_init (&iter, self->priv->channels);
+
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+        if (haze_im_channel_hibernate (value, idle_since))
+            hibernated++;
+    }
+
+    if (hibernated > 0)
+        DEBUG ("hibernated %u of %u IM channels", hibernated,
+            g_hash_table_size (self->priv->channels));
+
+    return TRUE;
+}
+
 static void
 haze_im_channel_factory_constructed (GObject *object)
 {
@@ -194,6 +420,13 @@ haze_im_channel_factory_constructed (GObject *object)
 
     self->priv->status_changed_id = g_signal_connect (self->priv->conn,
         "status-changed", (GCallback) status_changed_cb, self);
+
+    /* Checking twice per idle period means no channel stays awake for more
+     * than one and a half periods. */
+    if (get_hibernate_seconds () > 0)
+        self->priv->hibernate_id = g_timeout_add_seconds (
+            MAX (1, get_hibernate_seconds () / 2),
+            hibernate_idle_channels_cb, self);
 }
 
 static void
@@ -223,6 +456,13 @@ haze_im_channel_factory_class_init (HazeImChannelFactoryClass *klass)
 
     purple_signal_connect (conv_handle, "conversation-updated", klass,
         (PurpleCallback) conversation_updated_cb, NULL);
+    purple_signal_connect (conv_handle, "buddy-typing", klass,
+        (PurpleCallback) buddy_typing_cb, GINT_TO_POINTER (PURPLE_TYPING));
+    purple_signal_connect (conv_handle, "buddy-typed", klass,
+        (PurpleCallback) buddy_typing_cb, GINT_TO_POINTER (PURPLE_TYPED));
+    purple_signal_connect (conv_handle, "buddy-typing-stopped", klass,
+        (PurpleCallback) buddy_typing_cb,
+        GINT_TO_POINTER (PURPLE_NOT_TYPING));
 }
 
 static void
@@ -266,6 +506,7 @@ new_im_channel (HazeImChannelFactory *self,
 {
     HazeIMChannel *chan;
     GSList *requests = NULL;
+    BufferedChatState *buffered;
 
     g_assert (HAZE_IS_IM_CHANNEL_FACTORY (self));
 
@@ -296,6 +537,25 @@ new_im_channel (HazeImChannelFactory *self,
         TP_EXPORTABLE_CHANNEL (chan), requests);
     g_slist_free (requests);
 
+    buffered = g_hash_table_lookup (self->priv->chat_states,
+        GUINT_TO_POINTER (handle));
+
+    if (buffered != NULL)
+    {
+        gint64 age_ms = (g_get_monotonic_time () - buffered->updated) / 1000;
+
+        if (age_ms <= BUFFERED_CHAT_STATE_MAX_AGE_MS)
+            tp_svc_channel_interface_chat_state_emit_chat_state_changed (
+                (TpSvcChannelInterfaceChatState *) chan, handle,
+                buffered->state);
+        else
+            DEBUG ("dropping handle %u's chat state from %" G_GINT64_FORMAT
+                "ms ago", handle, age_ms);
+
+        g_hash_table_remove (self->priv->chat_states,
+            GUINT_TO_POINTER (handle));
+    }
+
     return chan;
 }
 
@@ -324,6 +584,15 @@ get_im_channel (HazeImChannelFactory *self,
     return chan;
 }
 
+gboolean
+haze_im_channel_factory_has_channel (HazeImChannelFactory *self,
+                                     TpHandle handle)
+{
+    return (self->priv->channels != NULL &&
+        g_hash_table_lookup (self->priv->channels,
+            GUINT_TO_POINTER (handle)) != NULL);
+}
+
 static void
 close_all (HazeImChannelFactory *self)
 {
@@ -338,12 +607,20 @@ close_all (HazeImChannelFactory *self)
         g_hash_table_destroy (tmp);
     }
 
+    tp_clear_pointer (&self->priv->chat_states, g_hash_table_unref);
+
     if (self->priv->status_changed_id != 0)
     {
         g_signal_handler_disconnect (self->priv->conn,
             self->priv->status_changed_id);
         self->priv->status_changed_id = 0;
     }
+
+    if (self->priv->hibernate_id != 0)
+    {
+        g_source_remove (self->priv->hibernate_id);
+        self->priv->hibernate_id = 0;
+    }
 }
 
 struct _ForeachData
@@ -383,15 +660,69 @@ haze_write_im (PurpleConversation *conv,
                time_t mtime)
 {
     PurpleAccount *account = purple_conversation_get_account (conv);
-    HazeImChannelFactory *im_factory =
-        ACCOUNT_GET_HAZE_CONNECTION (account)->im_factory;
+    HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (account);
+    HazeImChannelFactory *im_factory = conn->im_factory;
     HazeConversationUiData *ui_data = PURPLE_CONV_GET_HAZE_UI_DATA (conv);
-    HazeIMChannel *chan = get_im_channel (im_factory, ui_data->contact_handle,
+    HazeIMChannel *chan;
+
+    if (!haze_im_channel_factory_has_channel (im_factory,
+            ui_data->contact_handle) &&
+        haze_connection_bulk_receive (conn, ui_data->contact_handle,
+            xhtml_message, flags, mtime))
+        return;
+
+    chan = get_im_channel (im_factory, ui_data->contact_handle,
         ui_data->contact_handle, NULL, NULL);
 
     haze_im_channel_receive (chan, xhtml_message, flags, mtime);
 }
 
+static void
+haze_write_chat (PurpleConversation *conv,
+                 const char *who,
+                 const char *xhtml_message,
+                 PurpleMessageFlags flags,
+                 time_t mtime)
+{
+    HazeMUCChannel *chan = PURPLE_CONV_GET_HAZE_MUC_CHANNEL (conv);
+
+    if (chan != NULL)
+        haze_muc_channel_receive (chan, who, xhtml_message, flags, mtime);
+}
+
+static void
+haze_chat_add_users (PurpleConversation *conv,
+                     GList *cbuddies,
+                     gboolean new_arrivals)
+{
+    HazeMUCChannel *chan = PURPLE_CONV_GET_HAZE_MUC_CHANNEL (conv);
+
+    if (chan != NULL)
+        haze_muc_channel_add_users (chan, cbuddies);
+}
+
+static void
+haze_chat_rename_user (PurpleConversation *conv,
+                       const char *old_name,
+                       const char *new_name,
+                       const char *new_alias)
+{
+    HazeMUCChannel *chan = PURPLE_CONV_GET_HAZE_MUC_CHANNEL (conv);
+
+    if (chan != NULL)
+        haze_muc_channel_rename_user (chan, old_name, new_name);
+}
+
+static void
+haze_chat_remove_users (PurpleConversation *conv,
+                        GList *users)
+{
+    HazeMUCChannel *chan = PURPLE_CONV_GET_HAZE_MUC_CHANNEL (conv);
+
+    if (chan != NULL)
+        haze_muc_channel_remove_users (chan, users);
+}
+
 static void
 haze_write_conv (PurpleConversation *conv,
                  const char *name,
@@ -429,6 +760,13 @@ haze_create_conversation (PurpleConversation *conv)
 
     DEBUG ("(PurpleConversation *)%p created", conv);
 
+    if (conv->type == PURPLE_CONV_TYPE_CHAT)
+    {
+        haze_muc_channel_factory_conversation_created (
+            ACCOUNT_GET_HAZE_CONNECTION (account)->muc_factory, conv);
+        return;
+    }
+
     if (conv->type != PURPLE_CONV_TYPE_IM)
     {
         DEBUG ("not an IM conversation; ignoring");
@@ -438,6 +776,9 @@ haze_create_conversation (PurpleConversation *conv)
     g_assert (who);
 
     conv->ui_data = ui_data = g_slice_new0 (HazeConversationUiData);
+    /* which is what clients assume contacts start in */
+    ui_data->emitted_chat_state = TP_CHANNEL_CHAT_STATE_INACTIVE;
+    ui_data->pending_chat_state = TP_CHANNEL_CHAT_STATE_INACTIVE;
 
     ui_data->contact_handle = tp_handle_ensure (contact_repo, who, NULL, NULL);
     g_assert (ui_data->contact_handle);
@@ -447,8 +788,25 @@ static void
 haze_destroy_conversation (PurpleConversation *conv)
 {
     HazeConversationUiData *ui_data;
+    HazeTimerWheel *timer_wheel;
 
     DEBUG ("(PurpleConversation *)%p destroyed", conv);
+
+    if (conv->type == PURPLE_CONV_TYPE_CHAT)
+    {
+        HazeMUCChannel *chan = PURPLE_CONV_GET_HAZE_MUC_CHANNEL (conv);
+
+        /* The channel would have forgotten the conversation if it were
+         * destroying it itself, so libpurple is taking the room away. */
+        if (chan != NULL)
+        {
+            haze_muc_channel_forget_conversation (chan);
+            haze_muc_channel_left (chan);
+        }
+
+        return;
+    }
+
     if (conv->type != PURPLE_CONV_TYPE_IM)
     {
         DEBUG ("not an IM conversation; ignoring");
@@ -456,9 +814,14 @@ haze_destroy_conversation (PurpleConversation *conv)
     }
 
     ui_data = PURPLE_CONV_GET_HAZE_UI_DATA (conv);
+    timer_wheel = ACCOUNT_GET_HAZE_CONNECTION (
+        purple_conversation_get_account (conv))->timer_wheel;
+
+    if (ui_data->resend_typing_timer != NULL)
+        haze_timer_wheel_remove (timer_wheel, ui_data->resend_typing_timer);
 
-    if (ui_data->resend_typing_timeout_id)
-        g_source_remove (ui_data->resend_typing_timeout_id);
+    if (ui_data->chat_state_timer != NULL)
+        haze_timer_wheel_remove (timer_wheel, ui_data->chat_state_timer);
 
     g_slice_free (HazeConversationUiData, ui_data);
     conv->ui_data = NULL;
@@ -469,12 +832,12 @@ conversation_ui_ops =
 {
     haze_create_conversation,  /* create_conversation */
     haze_destroy_conversation, /* destroy_conversation */
-    NULL,                      /* write_chat */
+    haze_write_chat,           /* write_chat */
     haze_write_im,             /* write_im */
     haze_write_conv,           /* write_conv */
-    NULL,                      /* chat_add_users */
-    NULL,                      /* chat_rename_user */
-    NULL,                      /* chat_remove_users */
+    haze_chat_add_users,       /* chat_add_users */
+    haze_chat_rename_user,     /* chat_rename_user */
+    haze_chat_remove_users,    /* chat_remove_users */
     NULL,                      /* chat_update_user */
 
     NULL,                      /* present */
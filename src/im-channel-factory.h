@@ -22,6 +22,7 @@
  */
 
 #include <glib-object.h>
+#include <telepathy-glib/telepathy-glib.h>
 
 #include <libpurple/conversation.h>
 
@@ -57,6 +58,9 @@ struct _HazeImChannelFactoryClass {
 
 GType haze_im_channel_factory_get_type (void) G_GNUC_CONST;
 
+gboolean haze_im_channel_factory_has_channel (HazeImChannelFactory *self,
+    TpHandle handle);
+
 PurpleConversationUiOps *haze_get_conv_ui_ops (void);
 
 G_END_DECLS
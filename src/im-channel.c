@@ -26,15 +26,53 @@
 
 #include "connection.h"
 #include "debug.h"
+#include "markup.h"
+#include "pending-spool.h"
+#include "util.h"
+
+#include "extensions/extensions.h"
+
+/* The most memory a channel keeps around for received messages' text */
+#define SCRATCH_MAX_SIZE 4096
+
+/* How many unacknowledged messages a channel, and all the channels on a
+ * connection, keep in memory before spooling further messages to disk. */
+#define MAX_PENDING_DEFAULT 1000
+#define MAX_PENDING_TOTAL_DEFAULT 10000
+
+/* How long to wait for the rest of a burst of offline messages before
+ * signalling a batch containing one */
+#define DELAYED_BATCH_MS 250
 
 struct _HazeIMChannelPrivate
 {
+    /* NULL while the channel is hibernating */
     PurpleConversation *conv;
+    /* when a message was last sent or received, or the chat state set, in
+     * monotonic µs */
+    gint64 last_activity;
+    /* reused to hold received messages' plain text */
+    GString *scratch;
+    /* how many messages are pending in the TpMessageMixin */
+    guint n_pending;
+    /* received messages waiting to go into the TpMessageMixin, once the
+     * client has acknowledged some of those that are there */
+    HazePendingSpool *spool;
+    /* Message_Part_Lists of messages received since MessagesReceived was
+     * last emitted, and the timeout or idle which will emit it */
+    GPtrArray *batch;
+    guint batch_id;
+    gboolean batch_has_delayed;
+    /* unique names of the clients which have called Subscribe, and whose
+     * names we are watching; no batches are collected while it is empty */
+    GHashTable *batch_subscribers;
     gboolean dispose_has_run;
 };
 
 static void destroyable_iface_init (gpointer g_iface, gpointer iface_data);
 static void chat_state_iface_init (gpointer g_iface, gpointer iface_data);
+static void message_batches_iface_init (gpointer g_iface,
+    gpointer iface_data);
 
 G_DEFINE_TYPE_WITH_CODE(HazeIMChannel, haze_im_channel, TP_TYPE_BASE_CHANNEL,
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_TYPE_TEXT,
@@ -43,12 +81,33 @@ G_DEFINE_TYPE_WITH_CODE(HazeIMChannel, haze_im_channel, TP_TYPE_BASE_CHANNEL,
         tp_message_mixin_messages_iface_init);
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_INTERFACE_DESTROYABLE,
         destroyable_iface_init);
+    G_IMPLEMENT_INTERFACE (
+        HAZE_TYPE_SVC_CHANNEL_INTERFACE_HAZE_MESSAGE_BATCHES,
+        message_batches_iface_init);
 
     /* For some reason we reimplement ChatState rather than having the
      * TpMessageMixin do it :-( */
     G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_INTERFACE_CHAT_STATE,
         chat_state_iface_init))
 
+static HazeConnection *
+get_connection (HazeIMChannel *self)
+{
+  return HAZE_CONNECTION (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (self)));
+}
+
+static HazeSendScheduler *
+get_send_scheduler (HazeIMChannel *self)
+{
+  return get_connection (self)->send_scheduler;
+}
+
+static void page_in (HazeIMChannel *self);
+static void ensure_conversation (HazeIMChannel *self);
+static void pending_messages_removed_cb (HazeIMChannel *self,
+    const GArray *ids, gpointer user_data);
+
 static void
 haze_im_channel_close (TpBaseChannel *base)
 {
@@ -57,6 +116,8 @@ haze_im_channel_close (TpBaseChannel *base)
     /* The IM factory will resurrect the channel if we have pending
      * messages. When we're resurrected, we want the initiator
      * to be the contact who sent us those messages, if it isn't already */
+    page_in (self);
+
     if (tp_message_mixin_has_pending_messages ((GObject *) self, NULL))
     {
         DEBUG ("Not really closing, I still have pending messages");
@@ -66,6 +127,8 @@ haze_im_channel_close (TpBaseChannel *base)
     }
     else
     {
+        haze_send_scheduler_cancel (get_send_scheduler (self),
+            (GObject *) self);
         tp_clear_pointer (&self->priv->conv, purple_conversation_destroy);
         tp_base_channel_destroyed (base);
     }
@@ -105,6 +168,8 @@ haze_im_channel_get_interfaces (TpBaseChannel *base)
 
   g_ptr_array_add (interfaces, TP_IFACE_CHANNEL_INTERFACE_MESSAGES);
   g_ptr_array_add (interfaces, TP_IFACE_CHANNEL_INTERFACE_DESTROYABLE);
+  g_ptr_array_add (interfaces,
+      HAZE_IFACE_CHANNEL_INTERFACE_HAZE_MESSAGE_BATCHES);
 
   return interfaces;
 }
@@ -125,7 +190,12 @@ haze_im_channel_destroy (TpSvcChannelInterfaceDestroyable *iface,
 
     DEBUG ("called on %p", self);
 
-    /* Clear out any pending messages */
+    /* Clear out any pending messages, including those spooled to disk.
+     * tp_message_mixin_clear () doesn't emit PendingMessagesRemoved, so
+     * pending_messages_removed_cb () won't keep count for us. */
+    haze_pending_spool_clear (self->priv->spool);
+    get_connection (self)->pending_messages -= self->priv->n_pending;
+    self->priv->n_pending = 0;
     tp_message_mixin_clear ((GObject *) self);
 
     haze_im_channel_close (TP_BASE_CHANNEL (self));
@@ -144,6 +214,151 @@ destroyable_iface_init (gpointer g_iface,
 #undef IMPLEMENT
 }
 
+static void
+drop_batch (HazeIMChannel *self)
+{
+    HazeIMChannelPrivate *priv = self->priv;
+
+    if (priv->batch_id != 0)
+    {
+        g_source_remove (priv->batch_id);
+        priv->batch_id = 0;
+    }
+
+    g_ptr_array_set_size (priv->batch, 0);
+    priv->batch_has_delayed = FALSE;
+}
+
+static void batch_subscriber_owner_changed_cb (TpDBusDaemon *bus_daemon,
+    const gchar *name, const gchar *new_owner, gpointer user_data);
+
+static TpDBusDaemon *
+get_bus_daemon (HazeIMChannel *self)
+{
+    return tp_base_connection_get_dbus_daemon (
+        tp_base_channel_get_connection (TP_BASE_CHANNEL (self)));
+}
+
+static void
+remove_batch_subscriber (HazeIMChannel *self,
+                         const gchar *name)
+{
+    HazeIMChannelPrivate *priv = self->priv;
+
+    if (!g_hash_table_contains (priv->batch_subscribers, name))
+        return;
+
+    tp_dbus_daemon_cancel_name_owner_watch (get_bus_daemon (self), name,
+        batch_subscriber_owner_changed_cb, self);
+    g_hash_table_remove (priv->batch_subscribers, name);
+
+    if (g_hash_table_size (priv->batch_subscribers) == 0)
+    {
+        DEBUG ("channel %u: nobody wants MessagesReceived any more",
+            tp_base_channel_get_target_handle (TP_BASE_CHANNEL (self)));
+        drop_batch (self);
+    }
+}
+
+static void
+batch_subscriber_owner_changed_cb (TpDBusDaemon *bus_daemon,
+                                   const gchar *name,
+                                   const gchar *new_owner,
+                                   gpointer user_data)
+{
+    HazeIMChannel *self = HAZE_IM_CHANNEL (user_data);
+
+    /* A unique name never comes back once its owner has gone. */
+    if (tp_str_empty (new_owner))
+        remove_batch_subscriber (self, name);
+}
+
+static void
+forget_batch_subscribers (HazeIMChannel *self)
+{
+    HazeIMChannelPrivate *priv = self->priv;
+    GHashTableIter iter;
+    gpointer name;
+
+    g_hash_table_iter_init (&iter, priv->batch_subscribers);
+
+    while (g_hash_table_iter_next (&iter, &name, NULL))
+    {
+        tp_dbus_daemon_cancel_name_owner_watch (get_bus_daemon (self), name,
+            batch_subscriber_owner_changed_cb, self);
+        g_hash_table_iter_remove (&iter);
+    }
+
+    drop_batch (self);
+}
+
+/**
+ * haze_im_channel_subscribe
+ *
+ * Implements D-Bus method Subscribe
+ * on interface org.freedesktop.Telepathy.Channel.Interface.Haze.MessageBatches
+ */
+static void
+haze_im_channel_subscribe (HazeSvcChannelInterfaceHazeMessageBatches *iface,
+                           DBusGMethodInvocation *context)
+{
+    HazeIMChannel *self = HAZE_IM_CHANNEL (iface);
+    HazeIMChannelPrivate *priv = self->priv;
+    gchar *sender = dbus_g_method_get_sender (context);
+
+    if (g_hash_table_contains (priv->batch_subscribers, sender))
+    {
+        g_free (sender);
+    }
+    else
+    {
+        DEBUG ("channel %u: %s wants MessagesReceived",
+            tp_base_channel_get_target_handle (TP_BASE_CHANNEL (self)),
+            sender);
+        tp_dbus_daemon_watch_name_owner (get_bus_daemon (self), sender,
+            batch_subscriber_owner_changed_cb, self, NULL);
+        /* the table takes ownership of sender */
+        g_hash_table_add (priv->batch_subscribers, sender);
+    }
+
+    haze_svc_channel_interface_haze_message_batches_return_from_subscribe (
+        context);
+}
+
+/**
+ * haze_im_channel_unsubscribe
+ *
+ * Implements D-Bus method Unsubscribe
+ * on interface org.freedesktop.Telepathy.Channel.Interface.Haze.MessageBatches
+ */
+static void
+haze_im_channel_unsubscribe (HazeSvcChannelInterfaceHazeMessageBatches *iface,
+                             DBusGMethodInvocation *context)
+{
+    HazeIMChannel *self = HAZE_IM_CHANNEL (iface);
+    gchar *sender = dbus_g_method_get_sender (context);
+
+    remove_batch_subscriber (self, sender);
+    g_free (sender);
+
+    haze_svc_channel_interface_haze_message_batches_return_from_unsubscribe (
+        context);
+}
+
+static void
+message_batches_iface_init (gpointer g_iface,
+                            gpointer iface_data)
+{
+    HazeSvcChannelInterfaceHazeMessageBatchesClass *klass = g_iface;
+
+#define IMPLEMENT(x) \
+    haze_svc_channel_interface_haze_message_batches_implement_##x (\
+        klass, haze_im_channel_##x)
+    IMPLEMENT(subscribe);
+    IMPLEMENT(unsubscribe);
+#undef IMPLEMENT
+}
+
 const gchar *typing_state_names[] = {
     "not typing",
     "typing",
@@ -167,7 +382,7 @@ resend_typing_cb (gpointer data)
     else
     {
         DEBUG ("clearing resend_typing_cb timeout");
-        ui_data->resend_typing_timeout_id = 0;
+        ui_data->resend_typing_timer = NULL;
         return FALSE;
     }
 }
@@ -180,10 +395,10 @@ haze_im_channel_set_chat_state (TpSvcChannelInterfaceChatState *self,
 {
     HazeIMChannel *chan = HAZE_IM_CHANNEL (self);
 
-    PurpleConversation *conv = chan->priv->conv;
-    HazeConversationUiData *ui_data = PURPLE_CONV_GET_HAZE_UI_DATA (conv);
-    PurpleConnection *gc = purple_conversation_get_gc (conv);
-    const gchar *who = purple_conversation_get_name (conv);
+    PurpleConversation *conv;
+    HazeConversationUiData *ui_data;
+    PurpleConnection *gc;
+    const gchar *who;
 
     GError *error = NULL;
     PurpleTypingState typing = PURPLE_NOT_TYPING;
@@ -191,11 +406,18 @@ haze_im_channel_set_chat_state (TpSvcChannelInterfaceChatState *self,
 
     g_assert (_chat_state_available (chan));
 
-    if (ui_data->resend_typing_timeout_id)
+    ensure_conversation (chan);
+    conv = chan->priv->conv;
+    ui_data = PURPLE_CONV_GET_HAZE_UI_DATA (conv);
+    gc = purple_conversation_get_gc (conv);
+    who = purple_conversation_get_name (conv);
+
+    if (ui_data->resend_typing_timer != NULL)
     {
         DEBUG ("clearing existing resend_typing_cb timeout");
-        g_source_remove (ui_data->resend_typing_timeout_id);
-        ui_data->resend_typing_timeout_id = 0;
+        haze_timer_wheel_remove (get_connection (chan)->timer_wheel,
+            ui_data->resend_typing_timer);
+        ui_data->resend_typing_timer = NULL;
     }
 
     switch (state)
@@ -242,7 +464,8 @@ haze_im_channel_set_chat_state (TpSvcChannelInterfaceChatState *self,
      */
     if (timeout && typing != PURPLE_NOT_TYPING)
     {
-        ui_data->resend_typing_timeout_id = g_timeout_add (timeout * 1000,
+        ui_data->resend_typing_timer = haze_timer_wheel_add (
+            get_connection (chan)->timer_wheel, timeout * 1000,
             resend_typing_cb, conv);
     }
 
@@ -260,6 +483,19 @@ chat_state_iface_init (gpointer g_iface, gpointer iface_data)
 #undef IMPLEMENT
 }
 
+static void
+send_piece (GObject *obj,
+            const gchar *recipient,
+            const gchar *text,
+            PurpleMessageFlags flags)
+{
+  HazeIMChannel *self = HAZE_IM_CHANNEL (obj);
+
+  ensure_conversation (self);
+  purple_conv_im_send_with_flags (PURPLE_CONV_IM (self->priv->conv), text,
+      flags);
+}
+
 static void
 haze_im_channel_send (GObject *obj,
                       TpMessage *message,
@@ -270,7 +506,7 @@ haze_im_channel_send (GObject *obj,
   const gchar *content_type, *text;
   guint type = 0;
   PurpleMessageFlags flags = 0;
-  gchar *escaped, *line_broken, *reapostrophised;
+  const gchar *prefix = NULL;
   GError *error = NULL;
 
   if (tp_message_count_parts (message) != 2)
@@ -308,13 +544,12 @@ haze_im_channel_send (GObject *obj,
        *     for actions and doesn't do special stuff to messages which happen
        *     to start with "/me ".
        */
-      text = g_strconcat ("/me ", text, NULL);
+      prefix = "/me ";
       break;
     case TP_CHANNEL_TEXT_MESSAGE_TYPE_AUTO_REPLY:
       flags |= PURPLE_MESSAGE_AUTO_RESP;
       /* deliberate fall-through: */
     case TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL:
-      text = g_strdup (text);
       break;
     /* TODO: libpurple should probably have a NOTICE flag, and then we could
      * support TP_CHANNEL_TEXT_MESSAGE_TYPE_NOTICE.
@@ -325,23 +560,8 @@ haze_im_channel_send (GObject *obj,
       goto err;
     }
 
-  escaped = g_markup_escape_text (text, -1);
-  /* avoid line breaks being swallowed! */
-  line_broken = purple_strreplace (escaped, "\n", "<br>");
-  /* This is a workaround for prpl-yahoo, which in libpurple <= 2.3.1 could
-   * not deal with &apos; and would send it literally.
-   * TODO: When we depend on new enough libpurple, remove this workaround.
-   */
-  reapostrophised = purple_strreplace (line_broken, "&apos;", "'");
-
-  purple_conv_im_send_with_flags (PURPLE_CONV_IM (self->priv->conv),
-      reapostrophised, flags);
-
-  g_free (reapostrophised);
-  g_free (line_broken);
-  g_free (escaped);
-
-  tp_message_mixin_sent (obj, message, 0, "", NULL);
+  haze_send_scheduler_push (get_send_scheduler (self), obj, NULL, message,
+      prefix, text, flags, send_piece);
   return;
 
 err:
@@ -401,8 +621,17 @@ haze_im_channel_constructor (GType type, guint n_props,
     tp_message_mixin_implement_sending (obj, haze_im_channel_send, 3,
         supported_message_types, 0, 0, supported_content_types);
 
+    priv->scratch = g_string_new (NULL);
+    priv->spool = haze_pending_spool_new ();
+    priv->batch = g_ptr_array_new_with_free_func (
+        (GDestroyNotify) g_ptr_array_unref);
+    priv->batch_subscribers = g_hash_table_new_full (g_str_hash, g_str_equal,
+        g_free, NULL);
     priv->dispose_has_run = FALSE;
 
+    g_signal_connect (obj, "pending-messages-removed",
+        G_CALLBACK (pending_messages_removed_cb), NULL);
+
     return obj;
 }
 
@@ -416,13 +645,33 @@ haze_im_channel_dispose (GObject *obj)
         return;
     priv->dispose_has_run = TRUE;
 
+    haze_send_scheduler_cancel (get_send_scheduler (chan), obj);
     tp_clear_pointer (&priv->conv, purple_conversation_destroy);
 
+    forget_batch_subscribers (chan);
+
+    /* tp_message_mixin_finalize () drops whatever is still pending. */
+    get_connection (chan)->pending_messages -= priv->n_pending;
+    priv->n_pending = 0;
+
     tp_message_mixin_finalize (obj);
 
     G_OBJECT_CLASS (haze_im_channel_parent_class)->dispose (obj);
 }
 
+static void
+haze_im_channel_finalize (GObject *obj)
+{
+    HazeIMChannel *chan = HAZE_IM_CHANNEL (obj);
+
+    g_string_free (chan->priv->scratch, TRUE);
+    haze_pending_spool_free (chan->priv->spool);
+    g_ptr_array_unref (chan->priv->batch);
+    g_hash_table_unref (chan->priv->batch_subscribers);
+
+    G_OBJECT_CLASS (haze_im_channel_parent_class)->finalize (obj);
+}
+
 static gchar *
 haze_im_channel_get_object_path_suffix (TpBaseChannel *chan)
 {
@@ -440,6 +689,7 @@ haze_im_channel_class_init (HazeIMChannelClass *klass)
 
     object_class->constructor = haze_im_channel_constructor;
     object_class->dispose = haze_im_channel_dispose;
+    object_class->finalize = haze_im_channel_finalize;
 
     base_class->channel_type = TP_IFACE_CHANNEL_TYPE_TEXT;
     base_class->get_interfaces = haze_im_channel_get_interfaces;
@@ -476,19 +726,90 @@ haze_im_channel_start (HazeIMChannel *self)
         tp_base_channel_get_target_handle (base));
     priv->conv = purple_conversation_new (PURPLE_CONV_TYPE_IM,
         conn->account, recipient);
+    priv->last_activity = g_get_monotonic_time ();
+}
+
+/* Brings a hibernating channel's conversation back.  If libpurple has
+ * already made a new one because a message arrived, purple_conversation_new()
+ * returns that. */
+static void
+ensure_conversation (HazeIMChannel *self)
+{
+  if (self->priv->conv == NULL)
+    {
+      DEBUG ("channel %u: waking up",
+          tp_base_channel_get_target_handle (TP_BASE_CHANNEL (self)));
+      haze_im_channel_start (self);
+    }
+
+  self->priv->last_activity = g_get_monotonic_time ();
+}
+
+/*
+ * haze_im_channel_hibernate:
+ * @idle_since: a monotonic time, in µs
+ *
+ * Destroys the channel's PurpleConversation, and with it whatever libpurple
+ * keeps for it, if nothing has happened on the channel since @idle_since and
+ * it has no messages waiting to be acknowledged.  The conversation is made
+ * again when a message is next sent or received.
+ *
+ * Returns: %TRUE if the channel is now hibernating
+ */
+gboolean
+haze_im_channel_hibernate (HazeIMChannel *self,
+                           gint64 idle_since)
+{
+  HazeIMChannelPrivate *priv = self->priv;
+  HazeConversationUiData *ui_data;
+
+  if (priv->conv == NULL || priv->last_activity > idle_since)
+    return FALSE;
+
+  if (priv->n_pending > 0 || !haze_pending_spool_is_empty (priv->spool))
+    return FALSE;
+
+  /* Either side still typing counts as activity. */
+  ui_data = PURPLE_CONV_GET_HAZE_UI_DATA (priv->conv);
+
+  if (ui_data->active_state != PURPLE_NOT_TYPING ||
+      ui_data->chat_state_timer != NULL ||
+      purple_conv_im_get_typing_state (PURPLE_CONV_IM (priv->conv)) !=
+          PURPLE_NOT_TYPING)
+    return FALSE;
+
+  DEBUG ("channel %u: hibernating",
+      tp_base_channel_get_target_handle (TP_BASE_CHANNEL (self)));
+  tp_clear_pointer (&priv->conv, purple_conversation_destroy);
+  return TRUE;
+}
+
+/*
+ * haze_im_channel_wake:
+ *
+ * Brings the channel's conversation back if it is hibernating, and counts
+ * as activity on the channel either way.
+ *
+ * Returns: (transfer none): the channel's conversation
+ */
+PurpleConversation *
+haze_im_channel_wake (HazeIMChannel *self)
+{
+  ensure_conversation (self);
+  return self->priv->conv;
 }
 
 static TpMessage *
 _make_message (HazeIMChannel *self,
                char *text_plain,
                PurpleMessageFlags flags,
-               time_t mtime)
+               time_t mtime,
+               time_t received)
 {
   TpBaseChannel *base = TP_BASE_CHANNEL (self);
   TpBaseConnection *base_conn = tp_base_channel_get_connection (base);
   TpMessage *message = tp_cm_message_new (base_conn, 2);
   TpChannelTextMessageType type = TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL;
-  time_t now = time (NULL);
 
   if (flags & PURPLE_MESSAGE_AUTO_RESP)
     type = TP_CHANNEL_TEXT_MESSAGE_TYPE_AUTO_REPLY;
@@ -502,10 +823,10 @@ _make_message (HazeIMChannel *self,
   /* FIXME: the second half of this test shouldn't be necessary but prpl-jabber
    *        or the test are broken.
    */
-  if (flags & PURPLE_MESSAGE_DELAYED || mtime != now)
+  if (flags & PURPLE_MESSAGE_DELAYED || mtime != received)
     tp_message_set_int64 (message, 0, "message-sent", mtime);
 
-  tp_message_set_int64 (message, 0, "message-received", now);
+  tp_message_set_int64 (message, 0, "message-received", received);
 
   /* Body */
   tp_message_set_string (message, 1, "content-type", "text/plain");
@@ -541,6 +862,193 @@ _make_delivery_report (HazeIMChannel *self,
   return report;
 }
 
+static void
+get_max_pending (guint *per_channel,
+                 guint *per_connection)
+{
+  static guint max_pending = G_MAXUINT;
+  static guint max_pending_total = G_MAXUINT;
+
+  if (max_pending == G_MAXUINT)
+    {
+      max_pending = haze_get_tunable ("HAZE_MAX_PENDING_MESSAGES",
+          MAX_PENDING_DEFAULT);
+      max_pending_total = haze_get_tunable (
+          "HAZE_MAX_PENDING_MESSAGES_TOTAL", MAX_PENDING_TOTAL_DEFAULT);
+    }
+
+  *per_channel = max_pending;
+  *per_connection = max_pending_total;
+}
+
+/* Whether the TpMessageMixin has room for another message.  A channel with
+ * nothing pending always has room, so that every channel with spooled
+ * messages has something for the client to acknowledge, which is what
+ * brings them back.
+ */
+static gboolean
+has_room_for_pending (HazeIMChannel *self)
+{
+  guint per_channel, per_connection;
+
+  if (self->priv->n_pending == 0)
+    return TRUE;
+
+  get_max_pending (&per_channel, &per_connection);
+
+  if (per_channel != 0 && self->priv->n_pending >= per_channel)
+    return FALSE;
+
+  if (per_connection != 0 &&
+      get_connection (self)->pending_messages >= per_connection)
+    return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+emit_batch_cb (gpointer user_data)
+{
+  HazeIMChannel *self = user_data;
+  HazeIMChannelPrivate *priv = self->priv;
+
+  DEBUG ("channel %u: signalling %u messages",
+      tp_base_channel_get_target_handle (TP_BASE_CHANNEL (self)),
+      priv->batch->len);
+
+  haze_svc_channel_interface_haze_message_batches_emit_messages_received (
+      self, priv->batch);
+  g_ptr_array_set_size (priv->batch, 0);
+  priv->batch_has_delayed = FALSE;
+  priv->batch_id = 0;
+  return FALSE;
+}
+
+/* Called once the TpMessageMixin has signalled @message, so it has its
+ * pending-message-id. */
+static void
+add_to_batch (HazeIMChannel *self,
+              TpMessage *message,
+              PurpleMessageFlags flags)
+{
+  HazeIMChannelPrivate *priv = self->priv;
+  guint n_parts;
+  GPtrArray *parts;
+  guint i;
+
+  /* Nobody would hear the batch, so don't bother copying the message. */
+  if (g_hash_table_size (priv->batch_subscribers) == 0)
+    return;
+
+  n_parts = tp_message_count_parts (message);
+  parts = g_ptr_array_new_full (n_parts, (GDestroyNotify) g_hash_table_unref);
+
+  for (i = 0; i < n_parts; i++)
+    g_ptr_array_add (parts, tp_message_dup_part (message, i));
+
+  g_ptr_array_add (priv->batch, parts);
+
+  if ((flags & PURPLE_MESSAGE_DELAYED) && !priv->batch_has_delayed)
+    {
+      /* Offline messages can take a few iterations to all arrive. */
+      priv->batch_has_delayed = TRUE;
+
+      if (priv->batch_id != 0)
+        g_source_remove (priv->batch_id);
+
+      priv->batch_id = g_timeout_add (DELAYED_BATCH_MS, emit_batch_cb, self);
+    }
+  else if (priv->batch_id == 0)
+    {
+      priv->batch_id = g_idle_add (emit_batch_cb, self);
+    }
+}
+
+static void
+take_received (HazeIMChannel *self,
+               gchar *text_plain,
+               PurpleMessageFlags flags,
+               time_t mtime,
+               time_t received)
+{
+  TpMessage *message;
+
+  if (flags & PURPLE_MESSAGE_RECV)
+    message = _make_message (self, text_plain, flags, mtime, received);
+  else
+    message = _make_delivery_report (self, text_plain);
+
+  self->priv->n_pending++;
+  get_connection (self)->pending_messages++;
+  tp_message_mixin_take_received ((GObject *) self, message);
+  add_to_batch (self, message, flags);
+}
+
+static void
+receive_or_spool (HazeIMChannel *self,
+                  gchar *text_plain,
+                  PurpleMessageFlags flags,
+                  time_t mtime)
+{
+  HazeIMChannelPrivate *priv = self->priv;
+  time_t now = time (NULL);
+  GError *error = NULL;
+
+  /* Once anything has been spooled, everything after it must be too, to
+   * keep the messages in order. */
+  if (haze_pending_spool_is_empty (priv->spool) &&
+      has_room_for_pending (self))
+    {
+      take_received (self, text_plain, flags, mtime, now);
+      return;
+    }
+
+  if (!haze_pending_spool_push (priv->spool, text_plain, flags, mtime, now,
+          &error))
+    {
+      DEBUG ("couldn't spool message, keeping it in memory: %s",
+          error->message);
+      g_error_free (error);
+      take_received (self, text_plain, flags, mtime, now);
+    }
+}
+
+/* Moves as many spooled messages into the TpMessageMixin as there's room
+ * for. */
+static void
+page_in (HazeIMChannel *self)
+{
+  HazeIMChannelPrivate *priv = self->priv;
+
+  while (!haze_pending_spool_is_empty (priv->spool) &&
+         has_room_for_pending (self))
+    {
+      guint flags;
+      gint64 mtime, received;
+      gchar *text_plain = haze_pending_spool_pop (priv->spool, &flags,
+          &mtime, &received);
+
+      if (text_plain == NULL)
+        break;
+
+      take_received (self, text_plain, flags, mtime, received);
+      g_free (text_plain);
+    }
+}
+
+static void
+pending_messages_removed_cb (HazeIMChannel *self,
+                             const GArray *ids,
+                             gpointer user_data)
+{
+  HazeIMChannelPrivate *priv = self->priv;
+  guint removed = MIN (ids->len, priv->n_pending);
+
+  priv->n_pending -= removed;
+  get_connection (self)->pending_messages -= removed;
+  page_in (self);
+}
+
 void
 haze_im_channel_receive (HazeIMChannel *self,
                          const char *xhtml_message,
@@ -548,28 +1056,28 @@ haze_im_channel_receive (HazeIMChannel *self,
                          time_t mtime)
 {
   TpBaseChannel *base = TP_BASE_CHANNEL (self);
-  gchar *line_broken, *text_plain;
+  GString *scratch = self->priv->scratch;
+  gchar *text_plain;
 
-  /* Replaces newline characters with <br>, which then get turned back into
-   * newlines by purple_markup_strip_html (which replaces "\n" with " ")...
-   */
-  line_broken = purple_strdup_withhtml (xhtml_message);
-  text_plain = purple_markup_strip_html (line_broken);
-  g_free (line_broken);
+  ensure_conversation (self);
 
-  if (flags & PURPLE_MESSAGE_RECV)
-    tp_message_mixin_take_received ((GObject *) self,
-        _make_message (self, text_plain, flags, mtime));
+  haze_markup_strip (xhtml_message, scratch);
+  text_plain = scratch->str;
+
+  if (flags & (PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_ERROR))
+    receive_or_spool (self, text_plain, flags, mtime);
   else if (flags & PURPLE_MESSAGE_SEND)
     {
       /* Do nothing: the message mixin emitted sent for us. */
     }
-  else if (flags & PURPLE_MESSAGE_ERROR)
-    tp_message_mixin_take_received ((GObject *) self,
-        _make_delivery_report (self, text_plain));
   else
     DEBUG ("channel %u: ignoring message %s with flags %u",
         tp_base_channel_get_target_handle (base), text_plain, flags);
 
-  g_free (text_plain);
+  /* Don't hang on to the memory for an unusually long message forever. */
+  if (scratch->allocated_len > SCRATCH_MAX_SIZE)
+    {
+      g_string_free (scratch, TRUE);
+      self->priv->scratch = g_string_new (NULL);
+    }
 }
@@ -27,6 +27,8 @@
 
 #include <libpurple/conversation.h>
 
+#include "timer-wheel.h"
+
 G_BEGIN_DECLS
 
 typedef struct _HazeIMChannel HazeIMChannel;
@@ -74,13 +76,21 @@ struct _HazeConversationUiData
     TpHandle contact_handle;
 
     PurpleTypingState active_state;
-    guint resend_typing_timeout_id;
+    HazeTimer *resend_typing_timer;
+
+    /* the contact's chat state as last signalled, and as it will be when
+     * chat_state_timer fires */
+    TpChannelChatState emitted_chat_state;
+    TpChannelChatState pending_chat_state;
+    HazeTimer *chat_state_timer;
 };
 
 #define PURPLE_CONV_GET_HAZE_UI_DATA(conv) \
     ((HazeConversationUiData *) conv->ui_data)
 
 void haze_im_channel_start (HazeIMChannel *self);
+gboolean haze_im_channel_hibernate (HazeIMChannel *self, gint64 idle_since);
+PurpleConversation *haze_im_channel_wake (HazeIMChannel *self);
 
 void haze_im_channel_receive (HazeIMChannel *self, const char *xhtml_message,
     PurpleMessageFlags flags, time_t mtime);
@@ -46,10 +46,13 @@
 #include <telepathy-glib/telepathy-glib.h>
 
 #include "defines.h"
+#include "avatar-store.h"
 #include "debug.h"
 #include "connection-manager.h"
+#include "ft-manager.h"
 #include "notify.h"
 #include "request.h"
+#include "roomlist-manager.h"
 #include "util.h"
 
 /* Copied verbatim from nullclient, modulo changing whitespace. */
@@ -137,6 +140,8 @@ haze_ui_init (void)
     purple_request_set_ui_ops (haze_request_get_ui_ops ());
     purple_notify_set_ui_ops (haze_notify_get_ui_ops ());
     purple_privacy_set_ui_ops (haze_get_privacy_ui_ops ());
+    purple_roomlist_set_ui_ops (haze_get_roomlist_ui_ops ());
+    purple_xfers_set_ui_ops (haze_get_xfer_ui_ops ());
 }
 
 static PurpleCoreUiOps haze_core_uiops = 
@@ -249,11 +254,15 @@ main(int argc,
     haze_debug_set_flags_from_env ();
 
     signal (SIGCHLD, SIG_IGN);
+    /* File transfer clients may close their sockets at any moment. */
+    signal (SIGPIPE, SIG_IGN);
     init_libpurple();
+    haze_avatar_store_init ();
 
     ret = tp_run_connection_manager (UI_ID, PACKAGE_VERSION, get_cm, argc,
                                      argv);
 
+    haze_avatar_store_shutdown ();
     purple_core_quit ();
     delete_user_dir ();
 
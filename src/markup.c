@@ -0,0 +1,514 @@
+/*
+ * markup.c - converting between plain text and libpurple's markup
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <config.h>
+#include "markup.h"
+
+#include <string.h>
+
+#include <libpurple/purple.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Bytes which might need more than copying: the five characters
+ * g_markup_escape_text() turns into entities, newlines, the C0 controls
+ * (and NUL), DEL, and 0xc2, which starts the UTF-8 encoding of the C1
+ * controls.
+ */
+#define NEEDS_LOOKING_AT(c) \
+  ((c) < 0x20 || (c) == '&' || (c) == '<' || (c) == '>' || (c) == '\'' || \
+   (c) == '"' || (c) == 0x7f || (c) == 0xc2)
+
+/* Returns how many bytes at the start of p can be copied unchanged. */
+static gsize
+plain_run (const guchar *p)
+{
+  const guchar *start = p;
+
+#ifdef __SSE2__
+  /* Aligned 16-byte loads never cross a page boundary, so it's safe to look
+   * beyond the terminating NUL in the last block. */
+  while (((gsize) p & 15) != 0)
+    {
+      if (NEEDS_LOOKING_AT (*p))
+        return p - start;
+
+      p++;
+    }
+
+  for (;;)
+    {
+      __m128i v = _mm_load_si128 ((const __m128i *) p);
+      __m128i hits = _mm_cmpeq_epi8 (_mm_min_epu8 (v, _mm_set1_epi8 (0x1f)),
+          v);
+
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('&')));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('<')));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('>')));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\'')));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('"')));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, _mm_set1_epi8 (0x7f)));
+      hits = _mm_or_si128 (hits,
+          _mm_cmpeq_epi8 (v, _mm_set1_epi8 ((gchar) 0xc2)));
+
+      if (_mm_movemask_epi8 (hits) != 0)
+        break;
+
+      p += 16;
+    }
+#endif
+
+  while (!NEEDS_LOOKING_AT (*p))
+    p++;
+
+  return p - start;
+}
+
+static gsize
+write_char_reference (gunichar c,
+    gchar *out)
+{
+  static const gchar hex[] = "0123456789abcdef";
+  gchar buf[6];
+  gsize len = 0;
+
+  buf[len++] = '&';
+  buf[len++] = '#';
+  buf[len++] = 'x';
+
+  if (c >= 0x10)
+    buf[len++] = hex[c >> 4];
+
+  buf[len++] = hex[c & 0xf];
+  buf[len++] = ';';
+
+  if (out != NULL)
+    memcpy (out, buf, len);
+
+  return len;
+}
+
+/* Escapes the character starting at *p, which must need looking at; writes
+ * it to out unless that's NULL, advances *p past it, and returns how many
+ * bytes it became. */
+static gsize
+escape_char (const guchar **p,
+    gchar *out)
+{
+  const gchar *replacement;
+  guchar c = **p;
+
+  switch (c)
+    {
+    case '&':
+      replacement = "&amp;";
+      break;
+    case '<':
+      replacement = "&lt;";
+      break;
+    case '>':
+      replacement = "&gt;";
+      break;
+    case '"':
+      replacement = "&quot;";
+      break;
+    /* prpl-yahoo in libpurple <= 2.3.1 could not deal with &apos; and
+     * would send it literally.
+     * TODO: When we depend on new enough libpurple, use &apos;.
+     */
+    case '\'':
+      replacement = "'";
+      break;
+    /* avoid line breaks being swallowed! */
+    case '\n':
+      replacement = "<br>";
+      break;
+    case '\t':
+    case '\r':
+      replacement = NULL;
+      break;
+    case 0xc2:
+      {
+        guchar next = (*p)[1];
+
+        *p += 2;
+
+        if (next >= 0x80 && next <= 0x9f && next != 0x85)
+          return write_char_reference (next, out);
+
+        if (out != NULL)
+          {
+            out[0] = c;
+            out[1] = next;
+          }
+
+        return 2;
+      }
+    default:
+      /* The remaining C0 controls, and DEL */
+      (*p)++;
+      return write_char_reference (c, out);
+    }
+
+  (*p)++;
+
+  if (replacement == NULL)
+    {
+      if (out != NULL)
+        *out = c;
+
+      return 1;
+    }
+
+  if (out != NULL)
+    memcpy (out, replacement, strlen (replacement));
+
+  return strlen (replacement);
+}
+
+/* Escapes text into out, or just measures it if out is NULL. */
+static gsize
+escape (const gchar *text,
+    gchar *out)
+{
+  const guchar *p = (const guchar *) text;
+  gsize len = 0;
+
+  for (;;)
+    {
+      gsize run = plain_run (p);
+
+      if (out != NULL)
+        memcpy (out + len, p, run);
+
+      len += run;
+      p += run;
+
+      if (*p == '\0')
+        return len;
+
+      len += escape_char (&p, out == NULL ? NULL : out + len);
+    }
+}
+
+/*
+ * haze_markup_escape_text:
+ * @prefix: (allow-none): text to put before @text, such as "/me "
+ * @text: plain UTF-8 text
+ *
+ * Escapes @prefix followed by @text for passing to libpurple.  The result is
+ * the same as escaping them with g_markup_escape_text(), then replacing
+ * "\n" with "<br>" and "&apos;" with "'", but takes only one allocation.
+ *
+ * Returns: the escaped text
+ */
+gchar *
+haze_markup_escape_text (const gchar *prefix,
+    const gchar *text)
+{
+  gsize prefix_len = 0;
+  gsize len;
+  gchar *ret;
+
+  if (prefix != NULL)
+    prefix_len = escape (prefix, NULL);
+
+  len = prefix_len + escape (text, NULL);
+  ret = g_malloc (len + 1);
+
+  if (prefix != NULL)
+    escape (prefix, ret);
+
+  escape (text, ret + prefix_len);
+  ret[len] = '\0';
+
+  return ret;
+}
+
+/* Returns how many bytes the character at p becomes once escaped, and
+ * stores a pointer to the next character in next. */
+static gsize
+escaped_char_size (const gchar *p,
+    const gchar **next)
+{
+  const guchar *q = (const guchar *) p;
+
+  if (!NEEDS_LOOKING_AT (*q))
+    {
+      *next = g_utf8_next_char (p);
+      return *next - p;
+    }
+
+  /* escape_char() consumes all of the multi-byte characters it handles */
+  if (*q == 0xc2)
+    {
+      gsize size = escape_char (&q, NULL);
+
+      *next = (const gchar *) q;
+      return size;
+    }
+
+  *next = p + 1;
+  return escape_char (&q, NULL);
+}
+
+static void
+add_chunk (GPtrArray *chunks,
+    const gchar *prefix,
+    const gchar *start,
+    const gchar *end)
+{
+  gchar *text = g_strndup (start, end - start);
+
+  g_ptr_array_add (chunks, haze_markup_escape_text (prefix, text));
+  g_free (text);
+}
+
+/*
+ * haze_markup_escape_split:
+ * @prefix: (allow-none): text to put before each piece of @text
+ * @text: plain UTF-8 text
+ * @max_bytes: the most bytes each escaped piece may take, or 0 for no limit
+ * @split_lines: if %TRUE, start a new piece after each newline
+ *
+ * Like haze_markup_escape_text(), but splits @text into pieces which each
+ * fit into @max_bytes once escaped, breaking after whitespace where
+ * possible and never within a character or entity.  If @split_lines is
+ * %TRUE, the newlines between pieces are dropped, as are blank lines.
+ *
+ * Returns: a %NULL-terminated array of escaped pieces, of which there is
+ *  always at least one
+ */
+gchar **
+haze_markup_escape_split (const gchar *prefix,
+    const gchar *text,
+    gsize max_bytes,
+    gboolean split_lines)
+{
+  GPtrArray *chunks;
+  gsize prefix_size = 0;
+  gsize budget;
+  const gchar *p = text;
+
+  if (prefix != NULL)
+    prefix_size = escape (prefix, NULL);
+
+  /* The common case: it all fits in one piece. */
+  if ((max_bytes == 0 || prefix_size + escape (text, NULL) <= max_bytes) &&
+      (!split_lines || strchr (text, '\n') == NULL))
+    {
+      gchar **ret = g_new (gchar *, 2);
+
+      ret[0] = haze_markup_escape_text (prefix, text);
+      ret[1] = NULL;
+      return ret;
+    }
+
+  chunks = g_ptr_array_new ();
+
+  if (max_bytes == 0)
+    budget = G_MAXSIZE;
+  else if (max_bytes > prefix_size)
+    budget = max_bytes - prefix_size;
+  else
+    budget = 1;
+
+  do
+    {
+      const gchar *q = p;
+      const gchar *last_break = NULL;
+      const gchar *end;
+      gsize size = 0;
+
+      while (*q != '\0')
+        {
+          const gchar *next;
+          gsize char_size;
+
+          if (split_lines && *q == '\n')
+            break;
+
+          char_size = escaped_char_size (q, &next);
+
+          /* Always make progress, even if one character is too big. */
+          if (size + char_size > budget && q != p)
+            break;
+
+          size += char_size;
+
+          if (g_unichar_isspace (g_utf8_get_char (q)))
+            last_break = next;
+
+          q = next;
+        }
+
+      if (*q == '\0' || *q == '\n' || last_break == NULL)
+        end = q;
+      else
+        end = last_break;
+
+      /* Blank lines aren't worth sending on their own. */
+      if (end != p)
+        add_chunk (chunks, prefix, p, end);
+
+      p = end;
+
+      if (split_lines && *p == '\n')
+        p++;
+    }
+  while (*p != '\0');
+
+  if (chunks->len == 0)
+    add_chunk (chunks, prefix, text, text);
+
+  g_ptr_array_add (chunks, NULL);
+  return (gchar **) g_ptr_array_free (chunks, FALSE);
+}
+
+/* Bytes haze_markup_strip_simple() can't just copy: the start of tags and
+ * entities, and the whitespace other than ' ' and '\n' which
+ * purple_markup_strip_html() changes.
+ */
+#define NEEDS_STRIPPING(c) \
+  ((c) == '\0' || (c) == '<' || (c) == '&' || \
+   ((c) >= '\t' && (c) <= '\r' && (c) != '\n'))
+
+/* Returns how many bytes at the start of p can be copied unchanged. */
+static gsize
+unstripped_run (const guchar *p)
+{
+  const guchar *start = p;
+
+#ifdef __SSE2__
+  while (((gsize) p & 15) != 0)
+    {
+      if (NEEDS_STRIPPING (*p))
+        return p - start;
+
+      p++;
+    }
+
+  for (;;)
+    {
+      __m128i v = _mm_load_si128 ((const __m128i *) p);
+      /* '\t' to '\r' are the bytes which are at most 4 after subtracting
+       * '\t' (with wraparound), of which '\n' is fine. */
+      __m128i offset = _mm_sub_epi8 (v, _mm_set1_epi8 ('\t'));
+      __m128i hits = _mm_andnot_si128 (
+          _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n')),
+          _mm_cmpeq_epi8 (_mm_min_epu8 (offset, _mm_set1_epi8 (4)), offset));
+
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, _mm_setzero_si128 ()));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('<')));
+      hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('&')));
+
+      if (_mm_movemask_epi8 (hits) != 0)
+        break;
+
+      p += 16;
+    }
+#endif
+
+  while (!NEEDS_STRIPPING (*p))
+    p++;
+
+  return p - start;
+}
+
+/*
+ * haze_markup_strip_simple:
+ * @markup: a message from libpurple
+ * @out: a string to hold the plain-text version of @markup
+ *
+ * If @markup contains no tags or entities, which is true of most messages
+ * from protocols like XMPP and IRC, replaces the contents of @out with the
+ * same plain text that purple_strdup_withhtml() followed by
+ * purple_markup_strip_html() would produce.  Otherwise, leaves @out in an
+ * undefined state so the caller can fall back to those.
+ *
+ * Returns: %TRUE if @out holds the plain text
+ */
+gboolean
+haze_markup_strip_simple (const gchar *markup,
+    GString *out)
+{
+  const guchar *p = (const guchar *) markup;
+
+  g_string_truncate (out, 0);
+
+  for (;;)
+    {
+      gsize run = unstripped_run (p);
+
+      g_string_append_len (out, (const gchar *) p, run);
+      p += run;
+
+      switch (*p)
+        {
+        case '\0':
+          return TRUE;
+        case '<':
+        case '&':
+          return FALSE;
+        /* purple_strdup_withhtml() drops carriage returns... */
+        case '\r':
+          break;
+        /* ...and purple_markup_strip_html() turns other whitespace into
+         * spaces. */
+        default:
+          g_string_append_c (out, ' ');
+        }
+
+      p++;
+    }
+}
+
+/*
+ * haze_markup_strip:
+ * @markup: a message from libpurple
+ * @out: a string to hold the plain-text version of @markup
+ *
+ * Replaces the contents of @out with @markup stripped of its tags and
+ * entities, keeping its line breaks.  This is what every received message
+ * goes through before it is signalled.
+ */
+void
+haze_markup_strip (const gchar *markup,
+    GString *out)
+{
+  gchar *line_broken, *stripped;
+
+  /* Most messages have no markup at all, so this saves running libpurple's
+   * HTML tokenizer twice over them. */
+  if (haze_markup_strip_simple (markup, out))
+    return;
+
+  /* Replaces newline characters with <br>, which then get turned back into
+   * newlines by purple_markup_strip_html (which replaces "\n" with " ")...
+   */
+  line_broken = purple_strdup_withhtml (markup);
+  stripped = purple_markup_strip_html (line_broken);
+  g_free (line_broken);
+
+  g_string_assign (out, stripped);
+  g_free (stripped);
+}
@@ -0,0 +1,35 @@
+#ifndef __HAZE_MARKUP_H__
+#define __HAZE_MARKUP_H__
+/*
+ * markup.h - header for converting between plain text and libpurple's markup
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gchar *haze_markup_escape_text (const gchar *prefix, const gchar *text);
+gchar **haze_markup_escape_split (const gchar *prefix, const gchar *text,
+    gsize max_bytes, gboolean split_lines);
+gboolean haze_markup_strip_simple (const gchar *markup, GString *out);
+void haze_markup_strip (const gchar *markup, GString *out);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_MARKUP_H__ */
@@ -0,0 +1,646 @@
+/*
+ * muc-channel-factory.c - HazeMUCChannelFactory source
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "config.h"
+#include "muc-channel-factory.h"
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "connection.h"
+#include "debug.h"
+#include "muc-channel.h"
+
+/* libpurple can take a while to join a room, and may never say that it
+ * failed; requests are given up on after this long.
+ */
+#define JOIN_TIMEOUT_SECONDS 60
+
+struct _HazeMUCChannelFactoryPrivate {
+    HazeConnection *conn;
+    /* room TpHandle => owned HazeMUCChannel */
+    GHashTable *channels;
+    /* room TpHandle => owned PendingJoin, for rooms we have asked libpurple
+     * to join and have no channel for yet */
+    GHashTable *joining;
+    gulong status_changed_id;
+    gboolean dispose_has_run;
+};
+
+static void channel_manager_iface_init (gpointer, gpointer);
+
+G_DEFINE_TYPE_WITH_CODE(HazeMUCChannelFactory,
+    haze_muc_channel_factory,
+    G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (TP_TYPE_CHANNEL_MANAGER,
+      channel_manager_iface_init))
+
+/* properties: */
+enum {
+    PROP_CONNECTION = 1,
+
+    LAST_PROPERTY
+};
+
+typedef struct {
+    HazeMUCChannelFactory *self;
+    TpHandle room;
+    /* request tokens waiting for the room's channel, oldest first */
+    GSList *requests;
+    guint timeout_id;
+} PendingJoin;
+
+static void close_all (HazeMUCChannelFactory *self);
+
+static void
+pending_join_free (gpointer data)
+{
+    PendingJoin *join = data;
+
+    /* Anyone still waiting must have been answered by now. */
+    g_assert (join->requests == NULL);
+
+    if (join->timeout_id != 0)
+        g_source_remove (join->timeout_id);
+
+    g_slice_free (PendingJoin, join);
+}
+
+/* Fails all the requests waiting for @room to be joined, and forgets about
+ * them. */
+static void
+fail_join (HazeMUCChannelFactory *self,
+           TpHandle room,
+           gint code,
+           const gchar *message)
+{
+    PendingJoin *join;
+    GSList *l;
+
+    if (self->priv->joining == NULL)
+        return;
+
+    join = g_hash_table_lookup (self->priv->joining, GUINT_TO_POINTER (room));
+
+    if (join == NULL)
+        return;
+
+    for (l = join->requests; l != NULL; l = l->next)
+        tp_channel_manager_emit_request_failed (self, l->data, TP_ERROR,
+            code, message);
+
+    g_slist_free (join->requests);
+    join->requests = NULL;
+    g_hash_table_remove (self->priv->joining, GUINT_TO_POINTER (room));
+}
+
+static gboolean
+join_timeout_cb (gpointer data)
+{
+    PendingJoin *join = data;
+
+    DEBUG ("gave up waiting to join room %u", join->room);
+
+    join->timeout_id = 0;
+    fail_join (join->self, join->room, TP_ERROR_NETWORK_ERROR,
+        "Timed out joining the room");
+    return FALSE;
+}
+
+static gboolean
+prpl_supports_chats (PurplePluginProtocolInfo *prpl_info)
+{
+    return (prpl_info->join_chat != NULL &&
+        prpl_info->chat_info_defaults != NULL);
+}
+
+static void
+haze_muc_channel_factory_init (HazeMUCChannelFactory *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+        HAZE_TYPE_MUC_CHANNEL_FACTORY, HazeMUCChannelFactoryPrivate);
+
+    self->priv->channels = g_hash_table_new_full (NULL, NULL,
+        NULL, g_object_unref);
+    self->priv->joining = g_hash_table_new_full (NULL, NULL,
+        NULL, pending_join_free);
+    self->priv->conn = NULL;
+    self->priv->dispose_has_run = FALSE;
+}
+
+static void
+haze_muc_channel_factory_dispose (GObject *object)
+{
+    HazeMUCChannelFactory *self = HAZE_MUC_CHANNEL_FACTORY (object);
+
+    if (self->priv->dispose_has_run)
+        return;
+
+    self->priv->dispose_has_run = TRUE;
+
+    close_all (self);
+    g_assert (self->priv->channels == NULL);
+    g_assert (self->priv->joining == NULL);
+
+    if (G_OBJECT_CLASS (haze_muc_channel_factory_parent_class)->dispose)
+        G_OBJECT_CLASS (haze_muc_channel_factory_parent_class)->dispose (
+            object);
+}
+
+static void
+haze_muc_channel_factory_get_property (GObject *object,
+                                       guint property_id,
+                                       GValue *value,
+                                       GParamSpec *pspec)
+{
+    HazeMUCChannelFactory *self = HAZE_MUC_CHANNEL_FACTORY (object);
+
+    switch (property_id) {
+        case PROP_CONNECTION:
+            g_value_set_object (value, self->priv->conn);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+haze_muc_channel_factory_set_property (GObject *object,
+                                       guint property_id,
+                                       const GValue *value,
+                                       GParamSpec *pspec)
+{
+    HazeMUCChannelFactory *self = HAZE_MUC_CHANNEL_FACTORY (object);
+
+    switch (property_id) {
+        case PROP_CONNECTION:
+            self->priv->conn = g_value_get_object (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+status_changed_cb (HazeConnection *conn,
+                   guint status,
+                   guint reason,
+                   HazeMUCChannelFactory *self)
+{
+    if (status == TP_CONNECTION_STATUS_DISCONNECTED)
+        close_all (self);
+}
+
+static void
+haze_muc_channel_factory_constructed (GObject *object)
+{
+    HazeMUCChannelFactory *self = HAZE_MUC_CHANNEL_FACTORY (object);
+    void (*constructed) (GObject *) =
+        ((GObjectClass *) haze_muc_channel_factory_parent_class)->constructed;
+
+    if (constructed != NULL)
+    {
+        constructed (object);
+    }
+
+    self->priv->status_changed_id = g_signal_connect (self->priv->conn,
+        "status-changed", (GCallback) status_changed_cb, self);
+}
+
+static HazeMUCChannel *
+lookup_channel (HazeMUCChannelFactory *self,
+                TpHandle room)
+{
+    if (self->priv->channels == NULL)
+        return NULL;
+
+    return g_hash_table_lookup (self->priv->channels,
+        GUINT_TO_POINTER (room));
+}
+
+/* libpurple gives up on joining a room without making a conversation for
+ * it, so whoever asked for it gets an error rather than a channel. */
+static void
+chat_join_failed_cb (PurpleConnection *gc,
+                     GHashTable *components,
+                     gpointer unused)
+{
+    PurpleAccount *account = purple_connection_get_account (gc);
+    HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (account);
+    PurplePluginProtocolInfo *prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO (
+        gc->prpl);
+    TpHandleRepoIface *room_repo = tp_base_connection_get_handles (
+        TP_BASE_CONNECTION (conn), TP_HANDLE_TYPE_ROOM);
+    gchar *name;
+    TpHandle room;
+
+    if (components == NULL || prpl_info->get_chat_name == NULL)
+        return;
+
+    name = prpl_info->get_chat_name (components);
+    room = tp_handle_lookup (room_repo, name, NULL, NULL);
+
+    if (room != 0)
+    {
+        DEBUG ("couldn't join %s", name);
+        /* libpurple doesn't say why, beyond whatever it told the user. */
+        fail_join (conn->muc_factory, room, TP_ERROR_NOT_AVAILABLE,
+            "The room could not be joined");
+    }
+
+    g_free (name);
+}
+
+static void
+haze_muc_channel_factory_class_init (HazeMUCChannelFactoryClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GParamSpec *param_spec;
+
+    object_class->constructed = haze_muc_channel_factory_constructed;
+    object_class->dispose = haze_muc_channel_factory_dispose;
+    object_class->get_property = haze_muc_channel_factory_get_property;
+    object_class->set_property = haze_muc_channel_factory_set_property;
+
+    param_spec = g_param_spec_object ("connection", "HazeConnection object",
+                                      "Haze connection object that owns this "
+                                      "MUC channel factory object.",
+                                      HAZE_TYPE_CONNECTION,
+                                      G_PARAM_CONSTRUCT_ONLY |
+                                      G_PARAM_READWRITE |
+                                      G_PARAM_STATIC_NICK |
+                                      G_PARAM_STATIC_BLURB);
+    g_object_class_install_property (object_class, PROP_CONNECTION, param_spec);
+
+    g_type_class_add_private (object_class,
+                              sizeof(HazeMUCChannelFactoryPrivate));
+
+    purple_signal_connect (purple_conversations_get_handle (),
+        "chat-join-failed", klass, (PurpleCallback) chat_join_failed_cb,
+        NULL);
+}
+
+static void
+muc_channel_closed_cb (HazeMUCChannel *chan, gpointer user_data)
+{
+    HazeMUCChannelFactory *self = HAZE_MUC_CHANNEL_FACTORY (user_data);
+
+    tp_channel_manager_emit_channel_closed_for_object (self,
+        TP_EXPORTABLE_CHANNEL (chan));
+
+    if (self->priv->channels)
+    {
+        TpHandle room = tp_base_channel_get_target_handle (
+            TP_BASE_CHANNEL (chan));
+
+        DEBUG ("removing channel with handle %u", room);
+        g_hash_table_remove (self->priv->channels, GUINT_TO_POINTER (room));
+    }
+}
+
+/* @requests are the tokens of the requests satisfied by the new channel,
+ * if any. */
+static HazeMUCChannel *
+new_muc_channel (HazeMUCChannelFactory *self,
+                 TpHandle room,
+                 GSList *requests)
+{
+    TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
+    HazeMUCChannel *chan;
+
+    g_assert (lookup_channel (self, room) == NULL);
+
+    chan = g_object_new (HAZE_TYPE_MUC_CHANNEL,
+                         "connection", self->priv->conn,
+                         "handle", room,
+                         "initiator-handle",
+                             tp_base_connection_get_self_handle (base_conn),
+                         "requested", (requests != NULL),
+                         NULL);
+    tp_base_channel_register (TP_BASE_CHANNEL (chan));
+
+    DEBUG ("Created MUC channel with object path %s",
+        tp_base_channel_get_object_path (TP_BASE_CHANNEL (chan)));
+
+    g_signal_connect (chan, "closed", G_CALLBACK (muc_channel_closed_cb),
+        self);
+
+    g_hash_table_insert (self->priv->channels, GUINT_TO_POINTER (room), chan);
+
+    tp_channel_manager_emit_new_channel (self,
+        TP_EXPORTABLE_CHANNEL (chan), requests);
+
+    return chan;
+}
+
+/* Called whenever libpurple joins a room, whether because we asked it to or
+ * by itself. */
+void
+haze_muc_channel_factory_conversation_created (HazeMUCChannelFactory *self,
+                                               PurpleConversation *conv)
+{
+    TpHandleRepoIface *room_repo = tp_base_connection_get_handles (
+        TP_BASE_CONNECTION (self->priv->conn), TP_HANDLE_TYPE_ROOM);
+    const gchar *name = purple_conversation_get_name (conv);
+    TpHandle room = tp_handle_ensure (room_repo, name, NULL, NULL);
+    HazeMUCChannel *chan;
+    PendingJoin *join;
+
+    if (room == 0 || self->priv->channels == NULL)
+    {
+        DEBUG ("not making a channel for %s", name);
+        return;
+    }
+
+    chan = lookup_channel (self, room);
+
+    if (chan == NULL)
+    {
+        join = g_hash_table_lookup (self->priv->joining,
+            GUINT_TO_POINTER (room));
+
+        if (join != NULL)
+        {
+            chan = new_muc_channel (self, room, join->requests);
+            g_slist_free (join->requests);
+            join->requests = NULL;
+            g_hash_table_remove (self->priv->joining,
+                GUINT_TO_POINTER (room));
+        }
+        else
+        {
+            chan = new_muc_channel (self, room, NULL);
+        }
+    }
+
+    haze_muc_channel_set_conversation (chan, conv);
+}
+
+static void
+close_all (HazeMUCChannelFactory *self)
+{
+    GHashTable *tmp;
+
+    DEBUG ("closing muc channels");
+
+    if (self->priv->joining != NULL)
+    {
+        GHashTableIter iter;
+        gpointer key;
+
+        tmp = self->priv->joining;
+        g_hash_table_iter_init (&iter, tmp);
+
+        while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+            fail_join (self, GPOINTER_TO_UINT (key), TP_ERROR_DISCONNECTED,
+                "Connection closed while joining the room");
+            g_hash_table_iter_init (&iter, tmp);
+        }
+
+        self->priv->joining = NULL;
+        g_hash_table_destroy (tmp);
+    }
+
+    if (self->priv->channels)
+    {
+        tmp = self->priv->channels;
+        self->priv->channels = NULL;
+        g_hash_table_destroy (tmp);
+    }
+
+    if (self->priv->status_changed_id != 0)
+    {
+        g_signal_handler_disconnect (self->priv->conn,
+            self->priv->status_changed_id);
+        self->priv->status_changed_id = 0;
+    }
+}
+
+struct _ForeachData
+{
+    TpExportableChannelFunc foreach;
+    gpointer user_data;
+};
+
+static void
+_foreach_slave (gpointer key, gpointer value, gpointer user_data)
+{
+    struct _ForeachData *data = (struct _ForeachData *) user_data;
+    TpExportableChannel *chan = TP_EXPORTABLE_CHANNEL (value);
+
+    data->foreach (chan, data->user_data);
+}
+
+static void
+haze_muc_channel_factory_foreach (TpChannelManager *iface,
+                                  TpExportableChannelFunc foreach,
+                                  gpointer user_data)
+{
+    HazeMUCChannelFactory *self = HAZE_MUC_CHANNEL_FACTORY (iface);
+    struct _ForeachData data;
+
+    if (self->priv->channels == NULL)
+        return;
+
+    data.user_data = user_data;
+    data.foreach = foreach;
+
+    g_hash_table_foreach (self->priv->channels, _foreach_slave, &data);
+}
+
+static const gchar * const fixed_properties[] = {
+    TP_IFACE_CHANNEL ".ChannelType",
+    TP_IFACE_CHANNEL ".TargetHandleType",
+    NULL
+};
+static const gchar * const allowed_properties[] = {
+    TP_IFACE_CHANNEL ".TargetHandle",
+    TP_IFACE_CHANNEL ".TargetID",
+    NULL
+};
+
+static void
+haze_muc_channel_factory_foreach_channel_class (TpChannelManager *manager,
+    TpChannelManagerChannelClassFunc func,
+    gpointer user_data)
+{
+    HazeMUCChannelFactory *self = HAZE_MUC_CHANNEL_FACTORY (manager);
+    PurplePluginProtocolInfo *prpl_info;
+    GHashTable *table;
+    GValue *value;
+
+    g_object_get (self->priv->conn, "prpl-info", &prpl_info, NULL);
+
+    if (!prpl_supports_chats (prpl_info))
+        return;
+
+    table = g_hash_table_new_full (g_str_hash, g_str_equal,
+        NULL, (GDestroyNotify) tp_g_value_slice_free);
+
+    value = tp_g_value_slice_new (G_TYPE_STRING);
+    g_value_set_static_string (value, TP_IFACE_CHANNEL_TYPE_TEXT);
+    g_hash_table_insert (table, TP_IFACE_CHANNEL ".ChannelType", value);
+
+    value = tp_g_value_slice_new (G_TYPE_UINT);
+    g_value_set_uint (value, TP_HANDLE_TYPE_ROOM);
+    g_hash_table_insert (table, TP_IFACE_CHANNEL ".TargetHandleType", value);
+
+    func (manager, table, allowed_properties, user_data);
+
+    g_hash_table_destroy (table);
+}
+
+static gboolean
+haze_muc_channel_factory_request (HazeMUCChannelFactory *self,
+                                  gpointer request_token,
+                                  GHashTable *request_properties,
+                                  gboolean require_new)
+{
+    TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
+    PurpleConnection *gc = self->priv->conn->account->gc;
+    PurplePluginProtocolInfo *prpl_info;
+    TpHandleRepoIface *room_repo;
+    GHashTable *components;
+    TpHandle room;
+    HazeMUCChannel *chan;
+    PendingJoin *join;
+    GError *error = NULL;
+
+    if (tp_strdiff (tp_asv_get_string (request_properties,
+            TP_IFACE_CHANNEL ".ChannelType"),
+        TP_IFACE_CHANNEL_TYPE_TEXT))
+    {
+        return FALSE;
+    }
+
+    if (tp_asv_get_uint32 (request_properties,
+        TP_IFACE_CHANNEL ".TargetHandleType", NULL) != TP_HANDLE_TYPE_ROOM)
+    {
+        return FALSE;
+    }
+
+    room = tp_asv_get_uint32 (request_properties,
+        TP_IFACE_CHANNEL ".TargetHandle", NULL);
+    g_assert (room != 0);
+
+    if (tp_channel_manager_asv_has_unknown_properties (request_properties,
+          fixed_properties, allowed_properties, &error))
+    {
+        goto error;
+    }
+
+    prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO (gc->prpl);
+
+    if (!prpl_supports_chats (prpl_info))
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+            "this protocol doesn't have rooms");
+        goto error;
+    }
+
+    chan = lookup_channel (self, room);
+
+    if (chan != NULL)
+    {
+        if (require_new)
+        {
+            tp_channel_manager_emit_request_failed (self, request_token,
+                TP_ERROR, TP_ERROR_NOT_AVAILABLE, "Channel already exists");
+        }
+        else
+        {
+            tp_channel_manager_emit_request_already_satisfied (self,
+                request_token, TP_EXPORTABLE_CHANNEL (chan));
+        }
+
+        return TRUE;
+    }
+
+    /* The channel is only announced once libpurple has joined the room, so
+     * that failing to join can fail the request. */
+    join = g_hash_table_lookup (self->priv->joining, GUINT_TO_POINTER (room));
+
+    if (join != NULL)
+    {
+        DEBUG ("already joining room %u", room);
+        join->requests = g_slist_append (join->requests, request_token);
+        return TRUE;
+    }
+
+    join = g_slice_new0 (PendingJoin);
+    join->self = self;
+    join->room = room;
+    join->requests = g_slist_append (NULL, request_token);
+    join->timeout_id = g_timeout_add_seconds (JOIN_TIMEOUT_SECONDS,
+        join_timeout_cb, join);
+    g_hash_table_insert (self->priv->joining, GUINT_TO_POINTER (room), join);
+
+    room_repo = tp_base_connection_get_handles (base_conn,
+        TP_HANDLE_TYPE_ROOM);
+    components = prpl_info->chat_info_defaults (gc,
+        tp_handle_inspect (room_repo, room));
+    serv_join_chat (gc, components);
+    g_hash_table_destroy (components);
+
+    return TRUE;
+
+error:
+    tp_channel_manager_emit_request_failed (self, request_token,
+        error->domain, error->code, error->message);
+    g_error_free (error);
+    return TRUE;
+}
+
+static gboolean
+haze_muc_channel_factory_create_channel (TpChannelManager *manager,
+                                         gpointer request_token,
+                                         GHashTable *request_properties)
+{
+    return haze_muc_channel_factory_request (
+        HAZE_MUC_CHANNEL_FACTORY (manager), request_token,
+        request_properties, TRUE);
+}
+
+static gboolean
+haze_muc_channel_factory_ensure_channel (TpChannelManager *manager,
+                                         gpointer request_token,
+                                         GHashTable *request_properties)
+{
+    return haze_muc_channel_factory_request (
+        HAZE_MUC_CHANNEL_FACTORY (manager), request_token,
+        request_properties, FALSE);
+}
+
+static void
+channel_manager_iface_init (gpointer g_iface,
+                            gpointer iface_data G_GNUC_UNUSED)
+{
+    TpChannelManagerIface *iface = g_iface;
+
+    iface->foreach_channel = haze_muc_channel_factory_foreach;
+    iface->foreach_channel_class =
+        haze_muc_channel_factory_foreach_channel_class;
+    iface->create_channel = haze_muc_channel_factory_create_channel;
+    iface->ensure_channel = haze_muc_channel_factory_ensure_channel;
+    /* Request is equivalent to Ensure for this channel class */
+    iface->request_channel = haze_muc_channel_factory_ensure_channel;
+}
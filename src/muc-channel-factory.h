@@ -0,0 +1,65 @@
+#ifndef __HAZE_MUC_CHANNEL_FACTORY_H__
+#define __HAZE_MUC_CHANNEL_FACTORY_H__
+/*
+ * muc-channel-factory.h - HazeMUCChannelFactory header
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib-object.h>
+
+#include <libpurple/conversation.h>
+
+G_BEGIN_DECLS
+
+#define HAZE_TYPE_MUC_CHANNEL_FACTORY \
+    (haze_muc_channel_factory_get_type())
+#define HAZE_MUC_CHANNEL_FACTORY(obj) \
+    (G_TYPE_CHECK_INSTANCE_CAST((obj), HAZE_TYPE_MUC_CHANNEL_FACTORY, \
+                                HazeMUCChannelFactory))
+#define HAZE_MUC_CHANNEL_FACTORY_CLASS(klass) \
+    (G_TYPE_CHECK_CLASS_CAST((klass), HAZE_TYPE_MUC_CHANNEL_FACTORY, \
+                             HazeMUCChannelFactoryClass))
+#define HAZE_IS_MUC_CHANNEL_FACTORY(obj) \
+    (G_TYPE_CHECK_INSTANCE_TYPE((obj), HAZE_TYPE_MUC_CHANNEL_FACTORY))
+#define HAZE_IS_MUC_CHANNEL_FACTORY_CLASS(klass) \
+    (G_TYPE_CHECK_CLASS_TYPE((klass), HAZE_TYPE_MUC_CHANNEL_FACTORY))
+#define HAZE_MUC_CHANNEL_FACTORY_GET_CLASS(obj) \
+    (G_TYPE_INSTANCE_GET_CLASS((obj), HAZE_TYPE_MUC_CHANNEL_FACTORY, \
+                               HazeMUCChannelFactoryClass))
+
+typedef struct _HazeMUCChannelFactory      HazeMUCChannelFactory;
+typedef struct _HazeMUCChannelFactoryClass HazeMUCChannelFactoryClass;
+typedef struct _HazeMUCChannelFactoryPrivate HazeMUCChannelFactoryPrivate;
+
+struct _HazeMUCChannelFactory {
+    GObject parent;
+    HazeMUCChannelFactoryPrivate *priv;
+};
+
+struct _HazeMUCChannelFactoryClass {
+    GObjectClass parent_class;
+};
+
+GType haze_muc_channel_factory_get_type (void) G_GNUC_CONST;
+
+void haze_muc_channel_factory_conversation_created (
+    HazeMUCChannelFactory *self, PurpleConversation *conv);
+
+G_END_DECLS
+
+#endif /* __HAZE_MUC_CHANNEL_FACTORY_H__ */
@@ -0,0 +1,717 @@
+/*
+ * muc-channel.c - HazeMUCChannel source
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* A Text channel for a room, backed by a PurpleConvChat once libpurple has
+ * joined it.  Rooms can be huge, and libpurple tells us about their members
+ * one at a time as well as in lists, so changes to the membership are
+ * collected and signalled together once we get back to the main loop:
+ * joining a room with ten thousand people in it emits one MembersChanged.
+ */
+
+#include <config.h>
+#include "muc-channel.h"
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "connection.h"
+#include "debug.h"
+#include "markup.h"
+
+struct _HazeMUCChannelPrivate
+{
+  /* NULL until libpurple has joined the room, and once we've left it */
+  PurpleConversation *conv;
+  /* member name => TpHandle.  libpurple says who left by name, by which time
+   * the prpl may no longer know who that was. */
+  GHashTable *member_handles;
+  /* membership changes since MembersChanged was last emitted, and the idle
+   * which will emit it */
+  TpIntset *joined;
+  TpIntset *left;
+  guint members_id;
+  gboolean dispose_has_run;
+};
+
+G_DEFINE_TYPE_WITH_CODE (HazeMUCChannel, haze_muc_channel, TP_TYPE_BASE_CHANNEL,
+    G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_TYPE_TEXT,
+        tp_message_mixin_text_iface_init);
+    G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_INTERFACE_MESSAGES,
+        tp_message_mixin_messages_iface_init);
+    G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_INTERFACE_GROUP,
+        tp_group_mixin_iface_init))
+
+static HazeConnection *
+get_connection (HazeMUCChannel *self)
+{
+  return HAZE_CONNECTION (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (self)));
+}
+
+static HazeSendScheduler *
+get_send_scheduler (HazeMUCChannel *self)
+{
+  return get_connection (self)->send_scheduler;
+}
+
+static TpHandleRepoIface *
+get_contact_repo (HazeMUCChannel *self)
+{
+  return tp_base_connection_get_handles (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (self)),
+      TP_HANDLE_TYPE_CONTACT);
+}
+
+static void
+haze_muc_channel_close (TpBaseChannel *base)
+{
+  HazeMUCChannel *self = HAZE_MUC_CHANNEL (base);
+  PurpleConversation *conv = self->priv->conv;
+
+  /* Destroying the conversation leaves the room. */
+  if (conv != NULL)
+    {
+      haze_muc_channel_forget_conversation (self);
+      purple_conversation_destroy (conv);
+    }
+
+  tp_base_channel_destroyed (base);
+}
+
+static GPtrArray *
+haze_muc_channel_get_interfaces (TpBaseChannel *base)
+{
+  GPtrArray *interfaces;
+
+  interfaces = TP_BASE_CHANNEL_CLASS (
+      haze_muc_channel_parent_class)->get_interfaces (base);
+
+  g_ptr_array_add (interfaces, TP_IFACE_CHANNEL_INTERFACE_GROUP);
+  g_ptr_array_add (interfaces, TP_IFACE_CHANNEL_INTERFACE_MESSAGES);
+
+  return interfaces;
+}
+
+static void
+send_piece (GObject *obj,
+            const gchar *recipient,
+            const gchar *text,
+            PurpleMessageFlags flags)
+{
+  HazeMUCChannel *self = HAZE_MUC_CHANNEL (obj);
+
+  /* We cancel our queued messages when we leave the room. */
+  g_return_if_fail (self->priv->conv != NULL);
+
+  purple_conv_chat_send_with_flags (PURPLE_CONV_CHAT (self->priv->conv),
+      text, flags);
+}
+
+static void
+haze_muc_channel_send (GObject *obj,
+                       TpMessage *message,
+                       TpMessageSendingFlags send_flags)
+{
+  HazeMUCChannel *self = HAZE_MUC_CHANNEL (obj);
+  const GHashTable *header, *body;
+  const gchar *content_type, *text;
+  guint type = 0;
+  const gchar *prefix = NULL;
+  GError *error = NULL;
+
+  if (self->priv->conv == NULL)
+    {
+      error = g_error_new (TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "we haven't joined the room yet");
+      goto err;
+    }
+
+  if (tp_message_count_parts (message) != 2)
+    {
+      error = g_error_new (TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "messages must have a single plain-text part");
+      goto err;
+    }
+
+  header = tp_message_peek (message, 0);
+  body = tp_message_peek (message, 1);
+
+  type = tp_asv_get_uint32 (header, "message-type", NULL);
+  content_type = tp_asv_get_string (body, "content-type");
+  text = tp_asv_get_string (body, "content");
+
+  if (tp_strdiff (content_type, "text/plain"))
+    {
+      error = g_error_new (TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "messages must have a single plain-text part");
+      goto err;
+    }
+
+  if (text == NULL)
+    {
+      error = g_error_new (TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "message body must be a UTF-8 string");
+      goto err;
+    }
+
+  switch (type)
+    {
+    case TP_CHANNEL_TEXT_MESSAGE_TYPE_ACTION:
+      /* XXX as for IMs, this is not good enough for prpl-irc. */
+      prefix = "/me ";
+      break;
+    case TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL:
+      break;
+    default:
+      error = g_error_new (TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+          "unsupported message type: %u", type);
+      goto err;
+    }
+
+  haze_send_scheduler_push (get_send_scheduler (self), obj, NULL, message,
+      prefix, text, 0, send_piece);
+  return;
+
+err:
+  g_assert (error != NULL);
+  tp_message_mixin_sent (obj, message, 0, NULL, error);
+  g_error_free (error);
+}
+
+static gboolean
+haze_muc_channel_add_member (GObject *obj,
+                             TpHandle handle,
+                             const gchar *message,
+                             GError **error)
+{
+  HazeMUCChannel *self = HAZE_MUC_CHANNEL (obj);
+  PurpleConversation *conv = self->priv->conv;
+
+  if (conv == NULL)
+    {
+      g_set_error (error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "we haven't joined the room yet");
+      return FALSE;
+    }
+
+  serv_chat_invite (purple_conversation_get_gc (conv),
+      purple_conv_chat_get_id (PURPLE_CONV_CHAT (conv)), message,
+      tp_handle_inspect (get_contact_repo (self), handle));
+  return TRUE;
+}
+
+static gboolean
+haze_muc_channel_remove_member (GObject *obj,
+                                TpHandle handle,
+                                const gchar *message,
+                                GError **error)
+{
+  HazeMUCChannel *self = HAZE_MUC_CHANNEL (obj);
+
+  if (handle == self->group.self_handle)
+    {
+      haze_muc_channel_close (TP_BASE_CHANNEL (self));
+      return TRUE;
+    }
+
+  g_set_error (error, TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+      "libpurple can't remove other people from rooms");
+  return FALSE;
+}
+
+static void
+haze_muc_channel_fill_immutable_properties (TpBaseChannel *chan,
+    GHashTable *properties)
+{
+  TpBaseChannelClass *cls = TP_BASE_CHANNEL_CLASS (
+      haze_muc_channel_parent_class);
+
+  cls->fill_immutable_properties (chan, properties);
+
+  tp_dbus_properties_mixin_fill_properties_hash (
+      G_OBJECT (chan), properties,
+      TP_IFACE_CHANNEL_INTERFACE_MESSAGES, "MessagePartSupportFlags",
+      TP_IFACE_CHANNEL_INTERFACE_MESSAGES, "DeliveryReportingSupport",
+      TP_IFACE_CHANNEL_INTERFACE_MESSAGES, "SupportedContentTypes",
+      TP_IFACE_CHANNEL_INTERFACE_MESSAGES, "MessageTypes",
+      NULL);
+}
+
+static const TpChannelTextMessageType supported_message_types[] = {
+    TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+    TP_CHANNEL_TEXT_MESSAGE_TYPE_ACTION,
+};
+
+static const gchar * const supported_content_types[] = {
+    "text/plain",
+    NULL
+};
+
+static void
+haze_muc_channel_constructed (GObject *obj)
+{
+  HazeMUCChannel *self = HAZE_MUC_CHANNEL (obj);
+  HazeMUCChannelPrivate *priv = self->priv;
+  TpBaseConnection *base_conn = tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (self));
+  void (*constructed) (GObject *) =
+      G_OBJECT_CLASS (haze_muc_channel_parent_class)->constructed;
+
+  if (constructed != NULL)
+    constructed (obj);
+
+  tp_message_mixin_init (obj, G_STRUCT_OFFSET (HazeMUCChannel, messages),
+      base_conn);
+  tp_message_mixin_implement_sending (obj, haze_muc_channel_send,
+      G_N_ELEMENTS (supported_message_types), supported_message_types, 0, 0,
+      supported_content_types);
+
+  /* We're not in the room yet; once we are, we'll be whoever libpurple says
+   * has our nickname there. */
+  tp_group_mixin_init (obj, G_STRUCT_OFFSET (HazeMUCChannel, group),
+      get_contact_repo (self), tp_base_connection_get_self_handle (base_conn));
+
+  if (HAZE_CONNECTION_GET_PRPL_INFO (HAZE_CONNECTION (base_conn))->chat_invite
+      != NULL)
+    tp_group_mixin_change_flags (obj, TP_CHANNEL_GROUP_FLAG_CAN_ADD, 0);
+
+  priv->member_handles = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
+  priv->joined = tp_intset_new ();
+  priv->left = tp_intset_new ();
+}
+
+static void
+haze_muc_channel_dispose (GObject *obj)
+{
+  HazeMUCChannel *self = HAZE_MUC_CHANNEL (obj);
+  HazeMUCChannelPrivate *priv = self->priv;
+  PurpleConversation *conv = priv->conv;
+
+  if (priv->dispose_has_run)
+    return;
+  priv->dispose_has_run = TRUE;
+
+  haze_send_scheduler_cancel (get_send_scheduler (self), obj);
+
+  if (conv != NULL)
+    {
+      haze_muc_channel_forget_conversation (self);
+      purple_conversation_destroy (conv);
+    }
+
+  if (priv->members_id != 0)
+    {
+      g_source_remove (priv->members_id);
+      priv->members_id = 0;
+    }
+
+  tp_message_mixin_finalize (obj);
+
+  G_OBJECT_CLASS (haze_muc_channel_parent_class)->dispose (obj);
+}
+
+static void
+haze_muc_channel_finalize (GObject *obj)
+{
+  HazeMUCChannel *self = HAZE_MUC_CHANNEL (obj);
+
+  g_hash_table_unref (self->priv->member_handles);
+  tp_intset_destroy (self->priv->joined);
+  tp_intset_destroy (self->priv->left);
+  tp_group_mixin_finalize (obj);
+
+  G_OBJECT_CLASS (haze_muc_channel_parent_class)->finalize (obj);
+}
+
+static gchar *
+haze_muc_channel_get_object_path_suffix (TpBaseChannel *chan)
+{
+  return g_strdup_printf ("MUCChannel%u",
+      tp_base_channel_get_target_handle (chan));
+}
+
+static void
+haze_muc_channel_class_init (HazeMUCChannelClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  TpBaseChannelClass *base_class = TP_BASE_CHANNEL_CLASS (klass);
+
+  g_type_class_add_private (klass, sizeof (HazeMUCChannelPrivate));
+
+  object_class->constructed = haze_muc_channel_constructed;
+  object_class->dispose = haze_muc_channel_dispose;
+  object_class->finalize = haze_muc_channel_finalize;
+
+  base_class->channel_type = TP_IFACE_CHANNEL_TYPE_TEXT;
+  base_class->get_interfaces = haze_muc_channel_get_interfaces;
+  base_class->target_handle_type = TP_HANDLE_TYPE_ROOM;
+  base_class->close = haze_muc_channel_close;
+  base_class->fill_immutable_properties =
+      haze_muc_channel_fill_immutable_properties;
+  base_class->get_object_path_suffix =
+      haze_muc_channel_get_object_path_suffix;
+
+  tp_group_mixin_class_init (object_class,
+      G_STRUCT_OFFSET (HazeMUCChannelClass, group_class),
+      haze_muc_channel_add_member, haze_muc_channel_remove_member);
+  tp_group_mixin_class_allow_self_removal (object_class);
+  tp_group_mixin_init_dbus_properties (object_class);
+  tp_message_mixin_init_dbus_properties (object_class);
+}
+
+static void
+haze_muc_channel_init (HazeMUCChannel *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, HAZE_TYPE_MUC_CHANNEL,
+      HazeMUCChannelPrivate);
+}
+
+void
+haze_muc_channel_set_conversation (HazeMUCChannel *self,
+                                   PurpleConversation *conv)
+{
+  g_return_if_fail (self->priv->conv == NULL);
+
+  self->priv->conv = conv;
+  conv->ui_data = self;
+}
+
+/* Called when libpurple destroys the conversation, or before we do. */
+void
+haze_muc_channel_forget_conversation (HazeMUCChannel *self)
+{
+  HazeMUCChannelPrivate *priv = self->priv;
+
+  if (priv->conv == NULL)
+    return;
+
+  priv->conv->ui_data = NULL;
+  priv->conv = NULL;
+  haze_send_scheduler_cancel (get_send_scheduler (self), (GObject *) self);
+}
+
+static void
+flush_members (HazeMUCChannel *self)
+{
+  HazeMUCChannelPrivate *priv = self->priv;
+
+  if (priv->members_id != 0)
+    {
+      g_source_remove (priv->members_id);
+      priv->members_id = 0;
+    }
+
+  if (tp_intset_is_empty (priv->joined) && tp_intset_is_empty (priv->left))
+    return;
+
+  DEBUG ("channel %u: %u joined, %u left",
+      tp_base_channel_get_target_handle (TP_BASE_CHANNEL (self)),
+      tp_intset_size (priv->joined), tp_intset_size (priv->left));
+
+  tp_group_mixin_change_members ((GObject *) self, "", priv->joined,
+      priv->left, NULL, NULL, 0, TP_CHANNEL_GROUP_CHANGE_REASON_NONE);
+
+  tp_intset_clear (priv->joined);
+  tp_intset_clear (priv->left);
+}
+
+static gboolean
+flush_members_cb (gpointer user_data)
+{
+  HazeMUCChannel *self = HAZE_MUC_CHANNEL (user_data);
+
+  self->priv->members_id = 0;
+  flush_members (self);
+  return FALSE;
+}
+
+/* Someone who joins and leaves again before the next flush is never
+ * signalled at all, and vice versa. */
+static void
+member_joined (HazeMUCChannel *self,
+               TpHandle handle)
+{
+  HazeMUCChannelPrivate *priv = self->priv;
+
+  if (tp_intset_is_member (priv->left, handle))
+    tp_intset_remove (priv->left, handle);
+  else
+    tp_intset_add (priv->joined, handle);
+
+  if (priv->members_id == 0)
+    priv->members_id = g_idle_add (flush_members_cb, self);
+}
+
+static void
+member_left (HazeMUCChannel *self,
+             TpHandle handle)
+{
+  HazeMUCChannelPrivate *priv = self->priv;
+
+  if (tp_intset_is_member (priv->joined, handle))
+    tp_intset_remove (priv->joined, handle);
+  else
+    tp_intset_add (priv->left, handle);
+
+  if (priv->members_id == 0)
+    priv->members_id = g_idle_add (flush_members_cb, self);
+}
+
+/* Prefers the prpl's idea of who @name is, like "room@server/nick" rather
+ * than "nick" for XMPP. */
+static TpHandle
+ensure_member_handle (HazeMUCChannel *self,
+                      const gchar *name)
+{
+  PurpleConversation *conv = self->priv->conv;
+  PurpleConnection *gc = purple_conversation_get_gc (conv);
+  PurplePluginProtocolInfo *prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO (gc->prpl);
+  gpointer handle;
+  gchar *real_name = NULL;
+  TpHandle ret;
+
+  if (g_hash_table_lookup_extended (self->priv->member_handles, name, NULL,
+          &handle))
+    return GPOINTER_TO_UINT (handle);
+
+  if (prpl_info->get_cb_real_name != NULL)
+    real_name = prpl_info->get_cb_real_name (gc,
+        purple_conv_chat_get_id (PURPLE_CONV_CHAT (conv)), name);
+
+  ret = tp_handle_ensure (get_contact_repo (self),
+      real_name != NULL ? real_name : name, NULL, NULL);
+  g_free (real_name);
+  return ret;
+}
+
+static gboolean
+is_our_name (HazeMUCChannel *self,
+             const gchar *name)
+{
+  const gchar *nick = purple_conv_chat_get_nick (
+      PURPLE_CONV_CHAT (self->priv->conv));
+
+  return (nick != NULL && purple_utf8_strcasecmp (name, nick) == 0);
+}
+
+static void
+set_self_member (HazeMUCChannel *self,
+                 TpHandle handle)
+{
+  GObject *obj = (GObject *) self;
+  TpHandle conn_self = tp_base_connection_get_self_handle (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (self)));
+
+  if (handle == self->group.self_handle)
+    return;
+
+  if (handle != conn_self)
+    {
+      tp_group_mixin_add_handle_owner (obj, handle, conn_self);
+      tp_group_mixin_change_flags (obj,
+          TP_CHANNEL_GROUP_FLAG_CHANNEL_SPECIFIC_HANDLES, 0);
+    }
+
+  tp_group_mixin_change_self_handle (obj, handle);
+}
+
+void
+haze_muc_channel_add_users (HazeMUCChannel *self,
+                            GList *cbuddies)
+{
+  GList *l;
+
+  for (l = cbuddies; l != NULL; l = l->next)
+    {
+      const gchar *name = purple_conv_chat_cb_get_name (l->data);
+      TpHandle handle = ensure_member_handle (self, name);
+
+      if (handle == 0)
+        {
+          DEBUG ("couldn't get a handle for '%s'", name);
+          continue;
+        }
+
+      g_hash_table_insert (self->priv->member_handles, g_strdup (name),
+          GUINT_TO_POINTER (handle));
+
+      if (is_our_name (self, name))
+        set_self_member (self, handle);
+
+      member_joined (self, handle);
+    }
+}
+
+void
+haze_muc_channel_remove_users (HazeMUCChannel *self,
+                               GList *names)
+{
+  GList *l;
+
+  for (l = names; l != NULL; l = l->next)
+    {
+      const gchar *name = l->data;
+      gpointer handle;
+
+      if (!g_hash_table_lookup_extended (self->priv->member_handles, name,
+              NULL, &handle))
+        {
+          DEBUG ("'%s' left, but wasn't here", name);
+          continue;
+        }
+
+      member_left (self, GPOINTER_TO_UINT (handle));
+      g_hash_table_remove (self->priv->member_handles, name);
+    }
+}
+
+void
+haze_muc_channel_rename_user (HazeMUCChannel *self,
+                              const char *old_name,
+                              const char *new_name)
+{
+  GObject *obj = (GObject *) self;
+  gpointer old_handle_p;
+  TpHandle old_handle, new_handle;
+  TpIntset *added, *removed;
+
+  if (!g_hash_table_lookup_extended (self->priv->member_handles, old_name,
+          NULL, &old_handle_p))
+    {
+      DEBUG ("'%s' became '%s', but wasn't here", old_name, new_name);
+      return;
+    }
+
+  old_handle = GPOINTER_TO_UINT (old_handle_p);
+  g_hash_table_remove (self->priv->member_handles, old_name);
+  new_handle = ensure_member_handle (self, new_name);
+
+  if (new_handle == 0)
+    {
+      DEBUG ("couldn't get a handle for '%s'", new_name);
+      member_left (self, old_handle);
+      return;
+    }
+
+  g_hash_table_insert (self->priv->member_handles, g_strdup (new_name),
+      GUINT_TO_POINTER (new_handle));
+
+  if (new_handle == old_handle)
+    return;
+
+  /* Renames are signalled on their own, so that clients can tell them apart
+   * from someone leaving and someone else joining. */
+  flush_members (self);
+
+  if (old_handle == self->group.self_handle)
+    set_self_member (self, new_handle);
+
+  added = tp_intset_new_containing (new_handle);
+  removed = tp_intset_new_containing (old_handle);
+  tp_group_mixin_change_members (obj, "", added, removed, NULL, NULL, 0,
+      TP_CHANNEL_GROUP_CHANGE_REASON_RENAMED);
+  tp_intset_destroy (added);
+  tp_intset_destroy (removed);
+}
+
+/* We've been kicked out, or the conversation went away under us. */
+void
+haze_muc_channel_left (HazeMUCChannel *self)
+{
+  TpBaseChannel *base = TP_BASE_CHANNEL (self);
+  TpIntset *removed;
+
+  if (tp_base_channel_is_destroyed (base))
+    return;
+
+  DEBUG ("left room %u", tp_base_channel_get_target_handle (base));
+
+  flush_members (self);
+
+  removed = tp_intset_new_containing (self->group.self_handle);
+  tp_group_mixin_change_members ((GObject *) self, "", NULL, removed, NULL,
+      NULL, 0, TP_CHANNEL_GROUP_CHANGE_REASON_NONE);
+  tp_intset_destroy (removed);
+
+  /* We're called from inside libpurple's own handling of the room going
+   * away, which carries on using the conversation afterwards; so just let go
+   * of it, and leave destroying it to libpurple. */
+  haze_muc_channel_forget_conversation (self);
+  tp_base_channel_destroyed (base);
+}
+
+void
+haze_muc_channel_receive (HazeMUCChannel *self,
+                          const char *who,
+                          const char *xhtml_message,
+                          PurpleMessageFlags flags,
+                          time_t mtime)
+{
+  TpBaseConnection *base_conn = tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (self));
+  TpChannelTextMessageType type = TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL;
+  TpMessage *message;
+  TpHandle sender;
+  GString *text;
+
+  if (flags & PURPLE_MESSAGE_SEND)
+    {
+      /* Our own messages come back from some rooms; the message mixin has
+       * already said they were sent. */
+      return;
+    }
+
+  if (!(flags & PURPLE_MESSAGE_RECV) || who == NULL)
+    {
+      DEBUG ("ignoring message from %s with flags %u", who, flags);
+      return;
+    }
+
+  text = g_string_new (NULL);
+  haze_markup_strip (xhtml_message, text);
+  message = tp_cm_message_new (base_conn, 2);
+
+  if (flags & PURPLE_MESSAGE_AUTO_RESP)
+    type = TP_CHANNEL_TEXT_MESSAGE_TYPE_AUTO_REPLY;
+  else if (purple_message_meify (text->str, -1))
+    type = TP_CHANNEL_TEXT_MESSAGE_TYPE_ACTION;
+
+  sender = ensure_member_handle (self, who);
+
+  if (sender != 0)
+    tp_cm_message_set_sender (message, sender);
+
+  tp_message_set_uint32 (message, 0, "message-type", type);
+
+  /* Rooms replay their recent history to people joining them. */
+  if (flags & PURPLE_MESSAGE_DELAYED)
+    {
+      tp_message_set_int64 (message, 0, "message-sent", mtime);
+      tp_message_set_boolean (message, 0, "scrollback", TRUE);
+    }
+
+  tp_message_set_int64 (message, 0, "message-received", time (NULL));
+
+  tp_message_set_string (message, 1, "content-type", "text/plain");
+  tp_message_set_string (message, 1, "content", text->str);
+
+  tp_message_mixin_take_received ((GObject *) self, message);
+  g_string_free (text, TRUE);
+}
@@ -0,0 +1,87 @@
+#ifndef __HAZE_MUC_CHANNEL_H__
+#define __HAZE_MUC_CHANNEL_H__
+/*
+ * muc-channel.h - HazeMUCChannel header
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib-object.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include <libpurple/conversation.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HazeMUCChannel HazeMUCChannel;
+typedef struct _HazeMUCChannelPrivate HazeMUCChannelPrivate;
+typedef struct _HazeMUCChannelClass HazeMUCChannelClass;
+
+struct _HazeMUCChannelClass {
+    TpBaseChannelClass parent_class;
+
+    TpGroupMixinClass group_class;
+};
+
+struct _HazeMUCChannel {
+    TpBaseChannel parent;
+
+    TpMessageMixin messages;
+    TpGroupMixin group;
+
+    HazeMUCChannelPrivate *priv;
+};
+
+GType haze_muc_channel_get_type (void);
+
+/* TYPE MACROS */
+#define HAZE_TYPE_MUC_CHANNEL \
+  (haze_muc_channel_get_type ())
+#define HAZE_MUC_CHANNEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), HAZE_TYPE_MUC_CHANNEL, \
+                              HazeMUCChannel))
+#define HAZE_MUC_CHANNEL_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass), HAZE_TYPE_MUC_CHANNEL, \
+                           HazeMUCChannelClass))
+#define HAZE_IS_MUC_CHANNEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), HAZE_TYPE_MUC_CHANNEL))
+#define HAZE_IS_MUC_CHANNEL_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass), HAZE_TYPE_MUC_CHANNEL))
+#define HAZE_MUC_CHANNEL_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), HAZE_TYPE_MUC_CHANNEL, \
+                              HazeMUCChannelClass))
+
+/* A chat conversation's ui_data is the channel for its room, if any. */
+#define PURPLE_CONV_GET_HAZE_MUC_CHANNEL(conv) \
+    ((HazeMUCChannel *) conv->ui_data)
+
+void haze_muc_channel_set_conversation (HazeMUCChannel *self,
+    PurpleConversation *conv);
+void haze_muc_channel_forget_conversation (HazeMUCChannel *self);
+
+void haze_muc_channel_receive (HazeMUCChannel *self, const char *who,
+    const char *xhtml_message, PurpleMessageFlags flags, time_t mtime);
+void haze_muc_channel_add_users (HazeMUCChannel *self, GList *cbuddies);
+void haze_muc_channel_remove_users (HazeMUCChannel *self, GList *names);
+void haze_muc_channel_rename_user (HazeMUCChannel *self,
+    const char *old_name, const char *new_name);
+void haze_muc_channel_left (HazeMUCChannel *self);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_MUC_CHANNEL_H__*/
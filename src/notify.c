@@ -21,7 +21,9 @@
 #include <config.h>
 #include "notify.h"
 
+#include "connection-contact-info.h"
 #include "connection-mail.h"
+#include "contact-search-manager.h"
 #include "debug.h"
 
 static const gchar *
@@ -85,7 +87,16 @@ haze_notify_userinfo (PurpleConnection *gc,
                       PurpleNotifyUserInfo *user_info)
 {
     DEBUG ("[%s] %s", _account_name (gc), who);
-    return NULL;
+    return haze_connection_contact_info_notify_userinfo (gc, who, user_info);
+}
+
+static void
+haze_notify_close (PurpleNotifyType type,
+                   gpointer ui_handle)
+{
+    /* Search results are the only things we return handles for. */
+    if (type == PURPLE_NOTIFY_SEARCHRESULTS)
+        haze_contact_search_close_results (ui_handle);
 }
 
 static PurpleNotifyUiOps notify_ui_ops =
@@ -96,8 +107,9 @@ static PurpleNotifyUiOps notify_ui_ops =
     .notify_formatted = haze_notify_formatted,
     .notify_userinfo = haze_notify_userinfo,
     .notify_uri = haze_notify_uri,
-    .notify_searchresults = NULL,
-    .notify_searchresults_new_rows = NULL
+    .notify_searchresults = haze_contact_search_notify_results,
+    .notify_searchresults_new_rows = haze_contact_search_notify_new_rows,
+    .close_notify = haze_notify_close
 };
 
 PurpleNotifyUiOps *
@@ -0,0 +1,290 @@
+/*
+ * pending-spool.c - keeping unacknowledged messages on disk
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* A spool is a FIFO of received messages kept in an anonymous temporary
+ * file rather than in memory.  Records are appended at the end and read back
+ * from the front; once everything written has been read, the file is
+ * truncated so it doesn't grow forever.  The file is unlinked as soon as it
+ * is created, so nothing is left behind if we crash.  It lives in our own
+ * directory in the user's cache rather than in $TMPDIR, which may be shared,
+ * small, or in memory.
+ */
+
+#include <config.h>
+#include "pending-spool.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "debug.h"
+
+typedef struct {
+  guint32 text_len;
+  guint32 flags;
+  gint64 sent;
+  gint64 received;
+} RecordHeader;
+
+struct _HazePendingSpool {
+  /* -1 until the first message is spooled */
+  gint fd;
+  goffset read_offset;
+  goffset write_offset;
+};
+
+HazePendingSpool *
+haze_pending_spool_new (void)
+{
+  HazePendingSpool *self = g_slice_new0 (HazePendingSpool);
+
+  self->fd = -1;
+  return self;
+}
+
+void
+haze_pending_spool_free (HazePendingSpool *self)
+{
+  if (self->fd != -1)
+    close (self->fd);
+
+  g_slice_free (HazePendingSpool, self);
+}
+
+gboolean
+haze_pending_spool_is_empty (HazePendingSpool *self)
+{
+  return self->read_offset == self->write_offset;
+}
+
+static gboolean
+write_all (HazePendingSpool *self,
+    gconstpointer data,
+    gsize len,
+    GError **error)
+{
+  const gchar *p = data;
+
+  while (len > 0)
+    {
+      gssize written = pwrite (self->fd, p, len, self->write_offset);
+
+      if (written < 0 && errno == EINTR)
+        continue;
+
+      if (written < 0)
+        {
+          gint saved_errno = errno;
+
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (
+                saved_errno), "couldn't write to spool: %s",
+              g_strerror (saved_errno));
+          return FALSE;
+        }
+
+      p += written;
+      len -= written;
+      self->write_offset += written;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+read_all (HazePendingSpool *self,
+    gpointer data,
+    gsize len)
+{
+  gchar *p = data;
+
+  while (len > 0)
+    {
+      gssize got = pread (self->fd, p, len, self->read_offset);
+
+      if (got < 0 && errno == EINTR)
+        continue;
+
+      if (got <= 0)
+        return FALSE;
+
+      p += got;
+      len -= got;
+      self->read_offset += got;
+    }
+
+  return TRUE;
+}
+
+static gint
+open_spool_file (GError **error)
+{
+  gchar *dir = g_build_filename (g_get_user_cache_dir (), "telepathy-haze",
+      NULL);
+  gchar *path = NULL;
+  gint fd = -1;
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (
+            saved_errno), "couldn't create %s: %s", dir,
+          g_strerror (saved_errno));
+      goto out;
+    }
+
+  /* g_mkstemp() creates it readable and writable only by us. */
+  path = g_build_filename (dir, "spool-XXXXXX", NULL);
+  fd = g_mkstemp (path);
+
+  if (fd == -1)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (
+            saved_errno), "couldn't create spool in %s: %s", dir,
+          g_strerror (saved_errno));
+      goto out;
+    }
+
+  g_unlink (path);
+
+out:
+  g_free (path);
+  g_free (dir);
+  return fd;
+}
+
+/*
+ * haze_pending_spool_push:
+ * @text: a received message's plain text
+ * @flags: the PurpleMessageFlags it came with
+ * @sent: when it was sent, as a Unix timestamp
+ * @received: when we received it, as a Unix timestamp
+ * @error: set if the message couldn't be written out
+ *
+ * Adds a message to the end of the spool.
+ */
+gboolean
+haze_pending_spool_push (HazePendingSpool *self,
+    const gchar *text,
+    guint flags,
+    gint64 sent,
+    gint64 received,
+    GError **error)
+{
+  RecordHeader header;
+  goffset start = self->write_offset;
+
+  if (self->fd == -1)
+    {
+      self->fd = open_spool_file (error);
+
+      if (self->fd == -1)
+        return FALSE;
+    }
+
+  header.text_len = strlen (text);
+  header.flags = flags;
+  header.sent = sent;
+  header.received = received;
+
+  if (!write_all (self, &header, sizeof (header), error) ||
+      !write_all (self, text, header.text_len, error))
+    {
+      /* Forget any partial record. */
+      self->write_offset = start;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * haze_pending_spool_pop:
+ * @flags: set to the message's PurpleMessageFlags
+ * @sent: set to when it was sent
+ * @received: set to when we received it
+ *
+ * Removes the message at the front of the spool, which must not be empty.
+ *
+ * Returns: the message's text, or %NULL if it couldn't be read back, in
+ *          which case the spool is emptied.
+ */
+gchar *
+haze_pending_spool_pop (HazePendingSpool *self,
+    guint *flags,
+    gint64 *sent,
+    gint64 *received)
+{
+  RecordHeader header;
+  gchar *text = NULL;
+
+  g_return_val_if_fail (!haze_pending_spool_is_empty (self), NULL);
+
+  if (read_all (self, &header, sizeof (header)))
+    {
+      text = g_malloc (header.text_len + 1);
+
+      if (read_all (self, text, header.text_len))
+        {
+          text[header.text_len] = '\0';
+          *flags = header.flags;
+          *sent = header.sent;
+          *received = header.received;
+        }
+      else
+        {
+          g_free (text);
+          text = NULL;
+        }
+    }
+
+  if (text == NULL)
+    {
+      g_warning ("couldn't read back spooled message: %s",
+          g_strerror (errno));
+      self->read_offset = self->write_offset;
+    }
+
+  if (haze_pending_spool_is_empty (self))
+    {
+      DEBUG ("spool drained; truncating it");
+      haze_pending_spool_clear (self);
+    }
+
+  return text;
+}
+
+/*
+ * haze_pending_spool_clear:
+ *
+ * Throws away every message in the spool.
+ */
+void
+haze_pending_spool_clear (HazePendingSpool *self)
+{
+  self->read_offset = self->write_offset = 0;
+
+  if (self->fd != -1 && ftruncate (self->fd, 0) != 0)
+    DEBUG ("couldn't truncate spool: %s", g_strerror (errno));
+}
@@ -0,0 +1,41 @@
+#ifndef __HAZE_PENDING_SPOOL_H__
+#define __HAZE_PENDING_SPOOL_H__
+/*
+ * pending-spool.h - header for keeping unacknowledged messages on disk
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HazePendingSpool HazePendingSpool;
+
+HazePendingSpool *haze_pending_spool_new (void);
+void haze_pending_spool_free (HazePendingSpool *self);
+
+gboolean haze_pending_spool_is_empty (HazePendingSpool *self);
+gboolean haze_pending_spool_push (HazePendingSpool *self, const gchar *text,
+    guint flags, gint64 sent, gint64 received, GError **error);
+gchar *haze_pending_spool_pop (HazePendingSpool *self, guint *flags,
+    gint64 *sent, gint64 *received);
+void haze_pending_spool_clear (HazePendingSpool *self);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_PENDING_SPOOL_H__ */
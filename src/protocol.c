@@ -55,6 +55,8 @@ struct _KnownProtocolInfo
     const gchar *vcard_field;
     /* Function to call to add/remove param specs. */
     void (*fixup) (HazeProtocol *self, GArray *paramspecs);
+    /* If not NULL, how gently to send messages. */
+    const HazeSendLimits *send_limits;
 };
 
 typedef enum {
@@ -194,15 +196,26 @@ jabber_fixup (HazeProtocol *self,
     }
 }
 
+/* RFC 1459 §8.10: servers let a client get about ten seconds ahead at one
+ * message per two seconds before they start penalising it.  A PRIVMSG line
+ * is at most 512 bytes including the prefix and target the server adds.
+ */
+static const HazeSendLimits irc_send_limits = { 5, 2000, 400, TRUE };
+
+/* ejabberd's and Prosody's default c2s shapers and stanza size limits */
+static const HazeSendLimits jabber_send_limits = { 10, 200, 32768, FALSE };
+
 static const KnownProtocolInfo known_protocol_info[] = {
     { "aim", "prpl-aim", NULL, "x-aim" },
     /* Seriously. */
     { "facebook", "prpl-bigbrownchunx-facebookim", NULL, "" },
     { "gadugadu", "prpl-gg", NULL, "x-gadugadu" },
     { "groupwise", "prpl-novell", NULL, "x-groupwise" },
-    { "irc", "prpl-irc", irc_mappings, "x-irc" /* ? */ },
+    { "irc", "prpl-irc", irc_mappings, "x-irc" /* ? */, NULL,
+      &irc_send_limits },
     { "icq", "prpl-icq", encoding_to_charset, "x-icq" },
-    { "jabber", "prpl-jabber", jabber_mappings, "x-jabber", jabber_fixup },
+    { "jabber", "prpl-jabber", jabber_mappings, "x-jabber", jabber_fixup,
+      &jabber_send_limits },
     { "local-xmpp", "prpl-bonjour", bonjour_mappings, "" /* ? */ },
     { "msn", "prpl-msn", NULL, "x-msn" },
     { "qq", "prpl-qq", NULL, "x-qq" /* ? */ },
@@ -742,6 +755,7 @@ haze_protocol_new_connection (TpBaseProtocol *base,
   gchar *username;
   gchar *password;
   GHashTable *purple_params = haze_protocol_translate_parameters (self, asv);
+  const HazeSendLimits *send_limits = NULL;
 
   username = haze_protocol_get_username (purple_params, self->priv->prpl_info,
       TRUE);
@@ -754,10 +768,14 @@ haze_protocol_new_connection (TpBaseProtocol *base,
       g_hash_table_remove (purple_params, "password");
     }
 
+  if (self->priv->known_protocol != NULL)
+    send_limits = self->priv->known_protocol->send_limits;
+
   conn = g_object_new (HAZE_TYPE_CONNECTION,
       "protocol", tp_base_protocol_get_name (base),
       "prpl-id", self->priv->prpl_id,
       "prpl-info", self->priv->prpl_info,
+      "send-limits", send_limits,
       "parameters", purple_params,
       "username", username,
       "password", password,
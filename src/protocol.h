@@ -62,6 +62,21 @@ struct _HazeProtocol
   HazeProtocolPrivate *priv;
 };
 
+/* How fast, and in what size pieces, messages may be sent on a protocol
+ * without the server throttling us or disconnecting us for flooding. */
+typedef struct _HazeSendLimits HazeSendLimits;
+struct _HazeSendLimits
+{
+  /* How many messages may be sent back to back, and how long it takes to
+   * earn the right to send another; if burst is 0 there is no rate limit. */
+  guint burst;
+  guint interval_ms;
+  /* The longest message body, in bytes once escaped, or 0 for no limit */
+  gsize max_message_bytes;
+  /* TRUE if the prpl sends each line as a message of its own */
+  gboolean one_line_per_message;
+};
+
 GList *haze_protocol_build_list (void);
 
 G_END_DECLS
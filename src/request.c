@@ -28,8 +28,9 @@
 #include "debug.h"
 #include "request.h"
 #include "connection.h"
+#include "contact-search-manager.h"
+#include "roomlist-channel.h"
 
-#ifdef ENABLE_LEAKY_REQUEST_STUBS
 static gpointer
 haze_request_input (const char *title,
                     const char *primary,
@@ -47,6 +48,17 @@ haze_request_input (const char *title,
                     PurpleConversation *conv,
                     void *user_data)
 {
+    /* The only questions we know how to answer are a directory search's
+     * "which server?", while HazeContactSearchManager is starting one, and
+     * a room list's, while a HazeRoomlistChannel is starting one. */
+    if (haze_contact_search_manager_take_input (default_value,
+            (PurpleRequestInputCb) ok_cb, user_data))
+        return NULL;
+
+    if (haze_roomlist_channel_take_input (default_value,
+            (PurpleRequestInputCb) ok_cb, user_data))
+        return NULL;
+
     DEBUG ("ignoring request:");
     DEBUG ("    title: %s", (title ? title : "(null)"));
     DEBUG ("    primary: %s", (primary ? primary : "(null)"));
@@ -56,6 +68,7 @@ haze_request_input (const char *title,
     return NULL;
 }
 
+#ifdef ENABLE_LEAKY_REQUEST_STUBS
 static gpointer
 haze_request_choice (const char *title,
                      const char *primary,
@@ -108,6 +121,8 @@ struct fields_data {
     PurpleRequestFieldsCb ok_cb;
     PurpleRequestFieldsCb cancel_cb;
     void *user_data;
+    /* TRUE if HazeContactSearchManager is holding on to this */
+    gboolean search;
 };
 
 static void
@@ -116,20 +131,28 @@ haze_close_request (PurpleRequestType type,
 {
     struct fields_data *fd = ui_handle;
 
-    haze_connection_cancel_password_request (fd->account);
+    if (fd->password != NULL)
+        haze_connection_cancel_password_request (fd->account);
+
+    if (fd->search)
+        haze_contact_search_manager_forget_request (fd);
+
     purple_request_fields_destroy (fd->fields);
     g_slice_free (struct fields_data, fd);
 }
 
+/*
+ * Answers a fields request which we passed on to someone else, with whatever
+ * they filled in if @ok, and closes it.
+ */
 void
-haze_request_password_cb (gpointer user_data,
-                          const gchar *password)
+haze_request_fields_done (gpointer request,
+                          gboolean ok)
 {
-    struct fields_data *fd = user_data;
+    struct fields_data *fd = request;
 
-    if (password)
+    if (ok)
       {
-        purple_request_field_string_set_value (fd->password, password);
         if (fd->ok_cb)
           {
             (fd->ok_cb) (fd->user_data, fd->fields);
@@ -146,17 +169,22 @@ haze_request_password_cb (gpointer user_data,
     purple_request_close (PURPLE_REQUEST_FIELDS, fd);
 }
 
-static gboolean
-haze_request_fields_destroy (gpointer user_data)
+void
+haze_request_password_cb (gpointer user_data,
+                          const gchar *password)
 {
     struct fields_data *fd = user_data;
 
-    if (fd->cancel_cb)
-      {
-        (fd->cancel_cb) (fd->user_data, fd->fields);
-      }
+    if (password)
+        purple_request_field_string_set_value (fd->password, password);
+
+    haze_request_fields_done (fd, password != NULL);
+}
 
-    purple_request_close (PURPLE_REQUEST_FIELDS, user_data);
+static gboolean
+haze_request_fields_destroy (gpointer user_data)
+{
+    haze_request_fields_done (user_data, FALSE);
 
     return FALSE;
 }
@@ -185,6 +213,7 @@ haze_request_fields (const char *title,
     /* it is our responsibility to destroy this data */
     fd->account   = account;
     fd->fields    = fields;
+    fd->ok_cb     = (PurpleRequestFieldsCb) ok_cb;
     fd->cancel_cb = (PurpleRequestFieldsCb) cancel_cb;
     fd->user_data = user_data;
 
@@ -195,11 +224,16 @@ haze_request_fields (const char *title,
         DEBUG ("triggering password request");
 
         fd->password = purple_request_fields_get_field (fields, "password");
-        fd->ok_cb    = (PurpleRequestFieldsCb) ok_cb;
 
         haze_connection_request_password (account, fd);
 
       }
+    else if (haze_contact_search_manager_take_fields (account, fields, fd))
+      {
+        DEBUG ("passing '%s' on to contact search", title ? title : "(null)");
+
+        fd->search = TRUE;
+      }
     else
       {
         DEBUG ("ignoring request:");
@@ -253,8 +287,8 @@ haze_request_folder (const char *title,
 
 static PurpleRequestUiOps request_uiops =
 {
-#ifdef ENABLE_LEAKY_REQUEST_STUBS
     .request_input = haze_request_input,
+#ifdef ENABLE_LEAKY_REQUEST_STUBS
     .request_choice = haze_request_choice,
     .request_action = haze_request_action,
     .request_file = haze_request_file,
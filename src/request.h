@@ -22,5 +22,7 @@
 
 void haze_request_password_cb (gpointer user_data,
                                const gchar *password);
+void haze_request_fields_done (gpointer request,
+                               gboolean ok);
 
 PurpleRequestUiOps *haze_request_get_ui_ops (void);
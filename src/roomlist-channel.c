@@ -0,0 +1,532 @@
+/*
+ * roomlist-channel.c - HazeRoomlistChannel source
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* A RoomList channel, backed by a PurpleRoomlist while it is listing.  Some
+ * servers list tens of thousands of rooms, so rather than waiting for the
+ * whole list, rooms are passed on in GotRooms as they arrive: whenever we get
+ * back to the main loop, or sooner if MAX_ROOMS_PER_BATCH have piled up.
+ */
+
+#include <config.h>
+#include "roomlist-channel.h"
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "connection.h"
+#include "debug.h"
+
+/* The most rooms signalled in one GotRooms */
+#define MAX_ROOMS_PER_BATCH 100
+
+enum
+{
+  PROP_SERVER = 1,
+};
+
+struct _HazeRoomlistChannelPrivate
+{
+  /* the server the client asked for, or NULL to use the prpl's default */
+  gchar *server;
+  /* set if the prpl asked which server to list, and we couldn't say */
+  gboolean no_server;
+  /* a reference to the list being filled in, or NULL if we're not listing */
+  PurpleRoomlist *list;
+  /* Room_Info structs not yet signalled, and the idle which will */
+  GPtrArray *batch;
+  guint flush_id;
+  gboolean dispose_has_run;
+};
+
+static void room_list_iface_init (gpointer g_iface, gpointer iface_data);
+
+G_DEFINE_TYPE_WITH_CODE (HazeRoomlistChannel, haze_roomlist_channel,
+    TP_TYPE_BASE_CHANNEL,
+    G_IMPLEMENT_INTERFACE (TP_TYPE_SVC_CHANNEL_TYPE_ROOM_LIST,
+        room_list_iface_init))
+
+/* the channel asking the prpl for a room list right now, if any */
+static HazeRoomlistChannel *starting = NULL;
+
+static void
+flush_rooms (HazeRoomlistChannel *self)
+{
+  HazeRoomlistChannelPrivate *priv = self->priv;
+
+  if (priv->flush_id != 0)
+    {
+      g_source_remove (priv->flush_id);
+      priv->flush_id = 0;
+    }
+
+  if (priv->batch->len == 0)
+    return;
+
+  tp_svc_channel_type_room_list_emit_got_rooms (self, priv->batch);
+  g_ptr_array_set_size (priv->batch, 0);
+}
+
+static gboolean
+flush_rooms_cb (gpointer user_data)
+{
+  HazeRoomlistChannel *self = HAZE_ROOMLIST_CHANNEL (user_data);
+
+  self->priv->flush_id = 0;
+  flush_rooms (self);
+  return FALSE;
+}
+
+/* Called when libpurple destroys the list, or before we let go of it. */
+void
+haze_roomlist_channel_forget_list (HazeRoomlistChannel *self)
+{
+  HazeRoomlistChannelPrivate *priv = self->priv;
+
+  if (priv->list == NULL)
+    return;
+
+  priv->list->ui_data = NULL;
+  priv->list = NULL;
+}
+
+void
+haze_roomlist_channel_listing_finished (HazeRoomlistChannel *self)
+{
+  PurpleRoomlist *list = self->priv->list;
+
+  if (list == NULL)
+    return;
+
+  DEBUG ("finished listing rooms");
+
+  flush_rooms (self);
+  haze_roomlist_channel_forget_list (self);
+  purple_roomlist_unref (list);
+
+  tp_svc_channel_type_room_list_emit_listing_rooms (self, FALSE);
+}
+
+static void
+stop_listing (HazeRoomlistChannel *self)
+{
+  if (self->priv->list == NULL)
+    return;
+
+  /* The prpl should say it has stopped, but doesn't have to. */
+  purple_roomlist_cancel_get_list (self->priv->list);
+  haze_roomlist_channel_listing_finished (self);
+}
+
+static void
+add_field_info (GHashTable *info,
+                PurpleRoomlistField *field,
+                gpointer value)
+{
+  const gchar *name = purple_roomlist_field_get_name (field);
+
+  switch (purple_roomlist_field_get_type (field))
+    {
+    case PURPLE_ROOMLIST_FIELD_INT:
+      /* prpl-irc's name for it */
+      if (!tp_strdiff (name, "users"))
+        tp_asv_set_uint32 (info, "members", GPOINTER_TO_INT (value));
+      break;
+    case PURPLE_ROOMLIST_FIELD_STRING:
+      if (value == NULL)
+        break;
+
+      if (!tp_strdiff (name, "topic"))
+        tp_asv_set_string (info, "subject", value);
+      else if (!tp_strdiff (name, "description"))
+        tp_asv_set_string (info, "description", value);
+      break;
+    default:
+      break;
+    }
+}
+
+void
+haze_roomlist_channel_add_room (HazeRoomlistChannel *self,
+                                PurpleRoomlistRoom *room)
+{
+  HazeRoomlistChannelPrivate *priv = self->priv;
+  TpBaseConnection *base_conn = tp_base_channel_get_connection (
+      TP_BASE_CHANNEL (self));
+  PurplePluginProtocolInfo *prpl_info = HAZE_CONNECTION_GET_PRPL_INFO (
+      HAZE_CONNECTION (base_conn));
+  TpHandleRepoIface *room_repo = tp_base_connection_get_handles (base_conn,
+      TP_HANDLE_TYPE_ROOM);
+  const gchar *name = purple_roomlist_room_get_name (room);
+  gchar *id = NULL;
+  GList *fields, *values;
+  GHashTable *info;
+  TpHandle handle;
+
+  if (!(purple_roomlist_room_get_type (room) & PURPLE_ROOMLIST_ROOMTYPE_ROOM))
+    return;
+
+  /* For XMPP, the room's name is just its node; this gives its JID. */
+  if (prpl_info->roomlist_room_serialize != NULL)
+    id = prpl_info->roomlist_room_serialize (room);
+
+  if (id == NULL)
+    id = g_strdup (name);
+
+  handle = tp_handle_ensure (room_repo, id, NULL, NULL);
+
+  if (handle == 0)
+    {
+      DEBUG ("couldn't get a handle for room '%s'", id);
+      g_free (id);
+      return;
+    }
+
+  info = tp_asv_new (
+      "handle-name", G_TYPE_STRING, tp_handle_inspect (room_repo, handle),
+      "name", G_TYPE_STRING, name,
+      NULL);
+
+  for (fields = purple_roomlist_get_fields (priv->list),
+           values = purple_roomlist_room_get_fields (room);
+       fields != NULL && values != NULL;
+       fields = fields->next, values = values->next)
+    add_field_info (info, fields->data, values->data);
+
+  g_ptr_array_add (priv->batch, tp_value_array_build (3,
+      G_TYPE_UINT, handle,
+      G_TYPE_STRING, TP_IFACE_CHANNEL_TYPE_TEXT,
+      TP_HASH_TYPE_STRING_VARIANT_MAP, info,
+      G_TYPE_INVALID));
+  g_hash_table_unref (info);
+  g_free (id);
+
+  if (priv->batch->len >= MAX_ROOMS_PER_BATCH)
+    flush_rooms (self);
+  else if (priv->flush_id == 0)
+    priv->flush_id = g_idle_add (flush_rooms_cb, self);
+}
+
+/**
+ * haze_roomlist_channel_get_listing_rooms
+ *
+ * Implements D-Bus method GetListingRooms
+ * on interface org.freedesktop.Telepathy.Channel.Type.RoomList
+ */
+static void
+haze_roomlist_channel_get_listing_rooms (TpSvcChannelTypeRoomList *iface,
+                                         DBusGMethodInvocation *context)
+{
+  HazeRoomlistChannel *self = HAZE_ROOMLIST_CHANNEL (iface);
+
+  tp_svc_channel_type_room_list_return_from_get_listing_rooms (context,
+      self->priv->list != NULL);
+}
+
+/**
+ * haze_roomlist_channel_list_rooms
+ *
+ * Implements D-Bus method ListRooms
+ * on interface org.freedesktop.Telepathy.Channel.Type.RoomList
+ */
+static void
+haze_roomlist_channel_list_rooms (TpSvcChannelTypeRoomList *iface,
+                                  DBusGMethodInvocation *context)
+{
+  HazeRoomlistChannel *self = HAZE_ROOMLIST_CHANNEL (iface);
+  HazeRoomlistChannelPrivate *priv = self->priv;
+  HazeConnection *conn = HAZE_CONNECTION (
+      tp_base_channel_get_connection (TP_BASE_CHANNEL (self)));
+  PurpleRoomlist *list;
+
+  if (priv->list != NULL)
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "already listing rooms" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  /* The prpl may ask which server to list before this returns. */
+  priv->no_server = FALSE;
+  starting = self;
+  list = purple_roomlist_get_list (conn->account->gc);
+  starting = NULL;
+
+  if (list == NULL)
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+          "couldn't start listing rooms" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  if (priv->no_server)
+    {
+      GError e = { TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+          "No conference server is known for this account; "
+          "please give a Server" };
+
+      /* The prpl is still waiting for an answer, which will never come. */
+      purple_roomlist_cancel_get_list (list);
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  purple_roomlist_ref (list);
+  list->ui_data = self;
+  priv->list = list;
+
+  tp_svc_channel_type_room_list_emit_listing_rooms (self, TRUE);
+  tp_svc_channel_type_room_list_return_from_list_rooms (context);
+
+  /* Some prpls know all their rooms up front. */
+  if (!purple_roomlist_get_in_progress (list))
+    haze_roomlist_channel_listing_finished (self);
+}
+
+/**
+ * haze_roomlist_channel_stop_listing
+ *
+ * Implements D-Bus method StopListing
+ * on interface org.freedesktop.Telepathy.Channel.Type.RoomList
+ */
+static void
+haze_roomlist_channel_stop_listing (TpSvcChannelTypeRoomList *iface,
+                                    DBusGMethodInvocation *context)
+{
+  stop_listing (HAZE_ROOMLIST_CHANNEL (iface));
+  tp_svc_channel_type_room_list_return_from_stop_listing (context);
+}
+
+/*
+ * Called with the prpl's "which server?" question, if it asks one; XMPP
+ * does, offering the server it found by service discovery, if any.
+ */
+gboolean
+haze_roomlist_channel_take_input (const gchar *default_value,
+                                  PurpleRequestInputCb ok_cb,
+                                  gpointer user_data)
+{
+  const gchar *server;
+
+  if (starting == NULL)
+    return FALSE;
+
+  if (!tp_str_empty (starting->priv->server))
+    server = starting->priv->server;
+  else
+    server = default_value;
+
+  if (tp_str_empty (server))
+    {
+      starting->priv->no_server = TRUE;
+      return TRUE;
+    }
+
+  DEBUG ("listing the rooms on %s", server);
+
+  if (ok_cb != NULL)
+    ok_cb (user_data, server);
+
+  return TRUE;
+}
+
+static void
+room_list_iface_init (gpointer g_iface,
+                      gpointer iface_data)
+{
+  TpSvcChannelTypeRoomListClass *klass = g_iface;
+
+#define IMPLEMENT(x) tp_svc_channel_type_room_list_implement_##x (\
+    klass, haze_roomlist_channel_##x)
+  IMPLEMENT(get_listing_rooms);
+  IMPLEMENT(list_rooms);
+  IMPLEMENT(stop_listing);
+#undef IMPLEMENT
+}
+
+static void
+get_room_list_property (GObject *object,
+                        GQuark iface,
+                        GQuark name,
+                        GValue *value,
+                        gpointer getter_data)
+{
+  HazeRoomlistChannel *self = HAZE_ROOMLIST_CHANNEL (object);
+
+  /* If it's empty, the prpl picks one. */
+  g_value_set_string (value,
+      self->priv->server != NULL ? self->priv->server : "");
+}
+
+static void
+haze_roomlist_channel_close (TpBaseChannel *base)
+{
+  stop_listing (HAZE_ROOMLIST_CHANNEL (base));
+  tp_base_channel_destroyed (base);
+}
+
+static void
+haze_roomlist_channel_fill_immutable_properties (TpBaseChannel *chan,
+    GHashTable *properties)
+{
+  TpBaseChannelClass *cls = TP_BASE_CHANNEL_CLASS (
+      haze_roomlist_channel_parent_class);
+
+  cls->fill_immutable_properties (chan, properties);
+
+  tp_dbus_properties_mixin_fill_properties_hash (
+      G_OBJECT (chan), properties,
+      TP_IFACE_CHANNEL_TYPE_ROOM_LIST, "Server",
+      NULL);
+}
+
+static gchar *
+haze_roomlist_channel_get_object_path_suffix (TpBaseChannel *chan)
+{
+  static guint count = 0;
+
+  return g_strdup_printf ("RoomlistChannel%u", count++);
+}
+
+static void
+haze_roomlist_channel_init (HazeRoomlistChannel *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, HAZE_TYPE_ROOMLIST_CHANNEL,
+      HazeRoomlistChannelPrivate);
+
+  self->priv->batch = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) tp_value_array_free);
+}
+
+static void
+haze_roomlist_channel_get_property (GObject *object,
+                                    guint property_id,
+                                    GValue *value,
+                                    GParamSpec *pspec)
+{
+  HazeRoomlistChannel *self = HAZE_ROOMLIST_CHANNEL (object);
+
+  switch (property_id)
+    {
+    case PROP_SERVER:
+      g_value_set_string (value, self->priv->server);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+haze_roomlist_channel_set_property (GObject *object,
+                                    guint property_id,
+                                    const GValue *value,
+                                    GParamSpec *pspec)
+{
+  HazeRoomlistChannel *self = HAZE_ROOMLIST_CHANNEL (object);
+
+  switch (property_id)
+    {
+    case PROP_SERVER:
+      self->priv->server = g_value_dup_string (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+haze_roomlist_channel_dispose (GObject *obj)
+{
+  HazeRoomlistChannel *self = HAZE_ROOMLIST_CHANNEL (obj);
+  HazeRoomlistChannelPrivate *priv = self->priv;
+  PurpleRoomlist *list = priv->list;
+
+  if (priv->dispose_has_run)
+    return;
+  priv->dispose_has_run = TRUE;
+
+  /* Too late to signal anything. */
+  if (list != NULL)
+    {
+      haze_roomlist_channel_forget_list (self);
+      purple_roomlist_cancel_get_list (list);
+      purple_roomlist_unref (list);
+    }
+
+  if (priv->flush_id != 0)
+    {
+      g_source_remove (priv->flush_id);
+      priv->flush_id = 0;
+    }
+
+  G_OBJECT_CLASS (haze_roomlist_channel_parent_class)->dispose (obj);
+}
+
+static void
+haze_roomlist_channel_finalize (GObject *obj)
+{
+  HazeRoomlistChannel *self = HAZE_ROOMLIST_CHANNEL (obj);
+
+  g_ptr_array_unref (self->priv->batch);
+  g_free (self->priv->server);
+
+  G_OBJECT_CLASS (haze_roomlist_channel_parent_class)->finalize (obj);
+}
+
+static void
+haze_roomlist_channel_class_init (HazeRoomlistChannelClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  TpBaseChannelClass *base_class = TP_BASE_CHANNEL_CLASS (klass);
+  static TpDBusPropertiesMixinPropImpl room_list_props[] = {
+      { "Server", NULL, NULL },
+      { NULL }
+  };
+  GParamSpec *param_spec;
+
+  g_type_class_add_private (klass, sizeof (HazeRoomlistChannelPrivate));
+
+  object_class->get_property = haze_roomlist_channel_get_property;
+  object_class->set_property = haze_roomlist_channel_set_property;
+  object_class->dispose = haze_roomlist_channel_dispose;
+  object_class->finalize = haze_roomlist_channel_finalize;
+
+  base_class->channel_type = TP_IFACE_CHANNEL_TYPE_ROOM_LIST;
+  base_class->target_handle_type = TP_HANDLE_TYPE_NONE;
+  base_class->close = haze_roomlist_channel_close;
+  base_class->fill_immutable_properties =
+      haze_roomlist_channel_fill_immutable_properties;
+  base_class->get_object_path_suffix =
+      haze_roomlist_channel_get_object_path_suffix;
+
+  param_spec = g_param_spec_string ("server", "Server",
+      "The server whose rooms are listed, or NULL if libpurple chooses it",
+      NULL,
+      G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_SERVER, param_spec);
+
+  tp_dbus_properties_mixin_implement_interface (object_class,
+      TP_IFACE_QUARK_CHANNEL_TYPE_ROOM_LIST, get_room_list_property, NULL,
+      room_list_props);
+}
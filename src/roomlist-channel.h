@@ -0,0 +1,79 @@
+#ifndef __HAZE_ROOMLIST_CHANNEL_H__
+#define __HAZE_ROOMLIST_CHANNEL_H__
+/*
+ * roomlist-channel.h - HazeRoomlistChannel header
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib-object.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include <libpurple/request.h>
+#include <libpurple/roomlist.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HazeRoomlistChannel HazeRoomlistChannel;
+typedef struct _HazeRoomlistChannelPrivate HazeRoomlistChannelPrivate;
+typedef struct _HazeRoomlistChannelClass HazeRoomlistChannelClass;
+
+struct _HazeRoomlistChannelClass {
+    TpBaseChannelClass parent_class;
+};
+
+struct _HazeRoomlistChannel {
+    TpBaseChannel parent;
+
+    HazeRoomlistChannelPrivate *priv;
+};
+
+GType haze_roomlist_channel_get_type (void);
+
+/* TYPE MACROS */
+#define HAZE_TYPE_ROOMLIST_CHANNEL \
+  (haze_roomlist_channel_get_type ())
+#define HAZE_ROOMLIST_CHANNEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), HAZE_TYPE_ROOMLIST_CHANNEL, \
+                              HazeRoomlistChannel))
+#define HAZE_ROOMLIST_CHANNEL_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass), HAZE_TYPE_ROOMLIST_CHANNEL, \
+                           HazeRoomlistChannelClass))
+#define HAZE_IS_ROOMLIST_CHANNEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), HAZE_TYPE_ROOMLIST_CHANNEL))
+#define HAZE_IS_ROOMLIST_CHANNEL_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass), HAZE_TYPE_ROOMLIST_CHANNEL))
+#define HAZE_ROOMLIST_CHANNEL_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), HAZE_TYPE_ROOMLIST_CHANNEL, \
+                              HazeRoomlistChannelClass))
+
+/* A room list's ui_data is the channel listing it, if any. */
+#define PURPLE_ROOMLIST_GET_HAZE_CHANNEL(list) \
+    ((HazeRoomlistChannel *) (list)->ui_data)
+
+void haze_roomlist_channel_add_room (HazeRoomlistChannel *self,
+    PurpleRoomlistRoom *room);
+void haze_roomlist_channel_listing_finished (HazeRoomlistChannel *self);
+void haze_roomlist_channel_forget_list (HazeRoomlistChannel *self);
+
+gboolean haze_roomlist_channel_take_input (const gchar *default_value,
+    PurpleRequestInputCb ok_cb, gpointer user_data);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_ROOMLIST_CHANNEL_H__*/
@@ -0,0 +1,415 @@
+/*
+ * roomlist-manager.c - HazeRoomlistManager source
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "config.h"
+#include "roomlist-manager.h"
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "connection.h"
+#include "debug.h"
+#include "roomlist-channel.h"
+
+struct _HazeRoomlistManagerPrivate {
+    HazeConnection *conn;
+    /* prpls only list rooms once at a time, so neither do we */
+    HazeRoomlistChannel *channel;
+    gulong status_changed_id;
+    gboolean dispose_has_run;
+};
+
+static void channel_manager_iface_init (gpointer, gpointer);
+
+G_DEFINE_TYPE_WITH_CODE(HazeRoomlistManager,
+    haze_roomlist_manager,
+    G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (TP_TYPE_CHANNEL_MANAGER,
+      channel_manager_iface_init))
+
+/* properties: */
+enum {
+    PROP_CONNECTION = 1,
+
+    LAST_PROPERTY
+};
+
+static void close_all (HazeRoomlistManager *self);
+
+static void
+haze_roomlist_manager_init (HazeRoomlistManager *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+        HAZE_TYPE_ROOMLIST_MANAGER, HazeRoomlistManagerPrivate);
+
+    self->priv->conn = NULL;
+    self->priv->channel = NULL;
+    self->priv->dispose_has_run = FALSE;
+}
+
+static void
+haze_roomlist_manager_dispose (GObject *object)
+{
+    HazeRoomlistManager *self = HAZE_ROOMLIST_MANAGER (object);
+
+    if (self->priv->dispose_has_run)
+        return;
+
+    self->priv->dispose_has_run = TRUE;
+
+    close_all (self);
+
+    if (G_OBJECT_CLASS (haze_roomlist_manager_parent_class)->dispose)
+        G_OBJECT_CLASS (haze_roomlist_manager_parent_class)->dispose (object);
+}
+
+static void
+haze_roomlist_manager_get_property (GObject *object,
+                                    guint property_id,
+                                    GValue *value,
+                                    GParamSpec *pspec)
+{
+    HazeRoomlistManager *self = HAZE_ROOMLIST_MANAGER (object);
+
+    switch (property_id) {
+        case PROP_CONNECTION:
+            g_value_set_object (value, self->priv->conn);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+haze_roomlist_manager_set_property (GObject *object,
+                                    guint property_id,
+                                    const GValue *value,
+                                    GParamSpec *pspec)
+{
+    HazeRoomlistManager *self = HAZE_ROOMLIST_MANAGER (object);
+
+    switch (property_id) {
+        case PROP_CONNECTION:
+            self->priv->conn = g_value_get_object (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+status_changed_cb (HazeConnection *conn,
+                   guint status,
+                   guint reason,
+                   HazeRoomlistManager *self)
+{
+    if (status == TP_CONNECTION_STATUS_DISCONNECTED)
+        close_all (self);
+}
+
+static void
+haze_roomlist_manager_constructed (GObject *object)
+{
+    HazeRoomlistManager *self = HAZE_ROOMLIST_MANAGER (object);
+    void (*constructed) (GObject *) =
+        ((GObjectClass *) haze_roomlist_manager_parent_class)->constructed;
+
+    if (constructed != NULL)
+    {
+        constructed (object);
+    }
+
+    self->priv->status_changed_id = g_signal_connect (self->priv->conn,
+        "status-changed", (GCallback) status_changed_cb, self);
+}
+
+static void
+haze_roomlist_manager_class_init (HazeRoomlistManagerClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GParamSpec *param_spec;
+
+    object_class->constructed = haze_roomlist_manager_constructed;
+    object_class->dispose = haze_roomlist_manager_dispose;
+    object_class->get_property = haze_roomlist_manager_get_property;
+    object_class->set_property = haze_roomlist_manager_set_property;
+
+    param_spec = g_param_spec_object ("connection", "HazeConnection object",
+                                      "Haze connection object that owns this "
+                                      "room list manager object.",
+                                      HAZE_TYPE_CONNECTION,
+                                      G_PARAM_CONSTRUCT_ONLY |
+                                      G_PARAM_READWRITE |
+                                      G_PARAM_STATIC_NICK |
+                                      G_PARAM_STATIC_BLURB);
+    g_object_class_install_property (object_class, PROP_CONNECTION, param_spec);
+
+    g_type_class_add_private (object_class,
+                              sizeof(HazeRoomlistManagerPrivate));
+}
+
+static void
+roomlist_channel_closed_cb (HazeRoomlistChannel *chan, gpointer user_data)
+{
+    HazeRoomlistManager *self = HAZE_ROOMLIST_MANAGER (user_data);
+
+    tp_channel_manager_emit_channel_closed_for_object (self,
+        TP_EXPORTABLE_CHANNEL (chan));
+
+    if (self->priv->channel == chan)
+    {
+        DEBUG ("room list channel closed");
+        tp_clear_object (&self->priv->channel);
+    }
+}
+
+static void
+close_all (HazeRoomlistManager *self)
+{
+    tp_clear_object (&self->priv->channel);
+
+    if (self->priv->status_changed_id != 0)
+    {
+        g_signal_handler_disconnect (self->priv->conn,
+            self->priv->status_changed_id);
+        self->priv->status_changed_id = 0;
+    }
+}
+
+static void
+haze_roomlist_manager_foreach (TpChannelManager *iface,
+                               TpExportableChannelFunc foreach,
+                               gpointer user_data)
+{
+    HazeRoomlistManager *self = HAZE_ROOMLIST_MANAGER (iface);
+
+    if (self->priv->channel != NULL)
+        foreach (TP_EXPORTABLE_CHANNEL (self->priv->channel), user_data);
+}
+
+static const gchar * const fixed_properties[] = {
+    TP_IFACE_CHANNEL ".ChannelType",
+    TP_IFACE_CHANNEL ".TargetHandleType",
+    NULL
+};
+static const gchar * const allowed_properties[] = {
+    TP_PROP_CHANNEL_TYPE_ROOM_LIST_SERVER,
+    NULL
+};
+
+static void
+haze_roomlist_manager_foreach_channel_class (TpChannelManager *manager,
+    TpChannelManagerChannelClassFunc func,
+    gpointer user_data)
+{
+    HazeRoomlistManager *self = HAZE_ROOMLIST_MANAGER (manager);
+    PurplePluginProtocolInfo *prpl_info;
+    GHashTable *table;
+    GValue *value;
+
+    g_object_get (self->priv->conn, "prpl-info", &prpl_info, NULL);
+
+    if (prpl_info->roomlist_get_list == NULL)
+        return;
+
+    table = g_hash_table_new_full (g_str_hash, g_str_equal,
+        NULL, (GDestroyNotify) tp_g_value_slice_free);
+
+    value = tp_g_value_slice_new (G_TYPE_STRING);
+    g_value_set_static_string (value, TP_IFACE_CHANNEL_TYPE_ROOM_LIST);
+    g_hash_table_insert (table, TP_IFACE_CHANNEL ".ChannelType", value);
+
+    value = tp_g_value_slice_new (G_TYPE_UINT);
+    g_value_set_uint (value, TP_HANDLE_TYPE_NONE);
+    g_hash_table_insert (table, TP_IFACE_CHANNEL ".TargetHandleType", value);
+
+    func (manager, table, allowed_properties, user_data);
+
+    g_hash_table_destroy (table);
+}
+
+static gboolean
+haze_roomlist_manager_request (HazeRoomlistManager *self,
+                               gpointer request_token,
+                               GHashTable *request_properties,
+                               gboolean require_new)
+{
+    TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
+    GSList *requests = NULL;
+    GError *error = NULL;
+    const gchar *server;
+
+    if (tp_strdiff (tp_asv_get_string (request_properties,
+            TP_IFACE_CHANNEL ".ChannelType"),
+        TP_IFACE_CHANNEL_TYPE_ROOM_LIST))
+    {
+        return FALSE;
+    }
+
+    if (tp_asv_get_uint32 (request_properties,
+        TP_IFACE_CHANNEL ".TargetHandleType", NULL) != TP_HANDLE_TYPE_NONE)
+    {
+        g_set_error (&error, TP_ERROR, TP_ERROR_INVALID_ARGUMENT,
+            "RoomList channels can't have a target handle");
+        goto error;
+    }
+
+    if (tp_channel_manager_asv_has_unknown_properties (request_properties,
+          fixed_properties, allowed_properties, &error))
+    {
+        goto error;
+    }
+
+    server = tp_asv_get_string (request_properties,
+        TP_PROP_CHANNEL_TYPE_ROOM_LIST_SERVER);
+
+    if (tp_str_empty (server))
+        server = NULL;
+
+    if (self->priv->channel != NULL)
+    {
+        gchar *existing_server = NULL;
+
+        g_object_get (self->priv->channel, "server", &existing_server, NULL);
+
+        if (require_new || tp_strdiff (server, existing_server))
+        {
+            tp_channel_manager_emit_request_failed (self, request_token,
+                TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+                "Only one room list channel at a time is supported");
+        }
+        else
+        {
+            tp_channel_manager_emit_request_already_satisfied (self,
+                request_token, TP_EXPORTABLE_CHANNEL (self->priv->channel));
+        }
+
+        g_free (existing_server);
+        return TRUE;
+    }
+
+    self->priv->channel = g_object_new (HAZE_TYPE_ROOMLIST_CHANNEL,
+        "connection", self->priv->conn,
+        "initiator-handle", tp_base_connection_get_self_handle (base_conn),
+        "requested", TRUE,
+        "server", server,
+        NULL);
+    tp_base_channel_register (TP_BASE_CHANNEL (self->priv->channel));
+
+    g_signal_connect (self->priv->channel, "closed",
+        G_CALLBACK (roomlist_channel_closed_cb), self);
+
+    requests = g_slist_prepend (requests, request_token);
+    tp_channel_manager_emit_new_channel (self,
+        TP_EXPORTABLE_CHANNEL (self->priv->channel), requests);
+    g_slist_free (requests);
+
+    return TRUE;
+
+error:
+    tp_channel_manager_emit_request_failed (self, request_token,
+        error->domain, error->code, error->message);
+    g_error_free (error);
+    return TRUE;
+}
+
+static gboolean
+haze_roomlist_manager_create_channel (TpChannelManager *manager,
+                                      gpointer request_token,
+                                      GHashTable *request_properties)
+{
+    return haze_roomlist_manager_request (HAZE_ROOMLIST_MANAGER (manager),
+        request_token, request_properties, TRUE);
+}
+
+static gboolean
+haze_roomlist_manager_ensure_channel (TpChannelManager *manager,
+                                      gpointer request_token,
+                                      GHashTable *request_properties)
+{
+    return haze_roomlist_manager_request (HAZE_ROOMLIST_MANAGER (manager),
+        request_token, request_properties, FALSE);
+}
+
+static void
+channel_manager_iface_init (gpointer g_iface,
+                            gpointer iface_data G_GNUC_UNUSED)
+{
+    TpChannelManagerIface *iface = g_iface;
+
+    iface->foreach_channel = haze_roomlist_manager_foreach;
+    iface->foreach_channel_class =
+        haze_roomlist_manager_foreach_channel_class;
+    iface->create_channel = haze_roomlist_manager_create_channel;
+    iface->ensure_channel = haze_roomlist_manager_ensure_channel;
+    iface->request_channel = haze_roomlist_manager_create_channel;
+}
+
+static void
+haze_roomlist_add_room (PurpleRoomlist *list,
+                        PurpleRoomlistRoom *room)
+{
+    HazeRoomlistChannel *chan = PURPLE_ROOMLIST_GET_HAZE_CHANNEL (list);
+
+    if (chan != NULL)
+        haze_roomlist_channel_add_room (chan, room);
+}
+
+static void
+haze_roomlist_in_progress (PurpleRoomlist *list,
+                           gboolean in_progress)
+{
+    HazeRoomlistChannel *chan = PURPLE_ROOMLIST_GET_HAZE_CHANNEL (list);
+
+    if (chan != NULL && !in_progress)
+        haze_roomlist_channel_listing_finished (chan);
+}
+
+static void
+haze_roomlist_destroy (PurpleRoomlist *list)
+{
+    HazeRoomlistChannel *chan = PURPLE_ROOMLIST_GET_HAZE_CHANNEL (list);
+
+    if (chan != NULL)
+        haze_roomlist_channel_forget_list (chan);
+}
+
+static PurpleRoomlistUiOps
+roomlist_ui_ops =
+{
+    NULL,                      /* show_with_account */
+    NULL,                      /* create */
+    NULL,                      /* set_fields */
+    haze_roomlist_add_room,    /* add_room */
+    haze_roomlist_in_progress, /* in_progress */
+    haze_roomlist_destroy,     /* destroy */
+
+    NULL,                      /* _purple_reserved1 */
+    NULL,                      /* _purple_reserved2 */
+    NULL,                      /* _purple_reserved3 */
+    NULL,                      /* _purple_reserved4 */
+};
+
+PurpleRoomlistUiOps *
+haze_get_roomlist_ui_ops (void)
+{
+    return &roomlist_ui_ops;
+}
@@ -0,0 +1,64 @@
+#ifndef __HAZE_ROOMLIST_MANAGER_H__
+#define __HAZE_ROOMLIST_MANAGER_H__
+/*
+ * roomlist-manager.h - HazeRoomlistManager header
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib-object.h>
+
+#include <libpurple/roomlist.h>
+
+G_BEGIN_DECLS
+
+#define HAZE_TYPE_ROOMLIST_MANAGER \
+    (haze_roomlist_manager_get_type())
+#define HAZE_ROOMLIST_MANAGER(obj) \
+    (G_TYPE_CHECK_INSTANCE_CAST((obj), HAZE_TYPE_ROOMLIST_MANAGER, \
+                                HazeRoomlistManager))
+#define HAZE_ROOMLIST_MANAGER_CLASS(klass) \
+    (G_TYPE_CHECK_CLASS_CAST((klass), HAZE_TYPE_ROOMLIST_MANAGER, \
+                             HazeRoomlistManagerClass))
+#define HAZE_IS_ROOMLIST_MANAGER(obj) \
+    (G_TYPE_CHECK_INSTANCE_TYPE((obj), HAZE_TYPE_ROOMLIST_MANAGER))
+#define HAZE_IS_ROOMLIST_MANAGER_CLASS(klass) \
+    (G_TYPE_CHECK_CLASS_TYPE((klass), HAZE_TYPE_ROOMLIST_MANAGER))
+#define HAZE_ROOMLIST_MANAGER_GET_CLASS(obj) \
+    (G_TYPE_INSTANCE_GET_CLASS((obj), HAZE_TYPE_ROOMLIST_MANAGER, \
+                               HazeRoomlistManagerClass))
+
+typedef struct _HazeRoomlistManager      HazeRoomlistManager;
+typedef struct _HazeRoomlistManagerClass HazeRoomlistManagerClass;
+typedef struct _HazeRoomlistManagerPrivate HazeRoomlistManagerPrivate;
+
+struct _HazeRoomlistManager {
+    GObject parent;
+    HazeRoomlistManagerPrivate *priv;
+};
+
+struct _HazeRoomlistManagerClass {
+    GObjectClass parent_class;
+};
+
+GType haze_roomlist_manager_get_type (void) G_GNUC_CONST;
+
+PurpleRoomlistUiOps *haze_get_roomlist_ui_ops (void);
+
+G_END_DECLS
+
+#endif /* __HAZE_ROOMLIST_MANAGER_H__ */
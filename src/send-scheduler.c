@@ -0,0 +1,272 @@
+/*
+ * send-scheduler.c - pacing outgoing messages
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Every message a connection sends, on a channel or not, passes through its
+ * scheduler, which splits it into pieces small enough for the protocol and
+ * hands them to libpurple no faster than a token bucket allows: a burst of
+ * messages may go straight out, after which one more may be sent each
+ * interval.  Messages on channels are reported as sent to the
+ * TpMessageMixin only once their last piece has been handed over.
+ */
+
+#include <config.h>
+#include "send-scheduler.h"
+
+#include "debug.h"
+#include "markup.h"
+
+typedef struct {
+  /* borrowed; owners cancel their messages before they go away */
+  GObject *owner;
+  gchar *recipient;
+  /* owned by the channel's TpMessageMixin until we report it as sent, or
+   * NULL if the message wasn't sent on a channel */
+  TpMessage *message;
+  gchar **pieces;
+  guint next_piece;
+  PurpleMessageFlags flags;
+  HazeSendFunc send;
+} PendingMessage;
+
+struct _HazeSendScheduler {
+  const HazeSendLimits *limits;
+  GQueue queue;
+
+  guint tokens;
+  /* when tokens was last brought up to date, in monotonic µs */
+  gint64 last_refill;
+  guint timeout_id;
+};
+
+static void
+pending_message_free (PendingMessage *pending)
+{
+  g_free (pending->recipient);
+  g_strfreev (pending->pieces);
+  g_slice_free (PendingMessage, pending);
+}
+
+static gboolean
+is_rate_limited (HazeSendScheduler *self)
+{
+  return self->limits != NULL && self->limits->burst > 0;
+}
+
+static void
+refill (HazeSendScheduler *self)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 interval = (gint64) self->limits->interval_ms * 1000;
+  gint64 earned;
+
+  if (self->tokens >= self->limits->burst || interval <= 0)
+    {
+      self->tokens = self->limits->burst;
+      self->last_refill = now;
+      return;
+    }
+
+  earned = (now - self->last_refill) / interval;
+
+  if (earned <= 0)
+    return;
+
+  self->tokens = MIN (self->limits->burst, self->tokens + earned);
+  self->last_refill += earned * interval;
+}
+
+static void flush (HazeSendScheduler *self);
+
+static gboolean
+flush_cb (gpointer user_data)
+{
+  HazeSendScheduler *self = user_data;
+
+  self->timeout_id = 0;
+  flush (self);
+  return FALSE;
+}
+
+static void
+flush (HazeSendScheduler *self)
+{
+  while (!g_queue_is_empty (&self->queue))
+    {
+      PendingMessage *pending = g_queue_peek_head (&self->queue);
+
+      if (is_rate_limited (self))
+        {
+          refill (self);
+
+          if (self->tokens == 0)
+            {
+              gint64 wait = self->last_refill +
+                  (gint64) self->limits->interval_ms * 1000 -
+                  g_get_monotonic_time ();
+
+              if (self->timeout_id == 0)
+                self->timeout_id = g_timeout_add (MAX (1, wait / 1000),
+                    flush_cb, self);
+
+              return;
+            }
+
+          self->tokens--;
+        }
+
+      pending->send (pending->owner, pending->recipient,
+          pending->pieces[pending->next_piece], pending->flags);
+      pending->next_piece++;
+
+      if (pending->pieces[pending->next_piece] == NULL)
+        {
+          g_queue_pop_head (&self->queue);
+
+          if (pending->message != NULL)
+            tp_message_mixin_sent (pending->owner, pending->message, 0, "",
+                NULL);
+
+          pending_message_free (pending);
+        }
+    }
+}
+
+HazeSendScheduler *
+haze_send_scheduler_new (const HazeSendLimits *limits)
+{
+  HazeSendScheduler *self = g_slice_new0 (HazeSendScheduler);
+
+  self->limits = limits;
+  g_queue_init (&self->queue);
+
+  if (is_rate_limited (self))
+    {
+      self->tokens = limits->burst;
+      self->last_refill = g_get_monotonic_time ();
+    }
+
+  return self;
+}
+
+void
+haze_send_scheduler_free (HazeSendScheduler *self)
+{
+  /* Channels cancel their messages when they are closed or disposed, and
+   * they hold a ref to the connection, which cancels its own before this is
+   * called, so there should be nothing left. */
+  g_warn_if_fail (g_queue_is_empty (&self->queue));
+
+  if (self->timeout_id != 0)
+    g_source_remove (self->timeout_id);
+
+  g_queue_foreach (&self->queue, (GFunc) pending_message_free, NULL);
+  g_queue_clear (&self->queue);
+  g_slice_free (HazeSendScheduler, self);
+}
+
+/*
+ * haze_send_scheduler_push:
+ * @owner: the object sending the message
+ * @recipient: (allow-none): passed to @send
+ * @message: (allow-none): a message @owner, a channel using TpMessageMixin,
+ *           was asked to send
+ * @prefix: (allow-none): plain text to put before each piece, like "/me "
+ * @text: the plain text to send
+ * @flags: flags for libpurple
+ * @send: called with each escaped piece of @text when it's time to send it
+ *
+ * Queues @text, reporting @message as sent once it has been.
+ */
+void
+haze_send_scheduler_push (HazeSendScheduler *self,
+    GObject *owner,
+    const gchar *recipient,
+    TpMessage *message,
+    const gchar *prefix,
+    const gchar *text,
+    PurpleMessageFlags flags,
+    HazeSendFunc send)
+{
+  PendingMessage *pending = g_slice_new0 (PendingMessage);
+  gsize max_bytes = 0;
+  gboolean split_lines = FALSE;
+
+  if (self->limits != NULL)
+    {
+      max_bytes = self->limits->max_message_bytes;
+      split_lines = self->limits->one_line_per_message;
+    }
+
+  pending->owner = owner;
+  pending->recipient = g_strdup (recipient);
+  pending->message = message;
+  pending->pieces = haze_markup_escape_split (prefix, text, max_bytes,
+      split_lines);
+  pending->flags = flags;
+  pending->send = send;
+
+  if (pending->pieces[1] != NULL)
+    DEBUG ("split message into %u pieces",
+        g_strv_length (pending->pieces));
+
+  g_queue_push_tail (&self->queue, pending);
+
+  /* If a timeout is pending, we're out of tokens anyway. */
+  if (self->timeout_id == 0)
+    flush (self);
+}
+
+/*
+ * haze_send_scheduler_cancel:
+ * @owner: a channel or connection which is going away
+ *
+ * Forgets any messages @owner has queued, reporting those sent on a channel
+ * as not sent.
+ */
+void
+haze_send_scheduler_cancel (HazeSendScheduler *self,
+    GObject *owner)
+{
+  GList *l = self->queue.head;
+
+  while (l != NULL)
+    {
+      PendingMessage *pending = l->data;
+      GList *next = l->next;
+
+      if (pending->owner == owner)
+        {
+          g_queue_delete_link (&self->queue, l);
+
+          if (pending->message != NULL)
+            {
+              GError *error = g_error_new (TP_ERROR, TP_ERROR_CANCELLED,
+                  "the channel was closed before the message could be sent");
+
+              tp_message_mixin_sent (owner, pending->message, 0, NULL, error);
+              g_error_free (error);
+            }
+
+          pending_message_free (pending);
+        }
+
+      l = next;
+    }
+}
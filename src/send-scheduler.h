@@ -0,0 +1,47 @@
+#ifndef __HAZE_SEND_SCHEDULER_H__
+#define __HAZE_SEND_SCHEDULER_H__
+/*
+ * send-scheduler.h - header for pacing outgoing messages
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include <libpurple/conversation.h>
+
+#include "protocol.h"
+
+G_BEGIN_DECLS
+
+typedef struct _HazeSendScheduler HazeSendScheduler;
+
+/* Hands one escaped piece of a message to libpurple. */
+typedef void (*HazeSendFunc) (GObject *owner, const gchar *recipient,
+    const gchar *text, PurpleMessageFlags flags);
+
+HazeSendScheduler *haze_send_scheduler_new (const HazeSendLimits *limits);
+void haze_send_scheduler_free (HazeSendScheduler *self);
+
+void haze_send_scheduler_push (HazeSendScheduler *self, GObject *owner,
+    const gchar *recipient, TpMessage *message, const gchar *prefix,
+    const gchar *text, PurpleMessageFlags flags, HazeSendFunc send);
+void haze_send_scheduler_cancel (HazeSendScheduler *self, GObject *owner);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_SEND_SCHEDULER_H__ */
@@ -0,0 +1,247 @@
+/*
+ * timer-wheel.c - many cheap timers driven by one GSource
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* A hashed timer wheel: time is divided into ticks, and each timer hangs
+ * off the slot for the tick it expires on, modulo the number of slots.  A
+ * single timeout, which only runs while there are timers, visits one slot
+ * per tick and fires whatever in it has expired.  Adding and removing
+ * timers is O(1), and thousands of them cost one wakeup per tick rather
+ * than a GSource each.  Timers fire up to a tick late.
+ */
+
+#include <config.h>
+#include "timer-wheel.h"
+
+#define N_SLOTS 256
+
+struct _HazeTimer {
+  HazeTimer *prev;
+  HazeTimer *next;
+  /* the tick this timer is due on */
+  gint64 expires;
+  guint interval_ticks;
+  GSourceFunc func;
+  gpointer user_data;
+};
+
+struct _HazeTimerWheel {
+  HazeTimer *slots[N_SLOTS];
+  guint n_timers;
+
+  gint64 tick_us;
+  gint64 epoch;
+  /* the last tick whose slot has been visited */
+  gint64 now;
+  guint timeout_id;
+
+  /* the timer whose callback is running, if any, and whether it was
+   * removed from inside its callback */
+  HazeTimer *firing;
+  gboolean firing_removed;
+  /* where run_slot() goes next, kept up to date by removals */
+  HazeTimer *next_to_visit;
+};
+
+static gint64
+current_tick (HazeTimerWheel *self)
+{
+  return (g_get_monotonic_time () - self->epoch) / self->tick_us;
+}
+
+static void
+link_timer (HazeTimerWheel *self,
+    HazeTimer *timer)
+{
+  HazeTimer **head = &self->slots[timer->expires % N_SLOTS];
+
+  timer->prev = NULL;
+  timer->next = *head;
+
+  if (*head != NULL)
+    (*head)->prev = timer;
+
+  *head = timer;
+}
+
+static void
+unlink_timer (HazeTimerWheel *self,
+    HazeTimer *timer)
+{
+  if (self->next_to_visit == timer)
+    self->next_to_visit = timer->next;
+
+  if (timer->prev != NULL)
+    timer->prev->next = timer->next;
+  else
+    self->slots[timer->expires % N_SLOTS] = timer->next;
+
+  if (timer->next != NULL)
+    timer->next->prev = timer->prev;
+}
+
+static void
+run_slot (HazeTimerWheel *self)
+{
+  HazeTimer *timer = self->slots[self->now % N_SLOTS];
+
+  while (timer != NULL)
+    {
+      self->next_to_visit = timer->next;
+
+      /* Other timers in this slot are due on later turns of the wheel. */
+      if (timer->expires <= self->now)
+        {
+          gboolean again;
+
+          unlink_timer (self, timer);
+          self->firing = timer;
+          self->firing_removed = FALSE;
+          again = timer->func (timer->user_data);
+          self->firing = NULL;
+
+          if (again && !self->firing_removed)
+            {
+              timer->expires = self->now + timer->interval_ticks;
+              link_timer (self, timer);
+            }
+          else
+            {
+              self->n_timers--;
+              g_slice_free (HazeTimer, timer);
+            }
+        }
+
+      timer = self->next_to_visit;
+    }
+
+  self->next_to_visit = NULL;
+}
+
+static gboolean
+tick_cb (gpointer user_data)
+{
+  HazeTimerWheel *self = user_data;
+  gint64 target = current_tick (self);
+
+  /* If we've fallen more than a whole turn behind, visiting each slot once
+   * is enough to catch up. */
+  if (target - self->now > N_SLOTS)
+    self->now = target - N_SLOTS;
+
+  while (self->now < target && self->n_timers > 0)
+    {
+      self->now++;
+      run_slot (self);
+    }
+
+  if (self->n_timers == 0)
+    {
+      self->timeout_id = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+HazeTimerWheel *
+haze_timer_wheel_new (guint tick_ms)
+{
+  HazeTimerWheel *self;
+
+  g_return_val_if_fail (tick_ms > 0, NULL);
+
+  self = g_slice_new0 (HazeTimerWheel);
+  self->tick_us = (gint64) tick_ms * 1000;
+  self->epoch = g_get_monotonic_time ();
+  return self;
+}
+
+void
+haze_timer_wheel_free (HazeTimerWheel *self)
+{
+  guint i;
+
+  if (self->timeout_id != 0)
+    g_source_remove (self->timeout_id);
+
+  for (i = 0; i < N_SLOTS; i++)
+    {
+      while (self->slots[i] != NULL)
+        {
+          HazeTimer *timer = self->slots[i];
+
+          self->slots[i] = timer->next;
+          g_slice_free (HazeTimer, timer);
+        }
+    }
+
+  g_slice_free (HazeTimerWheel, self);
+}
+
+/*
+ * haze_timer_wheel_add:
+ * @interval_ms: how long to wait before calling @func, and then between
+ *               calls for as long as it returns %TRUE
+ * @func: the callback, which returns %FALSE to stop the timer
+ *
+ * Returns: the new timer, which is valid until @func returns %FALSE or it
+ *          is passed to haze_timer_wheel_remove()
+ */
+HazeTimer *
+haze_timer_wheel_add (HazeTimerWheel *self,
+    guint interval_ms,
+    GSourceFunc func,
+    gpointer user_data)
+{
+  HazeTimer *timer = g_slice_new0 (HazeTimer);
+
+  /* Round up, so timers never fire early. */
+  timer->interval_ticks = MAX (1,
+      ((gint64) interval_ms * 1000 + self->tick_us - 1) / self->tick_us);
+  timer->func = func;
+  timer->user_data = user_data;
+
+  if (self->timeout_id == 0)
+    {
+      self->now = current_tick (self);
+      self->timeout_id = g_timeout_add (self->tick_us / 1000, tick_cb, self);
+    }
+
+  timer->expires = current_tick (self) + timer->interval_ticks;
+  link_timer (self, timer);
+  self->n_timers++;
+
+  return timer;
+}
+
+void
+haze_timer_wheel_remove (HazeTimerWheel *self,
+    HazeTimer *timer)
+{
+  if (timer == self->firing)
+    {
+      self->firing_removed = TRUE;
+      return;
+    }
+
+  unlink_timer (self, timer);
+  self->n_timers--;
+  g_slice_free (HazeTimer, timer);
+}
@@ -0,0 +1,39 @@
+#ifndef __HAZE_TIMER_WHEEL_H__
+#define __HAZE_TIMER_WHEEL_H__
+/*
+ * timer-wheel.h - header for many cheap timers driven by one GSource
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HazeTimerWheel HazeTimerWheel;
+typedef struct _HazeTimer HazeTimer;
+
+HazeTimerWheel *haze_timer_wheel_new (guint tick_ms);
+void haze_timer_wheel_free (HazeTimerWheel *self);
+
+HazeTimer *haze_timer_wheel_add (HazeTimerWheel *self, guint interval_ms,
+    GSourceFunc func, gpointer user_data);
+void haze_timer_wheel_remove (HazeTimerWheel *self, HazeTimer *timer);
+
+G_END_DECLS
+
+#endif /* #ifndef __HAZE_TIMER_WHEEL_H__ */
@@ -54,3 +54,110 @@ haze_remove_directory (const gchar *path)
 
   return ret;
 }
+
+/*
+ * haze_get_tunable:
+ * @name: the name of an environment variable
+ * @default_value: the value to use if @name is unset or malformed
+ *
+ * Returns: the value of @name parsed as a non-negative decimal integer, or
+ *          @default_value.
+ */
+guint
+haze_get_tunable (const gchar *name,
+    guint default_value)
+{
+  const gchar *str = g_getenv (name);
+  gchar *end;
+  guint64 value;
+
+  if (str == NULL || *str == '\0')
+    return default_value;
+
+  value = g_ascii_strtoull (str, &end, 10);
+
+  if (*end != '\0' || value > G_MAXUINT || g_ascii_isspace (*str) ||
+      *str == '-')
+    {
+      g_warning ("ignoring malformed %s='%s'", name, str);
+      return default_value;
+    }
+
+  DEBUG ("%s=%" G_GUINT64_FORMAT, name, value);
+  return value;
+}
+
+/* libpurple labels with an obvious vCard counterpart.  Like the search
+ * actions in contact-search-manager.c, they're matched both as they are and
+ * as translated in libpurple's gettext domain, in case libpurple translated
+ * them.  Given and family names are parts of the structured "n" field, so
+ * they get ContactSearch's names for those parts; ContactInfo puts them back
+ * together. */
+static const struct {
+  const gchar *label;
+  const gchar *name;
+} vcard_names[] = {
+  { "Full Name", "fn" },
+  { "Name", "fn" },
+  { "First Name", "x-n-given" },
+  { "Given Name", "x-n-given" },
+  { "Last Name", "x-n-family" },
+  { "Family Name", "x-n-family" },
+  { "Nickname", "nickname" },
+  { "Nick", "nickname" },
+  { "Email", "email" },
+  { "Email Address", "email" },
+  { "E-Mail", "email" },
+  { "Birthday", "bday" },
+  { "URL", "url" },
+  { "Homepage", "url" },
+  { "Telephone", "tel" },
+  { "Phone", "tel" },
+  { "Title", "title" },
+  { "Role", "role" },
+  { "Organization", "org" },
+  { "Organization Name", "org" },
+  { "Note", "note" },
+  { NULL, NULL }
+};
+
+/*
+ * haze_vcard_field_name:
+ * @label: a human-readable label from libpurple, such as a search result
+ *         column title or a PurpleNotifyUserInfo entry's label
+ *
+ * Returns: a newly allocated ContactInfo field name for @label: the vCard
+ *          field it corresponds to if there is an obvious one, or else "x-"
+ *          followed by @label in lower case with runs of punctuation and
+ *          spaces replaced by '-'.
+ */
+gchar *
+haze_vcard_field_name (const gchar *label)
+{
+  GString *name;
+  const gchar *p;
+  guint i;
+
+  for (i = 0; vcard_names[i].label != NULL; i++)
+    {
+      if (!g_ascii_strcasecmp (label, vcard_names[i].label) ||
+          !g_strcmp0 (label,
+              g_dgettext (PURPLE_GETTEXT_DOMAIN, vcard_names[i].label)))
+        return g_strdup (vcard_names[i].name);
+    }
+
+  name = g_string_new ("x-");
+
+  for (p = label; *p != '\0'; p++)
+    {
+      if (g_ascii_isalnum (*p))
+        g_string_append_c (name, g_ascii_tolower (*p));
+      else if (name->str[name->len - 1] != '-')
+        g_string_append_c (name, '-');
+    }
+
+  if (name->str[name->len - 1] == '-' && name->len > 2)
+    g_string_truncate (name, name->len - 1);
+
+  return g_string_free (name, FALSE);
+}
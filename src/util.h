@@ -15,6 +15,13 @@ G_BEGIN_DECLS
 
 gboolean haze_remove_directory (const gchar *dir);
 
+guint haze_get_tunable (const gchar *name, guint default_value);
+
+/* libpurple's translations are in Pidgin's gettext domain. */
+#define PURPLE_GETTEXT_DOMAIN "pidgin"
+
+gchar *haze_vcard_field_name (const gchar *label);
+
 G_END_DECLS
 
 #endif /* #ifndef __HAZE_CONNECTION_H__*/
@@ -0,0 +1,168 @@
+/*
+ * escape-benchmark.c - checks and times haze_markup_escape_text()
+ * Copyright (C) 2026 The telepathy-haze authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Usage: escape-benchmark [ITERATIONS]
+ *
+ * Checks that haze_markup_escape_text() gives the same bytes as the chain
+ * of g_markup_escape_text() and two string replacements it replaced, then
+ * times both over short, long and emoji-heavy messages.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/markup.h"
+
+static gchar *
+replace (gchar *str,
+    const gchar *from,
+    const gchar *to)
+{
+  gchar **parts = g_strsplit (str, from, -1);
+  gchar *ret = g_strjoinv (to, parts);
+
+  g_strfreev (parts);
+  g_free (str);
+  return ret;
+}
+
+/* What haze_im_channel_send() used to do, with purple_strreplace()
+ * swapped for something equivalent. */
+static gchar *
+escape_the_old_way (const gchar *prefix,
+    const gchar *text)
+{
+  gchar *prefixed = g_strconcat (prefix == NULL ? "" : prefix, text, NULL);
+  gchar *ret = g_markup_escape_text (prefixed, -1);
+
+  g_free (prefixed);
+  ret = replace (ret, "\n", "<br>");
+  return replace (ret, "&apos;", "'");
+}
+
+typedef struct {
+  const gchar *name;
+  gchar *text;
+} Corpus;
+
+static gboolean
+check (const gchar *prefix,
+    const gchar *text)
+{
+  gchar *expected = escape_the_old_way (prefix, text);
+  gchar *actual = haze_markup_escape_text (prefix, text);
+  gboolean ok = (g_strcmp0 (expected, actual) == 0);
+
+  if (!ok)
+    g_printerr ("mismatch escaping \"%s\":\n  expected \"%s\"\n  got      "
+        "\"%s\"\n", text, expected, actual);
+
+  g_free (expected);
+  g_free (actual);
+  return ok;
+}
+
+static gdouble
+time_escaper (gchar *(*escaper) (const gchar *, const gchar *),
+    const gchar *text,
+    guint iterations)
+{
+  GTimer *timer = g_timer_new ();
+  gdouble elapsed;
+  guint i;
+
+  for (i = 0; i < iterations; i++)
+    g_free (escaper (NULL, text));
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+  return elapsed;
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  static const gchar * const awkward[] = {
+      "",
+      "hello",
+      "<b>not bold</b> & \"quoted\" 'apostrophised'",
+      "line one\nline two\r\n\tindented",
+      "\001\010\013\014\016\037\177 controls",
+      "\302\200\302\204\302\205\302\206\302\237\302\240 C1 controls",
+      "&apos; &amp; already escaped",
+      "caf\303\251 \342\202\254 \360\237\230\200\360\237\221\215",
+      NULL
+  };
+  Corpus corpora[] = {
+      { "short", NULL },
+      { "long", NULL },
+      { "emoji", NULL },
+  };
+  guint iterations = 1000;
+  gboolean ok = TRUE;
+  GString *s;
+  guint i;
+
+  if (argc > 1)
+    iterations = strtoul (argv[1], NULL, 10);
+
+  corpora[0].text = g_strdup ("ok, see you at 8 <3");
+
+  s = g_string_new ("");
+  for (i = 0; i < 200; i++)
+    g_string_append (s, "The quick brown fox jumps over the lazy dog. ");
+  g_string_append (s, "It's \"done\" & dusted\n");
+  corpora[1].text = g_string_free (s, FALSE);
+
+  s = g_string_new ("");
+  for (i = 0; i < 100; i++)
+    g_string_append (s, "\360\237\230\202\360\237\221\215\360\237\217\275 ");
+  corpora[2].text = g_string_free (s, FALSE);
+
+  for (i = 0; awkward[i] != NULL; i++)
+    {
+      ok = check (NULL, awkward[i]) && ok;
+      ok = check ("/me ", awkward[i]) && ok;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (corpora); i++)
+    {
+      gdouble old_time, new_time;
+
+      ok = check (NULL, corpora[i].text) && ok;
+
+      old_time = time_escaper (escape_the_old_way, corpora[i].text,
+          iterations);
+      new_time = time_escaper (haze_markup_escape_text, corpora[i].text,
+          iterations);
+
+      g_print ("%-6s %6" G_GSIZE_FORMAT " bytes: %8.1f ns/message before, "
+          "%8.1f ns/message after\n",
+          corpora[i].name, strlen (corpora[i].text),
+          old_time * 1e9 / iterations, new_time * 1e9 / iterations);
+
+      g_free (corpora[i].text);
+    }
+
+  return ok ? 0 : 1;
+}
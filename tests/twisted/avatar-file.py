@@ -0,0 +1,44 @@
+"""
+Test Haze's AvatarFiles extension, which hands out avatars as paths into its
+on-disk store rather than as byte arrays.
+"""
+
+import hashlib
+
+import dbus
+
+from servicetest import assertContains, assertEquals, assertDBusError
+from hazetest import exec_test
+import constants as cs
+
+CONN_IFACE_AVATAR_FILES = cs.CONN + '.Interface.Haze.AvatarFiles'
+
+AVATAR = b'\x89PNG\r\n\x1a\nnot really a PNG, but libpurple does not care'
+
+def test(q, bus, conn, stream):
+    assertContains(CONN_IFACE_AVATAR_FILES,
+            conn.Properties.Get(cs.CONN, 'Interfaces'))
+    avatar_files = dbus.Interface(conn, CONN_IFACE_AVATAR_FILES)
+    self_handle = conn.Properties.Get(cs.CONN, 'SelfHandle')
+
+    try:
+        avatar_files.GetAvatarFile(self_handle)
+    except dbus.DBusException as e:
+        assertDBusError(cs.NOT_AVAILABLE, e)
+    else:
+        raise AssertionError('GetAvatarFile succeeded without an avatar')
+
+    token = conn.Avatars.SetAvatar(dbus.ByteArray(AVATAR), 'image/png')
+    assertEquals(hashlib.sha1(AVATAR).hexdigest(), token)
+
+    file_token, path, size = avatar_files.GetAvatarFile(self_handle)
+    assertEquals(token, file_token)
+    assertEquals(len(AVATAR), size)
+    assertEquals(AVATAR, open(path, 'rb').read())
+
+    # The store is content-addressed.
+    assertEquals(token, path.split('/')[-1])
+    assertEquals(token[:2], path.split('/')[-2])
+
+if __name__ == '__main__':
+    exec_test(test)
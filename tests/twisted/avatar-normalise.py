@@ -0,0 +1,119 @@
+"""
+Test that SetAvatar scales avatars to fit the protocol's limits, re-encodes
+them into a format it accepts, and only ever applies the newest SetAvatar or
+ClearAvatar call, failing any it has superseded.
+"""
+
+import hashlib
+import struct
+import zlib
+
+import dbus
+
+from servicetest import (assertEquals, assertDBusError, call_async,
+        EventPattern)
+from hazetest import exec_test
+import constants as cs
+
+PNG_SIGNATURE = b'\x89PNG\r\n\x1a\n'
+
+def png_chunk(tag, data):
+    return (struct.pack('>I', len(data)) + tag + data +
+        struct.pack('>I', zlib.crc32(tag + data) & 0xffffffff))
+
+def make_png(width, height, pixel=b'\x20\x40\x80'):
+    row = b'\x00' + pixel * width
+    return (PNG_SIGNATURE +
+        png_chunk(b'IHDR',
+            struct.pack('>IIBBBBB', width, height, 8, 2, 0, 0, 0)) +
+        png_chunk(b'IDAT', zlib.compress(row * height)) +
+        png_chunk(b'IEND', b''))
+
+def make_bmp(width, height, pixel=b'\x80\x40\x20'):
+    # Rows of 24-bit pixels are padded to a multiple of four bytes.
+    row = pixel * width
+    row += b'\x00' * (-len(row) % 4)
+    pixels = row * height
+    return (b'BM' + struct.pack('<IHHI', 54 + len(pixels), 0, 0, 54) +
+        struct.pack('<IiiHHIIiiII', 40, width, height, 1, 24, 0,
+            len(pixels), 2835, 2835, 0, 0) +
+        pixels)
+
+def png_size(data):
+    assert data.startswith(PNG_SIGNATURE), repr(data[:8])
+    return struct.unpack('>II', data[16:24])
+
+def get_own_avatar(q, conn, self_handle, token):
+    q.expect('dbus-signal', signal='AvatarUpdated', args=[self_handle, token])
+    avatar, mime_type = conn.Avatars.RequestAvatar(self_handle,
+            byte_arrays=True)
+    assertEquals(token, hashlib.sha1(avatar).hexdigest())
+    return avatar
+
+def test(q, bus, conn, stream):
+    self_handle = conn.Properties.Get(cs.CONN, 'SelfHandle')
+    props = conn.Properties.GetAll(cs.CONN_IFACE_AVATARS)
+    max_width = props['MaximumAvatarWidth']
+    max_height = props['MaximumAvatarHeight']
+
+    # Too big: it's scaled down to fit, keeping its shape.
+    token = conn.Avatars.SetAvatar(
+            dbus.ByteArray(make_png(max_width * 4, max_height * 2)),
+            'image/png')
+    avatar = get_own_avatar(q, conn, self_handle, token)
+    assertEquals((max_width, max_height // 2), png_size(avatar))
+
+    # In a format the protocol doesn't take: it's re-encoded.
+    token = conn.Avatars.SetAvatar(dbus.ByteArray(make_bmp(64, 64)),
+            'image/bmp')
+    avatar = get_own_avatar(q, conn, self_handle, token)
+    assertEquals((64, 64), png_size(avatar))
+
+    # Already fine: it's used as it is.
+    small = make_png(64, 64)
+    small_token = hashlib.sha1(small).hexdigest()
+    assertEquals(small_token,
+            conn.Avatars.SetAvatar(dbus.ByteArray(small), 'image/png'))
+    get_own_avatar(q, conn, self_handle, small_token)
+
+    # A big avatar takes longer to process than a small one set just after
+    # it; whichever finishes first, the later call wins.
+    big = dbus.ByteArray(make_png(2000, 2000, b'\x10\x20\x30'))
+    other = make_png(48, 48, b'\x30\x20\x10')
+    other_token = hashlib.sha1(other).hexdigest()
+
+    wrong_avatar = EventPattern('dbus-signal', signal='AvatarUpdated',
+            predicate=lambda e: e.args != [self_handle, other_token])
+    q.forbid_events([wrong_avatar])
+
+    call_async(q, conn.Avatars, 'SetAvatar', big, 'image/png')
+    call_async(q, conn.Avatars, 'SetAvatar', dbus.ByteArray(other),
+            'image/png')
+
+    cancelled, ret, _ = q.expect_many(
+        EventPattern('dbus-error', method='SetAvatar'),
+        EventPattern('dbus-return', method='SetAvatar'),
+        EventPattern('dbus-signal', signal='AvatarUpdated',
+            args=[self_handle, other_token]))
+    assertDBusError(cs.CANCELLED, cancelled.error)
+    assertEquals([other_token], ret.value)
+    assertEquals({self_handle: other_token},
+            conn.Avatars.GetKnownAvatarTokens([self_handle]))
+
+    q.unforbid_events([wrong_avatar])
+
+    # Clearing the avatar supersedes a SetAvatar call still in progress.
+    call_async(q, conn.Avatars, 'SetAvatar', big, 'image/png')
+    call_async(q, conn.Avatars, 'ClearAvatar')
+
+    cancelled, _, _ = q.expect_many(
+        EventPattern('dbus-error', method='SetAvatar'),
+        EventPattern('dbus-return', method='ClearAvatar'),
+        EventPattern('dbus-signal', signal='AvatarUpdated',
+            args=[self_handle, '']))
+    assertDBusError(cs.CANCELLED, cancelled.error)
+    assertEquals({self_handle: ''},
+            conn.Avatars.GetKnownAvatarTokens([self_handle]))
+
+if __name__ == '__main__':
+    exec_test(test)
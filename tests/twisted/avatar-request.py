@@ -0,0 +1,106 @@
+"""
+Test that RequestAvatars returns at once and sends the avatars afterwards,
+a few at a time (HAZE_AVATAR_KB_PER_TICK) between handling other calls; and
+that each avatar asked for is sent exactly once, in the order asked for.
+"""
+
+import base64
+import hashlib
+
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals, sync_dbus
+from hazetest import exec_test, make_presence, make_result_iq, sync_stream
+import constants as cs
+import ns
+
+N_AVATARS = 8
+# Bigger than HAZE_AVATAR_KB_PER_TICK, so each avatar is sent on its own.
+AVATAR_SIZE = 2048
+
+def make_avatar(i):
+    header = b'\x89PNG\r\n\x1a\n'
+    return header + (b'%02d' % i) * ((AVATAR_SIZE - len(header)) // 2)
+
+def send_avatar(q, stream, jid, avatar):
+    token = hashlib.sha1(avatar).hexdigest()
+    stream.send(make_presence(jid, status='Here', photo=token))
+
+    e = q.expect('stream-iq', to=jid, iq_type='get', query_ns=ns.VCARD_TEMP,
+            query_name='vCard')
+    result = make_result_iq(stream, e.stanza, add_query_node=False)
+    vcard = result.addElement((ns.VCARD_TEMP, 'vCard'))
+    photo = vcard.addElement('PHOTO')
+    photo.addElement('TYPE', content='image/png')
+    photo.addElement('BINVAL', content=base64.b64encode(avatar))
+    stream.send(result)
+
+    return token
+
+def test(q, bus, conn, stream):
+    jids = ['contact%02d@foo.com' % i for i in range(N_AVATARS)]
+    # This one never sets an avatar, so there's nothing to send for her.
+    plain_jid = 'plain@foo.com'
+
+    iq = IQ(stream, 'set')
+    query = iq.addElement((ns.ROSTER, 'query'))
+
+    for jid in jids + [plain_jid]:
+        item = query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+
+    stream.send(iq)
+    sync_stream(q, stream)
+
+    handles = conn.get_contact_handles_sync(jids)
+    plain = conn.get_contact_handle_sync(plain_jid)
+    avatars = {}
+
+    for i, (jid, handle) in enumerate(zip(jids, handles)):
+        avatar = make_avatar(i)
+        token = send_avatar(q, stream, jid, avatar)
+        q.expect('dbus-signal', signal='AvatarUpdated', args=[handle, token])
+        avatars[handle] = (token, avatar)
+
+    events = []
+
+    def avatar_retrieved(handle, token, avatar, mime_type):
+        events.append(('AvatarRetrieved', handle, token, str(avatar)))
+
+    def returned(method):
+        return lambda *args: events.append((method,))
+
+    def failed(e):
+        raise e
+
+    bus.add_signal_receiver(avatar_retrieved,
+            signal_name='AvatarRetrieved',
+            dbus_interface=cs.CONN_IFACE_AVATARS,
+            path=conn.object_path, byte_arrays=True)
+
+    # Asking twice for the same contact only sends their avatar once.
+    conn.Avatars.RequestAvatars(handles + [plain] + handles[:1],
+            reply_handler=returned('RequestAvatars'), error_handler=failed)
+    conn.Avatars.GetKnownAvatarTokens(handles,
+            reply_handler=returned('GetKnownAvatarTokens'),
+            error_handler=failed)
+
+    for i in range(N_AVATARS):
+        q.expect('dbus-signal', signal='AvatarRetrieved')
+
+    sync_dbus(bus, q, conn)
+
+    # The request was answered before any avatar was sent, and the call
+    # queued behind it was answered too...
+    assertEquals(('RequestAvatars',), events[0])
+    assert ('GetKnownAvatarTokens',) in events, events
+
+    # ... and every avatar was sent, once, in the order asked for.
+    assertEquals(
+        [('AvatarRetrieved', h, avatars[h][0], avatars[h][1])
+            for h in handles],
+        [e for e in events if e[0] == 'AvatarRetrieved'])
+
+if __name__ == '__main__':
+    exec_test(test, environment={ 'HAZE_AVATAR_KB_PER_TICK': '1' })
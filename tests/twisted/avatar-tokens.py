@@ -0,0 +1,87 @@
+"""
+Test that contacts' avatar tokens are worked out once per new avatar and then
+answered from the cache: asking for them again, or being told about the same
+avatar again, neither signals AvatarUpdated nor fetches anything.
+"""
+
+import base64
+import hashlib
+
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals, EventPattern
+from hazetest import exec_test, make_presence, make_result_iq, sync_stream
+import constants as cs
+import ns
+
+ATTR_AVATAR_TOKEN = cs.CONN_IFACE_AVATARS + '/token'
+
+AVATARS = [
+    b'\x89PNG\r\n\x1a\nnot really a PNG, but libpurple does not care',
+    b'\x89PNG\r\n\x1a\nnor is this one',
+    ]
+
+def send_avatar(q, stream, jid, avatar):
+    token = hashlib.sha1(avatar).hexdigest()
+    stream.send(make_presence(jid, status='Here', photo=token))
+
+    # libpurple doesn't have this avatar yet, so it fetches the vCard.
+    e = q.expect('stream-iq', to=jid, iq_type='get', query_ns=ns.VCARD_TEMP,
+            query_name='vCard')
+    result = make_result_iq(stream, e.stanza, add_query_node=False)
+    vcard = result.addElement((ns.VCARD_TEMP, 'vCard'))
+    photo = vcard.addElement('PHOTO')
+    photo.addElement('TYPE', content='image/png')
+    photo.addElement('BINVAL', content=base64.b64encode(avatar))
+    stream.send(result)
+
+    return token
+
+def assert_tokens(conn, handle, token):
+    assertEquals({handle: token},
+            conn.Avatars.GetKnownAvatarTokens([handle]))
+    assertEquals([token], conn.Avatars.GetAvatarTokens([handle]))
+
+    attrs = conn.Contacts.GetContactAttributes([handle],
+            [cs.CONN_IFACE_AVATARS], False)
+    assertEquals(token, attrs[handle][ATTR_AVATAR_TOKEN])
+
+def test(q, bus, conn, stream):
+    jid = 'amy@foo.com'
+
+    iq = IQ(stream, 'set')
+    query = iq.addElement((ns.ROSTER, 'query'))
+    item = query.addElement('item')
+    item['jid'] = jid
+    item['subscription'] = 'both'
+    stream.send(iq)
+    sync_stream(q, stream)
+
+    amy = conn.get_contact_handle_sync(jid)
+
+    token = send_avatar(q, stream, jid, AVATARS[0])
+    q.expect('dbus-signal', signal='AvatarUpdated', args=[amy, token])
+
+    # From now on, the token comes from the cache...
+    avatar_updated = EventPattern('dbus-signal', signal='AvatarUpdated')
+    vcard_get = EventPattern('stream-iq', iq_type='get',
+            query_ns=ns.VCARD_TEMP, query_name='vCard')
+    q.forbid_events([avatar_updated, vcard_get])
+
+    for i in range(3):
+        assert_tokens(conn, amy, token)
+
+    # ... even when we're reminded of the avatar we already have.
+    stream.send(make_presence(jid, status='Still here', photo=token))
+    sync_stream(q, stream)
+    assert_tokens(conn, amy, token)
+
+    q.unforbid_events([avatar_updated, vcard_get])
+
+    # A new avatar replaces the cached token.
+    new_token = send_avatar(q, stream, jid, AVATARS[1])
+    q.expect('dbus-signal', signal='AvatarUpdated', args=[amy, new_token])
+    assert_tokens(conn, amy, new_token)
+
+if __name__ == '__main__':
+    exec_test(test)
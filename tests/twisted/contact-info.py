@@ -0,0 +1,110 @@
+"""
+Test ContactInfo: fetching a contact's vCard, sharing one fetch between
+concurrent requests, answering repeat requests from the cache, and failing
+requests still pending on disconnection.
+"""
+
+from hazetest import exec_test
+from gabbletest import make_result_iq, send_error_reply
+from servicetest import (call_async, EventPattern, assertEquals,
+        assertContains, assertDBusError)
+import constants as cs
+import ns
+
+NS_LAST_ACTIVITY = 'jabber:iq:last'
+
+def answer_get_info(q, stream, jid):
+    # For a contact who isn't online, libpurple asks for their vCard and
+    # when they were last seen.
+    vcard_get, last_get = q.expect_many(
+        EventPattern('stream-iq', to=jid, iq_type='get',
+            query_ns=ns.VCARD_TEMP, query_name='vCard'),
+        EventPattern('stream-iq', to=jid, iq_type='get',
+            query_ns=NS_LAST_ACTIVITY))
+
+    result = make_result_iq(stream, vcard_get.stanza, add_query_node=False)
+    vcard = result.addElement((ns.VCARD_TEMP, 'vCard'))
+    vcard.addElement('FN', content=u'Bob Builder')
+    vcard.addElement('NICKNAME', content=u'bob')
+    n = vcard.addElement('N')
+    n.addElement('FAMILY', content=u'Builder')
+    n.addElement('GIVEN', content=u'Bob')
+    email = vcard.addElement('EMAIL')
+    email.addElement('INTERNET')
+    email.addElement('USERID', content=u'bob@example.com')
+    stream.send(result)
+
+    send_error_reply(stream, last_get.stanza)
+
+def test(q, bus, conn, stream):
+    assertContains(cs.CONN_IFACE_CONTACT_INFO,
+            conn.Properties.Get(cs.CONN, 'Interfaces'))
+
+    props = conn.Properties.GetAll(cs.CONN_IFACE_CONTACT_INFO)
+    assertEquals(0, props['ContactInfoFlags'])
+    assertEquals([], props['SupportedFields'])
+
+    handle = conn.get_contact_handle_sync('bob@localhost')
+
+    # Nothing is known until someone asks.
+    assertEquals({}, conn.ContactInfo.GetContactInfo([handle]))
+
+    # Two requests for the same contact only go to the server once.
+    call_async(q, conn.ContactInfo, 'RequestContactInfo', handle)
+    call_async(q, conn.ContactInfo, 'RequestContactInfo', handle)
+
+    vcard_get = EventPattern('stream-iq', iq_type='get',
+        query_ns=ns.VCARD_TEMP, query_name='vCard')
+
+    answer_get_info(q, stream, 'bob@localhost')
+    q.forbid_events([vcard_get])
+
+    first, second, changed = q.expect_many(
+        EventPattern('dbus-return', method='RequestContactInfo'),
+        EventPattern('dbus-return', method='RequestContactInfo'),
+        EventPattern('dbus-signal', signal='ContactInfoChanged'))
+
+    info = first.value[0]
+    assertEquals(info, second.value[0])
+    assertEquals([handle, info], changed.args)
+    assertContains(('fn', [], [u'Bob Builder']), info)
+    assertContains(('nickname', [], [u'bob']), info)
+    # libpurple gives us the parts of the name separately.
+    assertContains(('n', [], [u'Builder', u'Bob', u'', u'', u'']), info)
+    # libpurple gives us this one as a mailto: link.
+    assertContains(('email', [], [u'bob@example.com']), info)
+
+    # Now it's cached, so none of these go to the server.
+    assertEquals({handle: info}, conn.ContactInfo.GetContactInfo([handle]))
+    assertEquals(info, conn.ContactInfo.RequestContactInfo(handle))
+
+    attrs = conn.Contacts.GetContactAttributes([handle],
+        [cs.CONN_IFACE_CONTACT_INFO], False)
+    assertEquals(info, attrs[handle][cs.CONN_IFACE_CONTACT_INFO + '/info'])
+
+    q.unforbid_events([vcard_get])
+
+    # Refreshing asks again, and says so even if nothing has changed.
+    conn.ContactInfo.RefreshContactInfo([handle])
+    answer_get_info(q, stream, 'bob@localhost')
+    q.expect('dbus-signal', signal='ContactInfoChanged', args=[handle, info])
+
+    call_async(q, conn.ContactInfo, 'SetContactInfo', [])
+    e = q.expect('dbus-error', method='SetContactInfo')
+    assertDBusError(cs.NOT_IMPLEMENTED, e.error)
+
+    # A request still waiting for the server when the connection goes away
+    # fails straight away.
+    handle = conn.get_contact_handle_sync('carol@localhost')
+    call_async(q, conn.ContactInfo, 'RequestContactInfo', handle)
+    q.expect('stream-iq', to='carol@localhost', iq_type='get',
+        query_ns=ns.VCARD_TEMP, query_name='vCard')
+
+    conn.Disconnect()
+    e, _ = q.expect_many(
+        EventPattern('dbus-error', method='RequestContactInfo'),
+        EventPattern('dbus-signal', signal='StatusChanged', args=[2, 1]))
+    assertDBusError(cs.DISCONNECTED, e.error)
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,101 @@
+"""
+Test searching an XMPP user directory with a ContactSearch channel.
+"""
+
+import dbus
+
+from hazetest import exec_test
+from gabbletest import make_result_iq, elem
+from servicetest import (call_async, EventPattern, assertEquals,
+        assertContains, assertSameSets, assertDBusError)
+import constants as cs
+import ns
+
+CONTACT_SEARCH_LIMIT = cs.CHANNEL_TYPE_CONTACT_SEARCH + '.Limit'
+
+def test(q, bus, conn, stream):
+    classes = conn.Properties.Get(cs.CONN_IFACE_REQUESTS,
+        'RequestableChannelClasses')
+    assertContains(({
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_CONTACT_SEARCH,
+        cs.TARGET_HANDLE_TYPE: cs.HT_NONE,
+        }, [cs.CONTACT_SEARCH_SERVER, CONTACT_SEARCH_LIMIT]), classes)
+
+    call_async(q, conn.Requests, 'CreateChannel', {
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_CONTACT_SEARCH,
+        cs.TARGET_HANDLE_TYPE: cs.HT_NONE,
+        cs.CONTACT_SEARCH_SERVER: 'users.localhost',
+        })
+
+    # The channel only appears once the directory has sent its form.
+    e = q.expect('stream-iq', to='users.localhost', iq_type='get',
+        query_ns=ns.SEARCH)
+    form = make_result_iq(stream, e.stanza, add_query_node=False)
+    form.addChild(elem(ns.SEARCH, 'query')(
+        elem('instructions')(u'Fill in a field to search'),
+        elem('first')(), elem('last')(), elem('nick')(), elem('email')()))
+    stream.send(form)
+
+    ret, _ = q.expect_many(
+        EventPattern('dbus-return', method='CreateChannel'),
+        EventPattern('dbus-signal', signal='NewChannels'))
+    path, props = ret.value
+    assertEquals('users.localhost', props[cs.CONTACT_SEARCH_SERVER])
+    assertSameSets(['x-n-given', 'x-n-family', 'nickname', 'email'],
+        props[cs.CONTACT_SEARCH_ASK])
+
+    # Only one at a time.
+    call_async(q, conn.Requests, 'CreateChannel', {
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_CONTACT_SEARCH,
+        cs.TARGET_HANDLE_TYPE: cs.HT_NONE,
+        })
+    e = q.expect('dbus-error', method='CreateChannel')
+    assertDBusError(cs.NOT_AVAILABLE, e.error)
+
+    chan = bus.get_object(conn.bus_name, path)
+    search = dbus.Interface(chan, cs.CHANNEL_TYPE_CONTACT_SEARCH)
+
+    call_async(q, search, 'Stop')
+    e = q.expect('dbus-error', method='Stop')
+    assertDBusError(cs.NOT_AVAILABLE, e.error)
+
+    call_async(q, search, 'Search', {'x-shoe-size': '11'})
+    e = q.expect('dbus-error', method='Search')
+    assertDBusError(cs.INVALID_ARGUMENT, e.error)
+
+    call_async(q, search, 'Search', {'nickname': 'bob'})
+    e, _, _ = q.expect_many(
+        EventPattern('stream-iq', to='users.localhost', iq_type='set',
+            query_ns=ns.SEARCH),
+        EventPattern('dbus-return', method='Search'),
+        EventPattern('dbus-signal', signal='SearchStateChanged',
+            args=[cs.SEARCH_IN_PROGRESS, '', {}]))
+    assertEquals('bob', str(e.query.nick))
+
+    reply = make_result_iq(stream, e.stanza, add_query_node=False)
+    reply.addChild(elem(ns.SEARCH, 'query')(
+        elem('item', jid='bob@localhost')(
+            elem('first')(u'Bob'), elem('last')(u'Builder'),
+            elem('nick')(u'bob'), elem('email')(u'bob@example.com'))))
+    stream.send(reply)
+
+    e = q.expect('dbus-signal', signal='SearchResultReceived')
+    results = e.args[0]
+    assertEquals(['bob@localhost'], results.keys())
+    assertContains(('nickname', [], ['bob']), results['bob@localhost'])
+    assertContains(('x-n-given', [], ['Bob']), results['bob@localhost'])
+
+    e = q.expect('dbus-signal', signal='SearchStateChanged')
+    assertEquals(cs.SEARCH_COMPLETED, e.args[0])
+
+    # Nothing left to stop.
+    search.Stop()
+
+    chan.Close(dbus_interface=cs.CHANNEL)
+    q.expect('dbus-signal', signal='Closed', path=path)
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
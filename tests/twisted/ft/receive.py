@@ -0,0 +1,139 @@
+"""
+Test receiving a file over in-band bytestreams: the offer, AcceptFile, the
+data passing through Haze's buffer to the client's socket, and the state
+changes along the way; and cancelling a transfer we haven't accepted.
+"""
+
+import base64
+import socket
+
+import dbus
+
+from hazetest import exec_test
+from gabbletest import elem, elem_iq
+from servicetest import EventPattern, assertEquals
+import constants as cs
+import ns
+
+SENDER = 'bob@localhost/Bob'
+BLOCK_SIZE = 4096
+
+# More than Haze's default buffer holds, so the data has to wrap around it,
+# and libpurple is held back while the client doesn't read.
+FILE_SIZE = 300 * 1024
+FILE_DATA = ''.join(chr(i % 251) for i in xrange(FILE_SIZE))
+
+def offer_file(q, stream, sid, filename, size):
+    stream.send(elem_iq(stream, 'set', from_=SENDER, id='offer-' + sid)(
+        elem(ns.SI, 'si', id=sid, profile=ns.FILE_TRANSFER)(
+            elem(ns.FILE_TRANSFER, 'file', name=filename, size=str(size))(),
+            elem(ns.FEATURE_NEG, 'feature')(
+                elem(ns.X_DATA, 'x', type='form')(
+                    elem('field', var='stream-method', type='list-single')(
+                        elem('option')(elem('value')(unicode(ns.IBB))),
+                    ),
+                ),
+            ),
+        )))
+
+    e = q.expect('dbus-signal', signal='NewChannels',
+        predicate=lambda e: e.args[0][0][1][cs.CHANNEL_TYPE] ==
+            cs.CHANNEL_TYPE_FILE_TRANSFER)
+    path, props = e.args[0][0]
+
+    assertEquals(cs.HT_CONTACT, props[cs.TARGET_HANDLE_TYPE])
+    assertEquals('bob@localhost', props[cs.TARGET_ID])
+    assertEquals(False, props[cs.REQUESTED])
+    assertEquals(filename, props[cs.FT_FILENAME])
+    assertEquals(size, props[cs.FT_SIZE])
+
+    return path
+
+def state_changed(path, state, reason):
+    return EventPattern('dbus-signal', signal='FileTransferStateChanged',
+        path=path, args=[state, reason])
+
+def test(q, bus, conn, stream):
+    sid = 'stream-1'
+    path = offer_file(q, stream, sid, 'data.bin', FILE_SIZE)
+    chan = bus.get_object(conn.bus_name, path)
+    ft = dbus.Interface(chan, cs.CHANNEL_TYPE_FILE_TRANSFER)
+    assertEquals(cs.FT_STATE_PENDING, chan.Get(cs.CHANNEL_TYPE_FILE_TRANSFER,
+        'State', dbus_interface=dbus.PROPERTIES_IFACE))
+
+    address = ft.AcceptFile(cs.SOCKET_ADDRESS_TYPE_UNIX,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, '', dbus.UInt64(0),
+        byte_arrays=True)
+
+    # libpurple answers the offer, choosing the only method it was offered.
+    _, _, result = q.expect_many(
+        state_changed(path, cs.FT_STATE_ACCEPTED,
+            cs.FT_STATE_CHANGE_REASON_REQUESTED),
+        EventPattern('dbus-signal', signal='InitialOffsetDefined', path=path,
+            args=[0]),
+        EventPattern('stream-iq', iq_type='result', iq_id='offer-' + sid,
+            query_ns=ns.SI))
+    value = result.query.firstChildElement().firstChildElement()\
+        .firstChildElement().firstChildElement()
+    assertEquals(ns.IBB, str(value))
+
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(address)
+
+    # The transfer is only open once the bytestream is.
+    stream.send(elem_iq(stream, 'set', from_=SENDER, id='open-' + sid)(
+        elem(ns.IBB, 'open', sid=sid, stanza='iq',
+            attrs={'block-size': str(BLOCK_SIZE)})))
+    q.expect_many(
+        EventPattern('stream-iq', iq_type='result', iq_id='open-' + sid),
+        state_changed(path, cs.FT_STATE_OPEN, cs.FT_STATE_CHANGE_REASON_NONE))
+
+    # Send the whole file before the client reads any of it.
+    ids = []
+    for seq, offset in enumerate(xrange(0, FILE_SIZE, BLOCK_SIZE)):
+        iq_id = 'data-%u' % seq
+        chunk = FILE_DATA[offset:offset + BLOCK_SIZE]
+        stream.send(elem_iq(stream, 'set', from_=SENDER, id=iq_id)(
+            elem(ns.IBB, 'data', sid=sid, seq=str(seq))(
+                unicode(base64.b64encode(chunk)))))
+        ids.append(iq_id)
+
+    q.expect_many(*[EventPattern('stream-iq', iq_type='result', iq_id=iq_id)
+        for iq_id in ids])
+
+    received = []
+    n_received = 0
+    while n_received < FILE_SIZE:
+        data = s.recv(65536)
+        assert data, 'socket closed after %u bytes' % n_received
+        received.append(data)
+        n_received += len(data)
+
+    assertEquals(FILE_SIZE, n_received)
+    assert ''.join(received) == FILE_DATA, 'the file was corrupted'
+
+    q.expect_many(
+        EventPattern('dbus-signal', signal='TransferredBytesChanged',
+            path=path, args=[FILE_SIZE]),
+        state_changed(path, cs.FT_STATE_COMPLETED,
+            cs.FT_STATE_CHANGE_REASON_NONE))
+
+    # Haze closes its end once it's done.
+    assertEquals('', s.recv(1))
+    s.close()
+    chan.Close(dbus_interface=cs.CHANNEL)
+
+    # Closing a transfer nobody has accepted cancels it.
+    path = offer_file(q, stream, 'stream-2', 'unwanted.bin', 1234)
+    chan = bus.get_object(conn.bus_name, path)
+    chan.Close(dbus_interface=cs.CHANNEL)
+    q.expect_many(
+        state_changed(path, cs.FT_STATE_CANCELLED,
+            cs.FT_STATE_CHANGE_REASON_LOCAL_STOPPED),
+        EventPattern('dbus-signal', signal='Closed', path=path))
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,50 @@
+"""
+Test requesting outgoing FileTransfer channels.
+"""
+
+import dbus
+
+from hazetest import exec_test
+from servicetest import (call_async, assertContains, assertDBusError)
+import constants as cs
+
+def test(q, bus, conn, stream):
+    classes = conn.Properties.Get(cs.CONN_IFACE_REQUESTS,
+        'RequestableChannelClasses')
+    assertContains(({
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_FILE_TRANSFER,
+        cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+        }, [cs.TARGET_HANDLE, cs.TARGET_ID, cs.FT_CONTENT_TYPE,
+            cs.FT_FILENAME, cs.FT_SIZE, cs.FT_DESCRIPTION, cs.FT_DATE]),
+        classes)
+
+    request = {
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_FILE_TRANSFER,
+        cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+        cs.TARGET_ID: 'bob@localhost',
+        cs.FT_FILENAME: 'report.txt',
+        cs.FT_SIZE: dbus.UInt64(1234),
+        }
+
+    for key in [cs.FT_FILENAME, cs.FT_SIZE]:
+        partial = dict(request)
+        del partial[key]
+        call_async(q, conn.Requests, 'CreateChannel', partial)
+        e = q.expect('dbus-error', method='CreateChannel')
+        assertDBusError(cs.INVALID_ARGUMENT, e.error)
+
+    call_async(q, conn.Requests, 'CreateChannel', dict(request.items() +
+        [(cs.FT_FILENAME, '../../etc/passwd')]))
+    e = q.expect('dbus-error', method='CreateChannel')
+    assertDBusError(cs.INVALID_ARGUMENT, e.error)
+
+    call_async(q, conn.Requests, 'CreateChannel', dict(request.items() +
+        [(cs.TARGET_ID, 'test@localhost')]))
+    e = q.expect('dbus-error', method='CreateChannel')
+    assertDBusError(cs.INVALID_ARGUMENT, e.error)
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,144 @@
+"""
+Test sending a file over in-band bytestreams: ProvideFile, the offer, the
+data read from the client's socket going out in chunks, and the state
+changes along the way; and the recipient declining a transfer.
+"""
+
+import base64
+import socket
+
+import dbus
+
+from hazetest import exec_test
+from gabbletest import elem, make_presence, make_result_iq, send_error_reply
+from servicetest import call_async, EventPattern, assertEquals
+import constants as cs
+import ns
+
+RECIPIENT = 'bob@localhost/Bob'
+
+FILE_SIZE = 10000
+FILE_DATA = ''.join(chr(i % 251) for i in xrange(FILE_SIZE))
+
+def request_ft(q, conn, filename, size):
+    call_async(q, conn.Requests, 'CreateChannel', {
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_FILE_TRANSFER,
+        cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+        cs.TARGET_ID: 'bob@localhost',
+        cs.FT_FILENAME: filename,
+        cs.FT_SIZE: dbus.UInt64(size),
+        })
+
+    ret = q.expect('dbus-return', method='CreateChannel')
+    return ret.value[0]
+
+def expect_offer(q, stream):
+    """Answers libpurple's question about what the recipient can do, if it
+    asks, and returns the offer which follows."""
+
+    e = q.expect('stream-iq', to=RECIPIENT,
+        predicate=lambda e: e.query_ns in (ns.DISCO_INFO, ns.SI))
+
+    if e.query_ns == ns.DISCO_INFO:
+        result = make_result_iq(stream, e.stanza)
+        for feature in [ns.SI, ns.FILE_TRANSFER, ns.IBB]:
+            result.firstChildElement().addChild(
+                elem('feature', var=feature)())
+        stream.send(result)
+
+        e = q.expect('stream-iq', to=RECIPIENT, iq_type='set', query_ns=ns.SI)
+
+    return e
+
+def state_changed(path, state, reason):
+    return EventPattern('dbus-signal', signal='FileTransferStateChanged',
+        path=path, args=[state, reason])
+
+def test(q, bus, conn, stream):
+    # libpurple only offers files to contacts it can see online.
+    stream.send(make_presence(RECIPIENT))
+
+    path = request_ft(q, conn, 'data.bin', FILE_SIZE)
+    chan = bus.get_object(conn.bus_name, path)
+    ft = dbus.Interface(chan, cs.CHANNEL_TYPE_FILE_TRANSFER)
+
+    address = ft.ProvideFile(cs.SOCKET_ADDRESS_TYPE_UNIX,
+        cs.SOCKET_ACCESS_CONTROL_LOCALHOST, '', byte_arrays=True)
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(address)
+    # It all fits in the socket's buffer, so this doesn't block.
+    s.sendall(FILE_DATA)
+
+    offer = expect_offer(q, stream)
+    file_ = offer.query.firstChildElement()
+    assertEquals('data.bin', file_['name'])
+    assertEquals(str(FILE_SIZE), file_['size'])
+
+    # Nothing has happened yet as far as the client can tell.
+    assertEquals(cs.FT_STATE_PENDING, chan.Get(cs.CHANNEL_TYPE_FILE_TRANSFER,
+        'State', dbus_interface=dbus.PROPERTIES_IFACE))
+
+    result = make_result_iq(stream, offer.stanza, add_query_node=False)
+    result.addChild(elem(ns.SI, 'si')(
+        elem(ns.FEATURE_NEG, 'feature')(
+            elem(ns.X_DATA, 'x', type='submit')(
+                elem('field', var='stream-method')(
+                    elem('value')(unicode(ns.IBB)),
+                ),
+            ),
+        )))
+    stream.send(result)
+
+    open_ = q.expect('stream-iq', iq_type='set', query_ns=ns.IBB,
+        query_name='open')
+    sid = open_.query['sid']
+    assertEquals(offer.query['id'], sid)
+    stream.send(make_result_iq(stream, open_.stanza, add_query_node=False))
+
+    # libpurple doesn't say when the recipient accepts, only when the
+    # bytestream opens; since the client is already connected, the transfer
+    # is open straight away.
+    q.expect_many(
+        state_changed(path, cs.FT_STATE_ACCEPTED,
+            cs.FT_STATE_CHANGE_REASON_NONE),
+        state_changed(path, cs.FT_STATE_OPEN, cs.FT_STATE_CHANGE_REASON_NONE))
+
+    # Each chunk waits for the last one to be acknowledged.
+    received = ''
+    seq = 0
+    while len(received) < FILE_SIZE:
+        e = q.expect('stream-iq', iq_type='set', query_ns=ns.IBB,
+            query_name='data')
+        assertEquals(sid, e.query['sid'])
+        assertEquals(str(seq), e.query['seq'])
+        received += base64.b64decode(str(e.query))
+        seq += 1
+        stream.send(make_result_iq(stream, e.stanza, add_query_node=False))
+
+    assertEquals(FILE_SIZE, len(received))
+    assert received == FILE_DATA, 'the file was corrupted'
+
+    q.expect_many(
+        EventPattern('dbus-signal', signal='TransferredBytesChanged',
+            path=path, args=[FILE_SIZE]),
+        state_changed(path, cs.FT_STATE_COMPLETED,
+            cs.FT_STATE_CHANGE_REASON_NONE))
+
+    s.close()
+    chan.Close(dbus_interface=cs.CHANNEL)
+
+    # The recipient can turn the offer down.
+    path = request_ft(q, conn, 'unwanted.bin', 1234)
+    offer = expect_offer(q, stream)
+    send_error_reply(stream, offer.stanza,
+        elem('error', type='cancel', code='403')(
+            elem(ns.STANZA, 'forbidden')(),
+        ))
+    q.expect('dbus-signal', signal='FileTransferStateChanged', path=path,
+        args=[cs.FT_STATE_CANCELLED, cs.FT_STATE_CHANGE_REASON_REMOTE_STOPPED])
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -67,9 +67,23 @@ def expect_kinda_connected(queue):
     queue.expect('dbus-signal', signal='StatusChanged',
         args=[cs.CONN_STATUS_CONNECTED, cs.CSR_REQUESTED])
 
+def set_activation_environment(environment):
+    # Haze is activated by the test's private session bus, so this is how
+    # tests set the HAZE_* tunables it reads at startup.
+    bus = dbus.SessionBus()
+    bus_daemon = dbus.Interface(
+        bus.get_object('org.freedesktop.DBus', '/org/freedesktop/DBus'),
+        'org.freedesktop.DBus')
+    bus_daemon.UpdateActivationEnvironment(
+        dbus.Dictionary(environment, signature='ss'))
+
 # Copy pasta because we need to replace make_connection
 def exec_test(fun, params=None, protocol=EmptyRosterXmppXmlStream, timeout=None,
-              authenticator=None, num_instances=1, do_connect=True):
+              authenticator=None, num_instances=1, do_connect=True,
+              environment=None):
+    if environment:
+        set_activation_environment(environment)
+
     reactor.callWhenRunning(
         exec_test_deferred, fun, params, protocol, timeout, authenticator, num_instances,
         do_connect, make_haze_connection, expect_kinda_connected)
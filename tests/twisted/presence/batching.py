@@ -0,0 +1,87 @@
+"""
+Test that contacts' presence changes are signalled in batches: changes
+arriving within HAZE_PRESENCE_BATCH_MS of each other share one
+PresencesChanged, a batch is cut short once it reaches
+HAZE_PRESENCE_BATCH_SIZE contacts, and a change to our own presence flushes
+the batch at once.
+"""
+
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals, assertLength
+from hazetest import exec_test, make_presence, sync_stream
+import constants as cs
+import ns
+
+BATCH_SIZE = 10
+
+def test(q, bus, conn, stream):
+    jids = ['contact%02d@foo.com' % i for i in range(BATCH_SIZE + 2)]
+
+    iq = IQ(stream, 'set')
+    query = iq.addElement((ns.ROSTER, 'query'))
+
+    for jid in jids:
+        item = query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+
+    stream.send(iq)
+    sync_stream(q, stream)
+
+    handles = conn.get_contact_handles_sync(jids)
+
+    # A handful of changes, including two for the same contact, make one
+    # signal carrying each contact's latest presence.
+    stream.send(make_presence(jids[0], show='away', status='Out to lunch'))
+
+    for jid in jids[1:5]:
+        stream.send(make_presence(jid, status='Here'))
+
+    stream.send(make_presence(jids[0], show='away', status='Back soon'))
+
+    e = q.expect('dbus-signal', signal='PresencesChanged')
+    assertEquals(
+        dict([(handles[0], (cs.PRESENCE_AWAY, 'away', 'Back soon'))] +
+            [(h, (cs.PRESENCE_AVAILABLE, 'available', 'Here'))
+                for h in handles[1:5]]),
+        e.args[0])
+
+    # More changes than fit in a batch are split, without waiting for the
+    # first batch's time to be up.
+    for jid in jids:
+        stream.send(make_presence(jid, show='xa', status='Gone home'))
+
+    e = q.expect('dbus-signal', signal='PresencesChanged')
+    assertLength(BATCH_SIZE, e.args[0])
+    first = e.args[0]
+
+    e = q.expect('dbus-signal', signal='PresencesChanged')
+    assertLength(2, e.args[0])
+    first.update(e.args[0])
+
+    assertEquals(
+        dict((h, (cs.PRESENCE_EXTENDED_AWAY, 'xa', 'Gone home'))
+            for h in handles),
+        first)
+
+    # Changing our own presence doesn't wait for the batch, and brings the
+    # rest of the batch along with it.
+    stream.send(make_presence(jids[5], status='Back again'))
+    sync_stream(q, stream)
+
+    conn.SimplePresence.SetPresence('away', 'Having a nap')
+
+    e = q.expect('dbus-signal', signal='PresencesChanged')
+    self_handle = conn.Properties.Get(cs.CONN, 'SelfHandle')
+    assertEquals(
+        { self_handle: (cs.PRESENCE_AWAY, 'away', 'Having a nap'),
+          handles[5]: (cs.PRESENCE_AVAILABLE, 'available', 'Back again'),
+        },
+        e.args[0])
+
+if __name__ == '__main__':
+    exec_test(test, environment={
+        'HAZE_PRESENCE_BATCH_MS': '2000',
+        'HAZE_PRESENCE_BATCH_SIZE': str(BATCH_SIZE),
+        })
@@ -0,0 +1,95 @@
+"""
+Test that, with HAZE_PRESENCE_DAMPING_MS set, a contact who goes offline and
+comes straight back is never signalled as offline, that one who stays away
+is signalled once the damping time is up, and that the flap is counted in
+the debug messages.
+"""
+
+import dbus
+
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals, EventPattern
+from hazetest import exec_test, make_presence, sync_stream
+import constants as cs
+import ns
+
+def get_presence(conn, handle):
+    attrs = conn.Contacts.GetContactAttributes([handle],
+            [cs.CONN_IFACE_SIMPLE_PRESENCE], False)
+    return attrs[handle][cs.ATTR_PRESENCE]
+
+def test(q, bus, conn, stream):
+    jids = ['amy@foo.com', 'bob@foo.com']
+
+    iq = IQ(stream, 'set')
+    query = iq.addElement((ns.ROSTER, 'query'))
+
+    for jid in jids:
+        item = query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+
+    stream.send(iq)
+    sync_stream(q, stream)
+
+    amy, bob = conn.get_contact_handles_sync(jids)
+    here = (cs.PRESENCE_AVAILABLE, 'available', 'Here')
+    back = (cs.PRESENCE_AVAILABLE, 'available', 'Back')
+
+    for jid in jids:
+        stream.send(make_presence(jid, status='Here'))
+
+    seen = {}
+
+    while len(seen) < 2:
+        e = q.expect('dbus-signal', signal='PresencesChanged')
+        seen.update(e.args[0])
+
+    assertEquals({ amy: here, bob: here }, seen)
+
+    # Amy's connection drops and comes straight back. In between, she
+    # still looks online, and she's never signalled as having gone.
+    amy_offline = EventPattern('dbus-signal', signal='PresencesChanged',
+            predicate=lambda e: e.args[0].get(amy, here)[0] ==
+                cs.PRESENCE_OFFLINE)
+    q.forbid_events([amy_offline])
+
+    stream.send(make_presence(jids[0], type='unavailable'))
+    sync_stream(q, stream)
+    assertEquals(here, get_presence(conn, amy))
+
+    stream.send(make_presence(jids[0], status='Back'))
+    q.expect('dbus-signal', signal='PresencesChanged',
+            predicate=lambda e: e.args[0].get(amy) == back)
+    assertEquals(back, get_presence(conn, amy))
+
+    # The flap shows up in the debug messages, which is where the
+    # statistics for tuning the damping time are published.
+    debug = dbus.Interface(
+        bus.get_object(conn._requested_bus_name, cs.DEBUG_PATH),
+        cs.DEBUG_IFACE)
+    messages = [m[3] for m in debug.GetMessages()]
+    assert [m for m in messages
+            if 'flapped; 1 of 1 contacts going offline came back' in m], \
+        messages
+
+    # Bob goes away for good: he still looks online until the damping time
+    # is up, then he's signalled as offline.
+    stream.send(make_presence(jids[1], type='unavailable'))
+    sync_stream(q, stream)
+    assertEquals(here, get_presence(conn, bob))
+
+    e = q.expect('dbus-signal', signal='PresencesChanged',
+            predicate=lambda e: bob in e.args[0])
+    assertEquals({ bob: (cs.PRESENCE_OFFLINE, 'offline', '') }, e.args[0])
+    assertEquals((cs.PRESENCE_OFFLINE, 'offline', ''),
+            get_presence(conn, bob))
+
+    q.unforbid_events([amy_offline])
+
+if __name__ == '__main__':
+    exec_test(test, environment={
+        'HAZE_PRESENCE_DAMPING_MS': '1000',
+        'HAZE_PRESENCE_BATCH_MS': '0',
+        })
@@ -0,0 +1,75 @@
+"""
+Test that contacts who share a status are given the same, correct presence,
+both while the status is in use and after it has been dropped from the
+cache of unused statuses (HAZE_PRESENCE_CACHE_SIZE) and looked up afresh.
+"""
+
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals
+from hazetest import exec_test, make_presence, sync_stream
+import constants as cs
+import ns
+
+N_CONTACTS = 20
+
+def set_all(q, stream, jids, handles, show, status, expected):
+    for jid in jids:
+        stream.send(make_presence(jid, show=show, status=status))
+
+    seen = {}
+
+    while len(seen) < len(handles):
+        e = q.expect('dbus-signal', signal='PresencesChanged')
+        seen.update(e.args[0])
+
+    assertEquals(dict((h, expected) for h in handles), seen)
+
+def test(q, bus, conn, stream):
+    jids = ['contact%02d@foo.com' % i for i in range(N_CONTACTS)]
+
+    iq = IQ(stream, 'set')
+    query = iq.addElement((ns.ROSTER, 'query'))
+
+    for jid in jids:
+        item = query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+
+    stream.send(iq)
+    sync_stream(q, stream)
+
+    handles = conn.get_contact_handles_sync(jids)
+    lunch = (cs.PRESENCE_AWAY, 'away', 'Fish & chips')
+    home = (cs.PRESENCE_EXTENDED_AWAY, 'xa', 'Gone home')
+    here = (cs.PRESENCE_AVAILABLE, 'available', '')
+
+    # Everyone shares one status; the message is given back without the
+    # markup libpurple stores it as.
+    set_all(q, stream, jids, handles, 'away', 'Fish & chips', lunch)
+
+    attrs = conn.Contacts.GetContactAttributes(handles,
+            [cs.CONN_IFACE_SIMPLE_PRESENCE], False)
+    assertEquals(dict((h, lunch) for h in handles),
+            dict((h, a[cs.ATTR_PRESENCE]) for h, a in attrs.items()))
+
+    # Once nobody is at lunch any more, that status is only cached; moving
+    # everyone on again pushes it out of a cache with room for one...
+    set_all(q, stream, jids, handles, 'xa', 'Gone home', home)
+    set_all(q, stream, jids, handles, None, None, here)
+
+    # ... so going back to it has to build it again, correctly.
+    set_all(q, stream, jids, handles, 'away', 'Fish & chips', lunch)
+
+    # Half move on, so the statuses are shared unevenly.
+    set_all(q, stream, jids[::2], handles[::2], 'xa', 'Gone home', home)
+
+    attrs = conn.Contacts.GetContactAttributes(handles,
+            [cs.CONN_IFACE_SIMPLE_PRESENCE], False)
+    assertEquals(
+        dict([(h, home) for h in handles[::2]] +
+            [(h, lunch) for h in handles[1::2]]),
+        dict((h, a[cs.ATTR_PRESENCE]) for h, a in attrs.items()))
+
+if __name__ == '__main__':
+    exec_test(test, environment={ 'HAZE_PRESENCE_CACHE_SIZE': '1' })
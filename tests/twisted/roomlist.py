@@ -0,0 +1,147 @@
+"""
+Test requesting RoomList channels, and listing the rooms on a server.
+"""
+
+import dbus
+
+from hazetest import exec_test
+from gabbletest import elem, make_result_iq, send_error_reply, sync_stream
+from servicetest import (call_async, EventPattern, assertEquals,
+        assertContains, assertDBusError, sync_dbus)
+import constants as cs
+import ns
+
+SERVER = 'conf.localhost'
+N_ROOMS = 150
+
+def expect_listing_rooms(q, path, listing):
+    q.expect('dbus-signal', signal='ListingRooms', path=path, args=[listing])
+
+def test(q, bus, conn, stream):
+    classes = conn.Properties.Get(cs.CONN_IFACE_REQUESTS,
+        'RequestableChannelClasses')
+    assertContains(({
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_ROOM_LIST,
+        cs.TARGET_HANDLE_TYPE: cs.HT_NONE,
+        }, [cs.CHANNEL_TYPE_ROOM_LIST + '.Server']), classes)
+
+    request = {
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_ROOM_LIST,
+        cs.TARGET_HANDLE_TYPE: cs.HT_NONE,
+        cs.CHANNEL_TYPE_ROOM_LIST + '.Server': SERVER,
+        }
+
+    call_async(q, conn.Requests, 'CreateChannel', request)
+    ret, _ = q.expect_many(
+        EventPattern('dbus-return', method='CreateChannel'),
+        EventPattern('dbus-signal', signal='NewChannels'))
+    path, props = ret.value
+    assertEquals(SERVER, props[cs.CHANNEL_TYPE_ROOM_LIST + '.Server'])
+
+    # Only one at a time.
+    call_async(q, conn.Requests, 'CreateChannel', request)
+    e = q.expect('dbus-error', method='CreateChannel')
+    assertDBusError(cs.NOT_AVAILABLE, e.error)
+
+    call_async(q, conn.Requests, 'EnsureChannel', request)
+    e = q.expect('dbus-return', method='EnsureChannel')
+    yours, ensured_path, _ = e.value
+    assert not yours
+    assertEquals(path, ensured_path)
+
+    # ... even if it's for a different server.
+    call_async(q, conn.Requests, 'EnsureChannel', dict(request.items() +
+        [(cs.CHANNEL_TYPE_ROOM_LIST + '.Server', 'conf.example.com')]))
+    e = q.expect('dbus-error', method='EnsureChannel')
+    assertDBusError(cs.NOT_AVAILABLE, e.error)
+
+    chan = bus.get_object(conn.bus_name, path)
+    room_list = dbus.Interface(chan, cs.CHANNEL_TYPE_ROOM_LIST)
+    assertEquals(False, room_list.GetListingRooms())
+
+    # libpurple asks which server to list, and we tell it the one the client
+    # asked for.
+    call_async(q, room_list, 'ListRooms')
+    _, _, disco = q.expect_many(
+        EventPattern('dbus-return', method='ListRooms'),
+        EventPattern('dbus-signal', signal='ListingRooms', path=path,
+            args=[True]),
+        EventPattern('stream-iq', to=SERVER, iq_type='get',
+            query_ns=ns.DISCO_ITEMS))
+    assertEquals(True, room_list.GetListingRooms())
+
+    call_async(q, room_list, 'ListRooms')
+    e = q.expect('dbus-error', method='ListRooms')
+    assertDBusError(cs.NOT_AVAILABLE, e.error)
+
+    result = make_result_iq(stream, disco.stanza)
+    for i in range(N_ROOMS):
+        result.firstChildElement().addChild(elem('item',
+            jid='room%u@%s' % (i, SERVER), name=u'Room %u' % i)())
+    stream.send(result)
+
+    # They arrive all at once, but are passed on in batches.
+    first = q.expect('dbus-signal', signal='GotRooms', path=path)
+    second = q.expect('dbus-signal', signal='GotRooms', path=path)
+    expect_listing_rooms(q, path, False)
+    assertEquals(100, len(first.args[0]))
+    assertEquals(N_ROOMS - 100, len(second.args[0]))
+
+    rooms = first.args[0] + second.args[0]
+    for i, (_, channel_type, info) in enumerate(rooms):
+        assertEquals(cs.CHANNEL_TYPE_TEXT, channel_type)
+        assertEquals('room%u@%s' % (i, SERVER), info['handle-name'])
+        assertEquals('room%u' % i, info['name'])
+        assertEquals('Room %u' % i, info['description'])
+
+    assertEquals(False, room_list.GetListingRooms())
+
+    # The client can stop listing before the server answers; the answer, when
+    # it comes, is ignored.
+    got_rooms = EventPattern('dbus-signal', signal='GotRooms')
+    q.forbid_events([got_rooms])
+
+    call_async(q, room_list, 'ListRooms')
+    _, _, disco = q.expect_many(
+        EventPattern('dbus-return', method='ListRooms'),
+        EventPattern('dbus-signal', signal='ListingRooms', path=path,
+            args=[True]),
+        EventPattern('stream-iq', to=SERVER, iq_type='get',
+            query_ns=ns.DISCO_ITEMS))
+
+    call_async(q, room_list, 'StopListing')
+    q.expect_many(
+        EventPattern('dbus-return', method='StopListing'),
+        EventPattern('dbus-signal', signal='ListingRooms', path=path,
+            args=[False]))
+    assertEquals(False, room_list.GetListingRooms())
+
+    result = make_result_iq(stream, disco.stanza)
+    result.firstChildElement().addChild(elem('item',
+        jid='late@%s' % SERVER, name=u'Too late')())
+    stream.send(result)
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+    assertEquals(False, room_list.GetListingRooms())
+
+    q.unforbid_events([got_rooms])
+
+    # If the server can't list its rooms, the listing just ends.
+    call_async(q, room_list, 'ListRooms')
+    _, _, disco = q.expect_many(
+        EventPattern('dbus-return', method='ListRooms'),
+        EventPattern('dbus-signal', signal='ListingRooms', path=path,
+            args=[True]),
+        EventPattern('stream-iq', to=SERVER, iq_type='get',
+            query_ns=ns.DISCO_ITEMS))
+    send_error_reply(stream, disco.stanza)
+    expect_listing_rooms(q, path, False)
+
+    chan.Close(dbus_interface=cs.CHANNEL)
+    q.expect('dbus-signal', signal='Closed', path=path)
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
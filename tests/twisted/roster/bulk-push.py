@@ -0,0 +1,84 @@
+"""
+Test that a large roster push is signalled in bulk, rather than with a
+ContactsChanged and a GroupsChanged for every single contact.
+
+This doubles as a crude benchmark: it reports how many signals this process
+had to handle, and how much CPU time it spent handling them.
+"""
+
+import os
+
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals, assertLength, sync_dbus
+from hazetest import exec_test, sync_stream
+import constants as cs
+import ns
+
+N_CONTACTS = 1000
+GROUPS = ['Friends', 'Family', 'Colleagues', 'Bots']
+
+def cpu_time():
+    t = os.times()
+    return t[0] + t[1]
+
+def test(q, bus, conn, stream):
+    contacts_changed = []
+    groups_changed = []
+
+    bus.add_signal_receiver(lambda *args: contacts_changed.append(args),
+            signal_name='ContactsChanged',
+            dbus_interface=cs.CONN_IFACE_CONTACT_LIST,
+            path=conn.object_path)
+    bus.add_signal_receiver(lambda *args: groups_changed.append(args),
+            signal_name='GroupsChanged',
+            dbus_interface=cs.CONN_IFACE_CONTACT_GROUPS,
+            path=conn.object_path)
+
+    jids = ['contact%04d@example.com' % i for i in range(N_CONTACTS)]
+
+    iq = IQ(stream, 'set')
+    query = iq.addElement((ns.ROSTER, 'query'))
+
+    for i, jid in enumerate(jids):
+        item = query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+        item.addElement('group', content=GROUPS[i % len(GROUPS)])
+
+    before = cpu_time()
+    stream.send(iq)
+
+    q.expect('dbus-signal', signal='ContactsChanged',
+            predicate=lambda e: len(e.args[0]) == N_CONTACTS)
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+    after = cpu_time()
+
+    print('%d contacts: %d ContactsChanged, %d GroupsChanged, '
+          '%.2fs client CPU' % (N_CONTACTS, len(contacts_changed),
+            len(groups_changed), after - before))
+
+    # Everyone should have been announced at once...
+    assertLength(1, contacts_changed)
+    changes, removals = contacts_changed[0]
+    assertLength(N_CONTACTS, changes)
+    assertLength(0, removals)
+
+    # ... and put in their group with one signal per group.
+    assertLength(len(GROUPS), groups_changed)
+    members = {}
+
+    for contacts, added, removed in groups_changed:
+        assertLength(1, added)
+        assertLength(0, removed)
+        members[added[0]] = len(contacts)
+
+    assertEquals(dict((g, N_CONTACTS // len(GROUPS)) for g in GROUPS),
+            members)
+
+    handles = conn.get_contact_handles_sync(jids)
+    assertEquals(sorted(handles), sorted(changes.keys()))
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,70 @@
+"""
+Test that a contact typing doesn't make a channel, but that their chat state
+is signalled on the channel made when their message arrives.
+"""
+
+from twisted.words.xish import domish
+
+from hazetest import exec_test, sync_stream
+from servicetest import EventPattern, assertEquals, sync_dbus
+import constants as cs
+import ns
+
+def message(jid, body=None, state=None):
+    m = domish.Element((None, 'message'))
+    m['from'] = jid + '/Pidgin'
+    m['type'] = 'chat'
+
+    if body is not None:
+        m.addElement('body', content=body)
+
+    if state is not None:
+        m.addElement((ns.CHAT_STATES, state))
+
+    return m
+
+def test(q, bus, conn, stream):
+    foo, bar = 'foo@bar.com', 'bar@bar.com'
+    foo_handle, bar_handle = conn.get_contact_handles_sync([foo, bar])
+
+    new_channels = EventPattern('dbus-signal', signal='NewChannels')
+    q.forbid_events([new_channels])
+
+    # Foo starts typing; bar starts, then stops.
+    stream.send(message(foo, state='composing'))
+    stream.send(message(bar, state='composing'))
+    stream.send(message(bar, state='active'))
+
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+    q.unforbid_events([new_channels])
+
+    # Foo's message brings a channel, which is told that foo is typing.
+    stream.send(message(foo, body='hello'))
+
+    event, state, _ = q.expect_many(
+        EventPattern('dbus-signal', signal='NewChannels'),
+        EventPattern('dbus-signal', signal='ChatStateChanged'),
+        EventPattern('dbus-signal', signal='MessageReceived'))
+    path, props = event.args[0][0]
+    assertEquals(foo_handle, props[cs.TARGET_HANDLE])
+    assertEquals(path, state.path)
+    assertEquals([foo_handle, cs.CHAT_STATE_COMPOSING], state.args)
+
+    # Bar had stopped typing, so there's nothing to tell bar's channel.
+    bar_composing = EventPattern('dbus-signal', signal='ChatStateChanged',
+        args=[bar_handle, cs.CHAT_STATE_COMPOSING])
+    q.forbid_events([bar_composing])
+
+    stream.send(message(bar, body='hi'))
+
+    event, _ = q.expect_many(
+        EventPattern('dbus-signal', signal='NewChannels'),
+        EventPattern('dbus-signal', signal='MessageReceived'))
+    assertEquals(bar_handle, event.args[0][0][1][cs.TARGET_HANDLE])
+
+    sync_dbus(bus, q, conn)
+    q.unforbid_events([bar_composing])
+
+if __name__ == '__main__':
+    exec_test(test)
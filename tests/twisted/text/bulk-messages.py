@@ -0,0 +1,118 @@
+"""
+Test Haze's BulkMessages extension, which sends and receives messages without
+Text channels.
+"""
+
+import os
+
+import dbus
+
+from twisted.words.xish import domish
+
+from hazetest import exec_test
+from servicetest import (EventPattern, assertContains, assertEquals,
+        assertDBusError, sync_dbus)
+import constants as cs
+
+CONN_IFACE_BULK_MESSAGES = cs.CONN + '.Interface.Haze.BulkMessages'
+
+def body_of(stanza):
+    for e in stanza.elements():
+        if e.name == 'body':
+            return str(e)
+
+    raise AssertionError('no body in %s' % stanza.toXml())
+
+def message_to(jid):
+    return EventPattern('stream-message',
+        predicate=lambda e: e.stanza['to'].split('/')[0] == jid)
+
+def test(q, bus, conn, stream):
+    assertContains(CONN_IFACE_BULK_MESSAGES,
+            conn.Properties.Get(cs.CONN, 'Interfaces'))
+    bulk = dbus.Interface(conn, CONN_IFACE_BULK_MESSAGES)
+
+    foo = conn.get_contact_handle_sync('foo@bar.com')
+    baz = conn.get_contact_handle_sync('baz@bar.com')
+
+    bulk.SendMessages({ foo: 'hello foo', baz: 'hello baz' })
+    stanzas = q.expect_many(
+            message_to('foo@bar.com'), message_to('baz@bar.com'))
+    assertEquals(['hello foo', 'hello baz'],
+            [body_of(e.stanza) for e in stanzas])
+
+    bulk.Broadcast([foo, baz], 'hello everyone')
+    stanzas = q.expect_many(
+            message_to('foo@bar.com'), message_to('baz@bar.com'))
+    assertEquals(['hello everyone'] * 2,
+            [body_of(e.stanza) for e in stanzas])
+
+    try:
+        bulk.Broadcast([foo, 31337], 'hello?')
+    except dbus.DBusException as e:
+        assertDBusError(cs.INVALID_HANDLE, e)
+    else:
+        raise AssertionError('Broadcast succeeded with an invalid handle')
+
+    new_channels = EventPattern('dbus-signal', signal='NewChannels')
+    q.forbid_events([new_channels])
+
+    bulk.SetReceivingWithoutChannels(True)
+
+    for text in ['one', 'two']:
+        m = domish.Element((None, 'message'))
+        m['from'] = 'foo@bar.com/Pidgin'
+        m['type'] = 'chat'
+        m.addElement('body', content=text)
+        stream.send(m)
+
+    texts = []
+    while len(texts) < 2:
+        e = q.expect('dbus-signal', signal='MessagesReceived')
+        for sender, sent, text in e.args[0]:
+            assertEquals(foo, sender)
+            texts.append(text)
+
+    assertEquals(['one', 'two'], texts)
+
+    sync_dbus(bus, q, conn)
+    q.unforbid_events([new_channels])
+
+    # Once turned off, messages make channels again.
+    bulk.SetReceivingWithoutChannels(False)
+
+    m = domish.Element((None, 'message'))
+    m['from'] = 'foo@bar.com/Pidgin'
+    m['type'] = 'chat'
+    m.addElement('body', content='three')
+    stream.send(m)
+
+    q.expect_many(
+            EventPattern('dbus-signal', signal='NewChannels'),
+            EventPattern('dbus-signal', signal='MessageReceived'))
+
+    # If the client which turned it on leaves the bus, it's turned off again
+    # rather than signalling messages to nobody.
+    other_bus = dbus.bus.BusConnection(os.environ['DBUS_SESSION_BUS_ADDRESS'])
+    other_bulk = dbus.Interface(
+            other_bus.get_object(conn.bus_name, conn.object_path),
+            CONN_IFACE_BULK_MESSAGES)
+    other_bulk.SetReceivingWithoutChannels(True)
+    other_bus.close()
+    sync_dbus(bus, q, conn)
+
+    m = domish.Element((None, 'message'))
+    m['from'] = 'baz@bar.com/Pidgin'
+    m['type'] = 'chat'
+    m.addElement('body', content='four')
+    stream.send(m)
+
+    q.expect_many(
+            EventPattern('dbus-signal', signal='NewChannels'),
+            EventPattern('dbus-signal', signal='MessageReceived'))
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,51 @@
+"""
+Test that a burst of typing notifications from a contact is signalled as a
+single chat state change.
+"""
+
+from twisted.words.xish import domish
+
+from hazetest import exec_test
+from servicetest import EventPattern, sync_dbus
+import constants as cs
+import ns
+
+def chat_state(jid, state):
+    m = domish.Element((None, 'message'))
+    m['from'] = jid + '/Pidgin'
+    m['type'] = 'chat'
+    m.addElement((ns.CHAT_STATES, state))
+    return m
+
+def test(q, bus, conn, stream):
+    jid = 'foo@bar.com'
+
+    # libpurple only passes on typing notifications for conversations which
+    # already exist.
+    m = domish.Element((None, 'message'))
+    m['from'] = jid + '/Pidgin'
+    m['type'] = 'chat'
+    m.addElement('body', content='hello')
+    stream.send(m)
+
+    event = q.expect('dbus-signal', signal='NewChannels')
+    handle = event.args[0][0][1][cs.TARGET_HANDLE]
+    q.expect('dbus-signal', signal='MessageReceived')
+
+    paused = EventPattern('dbus-signal', signal='ChatStateChanged',
+        args=[handle, cs.CHAT_STATE_PAUSED])
+    q.forbid_events([paused])
+
+    for state in ['composing', 'paused', 'composing']:
+        stream.send(chat_state(jid, state))
+
+    q.expect('dbus-signal', signal='ChatStateChanged',
+        args=[handle, cs.CHAT_STATE_COMPOSING])
+    sync_dbus(bus, q, conn)
+    q.unforbid_events([paused])
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,97 @@
+"""
+Test that an idle IM channel whose conversation has been hibernated
+(HAZE_IM_HIBERNATE_SECONDS) still signals the contact's typing, still
+receives messages, and can still send them, without a new channel being
+announced.
+"""
+
+import dbus
+
+from twisted.words.xish import domish
+
+from hazetest import exec_test
+from servicetest import EventPattern, assertEquals
+import constants as cs
+import ns
+
+JID = 'foo@bar.com'
+
+def message(body=None, state=None):
+    m = domish.Element((None, 'message'))
+    m['from'] = JID + '/Pidgin'
+    m['type'] = 'chat'
+
+    if body is not None:
+        m.addElement('body', content=body)
+
+    if state is not None:
+        m.addElement((ns.CHAT_STATES, state))
+
+    return m
+
+def expect_hibernation(q, handle):
+    q.expect('dbus-signal', signal='NewDebugMessage',
+        predicate=lambda e: ('channel %u: hibernating' % handle) in e.args[3])
+
+def test(q, bus, conn, stream):
+    # The debug messages say when the channel hibernates.
+    debug = bus.get_object(conn.bus_name, cs.DEBUG_PATH)
+    debug.Set(cs.DEBUG_IFACE, 'Enabled', True,
+        dbus_interface=dbus.PROPERTIES_IFACE)
+
+    stream.send(message(body='hello'))
+
+    event, received = q.expect_many(
+        EventPattern('dbus-signal', signal='NewChannels'),
+        EventPattern('dbus-signal', signal='MessageReceived'))
+    path, props = event.args[0][0]
+    handle = props[cs.TARGET_HANDLE]
+
+    chan = bus.get_object(conn.bus_name, path)
+    text_iface = dbus.Interface(chan, cs.CHANNEL_TYPE_TEXT)
+    messages_iface = dbus.Interface(chan, cs.CHANNEL_IFACE_MESSAGES)
+
+    # Channels with messages waiting don't hibernate.
+    text_iface.AcknowledgePendingMessages(
+        [received.args[0][0]['pending-message-id']])
+
+    new_channels = EventPattern('dbus-signal', signal='NewChannels')
+    q.forbid_events([new_channels])
+
+    expect_hibernation(q, handle)
+
+    # libpurple has no conversation to tell about the contact's typing, but
+    # the channel still hears about it...
+    stream.send(message(state='composing'))
+    q.expect('dbus-signal', signal='ChatStateChanged', path=path,
+        args=[handle, cs.CHAT_STATE_COMPOSING])
+
+    stream.send(message(state='active'))
+    q.expect('dbus-signal', signal='ChatStateChanged', path=path,
+        args=[handle, cs.CHAT_STATE_ACTIVE])
+
+    # ... and about messages.
+    stream.send(message(body='are you there?'))
+    received = q.expect('dbus-signal', signal='MessageReceived', path=path)
+    assertEquals('are you there?', received.args[0][1]['content'])
+    text_iface.AcknowledgePendingMessages(
+        [received.args[0][0]['pending-message-id']])
+
+    # Once it has gone back to sleep, sending a message wakes it up too.
+    expect_hibernation(q, handle)
+
+    messages_iface.SendMessage([{}, {
+        'content-type': 'text/plain',
+        'content': 'yes',
+        }], 0)
+
+    event = q.expect('stream-message')
+    assertEquals('chat', event.stanza['type'])
+    assert event.stanza['to'].startswith(JID), event.stanza['to']
+    bodies = [e for e in event.stanza.elements() if e.name == 'body']
+    assertEquals([u'yes'], [str(b) for b in bodies])
+
+    q.unforbid_events([new_channels])
+
+if __name__ == '__main__':
+    exec_test(test, environment={ 'HAZE_IM_HIBERNATE_SECONDS': '1' })
@@ -0,0 +1,114 @@
+"""
+Test joining a room, and that its members arrive in one MembersChanged.
+"""
+
+import dbus
+
+from twisted.words.xish import domish
+
+from hazetest import exec_test
+from gabbletest import make_muc_presence, sync_stream
+from servicetest import (call_async, EventPattern, assertEquals,
+        assertContains, assertSameSets, assertDBusError)
+import constants as cs
+import ns
+
+ROOM = 'chat@conf.localhost'
+BANNED_ROOM = 'private@conf.localhost'
+
+def presence_to(jid, type=None):
+    return EventPattern('stream-presence',
+        predicate=lambda e: e.stanza.getAttribute('to') == jid and
+            e.stanza.getAttribute('type') == type)
+
+def test(q, bus, conn, stream):
+    call_async(q, conn.Requests, 'CreateChannel', {
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_TEXT,
+        cs.TARGET_HANDLE_TYPE: cs.HT_ROOM,
+        cs.TARGET_ID: ROOM,
+        })
+
+    # The channel only appears once the room has let us in.
+    q.expect_many(presence_to('%s/test' % ROOM))
+    q.forbid_events([EventPattern('dbus-signal', signal='NewChannels')])
+    sync_stream(q, stream)
+    q.unforbid_all()
+
+    for nick in ['alice', 'bob', 'carol']:
+        stream.send(make_muc_presence('none', 'participant', ROOM, nick))
+
+    presence = make_muc_presence('none', 'participant', ROOM, 'test')
+    presence.children[0].addElement('status')['code'] = '110'
+    stream.send(presence)
+
+    ret, _, e = q.expect_many(
+        EventPattern('dbus-return', method='CreateChannel'),
+        EventPattern('dbus-signal', signal='NewChannels'),
+        EventPattern('dbus-signal', signal='MembersChanged'))
+
+    path, props = ret.value
+    assertEquals(cs.HT_ROOM, props[cs.TARGET_HANDLE_TYPE])
+    assertEquals(ROOM, props[cs.TARGET_ID])
+    assertEquals(path, e.path)
+
+    chan = bus.get_object(conn.bus_name, path)
+    assertContains(cs.CHANNEL_IFACE_GROUP,
+        chan.Get(cs.CHANNEL, 'Interfaces', dbus_interface=cs.PROPERTIES_IFACE))
+
+    alice, bob, carol, me = conn.get_contact_handles_sync(
+        ['%s/%s' % (ROOM, nick) for nick in ['alice', 'bob', 'carol', 'test']])
+    assertSameSets([alice, bob, carol, me], e.args[1])
+
+    group_props = chan.GetAll(cs.CHANNEL_IFACE_GROUP,
+        dbus_interface=cs.PROPERTIES_IFACE)
+    assertEquals(me, group_props['SelfHandle'])
+    assertSameSets([alice, bob, carol, me], group_props['Members'])
+
+    m = domish.Element((None, 'message'))
+    m['from'] = '%s/alice' % ROOM
+    m['type'] = 'groupchat'
+    m.addElement('body', content='hello room')
+    stream.send(m)
+
+    e = q.expect('dbus-signal', signal='MessageReceived', path=path)
+    header, body = e.args[0]
+    assertEquals(alice, header['message-sender'])
+    assertEquals('hello room', body['content'])
+
+    presence = make_muc_presence('none', 'none', ROOM, 'bob')
+    presence['type'] = 'unavailable'
+    stream.send(presence)
+
+    e = q.expect('dbus-signal', signal='MembersChanged', path=path)
+    assertEquals([], e.args[1])
+    assertEquals([bob], e.args[2])
+
+    chan.Close(dbus_interface=cs.CHANNEL)
+    q.expect_many(
+        EventPattern('dbus-signal', signal='Closed', path=path),
+        presence_to('%s/test' % ROOM, 'unavailable'))
+
+    # A room which won't have us fails the request, rather than producing a
+    # channel which closes straight away.
+    call_async(q, conn.Requests, 'CreateChannel', {
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_TEXT,
+        cs.TARGET_HANDLE_TYPE: cs.HT_ROOM,
+        cs.TARGET_ID: BANNED_ROOM,
+        })
+    q.expect_many(presence_to('%s/test' % BANNED_ROOM))
+
+    error = domish.Element((None, 'presence'))
+    error['from'] = '%s/test' % BANNED_ROOM
+    error['type'] = 'error'
+    error.addElement('error')['type'] = 'auth'
+    error.children[0].addElement((ns.STANZA, 'forbidden'))
+    stream.send(error)
+
+    e = q.expect('dbus-error', method='CreateChannel')
+    assertDBusError(cs.NOT_AVAILABLE, e.error)
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
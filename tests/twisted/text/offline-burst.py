@@ -0,0 +1,86 @@
+"""
+Test that a burst of offline messages is signalled as one batch per channel,
+as well as one message at a time, to clients which have asked for batches.
+"""
+
+import dbus
+
+from twisted.words.xish import domish
+
+from hazetest import exec_test
+from servicetest import (EventPattern, assertContains, assertEquals,
+        sync_dbus)
+import constants as cs
+
+CHANNEL_IFACE_MESSAGE_BATCHES = cs.CHANNEL + '.Interface.Haze.MessageBatches'
+
+def offline_message(sender, text):
+    m = domish.Element((None, 'message'))
+    m['from'] = sender
+    m['type'] = 'chat'
+    m.addElement('body', content=text)
+
+    x = m.addElement(('jabber:x:delay', 'x'))
+    x['stamp'] = '20070517T16:15:01'
+
+    return m
+
+def test(q, bus, conn, stream):
+    batches = EventPattern('dbus-signal', signal='MessagesReceived')
+
+    # Nobody has asked for batches yet, so none are signalled.
+    q.forbid_events([batches])
+
+    stream.send(offline_message('foo@bar.com', 'zero'))
+
+    event, zero = q.expect_many(
+        EventPattern('dbus-signal', signal='NewChannels'),
+        EventPattern('dbus-signal', signal='MessageReceived'))
+    path = event.args[0][0][0]
+    assertContains(CHANNEL_IFACE_MESSAGE_BATCHES,
+        event.args[0][0][1][cs.INTERFACES])
+
+    sync_dbus(bus, q, conn)
+    q.unforbid_events([batches])
+
+    chan = bus.get_object(conn.bus_name, path)
+    batches_iface = dbus.Interface(chan, CHANNEL_IFACE_MESSAGE_BATCHES)
+    batches_iface.Subscribe()
+    # Subscribing twice is harmless.
+    batches_iface.Subscribe()
+
+    texts = ['one', 'two', 'three']
+
+    for text in texts:
+        stream.send(offline_message('foo@bar.com', text))
+
+    received = []
+    while len(received) < len(texts):
+        e = q.expect('dbus-signal', signal='MessageReceived', path=path)
+        received.append(e.args[0])
+
+    batch = q.expect('dbus-signal', signal='MessagesReceived', path=path)
+    assertEquals(texts, [message[1]['content'] for message in batch.args[0]])
+    assertEquals([message[0]['pending-message-id'] for message in received],
+        [message[0]['pending-message-id'] for message in batch.args[0]])
+
+    # They are acknowledged in the usual way.
+    text_chan = dbus.Interface(chan, cs.CHANNEL_TYPE_TEXT)
+    text_chan.AcknowledgePendingMessages(
+        [zero.args[0][0]['pending-message-id']] +
+        [message[0]['pending-message-id'] for message in batch.args[0]])
+
+    # Once the only subscriber has gone, batches stop again.
+    batches_iface.Unsubscribe()
+    q.forbid_events([batches])
+
+    stream.send(offline_message('foo@bar.com', 'four'))
+    q.expect('dbus-signal', signal='MessageReceived', path=path)
+    sync_dbus(bus, q, conn)
+    q.unforbid_events([batches])
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,120 @@
+"""
+Test that, past HAZE_MAX_PENDING_MESSAGES unacknowledged messages, further
+messages are held back and signalled as earlier ones are acknowledged, in
+order and with their original timestamps; and that destroying the channel
+throws the held-back messages away and stops counting its pending ones.
+"""
+
+import calendar
+
+import dbus
+
+from twisted.words.xish import domish
+
+from hazetest import exec_test, sync_stream
+from servicetest import (call_async, EventPattern, assertEquals,
+        assertLength, sync_dbus)
+import constants as cs
+
+JID = 'foo@bar.com'
+
+def offline_message(text, second):
+    m = domish.Element((None, 'message'))
+    m['from'] = JID
+    m['type'] = 'chat'
+    m.addElement('body', content=text)
+
+    x = m.addElement(('jabber:x:delay', 'x'))
+    x['stamp'] = '20070517T16:15:%02d' % second
+
+    return m
+
+def sent_at(second):
+    return calendar.timegm((2007, 5, 17, 16, 15, second))
+
+def expect_messages(q, texts, seconds):
+    messages = []
+
+    for text, second in zip(texts, seconds):
+        e = q.expect('dbus-signal', signal='MessageReceived')
+        header, body = e.args[0]
+        assertEquals(text, body['content'])
+        assertEquals(sent_at(second), header['message-sent'])
+        messages.append(e.args[0])
+
+    return messages
+
+def ids(messages):
+    return [header['pending-message-id'] for header, body in messages]
+
+def test(q, bus, conn, stream):
+    texts = ['zero', 'one', 'two', 'three', 'four']
+    seconds = range(1, len(texts) + 1)
+
+    for text, second in zip(texts, seconds):
+        stream.send(offline_message(text, second))
+
+    e = q.expect('dbus-signal', signal='NewChannels')
+    path = e.args[0][0][0]
+    chan = bus.get_object(conn.bus_name, path)
+    text_iface = dbus.Interface(chan, cs.CHANNEL_TYPE_TEXT)
+
+    # Only the first two are pending; the rest are held back.
+    received = EventPattern('dbus-signal', signal='MessageReceived')
+    first = expect_messages(q, texts[:2], seconds[:2])
+    q.forbid_events([received])
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+    q.unforbid_events([received])
+
+    pending = chan.Get(cs.CHANNEL_IFACE_MESSAGES, 'PendingMessages',
+            dbus_interface=cs.PROPERTIES_IFACE)
+    assertEquals(ids(first), ids(pending))
+
+    # Acknowledging them brings the next two in, and so on.
+    text_iface.AcknowledgePendingMessages(ids(first))
+    second = expect_messages(q, texts[2:4], seconds[2:4])
+
+    text_iface.AcknowledgePendingMessages(ids(second))
+    third = expect_messages(q, texts[4:], seconds[4:])
+
+    text_iface.AcknowledgePendingMessages(ids(third))
+
+    # Fill the channel up again, with some held back, then destroy it.
+    for text, second in zip(texts, seconds):
+        stream.send(offline_message(text, second))
+
+    expect_messages(q, texts[:2], seconds[:2])
+    sync_stream(q, stream)
+
+    q.forbid_events([received])
+    call_async(q, dbus.Interface(chan, cs.CHANNEL_IFACE_DESTROYABLE),
+            'Destroy')
+    q.expect_many(
+        EventPattern('dbus-signal', signal='Closed', path=path),
+        EventPattern('dbus-return', method='Destroy'))
+
+    # Nothing comes back from the dead...
+    sync_dbus(bus, q, conn)
+    q.unforbid_events([received])
+
+    # ... and the destroyed channel's messages no longer count against the
+    # connection's limit, so a new channel takes two messages at once.
+    stream.send(offline_message('five', 6))
+    stream.send(offline_message('six', 7))
+
+    e = q.expect('dbus-signal', signal='NewChannels')
+    new_path = e.args[0][0][0]
+    messages = expect_messages(q, ['five', 'six'], [6, 7])
+
+    new_chan = bus.get_object(conn.bus_name, new_path)
+    pending = new_chan.Get(cs.CHANNEL_IFACE_MESSAGES, 'PendingMessages',
+            dbus_interface=cs.PROPERTIES_IFACE)
+    assertLength(2, pending)
+    assertEquals(ids(messages), ids(pending))
+
+if __name__ == '__main__':
+    exec_test(test, environment={
+        'HAZE_MAX_PENDING_MESSAGES': '2',
+        'HAZE_MAX_PENDING_MESSAGES_TOTAL': '3',
+        })
@@ -0,0 +1,76 @@
+"""
+Test that messages sent faster than the protocol allows are paced, delivered
+in order, and only reported as sent once they have been, and that messages
+too big for one stanza are split.
+"""
+
+import dbus
+
+from hazetest import exec_test
+from servicetest import EventPattern, assertEquals
+import constants as cs
+
+# These follow jabber_send_limits in src/protocol.c.
+BURST = 10
+MAX_MESSAGE_BYTES = 32768
+
+def body_of(stanza):
+    for e in stanza.elements():
+        if e.name == 'body':
+            return str(e)
+
+    raise AssertionError('no body in %s' % stanza.toXml())
+
+def test(q, bus, conn, stream):
+    jid = 'foo@bar.com'
+    handle = conn.get_contact_handle_sync(jid)
+
+    path, _ = conn.Requests.CreateChannel({
+        cs.CHANNEL_TYPE: cs.CHANNEL_TYPE_TEXT,
+        cs.TARGET_HANDLE_TYPE: cs.HT_CONTACT,
+        cs.TARGET_HANDLE: handle,
+        })
+    text_chan = dbus.Interface(bus.get_object(conn.bus_name, path),
+        cs.CHANNEL_IFACE_MESSAGES)
+
+    texts = ['message %d' % i for i in range(BURST + 5)]
+
+    for text in texts:
+        text_chan.SendMessage([{}, {
+            'content-type': 'text/plain',
+            'content': text,
+            }], 0)
+
+    for text in texts:
+        stream_message, message_sent = q.expect_many(
+            EventPattern('stream-message'),
+            EventPattern('dbus-signal', signal='MessageSent'),
+            )
+        assertEquals(text, body_of(stream_message.stanza))
+        assertEquals(text, message_sent.args[0][1]['content'])
+
+    # One word too many to fit in a stanza: it should be split between two
+    # words, and reported as sent once, with the original text.
+    word = 'flood '
+    text = word * (MAX_MESSAGE_BYTES // len(word) + 1)
+    text_chan.SendMessage([{}, {
+        'content-type': 'text/plain',
+        'content': text,
+        }], 0)
+
+    first, second, message_sent = q.expect_many(
+        EventPattern('stream-message'),
+        EventPattern('stream-message'),
+        EventPattern('dbus-signal', signal='MessageSent'),
+        )
+    first_body = body_of(first.stanza)
+    assert len(first_body) <= MAX_MESSAGE_BYTES, len(first_body)
+    assert first_body.endswith(' '), first_body[-10:]
+    assertEquals(text, first_body + body_of(second.stanza))
+    assertEquals(text, message_sent.args[0][1]['content'])
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
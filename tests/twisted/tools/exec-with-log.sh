@@ -14,6 +14,10 @@ export G_MESSAGES_DEBUG
 ulimit -c unlimited
 exec >> haze-testing.log 2>&1
 
+# Don't leave avatars in, or pick them up from, the user's real cache
+XDG_CACHE_HOME="${abs_top_builddir}/tests/cache"
+export XDG_CACHE_HOME
+
 # Avoid using a non-trivial GSettings backend
 GSETTINGS_BACKEND=memory
 export GSETTINGS_BACKEND